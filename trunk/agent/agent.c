@@ -35,9 +35,14 @@ ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <string.h>
+#include <netinet/in.h>
+
 #include "dfp.h"
 #include "dfp-private.h"
 #include "probe.h"
+#include "report.h"
+#include "push.h"
 #include "wire.h"
 #include "config.h"
 #include "dfp-common.h"
@@ -46,26 +51,44 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
 #define DFP_MAX_KEEPALIVE_INTERVAL_SEC 60
+/* The probe workers log too: through a ring, the loop never waits for
+ * stdout.
+ */
+#define DFP_LOG_RING_SIZE       (64 * 1024)
+#define DFP_LOG_FLUSH_INTERVAL  cpe_time_from_msec(100)
 
 
-typedef struct timer_ctx_ {
-    cpe_io_buf      *tc_iobuf;
-    cpe_network_ctx *tc_nctx;
-} timer_ctx_t;
-
+/* A connection with a manager (load balancer). Each has its own keepalive
+ * interval, set by the DFP Parameters it sends.
+ */
+typedef struct dfp_conn_ dfp_conn_t;
+struct dfp_conn_ {
+    dfp_conn_t      *cn_next;
+    dfp_conn_t      *cn_prev;
+    cpe_network_ctx  cn_nctx;       /* nc_user_data points back here */
+    apr_pool_t      *cn_pool;       /* destroyed with the connection */
+    cpe_event       *cn_keepalive;
+    cpe_io_buf      *cn_pref_iobuf; /* Preference Information template */
+    apr_uint32_t     cn_pref_generation; /* of the weights in it */
+    cpe_io_buf      *cn_bind_iobuf; /* BindId Report */
+    uint32_t         cn_ipaddr_v4;  /* local address, network order */
+    /* last weight sent for each service, -1 if none */
+    int              cn_last_weights[DFP_CFG_MAX_SERVICES];
+};
 
 static dfp_config_t   g_dfp_conf;
 static apr_pool_t    *g_dfp_pool;
-static cpe_event     *g_dfp_keepalive_event;
-static cpe_queue_t   *g_dfp_sendQ;
-
-dfp_probe_ctx_t      *g_dfp_probe_ctx;
-dfp_calc_average_t    g_dfp_probe_calc_average;
+static dfp_conn_t    *g_dfp_conns;      /* all the managers */
+static int            g_dfp_nconns;
+static dfp_report_t   g_dfp_report;
+static dfp_push_t     g_dfp_push;
 
 
 static apr_status_t dfp_server_cb(void *ctx, apr_pollfd_t *pfd, cpe_event *e);
 static apr_status_t dfp_one_shot_cb(void *context, apr_pollfd_t *pfd,
     cpe_event *event);
+static apr_status_t dfp_report_init(void);
+static void dfp_report_stats_log(void);
 
 
 int
@@ -74,8 +97,6 @@ main(int argc, const char *const *argv, const char *const *env)
     apr_status_t        rv;
     apr_socket_t       *lsock;
     apr_sockaddr_t     *lsockaddr;
-    cpe_network_ctx    *server_ctx;
-    int                 backlog, max_peers;
 
     /* Misc init.
      */
@@ -83,86 +104,252 @@ main(int argc, const char *const *argv, const char *const *env)
     CHECK(apr_pool_create(&g_dfp_pool, NULL));
     CHECK(dfp_agent_config(&g_dfp_conf, argc, argv));
     CHECK(cpe_log_init(g_dfp_conf.dc_log_level));
+    rv = cpe_log_async(DFP_LOG_RING_SIZE, DFP_LOG_FLUSH_INTERVAL, g_dfp_pool);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_WARN, "logging synchronously: %s", cpe_errmsg(rv));
+    }
     CHECK(cpe_system_init(CPE_NUM_EVENTS_DEFAULT));
-    CHECK(dfp_probe_init(g_dfp_pool));
+    CHECK(dfp_probe_init(g_dfp_pool, &g_dfp_conf));
+    CHECK(dfp_report_init());
 
-    /* Network init.
+    /* Network init. Each accepted connection gets its own context, see
+     * dfp_one_shot_cb().
      */
-    backlog = 1;
-    max_peers = 1;
     CHECK(cpe_socket_server_create(&lsock, &lsockaddr,
-        g_dfp_conf.dc_listen_address, g_dfp_conf.dc_listen_port, backlog,
-        g_dfp_pool));
-    server_ctx = apr_pcalloc(g_dfp_pool, sizeof *server_ctx);
-    server_ctx->nc_pool = g_dfp_pool;
-    CHECK(cpe_socket_after_accept(lsock, dfp_server_cb, server_ctx,
-        APR_POLLIN, cpe_filter_any, max_peers, dfp_one_shot_cb, server_ctx,
-        g_dfp_pool));
+        g_dfp_conf.dc_listen_address, g_dfp_conf.dc_listen_port,
+        g_dfp_conf.dc_max_managers, g_dfp_pool));
+    CHECK(cpe_socket_after_accept(lsock, dfp_server_cb, NULL,
+        APR_POLLIN, cpe_filter_any, g_dfp_conf.dc_max_managers,
+        dfp_one_shot_cb, NULL, g_dfp_pool));
 
     /* Event loop.
      */
     CHECK(cpe_main_loop(g_dfp_conf.dc_loop_duration));
+    dfp_report_stats_log();
+    dfp_probe_fini();
+    cpe_log_async_stop();
+    /* if the log fell back to direct writes */
+    cpe_log_flush();
     return 0;
 }
 
 
+/* Compute the weight of \p sv from the samples of its probe. */
+static void
+dfp_report_update(dfp_service_t *sv)
+{
+    int32_t value;
+
+    if (g_dfp_probe_calc_average(sv->sv_probe, &value) != APR_SUCCESS) {
+        /* No sample yet, or the probe failed: off-line. */
+        value = 0;
+    }
+    dfp_report_set_weight(&g_dfp_report, sv, value);
+}
+
+
+/* Log the counters of the report, of the pushes and of the probe of each
+ * service.
+ */
+static void
+dfp_report_stats_log(void)
+{
+    dfp_probe_stats_t  st;
+    dfp_push_stats_t   pst;
+    dfp_service_t     *sv;
+    int                k;
+
+    cpe_log(CPE_INFO, "PREF_INFO: %u encodings, %u weight patches",
+        g_dfp_report.rp_encodings, g_dfp_report.rp_patches);
+    if (g_dfp_conf.dc_push_delta > 0) {
+        dfp_push_stats_get(&g_dfp_push, &pst);
+        cpe_log(CPE_INFO, "weight pushes: %u sent, %u deferred, %u "
+            "suppressed, latency max %lld ms avg %lld ms", pst.pus_pushes,
+            pst.pus_deferred, pst.pus_suppressed,
+            apr_time_as_msec(pst.pus_latency_max), pst.pus_pushes == 0 ? 0 :
+            apr_time_as_msec(pst.pus_latency_sum / pst.pus_pushes));
+    }
+    for (k = 0; k < g_dfp_report.rp_nservices; k++) {
+        sv = &g_dfp_report.rp_services[k];
+        dfp_probe_stats_get(sv->sv_probe, &st);
+        cpe_log(CPE_INFO, "service port %d protocol %d: %u measures, "
+            "%u in time, %u failed, %u timeouts, %u skipped, %u discarded",
+            sv->sv_conf->sc_port, sv->sv_conf->sc_protocol, st.ps_started,
+            st.ps_completed, st.ps_failed, st.ps_timeouts, st.ps_skipped,
+            st.ps_discarded);
+    }
+}
+
+
+/* Queue a Preference Information message with the current weights.
+ *
+ * Each connection has the message encoded at setup in cn_pref_iobuf; a
+ * send only patches the weights in, if they changed since. The connections
+ * with the same local address share one copy, rp_msg, patched once per
+ * change, and queue the same buffer; a connection with another local
+ * address (agent listening on several addresses, and a service reporting
+ * the local address) sends its own. A shared message still in some queue
+ * is never rewritten: a new copy replaces it, and the old one goes away
+ * with its last send.
+ *
+ * @return APR_EAGAIN if the connection has not sent what was queued before.
+ */
+static apr_status_t
+dfp_pref_info_send(dfp_conn_t *conn)
+{
+    dfp_report_t   *rp = &g_dfp_report;
+    cpe_io_buf     *iobuf = conn->cn_pref_iobuf;
+    apr_status_t    rv;
+    int             k;
+
+    if (conn->cn_nctx.nc_sendQ->cq_nelems > 0) {
+        cpe_log(CPE_WARN, "queue %p not drained, skipping",
+            conn->cn_nctx.nc_sendQ);
+        return APR_EAGAIN;
+    }
+
+    if (rp->rp_msg->buf_len == 0 || ! rp->rp_local ||
+        rp->rp_ipaddr_v4 == conn->cn_ipaddr_v4)
+    {
+        if (rp->rp_msg->buf_len > 0 &&
+            rp->rp_msg_generation != rp->rp_generation &&
+            rp->rp_msg->inqueue)
+        {
+            cpe_iobuf_release(&rp->rp_msg, NULL);
+            CHECK(cpe_iobuf_get(&rp->rp_msg, rp->rp_msg_size));
+        }
+        if (rp->rp_msg->buf_len == 0) {
+            /* Same bytes as the template of conn, but for the weights. */
+            memcpy(rp->rp_msg->buf, iobuf->buf, iobuf->buf_len);
+            rp->rp_msg->buf_len = iobuf->buf_len;
+            rp->rp_ipaddr_v4 = conn->cn_ipaddr_v4;
+            dfp_pref_info_patch(rp, rp->rp_msg);
+            rp->rp_msg_generation = rp->rp_generation;
+        } else if (rp->rp_msg_generation != rp->rp_generation) {
+            dfp_pref_info_patch(rp, rp->rp_msg);
+            rp->rp_msg_generation = rp->rp_generation;
+        }
+        CHECK(cpe_send_enqueue_shared(conn->cn_nctx.nc_sendQ, rp->rp_msg));
+    } else {
+        if (conn->cn_pref_generation != rp->rp_generation) {
+            dfp_pref_info_patch(rp, iobuf);
+            conn->cn_pref_generation = rp->rp_generation;
+        }
+        CHECK(cpe_send_enqueue(conn->cn_nctx.nc_sendQ, iobuf));
+    }
+
+    for (k = 0; k < rp->rp_nservices; k++) {
+        conn->cn_last_weights[k] = rp->rp_services[k].sv_weight;
+    }
+    return APR_SUCCESS;
+}
+
+
 /** Callback to periodically send a DFP Preference Information message.
  * This acts as an application-level keepalive, required by the DFP specs.
  * The sending period can change depending on received msg DFP Parameters.
+ * With change-driven reporting (dc_push_delta), it is the floor: the
+ * weight is sent at least this often even if it doesn't change.
  */
 static apr_status_t
 dfp_keepalive_cb(void *context, apr_pollfd_t *pfd, cpe_event *event)
 {
-    timer_ctx_t    *ctx = context;
-    cpe_io_buf     *iobuf = ctx->tc_iobuf;
-    apr_status_t    rv;
-    int             start;
-    uint16_t        bind_id, weight;
-    int32_t         value;
-    apr_socket_t   *sock;
-
     cpe_log(CPE_DEB, "%s", "enter");
-    cpe_event_add(event);
     pfd = NULL;
+    event = NULL;   /* periodic, re-armed by CPE */
 
-    if (iobuf->inqueue) {
-        cpe_log(CPE_WARN, "iobuf %p still in queue, skipping", iobuf);
-        return APR_SUCCESS;
+    dfp_pref_info_send(context);
+    return APR_SUCCESS;
+}
+
+
+/* Is a weight outside the dead band around the last one sent to conn? */
+static int
+dfp_push_is_change(dfp_conn_t *conn)
+{
+    return dfp_report_is_change(&g_dfp_report, conn->cn_last_weights,
+        g_dfp_conf.dc_push_delta);
+}
+
+
+/* dfp_push_changed_t: has any manager a weight outside the dead band? */
+static int
+dfp_push_changed_cb(void *context)
+{
+    dfp_conn_t *conn;
+
+    context = NULL;
+    for (conn = g_dfp_conns; conn != NULL; conn = conn->cn_next) {
+        if (dfp_push_is_change(conn)) {
+            return 1;
+        }
     }
-    /* Reuse buffer from the beginning. */
-    iobuf->buf_len = 0;
+    return 0;
+}
 
-    /* Build the message.
-     */
-    CHECK_NULL(sock, cpe_queue_get_socket(ctx->tc_nctx->nc_sendQ));
-    bind_id = 0;
 
-    /* XXX Having a global like g_dfp_probe_ctx is a bit grossy; should be redesigned */
-    g_dfp_probe_calc_average(g_dfp_probe_ctx, &value);
-    /* XXX should check if we lose data from 32 to 16 */
-    weight = value;
-    CHECK(dfp_msg_pref_info_complete(iobuf, &start, sock, bind_id, weight));
+/* dfp_push_send_t: send to the managers outside the dead band. */
+static int
+dfp_push_send_cb(void *context)
+{
+    dfp_conn_t *conn;
+    int         nsent = 0;
+
+    context = NULL;
+    for (conn = g_dfp_conns; conn != NULL; conn = conn->cn_next) {
+        if (dfp_push_is_change(conn) && dfp_pref_info_send(conn) ==
+            APR_SUCCESS)
+        {
+            nsent++;
+        }
+    }
+    return nsent;
+}
+
 
-    CHECK(cpe_send_enqueue(ctx->tc_nctx->nc_sendQ, iobuf));
+/* Called after each sample of the probe of a service: compute its weight
+ * once for all the managers, and push it if it changed enough.
+ */
+static void
+dfp_sample_cb(void *context, apr_time_t sample_time)
+{
+    dfp_service_t *sv = context;
 
-    return APR_SUCCESS;
+    dfp_report_update(sv);
+    if (g_dfp_conf.dc_push_delta > 0 && g_dfp_conns != NULL) {
+        dfp_push_sample(&g_dfp_push, sample_time);
+    }
 }
 
 
-/* Init keepalive context.
+/* Set up the services, each with its probe and weight, and, if
+ * configured, change-driven reporting.
  */
 static apr_status_t
-dfp_keepalive_init(timer_ctx_t **tctx, cpe_network_ctx *nctx, apr_pool_t *pool)
+dfp_report_init(void)
 {
-    apr_status_t  rv;
-    timer_ctx_t  *t2;
-
-    cpe_log(CPE_DEB, "%s", "enter");
-    *tctx = NULL;
-    CHECK_NULL(t2, apr_pcalloc(pool, sizeof(timer_ctx_t)));
-    t2->tc_nctx = nctx;
-    CHECK(cpe_iobuf_create(&t2->tc_iobuf, ONE_SI_KILO, pool));
-    *tctx = t2;
+    dfp_report_t  *rp = &g_dfp_report;
+    dfp_push_t    *pu = &g_dfp_push;
+    dfp_service_t *sv;
+    apr_status_t   rv;
+    int            k;
+
+    dfp_report_layout(rp, &g_dfp_conf);
+    for (k = 0; k < rp->rp_nservices; k++) {
+        sv = &rp->rp_services[k];
+        CHECK(dfp_probe_create(&sv->sv_probe, g_dfp_pool, &g_dfp_conf,
+            sv->sv_conf));
+        dfp_report_update(sv);
+        dfp_probe_set_notify(sv->sv_probe, dfp_sample_cb, sv);
+    }
+    CHECK(cpe_iobuf_get(&rp->rp_msg, rp->rp_msg_size));
+    if (g_dfp_conf.dc_push_delta <= 0) {
+        return APR_SUCCESS;
+    }
+    CHECK(dfp_push_init(pu, g_dfp_conf.dc_push_min_gap, dfp_push_changed_cb,
+        dfp_push_send_cb, NULL));
+    cpe_log(CPE_INFO, "pushing weight changes >= %d, at most every %lld ms",
+        g_dfp_conf.dc_push_delta, apr_time_as_msec(g_dfp_conf.dc_push_min_gap));
     return APR_SUCCESS;
 }
 
@@ -172,44 +359,123 @@ dfp_keepalive_init(timer_ctx_t **tctx, cpe_network_ctx *nctx, apr_pool_t *pool)
  * the update.
  */
 static apr_status_t
-dfp_keepalive_set_interval(apr_time_t interval)
+dfp_keepalive_set_interval(dfp_conn_t *conn, apr_time_t interval)
 {
     apr_status_t rv;
 
-    CHECK(cpe_event_remove(g_dfp_keepalive_event));
-    CHECK(cpe_event_set_timeout(g_dfp_keepalive_event, interval));
+    CHECK(cpe_event_remove(conn->cn_keepalive));
+    CHECK(cpe_event_set_timeout(conn->cn_keepalive, interval));
     /* Force the _first_ expiration ASAP; next expirations will follow the
-     * value of interval.
+     * value of interval, starting from now.
      */
-    CHECK(cpe_event_add2(g_dfp_keepalive_event, 1));
+    CHECK(cpe_event_add2(conn->cn_keepalive, cpe_now()));
+    return APR_SUCCESS;
+}
+
+
+/* Posted by dfp_conn_closed(), once the callbacks of the connection are
+ * over.
+ */
+static apr_status_t
+dfp_conn_destroy(void *context)
+{
+    dfp_conn_t *conn = context;
+
+    apr_pool_destroy(conn->cn_pool);
     return APR_SUCCESS;
 }
 
 
+/* The socket of a connection is gone; its keepalive event is destroyed by
+ * CPE, see cpe_queue_init().
+ */
+static void
+dfp_conn_closed(void *context)
+{
+    dfp_conn_t   *conn = context;
+    apr_status_t  rv;
+
+    if (conn->cn_prev != NULL) {
+        conn->cn_prev->cn_next = conn->cn_next;
+    } else {
+        g_dfp_conns = conn->cn_next;
+    }
+    if (conn->cn_next != NULL) {
+        conn->cn_next->cn_prev = conn->cn_prev;
+    }
+    g_dfp_nconns--;
+    cpe_log(CPE_INFO, "manager gone, %d left", g_dfp_nconns);
+
+    /* We are in the middle of dfp_server_cb(): free later. */
+    rv = cpe_post(cpe_loop_current(), dfp_conn_destroy, conn);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_ERR, "cpe_post: %s, leaking %p", cpe_errmsg(rv), conn);
+    }
+}
+
+
 /* Called once on the newly accepted socket. Perform the initialization
  * steps that cannot be done before.
  */
 static apr_status_t
 dfp_one_shot_cb(void *context, apr_pollfd_t *pfd, cpe_event *event)
 {
-    cpe_network_ctx *nctx = context;
-    timer_ctx_t     *keepalive_ctx;
+    dfp_conn_t      *conn;
+    apr_pool_t      *pool;
+    apr_sockaddr_t  *sockaddr;
     apr_status_t     rv;
+    int              k;
 
     cpe_log(CPE_DEB, "%s", "enter");
+    context = NULL;
+
+    /* Per-connection state, in its own pool. */
+    CHECK(apr_pool_create(&pool, g_dfp_pool));
+    CHECK_NULL(conn, apr_pcalloc(pool, sizeof *conn));
+    conn->cn_pool = pool;
+    for (k = 0; k < DFP_CFG_MAX_SERVICES; k++) {
+        conn->cn_last_weights[k] = -1;
+    }
+    conn->cn_nctx.nc_pool = pool;
+    conn->cn_nctx.nc_user_data = conn;
+    CHECK(apr_socket_addr_get(&sockaddr, APR_LOCAL, pfd->desc.s));
+    conn->cn_ipaddr_v4 = *(uint32_t *) sockaddr->ipaddr_ptr;
+    CHECK(cpe_iobuf_create(&conn->cn_pref_iobuf, g_dfp_report.rp_msg_size,
+        pool));
+    /* Encoded once: a keepalive only patches the weights in. */
+    CHECK(dfp_pref_info_encode(&g_dfp_report, conn->cn_pref_iobuf,
+        conn->cn_ipaddr_v4));
+    conn->cn_pref_generation = g_dfp_report.rp_generation;
+    CHECK(cpe_iobuf_create(&conn->cn_bind_iobuf, ONE_SI_KILO, pool));
+
+    /* The accepted socket stays in the pollset, see dfp_server_cb(), and
+     * its event goes with it when the connection is dropped.
+     */
+    CHECK(cpe_event_set_persistent(event, 1));
+    CHECK(cpe_event_set_context(event, &conn->cn_nctx));
+    CHECK(cpe_resource_register_user(pfd->desc.s, event));
 
     /* Install keepalive callback
      */
-    CHECK(dfp_keepalive_init(&keepalive_ctx, nctx, nctx->nc_pool));
-    CHECK_NULL(event,
+    CHECK_NULL(conn->cn_keepalive,
         cpe_event_timer_create(g_dfp_conf.dc_keepalive_interval,
-            dfp_keepalive_cb, keepalive_ctx));
-    g_dfp_keepalive_event = event;
-    CHECK(cpe_event_add(event));
-
-    CHECK(cpe_queue_init(&nctx->nc_sendQ, pfd, g_dfp_pool, event));
-    g_dfp_sendQ = nctx->nc_sendQ;
-    return rv;
+            dfp_keepalive_cb, conn));
+    /* Keep the cadence: a late send doesn't delay the following ones. */
+    CHECK(cpe_event_set_periodic(conn->cn_keepalive, CPE_PERIODIC_SKIP));
+    CHECK(cpe_event_add(conn->cn_keepalive));
+
+    CHECK(cpe_queue_init(&conn->cn_nctx.nc_sendQ, pfd, pool,
+        conn->cn_keepalive));
+    CHECK(cpe_resource_register_callback(pfd->desc.s, dfp_conn_closed, conn));
+
+    conn->cn_next = g_dfp_conns;
+    if (g_dfp_conns != NULL) {
+        g_dfp_conns->cn_prev = conn;
+    }
+    g_dfp_conns = conn;
+    g_dfp_nconns++;
+    cpe_log(CPE_INFO, "manager connected, %d in total", g_dfp_nconns);
+    return APR_SUCCESS;
 }
 
 
@@ -217,64 +483,28 @@ dfp_one_shot_cb(void *context, apr_pollfd_t *pfd, cpe_event *event)
  * of server load based on its contents.
  */
 static apr_status_t
-dfp_handle_msg_server_state(cpe_io_buf *iobuf, int payload_offset,
-    int payload_len)
+dfp_handle_msg_server_state(const dfp_msg_view_t *msg)
 {
-    apr_status_t rv;
-    uint32_t     pref_ipaddr_v4;
-    uint16_t     pref_bind_id;
-    uint16_t     pref_weight;
-    char         ipaddr_str[20];
-
-    CHECK(dfp_parse_load(iobuf, payload_offset, payload_len,
-        &pref_ipaddr_v4, &pref_bind_id, &pref_weight));
-
     /* Just log the info, as required by the spec.
      */
-    apr_snprintf(ipaddr_str, sizeof ipaddr_str, "%pA",
-        (struct in_addr *) &pref_ipaddr_v4);
-    cpe_log(CPE_INFO,
-        "received Server State msg, server %s, bindId %d, weight %d",
-        ipaddr_str, pref_bind_id, pref_weight);
-
-    return APR_SUCCESS;
+    return dfp_log_load(msg);
 }
 
 
 static apr_status_t
-dfp_handle_msg_dfp_parameters(cpe_io_buf *iobuf, int payload_offset,
-    int payload_len)
+dfp_handle_msg_dfp_parameters(dfp_conn_t *conn, const dfp_msg_view_t *msg)
 {
-    int                  minlen;
-    uint16_t             tlv_type;
-    uint16_t             tlv_len;
-    uint32_t             interval_sec;
-    dfp_tlv_keepalive_t *keepalive_tlv;
-    apr_status_t         rv;
+    uint32_t     interval_sec;
+    apr_status_t rv;
 
     /* TODO should perform some rate-limiting before further processing.
      */
 
-    minlen = sizeof(dfp_tlv_keepalive_t);
-    if (payload_len < minlen) {
-        cpe_log(CPE_WARN, "payload len (%d) < minimum len (%d)",
-            payload_len, minlen);
-        return APR_EGENERAL;
-    }
-
-    keepalive_tlv = (dfp_tlv_keepalive_t *) &iobuf->buf[payload_offset];
-    tlv_type = ntohs(keepalive_tlv->ka_header.tlv_type);
-    tlv_len = ntohs(keepalive_tlv->ka_header.tlv_len);
-    if (tlv_type != DFP_TLV_KEEPALIVE) {
-        cpe_log(CPE_WARN, "TLV type (%#x) is not keepalive interval", tlv_type);
-        return APR_EGENERAL;
-    }
-    if (tlv_len > payload_len) {
-        cpe_log(CPE_WARN, "TLV len (%d) > payload len (%d)", tlv_len,
-            payload_len);
+    if (! msg->mv_has_keepalive) {
+        cpe_log(CPE_WARN, "%s", "DFP Parameters msg without Keepalive TLV");
         return APR_EGENERAL;
     }
-    interval_sec = ntohl(keepalive_tlv->ka_interval_sec);
+    interval_sec = msg->mv_keepalive.kv_interval_sec;
     if (interval_sec == 0) {
         cpe_log(CPE_DEB, "%s", "keepalive interval 0: informational: "
             "manager will not close connection in case of no response");
@@ -286,16 +516,16 @@ dfp_handle_msg_dfp_parameters(cpe_io_buf *iobuf, int payload_offset,
         interval_sec = DFP_MAX_KEEPALIVE_INTERVAL_SEC;
     }
     cpe_log(CPE_INFO, "setting keepalive interval to %d sec", interval_sec);
-    CHECK(dfp_keepalive_set_interval(apr_time_from_sec(interval_sec)));
+    CHECK(dfp_keepalive_set_interval(conn, apr_time_from_sec(interval_sec)));
 
     return APR_SUCCESS;
 }
 
 
 static apr_status_t
-dfp_handle_msg_bind_request(void)
+dfp_handle_msg_bind_request(dfp_conn_t *conn)
 {
-    static cpe_io_buf *iobuf;
+    cpe_io_buf        *iobuf = conn->cn_bind_iobuf;
     apr_status_t       rv;
     int                reqlen, start;
 
@@ -306,17 +536,6 @@ dfp_handle_msg_bind_request(void)
      * To keep it simple, we do all the work right now.
      */
 
-    /* one-shot */
-    if (iobuf == NULL) {
-        CHECK(cpe_iobuf_create(&iobuf, ONE_SI_KILO, g_dfp_pool));
-        cpe_log(CPE_DEB, "one-shot: created iobuf %p", iobuf);
-
-        /* XXX BUG this works only if we create a separate event,
-         * or if we extend the resource register to accept a generic
-         * callback
-         */
-        //cpe_resource_register_user(sock, dtor);
-    }
     if (iobuf->inqueue) {
         cpe_log(CPE_WARN, "iobuf %p still in queue, skipping", iobuf);
         return APR_SUCCESS;
@@ -331,91 +550,84 @@ dfp_handle_msg_bind_request(void)
     CHECK(dfp_msg_bind_report_prepare(iobuf, reqlen, &start));
     CHECK(dfp_msg_tlv_bind_table_prepare(iobuf, 0, 0, 0, 0));
 
-    if (g_dfp_sendQ == NULL) {
-        cpe_log(CPE_ERR, "%s", "sendQ is NULL");
-        return APR_EGENERAL;
-    }
-    CHECK(cpe_send_enqueue(g_dfp_sendQ, iobuf));
+    CHECK(cpe_send_enqueue(conn->cn_nctx.nc_sendQ, iobuf));
 
     return APR_SUCCESS;
 }
 
 
 /* If a DFP message contains a security TLV, it MUST be the first TLV in the
- * message.
+ * message; dfp_msg_decode() has already checked that.
  */
 static apr_status_t
-dfp_handle_security_tlv(cpe_io_buf *iobuf, int payload_offset,
-    int payload_len)
+dfp_handle_security_tlv(const dfp_msg_view_t *msg)
 {
     /* XXX WRITE ME!!! */
-    iobuf = NULL;
-    payload_offset = 0;
-    payload_len = 0;
+    msg = NULL;
     return APR_SUCCESS;
 }
 
 
 /** State machine to handle a received DFP message.
- * @remark We must deallocate the iobuf once done, so we cannot use the CHECK
- *         macro.
+ * @remark The iobuf is lent by cpe_receiver_stream() for this call only;
+ *         cpe_iobuf_destroy() on it does nothing, but keeps this handler
+ *         usable with cpe_receiver().
  */
 static apr_status_t
 dfp_msg_handler_cb(cpe_io_buf *iobuf, cpe_network_ctx *nctx)
 {
-    dfp_msg_header_t *hdr;
-    uint16_t          msg_type;
-    int32_t           msg_len;
-    int               payload_offset;
-    int               payload_len;
-    apr_status_t      rv = APR_SUCCESS;
-
-    hdr = (dfp_msg_header_t *) &iobuf->buf[0];
+    dfp_conn_t     *conn = nctx->nc_user_data;
+    dfp_msg_view_t  msg;
+    apr_status_t    rv;
 
-    /* Version has already been tested by dfp_get_msg_size_cb(). */
-    msg_type = ntohs(hdr->msg_type);
-    msg_len = ntohl(hdr->msg_len);
-    if (msg_len < 0) {
-        msg_len = 0;
+    /* Version has already been tested by dfp_get_msg_size_cb(); this
+     * validates every TLV, so the handlers below only see well-formed ones.
+     */
+    rv = dfp_msg_decode(iobuf, 0, &msg);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_WARN, "malformed msg (iobuf len %d), discarding",
+            iobuf->buf_len);
+        cpe_iobuf_destroy(&iobuf, nctx);
+        return rv;
     }
     cpe_log(CPE_DEB, "received msg version %#x, type '%s' (%#x), len %u, "
-        "iobuf len %d", hdr->msg_version, dfp_msg_type2string(msg_type),
-        msg_type, msg_len, iobuf->buf_len);
+        "iobuf len %d", msg.mv_version, dfp_msg_type2string(msg.mv_type),
+        msg.mv_type, msg.mv_len, iobuf->buf_len);
 
-    if (msg_len != iobuf->buf_len) {
+    if (msg.mv_len != (uint32_t) iobuf->buf_len) {
         cpe_log(CPE_DEB,
-            "lenght mismatch (declared %d, real %d), trying to proceed anyway",
-            msg_len, iobuf->buf_len);
+            "lenght mismatch (declared %u, real %d), ignoring the excess",
+            msg.mv_len, iobuf->buf_len);
     }
-    payload_offset = sizeof(dfp_msg_header_t);
-    payload_len = cpe_min(msg_len, iobuf->buf_len) - payload_offset;
 
-    switch (msg_type) {
+    switch (msg.mv_type) {
 
     case DFP_MSG_SERVER_STATE:
-        rv = dfp_handle_security_tlv(iobuf, payload_offset, payload_len);
-        rv = dfp_handle_msg_server_state(iobuf, payload_offset, payload_len);
+        rv = dfp_handle_security_tlv(&msg);
+        rv = dfp_handle_msg_server_state(&msg);
     break;
 
     case DFP_MSG_DFP_PARAMS:
-        rv = dfp_handle_security_tlv(iobuf, payload_offset, payload_len);
-        rv = dfp_handle_msg_dfp_parameters(iobuf, payload_offset, payload_len);
+        rv = dfp_handle_security_tlv(&msg);
+        rv = dfp_handle_msg_dfp_parameters(conn, &msg);
     break;
 
     case DFP_MSG_BIND_REQ:
-        rv = dfp_handle_security_tlv(iobuf, payload_offset, payload_len);
-        rv = dfp_handle_msg_bind_request();
+        rv = dfp_handle_security_tlv(&msg);
+        rv = dfp_handle_msg_bind_request(conn);
     break;
 
     case DFP_MSG_PREF_INFO:
     case DFP_MSG_BIND_REPORT:
     case DFP_MSG_BIND_CHANGE:
         cpe_log(CPE_INFO, "Unexpected message (wrong direction)"
-            " %#x (%s), discarding", msg_type, dfp_msg_type2string(msg_type));
+            " %#x (%s), discarding", msg.mv_type,
+            dfp_msg_type2string(msg.mv_type));
     break;
 
     default:
-        cpe_log(CPE_INFO, "Received unknown message %#x, discarding", msg_type);
+        cpe_log(CPE_INFO, "Received unknown message %#x, discarding",
+            msg.mv_type);
     }
 
     cpe_log(CPE_DEB, "finished consuming iobuf %p, discarding", iobuf);
@@ -458,18 +670,34 @@ static apr_status_t
 dfp_server_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
 {
     cpe_network_ctx *nctx = (cpe_network_ctx *) context;
-    apr_status_t     rv;
+    apr_status_t     rv = APR_SUCCESS;
 
-    cpe_event_add(e);
+    e = NULL;   /* persistent, see dfp_one_shot_cb() */
     nctx->nc_count++;
 
     if (pfd->rtnevents & APR_POLLOUT) {
         rv = cpe_sender(nctx);
+        if (rv != APR_SUCCESS) {
+            /* not EAGAIN, see cpe_sender(): the connection is broken,
+             * whatever there is to read
+             */
+            cpe_log(CPE_INFO, "manager connection: send failed (%s), "
+                "dropping", cpe_errmsg(rv));
+            cpe_receiver_stream_drop(nctx, pfd);
+            return rv;
+        }
     }
     if (pfd->rtnevents & APR_POLLIN) {
-        /* XXX FIXME 2000 */
-        rv = cpe_receiver(nctx, pfd, 2000, nctx->nc_pool,
+        rv = cpe_receiver_stream(nctx, pfd, DFP_MAX_MSG_SIZE,
             sizeof(dfp_msg_header_t), dfp_get_msg_size_cb, dfp_msg_handler_cb);
+    } else if (pfd->rtnevents & (APR_POLLHUP | APR_POLLERR)) {
+        /* Nothing to read that would tell us: the event is persistent,
+         * without this it would fire again at once, forever.
+         */
+        cpe_log(CPE_INFO, "manager connection %s, dropping",
+            pfd->rtnevents & APR_POLLERR ? "failed" : "hung up");
+        cpe_receiver_stream_drop(nctx, pfd);
+        rv = APR_EOF;
     }
     return rv;
 }
@@ -40,8 +40,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "apr_getopt.h"
 #include "config.h"
+#include "cpe.h"
 
 /*
  * TODO parse file
@@ -55,10 +59,96 @@ dfp_config_from_file(dfp_config_t *config)
     config->dc_log_level          = DFP_CFG_LOG_LEVEL;
     config->dc_loop_duration      = DFP_CFG_LOOP_DURATION;
     config->dc_keepalive_interval = DFP_CFG_KEEPALIVE_INTERVAL;
+    config->dc_max_managers       = DFP_CFG_MAX_MANAGERS;
+    config->dc_probe_workers      = DFP_CFG_PROBE_WORKERS;
+    config->dc_probe_deadline     = DFP_CFG_PROBE_DEADLINE;
+    config->dc_probe_interval     = DFP_CFG_PROBE_INTERVAL;
+    config->dc_probe_window       = DFP_CFG_PROBE_WINDOW;
+    config->dc_probe_half_life    = DFP_CFG_PROBE_HALF_LIFE;
+    apr_cpystrn(config->dc_probe_aggr, DFP_CFG_PROBE_AGGR,
+        sizeof config->dc_probe_aggr);
+    config->dc_push_delta         = DFP_CFG_PUSH_DELTA;
+    config->dc_push_min_gap       = DFP_CFG_PUSH_MIN_GAP;
+    config->dc_nservices          = 0;    /* see dfp_agent_config() */
 
     return APR_SUCCESS;
 }
 
+/* Append the service described by \p arg, "port[/proto][:aggr][@addr,...]".
+ * The port and protocol are numbers, 0 for any; the protocol can also be
+ * "tcp" or "udp". aggr overrides dc_probe_aggr for the probe of the
+ * service. Without addresses, the local address of each manager connection
+ * is reported.
+ */
+static apr_status_t
+dfp_config_add_service(dfp_config_t *config, const char *arg)
+{
+    dfp_service_config_t *sc;
+    char                  buf[256];
+    char                 *hosts, *aggr, *proto, *host, *last, *end;
+    long                  n;
+    struct in_addr        addr;
+
+    if (config->dc_nservices >= DFP_CFG_MAX_SERVICES) {
+        cpe_log(CPE_ERR, "too many services (max %d)", DFP_CFG_MAX_SERVICES);
+        return APR_EINVAL;
+    }
+    sc = &config->dc_services[config->dc_nservices];
+    memset(sc, 0, sizeof *sc);
+    apr_cpystrn(buf, arg, sizeof buf);
+
+    if ((hosts = strchr(buf, '@')) != NULL) {
+        *hosts++ = '\0';
+    }
+    if ((aggr = strchr(buf, ':')) != NULL) {
+        *aggr++ = '\0';
+        apr_cpystrn(sc->sc_probe_aggr, aggr, sizeof sc->sc_probe_aggr);
+    }
+    if ((proto = strchr(buf, '/')) != NULL) {
+        *proto++ = '\0';
+    }
+
+    n = strtol(buf, &end, 10);
+    if (end == buf || *end != '\0' || n < 0 || n > 65535) {
+        cpe_log(CPE_ERR, "service '%s': invalid port", arg);
+        return APR_EINVAL;
+    }
+    sc->sc_port = n;
+
+    if (proto == NULL) {
+        sc->sc_protocol = 0;
+    } else if (strcmp(proto, "tcp") == 0) {
+        sc->sc_protocol = IPPROTO_TCP;
+    } else if (strcmp(proto, "udp") == 0) {
+        sc->sc_protocol = IPPROTO_UDP;
+    } else {
+        n = strtol(proto, &end, 10);
+        if (end == proto || *end != '\0' || n < 0 || n > 255) {
+            cpe_log(CPE_ERR, "service '%s': invalid protocol", arg);
+            return APR_EINVAL;
+        }
+        sc->sc_protocol = n;
+    }
+
+    for (host = hosts != NULL ? apr_strtok(hosts, ",", &last) : NULL;
+         host != NULL; host = apr_strtok(NULL, ",", &last))
+    {
+        if (sc->sc_nhosts >= DFP_CFG_MAX_SERVICE_HOSTS) {
+            cpe_log(CPE_ERR, "service '%s': too many addresses (max %d)",
+                arg, DFP_CFG_MAX_SERVICE_HOSTS);
+            return APR_EINVAL;
+        }
+        if (inet_pton(AF_INET, host, &addr) != 1) {
+            cpe_log(CPE_ERR, "service '%s': invalid address '%s'", arg, host);
+            return APR_EINVAL;
+        }
+        sc->sc_hosts[sc->sc_nhosts++] = addr.s_addr;
+    }
+
+    config->dc_nservices++;
+    return APR_SUCCESS;
+}
+
 static apr_status_t
 dfp_config_from_command_line(dfp_config_t *config,
     int argc, const char *const *argv)
@@ -72,9 +162,19 @@ dfp_config_from_command_line(dfp_config_t *config,
     static const apr_getopt_option_t options[] = {
         /* long-option, short-option, has-arg flag, description */
         { "address", 'a', TRUE,  "listen address"                  },
+        { "aggregate",'A', TRUE, "sma|ewma|min|max|p50|p95|p99|last" },
+        { "change",  'c', TRUE,  "push weight changes >= this (0 off)" },
         { "debug",   'd', TRUE,  "debug level"                     },
+        { "deadline",'D', TRUE,  "probe deadline [msec]"           },
+        { "gap",     'g', TRUE,  "min gap between pushes [msec]"   },
+        { "half-life",'H', TRUE, "probe EWMA half life [sec]"      },
+        { "interval",'i', TRUE,  "probe poll interval [msec]"      },
+        { "managers",'m', TRUE,  "max number of managers"          },
         { "port",    'p', TRUE,  "listen port"                     },
+        { "service", 's', TRUE,  "port[/proto][:aggr][@addr,...], repeatable" },
         { "timeout", 't', TRUE,  "main loop duration [sec]"        },
+        { "window",  'W', TRUE,  "probe window [samples]"          },
+        { "workers", 'w', TRUE,  "probe worker threads"            },
         { NULL,       0,  0,     NULL                              } /* end */
     };
 
@@ -87,15 +187,49 @@ dfp_config_from_command_line(dfp_config_t *config,
             apr_cpystrn(config->dc_listen_address, optarg,
                 sizeof config->dc_listen_address);
             break;
+        case 'A':
+            apr_cpystrn(config->dc_probe_aggr, optarg,
+                sizeof config->dc_probe_aggr);
+            break;
+        case 'c':
+            config->dc_push_delta = atoi(optarg);
+            break;
         case 'd':
             config->dc_log_level = atoi(optarg);
             break;
+        case 'D':
+            config->dc_probe_deadline = cpe_time_from_msec(atoi(optarg));
+            break;
+        case 'g':
+            config->dc_push_min_gap = cpe_time_from_msec(atoi(optarg));
+            break;
+        case 'H':
+            config->dc_probe_half_life = apr_time_from_sec(atoi(optarg));
+            break;
+        case 'i':
+            config->dc_probe_interval = cpe_time_from_msec(atoi(optarg));
+            break;
+        case 'm':
+            config->dc_max_managers = atoi(optarg);
+            break;
         case 'p':
             config->dc_listen_port = atoi(optarg);
             break;
+        case 's':
+            rv = dfp_config_add_service(config, optarg);
+            break;
         case 't':
             config->dc_loop_duration = apr_time_from_sec(atoi(optarg));
             break;
+        case 'W':
+            config->dc_probe_window = atoi(optarg);
+            break;
+        case 'w':
+            config->dc_probe_workers = atoi(optarg);
+            break;
+        }
+        if (rv != APR_SUCCESS) {
+            break;
         }
     }
     if (rv == APR_BADCH) {
@@ -122,5 +256,17 @@ dfp_agent_config(dfp_config_t *config, int argc, const char *const *argv)
         return rv;
     }
     /* And now override with command-line parameters. */
-    return dfp_config_from_command_line(config, argc, argv);
+    if ((rv = dfp_config_from_command_line(config, argc, argv)) !=
+        APR_SUCCESS)
+    {
+        return rv;
+    }
+    /* No service given: a single one, any port and protocol, reported for
+     * the local address.
+     */
+    if (config->dc_nservices == 0) {
+        memset(&config->dc_services[0], 0, sizeof config->dc_services[0]);
+        config->dc_nservices = 1;
+    }
+    return APR_SUCCESS;
 }
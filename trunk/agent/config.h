@@ -48,6 +48,30 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define DFP_CFG_LOG_LEVEL           CPE_INFO
 #define DFP_CFG_LOOP_DURATION       0
 #define DFP_CFG_KEEPALIVE_INTERVAL  apr_time_from_sec(5)
+#define DFP_CFG_MAX_MANAGERS        16
+#define DFP_CFG_PROBE_WORKERS       2
+#define DFP_CFG_PROBE_DEADLINE      apr_time_from_sec(2)
+#define DFP_CFG_PROBE_INTERVAL      0       /* use the plugin's */
+#define DFP_CFG_PROBE_WINDOW        60
+#define DFP_CFG_PROBE_HALF_LIFE     apr_time_from_sec(30)
+#define DFP_CFG_PROBE_AGGR          "sma"
+#define DFP_CFG_PUSH_DELTA          0       /* keepalive only */
+#define DFP_CFG_PUSH_MIN_GAP        cpe_time_from_msec(500)
+#define DFP_CFG_MAX_SERVICES        16      /* Load TLVs in one PREF_INFO */
+#define DFP_CFG_MAX_SERVICE_HOSTS   16
+
+/* A service (port and protocol) the agent reports a weight for: one Load
+ * TLV in each Preference Information, driven by its own probe. With no
+ * hosts, the TLV carries the local address of the manager connection.
+ */
+struct dfp_service_config_t {
+    int          sc_port;           /* 0 for any */
+    int          sc_protocol;       /* 0 for any */
+    char         sc_probe_aggr[16]; /* "" for dc_probe_aggr */
+    int          sc_nhosts;
+    apr_uint32_t sc_hosts[DFP_CFG_MAX_SERVICE_HOSTS]; /* network order */
+};
+typedef struct dfp_service_config_t dfp_service_config_t;
 
 struct dfp_config_t {
     int        dc_listen_port;
@@ -55,6 +79,17 @@ struct dfp_config_t {
     int        dc_log_level;
     apr_time_t dc_loop_duration;
     apr_time_t dc_keepalive_interval;
+    int        dc_max_managers;
+    int        dc_probe_workers;
+    apr_time_t dc_probe_deadline;
+    apr_time_t dc_probe_interval;
+    int        dc_probe_window;
+    apr_time_t dc_probe_half_life;
+    char       dc_probe_aggr[16];
+    int        dc_push_delta;
+    apr_time_t dc_push_min_gap;
+    int        dc_nservices;
+    dfp_service_config_t dc_services[DFP_CFG_MAX_SERVICES];
 };
 typedef struct dfp_config_t dfp_config_t;
 
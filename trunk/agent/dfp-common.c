@@ -37,6 +37,8 @@ ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <netinet/in.h>
+#include <apr_strings.h>
 #include "dfp-common.h"
 #include "wire.h"
 
@@ -44,45 +46,42 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * agent -> manager    Preference Info msg
  * or
  * agent <- manager    Server Status msg
+ * Every Host Preference of every Load TLV is logged; neither side acts on
+ * them yet.
  */
 apr_status_t
-dfp_parse_load(cpe_io_buf *iobuf, int payload_offset, int payload_len,
-    uint32_t *pref_ipaddr_v4, uint16_t *pref_bind_id, uint16_t *pref_weight)
+dfp_log_load(const dfp_msg_view_t *msg)
 {
-    int                        nhosts;
-    int                        minlen;
-    dfp_tlv_load_t            *load_tlv;
-    dfp_tlv_load_preference_t *load_pref;
-    uint16_t                   tlv_type;
-    uint16_t                   tlv_len;
+    const dfp_load_view_t *load;
+    uint                   i, k;
+    uint32_t               pref_ipaddr_v4;
+    uint16_t               pref_bind_id;
+    uint16_t               pref_weight;
+    char                   ipaddr_str[20];
 
-    nhosts = 1;
-    minlen = sizeof(dfp_tlv_load_t) + \
-        nhosts * sizeof(dfp_tlv_load_preference_t);
-    if (payload_len < minlen) {
-        cpe_log(CPE_WARN, "payload len (%d) < minimum len (%d)",
-            payload_len, minlen);
-        return APR_EGENERAL;
+    if (msg->mv_nloads == 0) {
+        cpe_log(CPE_DEB, "received %s msg without Load TLV",
+            dfp_msg_type2string(msg->mv_type));
+        return APR_SUCCESS;
     }
-
-    load_tlv = (dfp_tlv_load_t *) &iobuf->buf[payload_offset];
-    tlv_type = ntohs(load_tlv->load_header.tlv_type);
-    tlv_len = ntohs(load_tlv->load_header.tlv_len);
-    if (tlv_type != DFP_TLV_LOAD) {
-        cpe_log(CPE_WARN, "TLV type (%#x) is not Load", tlv_type);
-        return APR_EGENERAL;
+    for (i = 0; i < msg->mv_nloads; i++) {
+        load = &msg->mv_loads[i];
+        for (k = 0; k < load->lv_nhosts; k++) {
+            dfp_load_view_pref(load, k, &pref_ipaddr_v4, &pref_bind_id,
+                &pref_weight);
+            apr_snprintf(ipaddr_str, sizeof ipaddr_str, "%pA",
+                (struct in_addr *) &pref_ipaddr_v4);
+            cpe_log(CPE_INFO, "received %s msg, port %d, protocol %d, "
+                "server %s, bindId %d, weight %d",
+                dfp_msg_type2string(msg->mv_type), load->lv_portn,
+                load->lv_protocol, ipaddr_str, pref_bind_id, pref_weight);
+        }
     }
-    if (tlv_len > payload_len) {
-        cpe_log(CPE_WARN, "TLV len (%d) > payload len (%d)", tlv_len,
-            payload_len);
-        return APR_EGENERAL;
+    if (msg->mv_nloads_dropped > 0) {
+        cpe_log(CPE_WARN, "%s msg: ignored %u Load TLVs beyond the first %d",
+            dfp_msg_type2string(msg->mv_type), msg->mv_nloads_dropped,
+            DFP_MSG_MAX_LOADS);
     }
 
-    load_pref = (dfp_tlv_load_preference_t *) \
-        &iobuf->buf[payload_offset + sizeof(dfp_tlv_load_t)];
-    *pref_ipaddr_v4 = load_pref->pref_ipaddr_v4;
-    *pref_bind_id   = ntohs(load_pref->pref_bind_id);
-    *pref_weight    = ntohs(load_pref->pref_weight);
-
     return APR_SUCCESS;
 }
@@ -39,11 +39,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define DFP_COMMON_INCLUDED
 
 #include "apr_errno.h"
-#include "cpe-network.h"
+#include "wire.h"
 
 apr_status_t
-dfp_parse_load(cpe_io_buf *iobuf, int payload_offset, int payload_len,
-    uint32_t *pref_ipaddr_v4, uint16_t *pref_bind_id, uint16_t *pref_weight);
+dfp_log_load(const dfp_msg_view_t *msg);
 
 
 
@@ -40,7 +40,6 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "probe.h"
 
-extern dfp_probe_ctx_t      *g_dfp_probe_ctx;
 extern dfp_calc_average_t   g_dfp_probe_calc_average;
 
 
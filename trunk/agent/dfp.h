@@ -66,9 +66,19 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "probe.h"
 
-/** Callback used by DFP core to get the measured value from the plugin. */
+/** Callback used by DFP core to get the measured value from the plugin.
+ *  \p context is the one given by dfp_measure_open_t for the service.
+ */
 typedef apr_status_t (*dfp_take_measure_t)(void *context, apr_int32_t *value);
 
+/** Callback used by DFP core once per service, before its first measure,
+ *  to get from the plugin the context of the measures of that service.
+ *  The measures of different services can run at the same time, each with
+ *  its own context; those of one service never do.
+ */
+typedef apr_status_t (*dfp_measure_open_t)(
+    const dfp_service_config_t *service, apr_pool_t *pool, void **context);
+
 /** Used by a plugin wanting to override calc_average. */
 typedef apr_status_t (*dfp_calc_average_t)(dfp_probe_ctx_t *context,
     apr_int32_t *value);
@@ -80,7 +90,7 @@ plugin_init(
     char               **probe_name,
     apr_time_t          *poll_interval,
     dfp_take_measure_t  *probe_take_measure,
-    void               **take_measure_ctx,
+    dfp_measure_open_t  *probe_measure_open,
     dfp_calc_average_t  *probe_calc_average);
 
 
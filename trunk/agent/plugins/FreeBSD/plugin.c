@@ -48,19 +48,20 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/sysctl.h>
 
 
-/* Probe context; might be useful or not depending on the specific
- * implementation.
+/* Probe context, one per service; might be useful or not depending on the
+ * specific implementation.
  */
-static struct fbsd_probe_ctx_ {
-    int p_foo;
-} fbsd_probe_ctx;
+struct fbsd_probe_ctx_ {
+    int p_port;
+};
 typedef struct fbsd_probe_ctx_ fbsd_probe_ctx_t;
 
 
 static apr_status_t
 fbsd_probe_take_measure(void *context, int *value);
 static apr_status_t
-fbsd_probe_calc_average(dfp_probe_ctx_t *ctx, int *value);
+fbsd_probe_measure_open(const dfp_service_config_t *service,
+    apr_pool_t *pool, void **context);
 
 
 /*****************************************************************************
@@ -74,18 +75,18 @@ plugin_init(
     char               **probe_name,
     apr_time_t          *poll_interval,
     dfp_take_measure_t  *probe_take_measure,
-    void               **take_measure_ctx,
+    dfp_measure_open_t  *probe_measure_open,
     dfp_calc_average_t  *probe_calc_average)
 {
     *probe_name         = "fbsd plugin";
     *poll_interval      = apr_time_from_sec(5);
     *probe_take_measure = fbsd_probe_take_measure;
-    *take_measure_ctx   = &fbsd_probe_ctx;
+    *probe_measure_open = fbsd_probe_measure_open;
 
-    /* Overriding this is not normally needed, since DFP knows how to calculate
-     * a moving average for you. Use it only if you know what you are doing.
+    /* Not overridden: the load average is sampled like any other measure,
+     * and DFP aggregates the samples as configured (-A, -W, -H).
      */
-    *probe_calc_average = fbsd_probe_calc_average;
+    *probe_calc_average = NULL;
 
     return APR_SUCCESS;
 }
@@ -96,53 +97,61 @@ plugin_init(
  *****************************************************************************/
 
 
-/* Called periodically by the DFP probe subsystem.
- *
- * Here a real probe would gather a snapshot of the quantity it is due to
- * measure (CPU load, free memory, whatever) and return it in \p value.
- *
- * NOTE The DFP specs don't specify the weight range; they specify only that
- * a weight of 0 means full load, i.e. that server is not available for any
- * more flows.
- *
- * For the time being we use the convention that our values have a range
- * from 0 to 100, where 0 means full load and 100 means 0 load.
+/* Called once per service, before its first measure. The load average is
+ * the same for all the services: the context only records which one it is.
  */
 static apr_status_t
-fbsd_probe_take_measure(void *context, int *value)
+fbsd_probe_measure_open(const dfp_service_config_t *service,
+    apr_pool_t *pool, void **context)
 {
-    fbsd_probe_ctx_t *ctx = context;
+    fbsd_probe_ctx_t *ctx;
 
-    ctx = NULL;
-    *value = 0;
+    ctx = apr_pcalloc(pool, sizeof *ctx);
+    if (ctx == NULL) {
+        return APR_ENOMEM;
+    }
+    ctx->p_port = service->sc_port;
+    *context = ctx;
 
     return APR_SUCCESS;
 }
 
 
-/* WARNING: Normally you do NOT need to provide this method, DFP does it for
- * you.
+/* Called periodically by the DFP probe subsystem: one sample of the 1 minute
+ * load average, as a weight.
+ *
+ * It runs in a worker thread, not on the event loop, so it may block; it is
+ * never called again before it returns. Taking longer than the probe
+ * deadline gives a degraded sample.
  *
  * XXX WARNING The load average is NOT a good measure of system availability
  * for example, if a process is swapping to disk, load average will remain
  * low but the system will be unresponsive!!!!
  *
- * In this particular case, we want to override it because the OS keeps a
- * load average (I think this is common to all Unices) and we just normalize it.
- * Note that this is quite coarse, since we take into consideration only the VM
- * load.
+ * We use it because the OS keeps a load average (I think this is common to
+ * all Unices) and we just normalize it. Note that this is quite coarse,
+ * since we take into consideration only the VM load. The kernel already
+ * averages over 1 minute; DFP then aggregates our samples on top of it.
  *
  * Load average is a tuple of 3 floating point values, representing the load
  * in the last 1, 5, 15 minutes.
  * The range is not clearly specified, can be greater than 1, but 1 already
  * means that the CPU is idle 0%, at least on a uniprocessor system.
+ *
+ * NOTE The DFP specs don't specify the weight range; they specify only that
+ * a weight of 0 means full load, i.e. that server is not available for any
+ * more flows.
+ *
+ * For the time being we use the convention that our values have a range
+ * from 0 to 100, where 0 means full load and 100 means 0 load.
  */
 static apr_status_t
-fbsd_probe_calc_average(dfp_probe_ctx_t *ctx, int *value)
+fbsd_probe_take_measure(void *context, int *value)
 {
-    struct loadavg load_s;
-    float          load_1min;
-    int            load_i, size;
+    fbsd_probe_ctx_t *ctx = context;
+    struct loadavg    load_s;
+    float             load_1min;
+    int               load_i, size;
 
     ctx = NULL;
     /* In case of error, we put the server off-line. This should ring a
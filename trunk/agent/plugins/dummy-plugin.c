@@ -43,14 +43,18 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <assert.h>
 
 
-static struct dummy_probe_ctx_ {
+/* One per service, see dummy_probe_measure_open(). */
+struct dummy_probe_ctx_ {
     int du_foo;
-} dummy_probe_ctx;
+};
 typedef struct dummy_probe_ctx_ dummy_probe_ctx_t;
 
 
 static apr_status_t
 dummy_probe_take_measure(void *context, int *value);
+static apr_status_t
+dummy_probe_measure_open(const dfp_service_config_t *service,
+    apr_pool_t *pool, void **context);
 
 
 /*****************************************************************************
@@ -64,13 +68,13 @@ plugin_init(
     char               **probe_name,
     apr_time_t          *poll_interval,
     dfp_take_measure_t  *probe_take_measure,
-    void               **take_measure_ctx,
+    dfp_measure_open_t  *probe_measure_open,
     dfp_calc_average_t  *probe_calc_average)
 {
     *probe_name         = "dummy plugin";
     *poll_interval      = apr_time_from_sec(5);
     *probe_take_measure = dummy_probe_take_measure;
-    *take_measure_ctx   = &dummy_probe_ctx;
+    *probe_measure_open = dummy_probe_measure_open;
     /* Overriding probe_calc_average is NOT normally needed, since DFP already
      * does the calculation for you. Use it only if you know what you are doing.
      */
@@ -85,12 +89,41 @@ plugin_init(
  *****************************************************************************/
 
 
+/* Called once per service, before its first measure.
+ *
+ * Here a real probe would find what it measures for this service (the
+ * process listening on sc_port, the application instance, ...) and keep
+ * it in the context it returns. The context is then passed to each
+ * take_measure of the service.
+ */
+static apr_status_t
+dummy_probe_measure_open(const dfp_service_config_t *service,
+    apr_pool_t *pool, void **context)
+{
+    dummy_probe_ctx_t *ctx;
+
+    ctx = apr_pcalloc(pool, sizeof *ctx);
+    if (ctx == NULL) {
+        return APR_ENOMEM;
+    }
+    /* so that the services don't all report the same weight */
+    ctx->du_foo = service->sc_port % 100;
+    *context = ctx;
+
+    return APR_SUCCESS;
+}
+
+
 /* Called periodically by the DFP probe subsystem.
  *
  * Here a real probe would gather a snapshot of the quantity it is due to
  * measure (CPU load, free memory, I/O, application-specific, whatever) and
  * return it in \p value.
  *
+ * It runs in a worker thread, not on the event loop, so it may block; it is
+ * never called again before it returns. Taking longer than the probe
+ * deadline gives a degraded sample.
+ *
  * NOTE The DFP specs don't specify the weight range; they specify only that
  * a weight of 0 means full load, i.e. that server is not available for any
  * more flows.
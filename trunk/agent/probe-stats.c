@@ -0,0 +1,213 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "probe-stats.h"
+#include "cpe.h"
+#include "cpe-logging.h"
+
+
+static const char *g_dfp_aggr_names[] = {
+    "sma", "ewma", "min", "max", "p50", "p95", "p99", "last", NULL
+};
+
+
+/*****************************************************************************
+ *                                 INTERFACE                                 *
+ *****************************************************************************/
+
+
+/** Initialize the statistics of a probe.
+ *
+ * @param window     Number of samples for SMA, min, max and percentiles.
+ * @param period     Time between two samples.
+ * @param half_life  Age at which a sample weights half in the EWMA. Must
+ *                   not be shorter than the period.
+ */
+apr_status_t
+dfp_stats_init(dfp_stats_t *st, int window, apr_time_t period,
+    apr_time_t half_life, apr_pool_t *pool)
+{
+    if (window <= 0 || window > DFP_STATS_MAX_WINDOW || period <= 0 ||
+        half_life < period)
+    {
+        cpe_log(CPE_ERR, "invalid parms (window %d, period %lld ms, "
+            "half life %lld ms)", window, apr_time_as_msec(period),
+            apr_time_as_msec(half_life));
+        return APR_EINVAL;
+    }
+    memset(st, 0, sizeof *st);
+    st->st_ring = apr_pcalloc(pool, window * sizeof *st->st_ring);
+    if (st->st_ring == NULL) {
+        return APR_ENOMEM;
+    }
+    st->st_window = window;
+    /* After half_life / period samples, the old value weights 1/2. */
+    st->st_alpha = 1.0 - pow(0.5, (double) period / (double) half_life);
+    return APR_SUCCESS;
+}
+
+
+/** Add a sample, evicting the oldest one when the window is full. O(1). */
+void
+dfp_stats_add(dfp_stats_t *st, int value)
+{
+    int old;
+
+    if (value < 0) {
+        value = 0;
+    } else if (value > DFP_STATS_MAX_VALUE) {
+        value = DFP_STATS_MAX_VALUE;
+    }
+    if (st->st_count == st->st_window) {
+        old = st->st_ring[st->st_index];
+        st->st_sum -= old;
+        st->st_hist[old]--;
+    } else {
+        st->st_count++;
+    }
+    st->st_ring[st->st_index] = value;
+    st->st_index++;
+    st->st_index %= st->st_window;
+    st->st_sum += value;
+    st->st_hist[value]++;
+
+    /* The first sample seeds the EWMA, otherwise it would start from 0. */
+    if (st->st_total++ == 0) {
+        st->st_ewma = value;
+    } else {
+        st->st_ewma += st->st_alpha * (value - st->st_ewma);
+    }
+    st->st_last = value;
+}
+
+
+/** Reduce the window to one value.
+ *
+ * Percentiles are nearest-rank over the window, exact for integer samples;
+ * they, min and max cost at most one scan of the DFP_STATS_MAX_VALUE + 1
+ * histogram bins.
+ *
+ * @return APR_EINCOMPLETE, with \p value 0, if there is no sample yet.
+ */
+apr_status_t
+dfp_stats_get(dfp_stats_t *st, dfp_stats_aggr aggr, int *value)
+{
+    apr_uint32_t rank, seen;
+    int          i, pct;
+
+    *value = 0;
+    if (st->st_count == 0) {
+        return APR_EINCOMPLETE;
+    }
+    switch (aggr) {
+    case DFP_AGGR_SMA:
+        *value = st->st_sum / st->st_count;
+        return APR_SUCCESS;
+    case DFP_AGGR_EWMA:
+        *value = (int) (st->st_ewma + 0.5);
+        return APR_SUCCESS;
+    case DFP_AGGR_LAST:
+        *value = st->st_last;
+        return APR_SUCCESS;
+    case DFP_AGGR_MAX:
+        for (i = DFP_STATS_MAX_VALUE; st->st_hist[i] == 0; i--) {
+        }
+        *value = i;
+        return APR_SUCCESS;
+    case DFP_AGGR_MIN:
+        pct = 0;
+        break;
+    case DFP_AGGR_P50:
+        pct = 50;
+        break;
+    case DFP_AGGR_P95:
+        pct = 95;
+        break;
+    case DFP_AGGR_P99:
+        pct = 99;
+        break;
+    default:
+        cpe_log(CPE_ERR, "unknown aggregation %d", aggr);
+        return APR_EINVAL;
+    }
+    /* nearest rank: the smallest value with at least pct% of the samples
+     * less or equal to it.
+     */
+    rank = (pct * st->st_count + 99) / 100;
+    if (rank == 0) {
+        rank = 1;
+    }
+    seen = 0;
+    for (i = 0; i < DFP_STATS_MAX_VALUE; i++) {
+        seen += st->st_hist[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    *value = i;
+    return APR_SUCCESS;
+}
+
+
+/** Parse the name of an aggregation ("sma", "ewma", "p95"...). */
+apr_status_t
+dfp_stats_aggr_from_string(const char *name, dfp_stats_aggr *aggr)
+{
+    int i;
+
+    for (i = 0; g_dfp_aggr_names[i] != NULL; i++) {
+        if (strcmp(name, g_dfp_aggr_names[i]) == 0) {
+            *aggr = i;
+            return APR_SUCCESS;
+        }
+    }
+    cpe_log(CPE_ERR, "unknown aggregation '%s'", name);
+    return APR_EINVAL;
+}
+
+
+const char *
+dfp_stats_aggr2string(dfp_stats_aggr aggr)
+{
+    if (aggr < DFP_AGGR_SMA || aggr > DFP_AGGR_LAST) {
+        return "unknown";
+    }
+    return g_dfp_aggr_names[aggr];
+}
@@ -0,0 +1,92 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef DFP_PROBE_STATS_INCLUDED
+#define DFP_PROBE_STATS_INCLUDED
+
+#include "apr_pools.h"
+#include "apr_time.h"
+
+/* Samples are weights, 0 (full load) .. 100 (no load); others are clamped. */
+#define DFP_STATS_MAX_VALUE     100
+#define DFP_STATS_MAX_WINDOW    3600
+
+/** How the samples of a probe are reduced to one weight. */
+enum dfp_stats_aggr {
+    DFP_AGGR_SMA,       /**< simple moving average over the window */
+    DFP_AGGR_EWMA,      /**< exponentially weighted, see dfp_stats_init() */
+    DFP_AGGR_MIN,
+    DFP_AGGR_MAX,
+    DFP_AGGR_P50,
+    DFP_AGGR_P95,
+    DFP_AGGR_P99,
+    DFP_AGGR_LAST,      /**< the most recent sample */
+};
+typedef enum dfp_stats_aggr dfp_stats_aggr;
+
+/** Streaming statistics over the last st_window samples.
+ *
+ * Adding a sample is O(1): the window keeps a running sum, and a histogram
+ * with one bin per value from which min, max and percentiles are read.
+ */
+struct dfp_stats_ {
+    int           *st_ring;     /* circular buffer, modulo st_window */
+    int            st_window;
+    int            st_index;
+    int            st_count;    /* samples in the window */
+    apr_uint32_t   st_total;    /* samples ever added */
+    apr_int64_t    st_sum;      /* of the samples in the window */
+    apr_uint32_t   st_hist[DFP_STATS_MAX_VALUE + 1];
+    double         st_ewma;
+    double         st_alpha;    /* weight of a new sample in st_ewma */
+    int            st_last;
+};
+typedef struct dfp_stats_ dfp_stats_t;
+
+apr_status_t
+dfp_stats_init(dfp_stats_t *st, int window, apr_time_t period,
+    apr_time_t half_life, apr_pool_t *pool);
+void
+dfp_stats_add(dfp_stats_t *st, int value);
+apr_status_t
+dfp_stats_get(dfp_stats_t *st, dfp_stats_aggr aggr, int *value);
+apr_status_t
+dfp_stats_aggr_from_string(const char *name, dfp_stats_aggr *aggr);
+const char *
+dfp_stats_aggr2string(dfp_stats_aggr aggr);
+
+#endif /* DFP_PROBE_STATS_INCLUDED */
@@ -35,26 +35,106 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <apr_thread_proc.h>
 
 #include "dfp.h"
 #include "dfp-private.h"
 #include "probe.h"
+#include "probe-stats.h"
+#include "config.h"
 #include "cpe-logging.h"
 
-#define DFP_SAMPLES 60
 struct dfp_probe_ctx_ {
-    unsigned int        dp_count;
-    /* circular buffer, requires modulo N arithmetic */
-    int                 dp_samples[DFP_SAMPLES];
-    int                 dp_index;
+    /* the samples of the last dc_probe_window polls */
+    dfp_stats_t         dp_window;
+    dfp_stats_aggr      dp_aggr;
     apr_time_t          dp_poll_interval;
     dfp_take_measure_t  dp_take_measure_cb;
     void               *dp_take_measure_ctx;
+    /* Off-loop measure, see dfp_probe_cb(). The loop owns all the fields
+     * but dp_result_*, written by the worker before posting the result.
+     */
+    cpe_loop_t         *dp_loop;
+    cpe_event          *dp_deadline_event;
+    apr_time_t          dp_deadline;
+    int                 dp_busy;        /* a worker has the measure */
+    int                 dp_late;        /* its deadline has expired */
+    int                 dp_deadline_armed;
+    /* Written by the worker, only while dfp_probe_fini() waits for it. */
+    apr_status_t        dp_result_rv;
+    apr_int32_t         dp_result_value;
+    dfp_probe_stats_t   dp_stats;
+    apr_time_t          dp_tick_time;   /* start of the last poll */
+    dfp_probe_notify_t  dp_notify;
+    void               *dp_notify_ctx;
+};
+
+/* The plugin, shared by the probes of all the services. */
+struct dfp_plugin_ {
+    char               *pl_name;
+    apr_time_t          pl_poll_interval;
+    apr_time_t          pl_deadline;
+    dfp_take_measure_t  pl_take_measure_cb;
+    dfp_measure_open_t  pl_measure_open_cb;
 };
+typedef struct dfp_plugin_ dfp_plugin_t;
+
+/* State of a worker, changed with a compare and swap: by the worker from
+ * IDLE to BUSY to POSTING and back, by dfp_probe_fini() from IDLE to
+ * STOPPED or from BUSY to DETACHED.
+ */
+enum {
+    DFP_PW_IDLE,            /* waiting for a job, or stopping */
+    DFP_PW_BUSY,            /* in take_measure */
+    DFP_PW_POSTING,         /* handing the result to the loop */
+    DFP_PW_STOPPED,         /* to be joined */
+    DFP_PW_DETACHED         /* was busy at exit, not joined */
+};
+
+/* A worker thread, see dfp_probe_worker(). */
+struct dfp_probe_worker_ {
+    struct dfp_probe_pool_ *pw_pp;
+    apr_thread_t           *pw_thread;
+    volatile int            pw_state;   /* DFP_PW_* */
+};
+typedef struct dfp_probe_worker_ dfp_probe_worker_t;
+
+/* Worker threads running the take_measure callbacks, see dfp_probe_cb().
+ * malloc'd, with the workers: a detached worker may still come back after
+ * the pools are gone, and the last one out frees it, see dfp_probe_fini().
+ */
+struct dfp_probe_pool_ {
+    int                 pp_refs;        /* the loop, the detached workers */
+    int                 pp_jobs[2];     /* pipe of dfp_probe_ctx_t pointers */
+    apr_pool_t         *pp_pool;        /* of the threads */
+    int                 pp_nthreads;
+    dfp_probe_worker_t *pp_workers;
+};
+typedef struct dfp_probe_pool_ dfp_probe_pool_t;
+
+static dfp_plugin_t      g_dfp_plugin;
+static dfp_probe_pool_t *g_dfp_probe_pool;
+
+dfp_calc_average_t      g_dfp_probe_calc_average;
 
 
 static apr_status_t
 dfp_probe_cb(void *context, apr_pollfd_t *pfd, cpe_event *e);
+static apr_status_t
+dfp_probe_deadline_cb(void *context, apr_pollfd_t *pfd, cpe_event *e);
+static apr_status_t
+dfp_probe_pool_init(dfp_probe_pool_t **ppp, int nthreads, apr_pool_t *pool);
+static apr_status_t
+dfp_probe_pool_submit(dfp_probe_pool_t *pp, dfp_probe_ctx_t *ctx);
+static void
+dfp_probe_pool_release(dfp_probe_pool_t *pp);
+static int
+dfp_probe_aggr_configured(const dfp_config_t *conf);
 
 
 /*****************************************************************************
@@ -62,92 +142,228 @@ dfp_probe_cb(void *context, apr_pollfd_t *pfd, cpe_event *e);
  *****************************************************************************/
 
 
-/** Find and initialize the probe callbacks.
+/** Find and initialize the probe callbacks, and start the workers, until
+ * dfp_probe_fini().
+ *
+ * Uses from \p conf: dc_probe_workers, the number of threads running the
+ * measures (see dfp_probe_cb()); dc_probe_deadline, the time given to a
+ * measure before it counts as a degraded sample, capped to the poll
+ * interval; dc_probe_interval, which overrides the poll interval of the
+ * plugin if not 0. The probes themselves come from dfp_probe_create().
+ *
+ * @return APR_EINVAL if the plugin overrides calc_average while \p conf
+ * sets an aggregation, which the override would ignore.
  */
 apr_status_t
-dfp_probe_init(apr_pool_t *pool)
+dfp_probe_init(apr_pool_t *pool, const dfp_config_t *conf)
 {
+    dfp_plugin_t       *pl = &g_dfp_plugin;
     apr_status_t        rv;
-    apr_time_t          poll_interval;
-    dfp_take_measure_t  take_measure_cb = NULL;
-    void               *take_measure_ctx = NULL;
-    cpe_event          *event;
-    dfp_probe_ctx_t    *event_ctx;
     dfp_calc_average_t  calc_average_cb = NULL;
-    char               *probe_name = NULL;
-
-    /* For each found probe: create a timer event with dfp_probe_cb()
-     * as callback;
-     *
-     * TODO: write the for each loop. For the time being we use only the
-     * dummy probe.
-     *
-     * TODO: maybe create a subpool per probe?
-     */
 
     /* Until we get a real plugin system, we just play a linker trick for
      * the probe_init() symbol.
      */
     g_dfp_probe_calc_average = dfp_probe_calc_average;
-    CHECK(plugin_init(&probe_name, &poll_interval,
-        &take_measure_cb, &take_measure_ctx, &calc_average_cb));
+    CHECK(plugin_init(&pl->pl_name, &pl->pl_poll_interval,
+        &pl->pl_take_measure_cb, &pl->pl_measure_open_cb, &calc_average_cb));
+    if (conf->dc_probe_interval > 0) {
+        pl->pl_poll_interval = conf->dc_probe_interval;
+    }
     cpe_log(CPE_INFO, "found probe: %s, poll interval %lld ms",
-        probe_name, apr_time_as_msec(poll_interval));
+        pl->pl_name, apr_time_as_msec(pl->pl_poll_interval));
 
     /* Given that the plugin is the same process as us, the maximum check we
      * can perform is wether the callback pointer is NULL or not.
      */
-    if (take_measure_cb == NULL) {
+    if (pl->pl_take_measure_cb == NULL || pl->pl_measure_open_cb == NULL) {
         cpe_log(CPE_WARN, "%s", "warning: plugin init failed for xxx");
         /* Actually we should continue to the next plugin */
         return APR_EGENERAL;
     }
     if (calc_average_cb != NULL) {
+        /* The override replaces the window: refuse to ignore silently
+         * what was asked of it.
+         */
+        if (dfp_probe_aggr_configured(conf)) {
+            cpe_log(CPE_ERR, "%s", "plugin overrides calc_average: "
+                "-A, -W, -H and :aggr cannot be used with it");
+            return APR_EINVAL;
+        }
         cpe_log(CPE_INFO, "%s", "plugin is overriding calc_average");
         g_dfp_probe_calc_average = calc_average_cb;
     }
+    pl->pl_deadline = conf->dc_probe_deadline;
+    if (pl->pl_deadline <= 0 || pl->pl_deadline > pl->pl_poll_interval) {
+        pl->pl_deadline = pl->pl_poll_interval;
+    }
 
-    event_ctx = apr_pcalloc(pool, sizeof(dfp_probe_ctx_t));
-    event_ctx->dp_poll_interval = poll_interval;
-    event_ctx->dp_take_measure_cb = take_measure_cb;
-    event_ctx->dp_take_measure_ctx = take_measure_ctx;
+    CHECK(dfp_probe_pool_init(&g_dfp_probe_pool, conf->dc_probe_workers,
+        pool));
+    cpe_log(CPE_INFO, "probe deadline %lld ms, %d workers",
+        apr_time_as_msec(pl->pl_deadline), conf->dc_probe_workers);
+    return APR_SUCCESS;
+}
 
-    CHECK_NULL(event,
-        cpe_event_timer_create(poll_interval, dfp_probe_cb, event_ctx));
 
-    /*XXX HACK */
-    g_dfp_probe_ctx = event_ctx;
+/** Create and start the probe driving the weight of \p service.
+ *
+ * Each service has its own samples, measured by its own timer with its own
+ * plugin context: uses from \p conf dc_probe_window, dc_probe_half_life and
+ * dc_probe_aggr, unless the service has its own aggregation; see
+ * dfp_probe_calc_average(). Requires dfp_probe_init().
+ */
+apr_status_t
+dfp_probe_create(dfp_probe_ctx_t **probe, apr_pool_t *pool,
+    const dfp_config_t *conf, const dfp_service_config_t *service)
+{
+    dfp_plugin_t       *pl = &g_dfp_plugin;
+    apr_status_t        rv;
+    dfp_stats_aggr      aggr;
+    const char         *aggr_name;
+    cpe_event          *event;
+    dfp_probe_ctx_t    *ctx;
+
+    *probe = NULL;
+    assert(pl->pl_take_measure_cb != NULL);
+    aggr_name = service->sc_probe_aggr[0] != '\0' ? service->sc_probe_aggr :
+        conf->dc_probe_aggr;
+    CHECK(dfp_stats_aggr_from_string(aggr_name, &aggr));
+
+    CHECK_NULL(ctx, apr_pcalloc(pool, sizeof(dfp_probe_ctx_t)));
+    CHECK(dfp_stats_init(&ctx->dp_window, conf->dc_probe_window,
+        pl->pl_poll_interval,
+        cpe_max(conf->dc_probe_half_life, pl->pl_poll_interval), pool));
+    ctx->dp_aggr = aggr;
+    ctx->dp_poll_interval = pl->pl_poll_interval;
+    ctx->dp_take_measure_cb = pl->pl_take_measure_cb;
+    CHECK(pl->pl_measure_open_cb(service, pool, &ctx->dp_take_measure_ctx));
+    ctx->dp_loop = cpe_loop_current();
+    ctx->dp_deadline = pl->pl_deadline;
+    CHECK_NULL(ctx->dp_deadline_event,
+        cpe_event_timer_create(ctx->dp_deadline, dfp_probe_deadline_cb, ctx));
 
-    return cpe_event_add(event);
+    CHECK_NULL(event,
+        cpe_event_timer_create(ctx->dp_poll_interval, dfp_probe_cb, ctx));
+    /* Samples at a fixed rate, the moving average depends on it. */
+    CHECK(cpe_event_set_periodic(event, CPE_PERIODIC_SKIP));
+    CHECK(cpe_event_add(event));
+
+    cpe_log(CPE_INFO, "service port %d protocol %d: probe %s over %d "
+        "samples", service->sc_port, service->sc_protocol,
+        dfp_stats_aggr2string(aggr), conf->dc_probe_window);
+    *probe = ctx;
+    return APR_SUCCESS;
 }
 
 
-/* Compute a N-moving average
- *
- * This is crude because the N and the polling interval which determines the
- * time width of the samples is hard-coded, but it is straightforward to make
- * it more flexible.
- *
+/* Reduce the samples of the window to one weight, with the aggregation
+ * chosen for the probe (dc_probe_aggr). The window holds the last
+ * dc_probe_window samples, one per poll interval; the EWMA has a half life
+ * of dc_probe_half_life. See dfp_stats_get() for the cost.
  *
+ * @return APR_EINCOMPLETE, with \p value 0, before the first sample.
  */
 apr_status_t
 dfp_probe_calc_average(dfp_probe_ctx_t *ctx, apr_int32_t *value)
 {
-    unsigned int i, stop;
-    int          avg;
+    int          v;
+    apr_status_t rv;
 
     assert(ctx != NULL);
 
-    avg = 0;
-    /* "stop" is useful when the ring buffer is not full yet */
-    stop = cpe_min(ctx->dp_count, DFP_SAMPLES);
-    for (i = 0; i < stop; i++) {
-        avg += ctx->dp_samples[i];
-    }
-    avg /= stop;
-    *value = avg;
+    rv = dfp_stats_get(&ctx->dp_window, ctx->dp_aggr, &v);
+    *value = v;
+    return rv;
+}
 
-    return APR_SUCCESS;
+
+/** Counters of the measures of a probe. */
+void
+dfp_probe_stats_get(dfp_probe_ctx_t *ctx, dfp_probe_stats_t *stats)
+{
+    assert(ctx != NULL);
+    *stats = ctx->dp_stats;
+}
+
+
+/** Have fn(fn_ctx, sample_time) called after each sample of the probe,
+ * degraded ones included. NULL to stop.
+ */
+void
+dfp_probe_set_notify(dfp_probe_ctx_t *ctx, dfp_probe_notify_t fn,
+    void *fn_ctx)
+{
+    assert(ctx != NULL);
+    ctx->dp_notify = fn;
+    ctx->dp_notify_ctx = fn_ctx;
+}
+
+
+/** Stop the workers, before the pools given to dfp_probe_init() and
+ * dfp_probe_create() are destroyed. The idle ones are joined. One in a
+ * measure may stay there as long as the plugin is stuck: it is detached
+ * instead, and drops its result if it ever comes back; its thread is left
+ * to the pool of dfp_probe_init().
+ */
+void
+dfp_probe_fini(void)
+{
+    dfp_probe_pool_t   *pp = g_dfp_probe_pool;
+    dfp_probe_worker_t *pw;
+    dfp_probe_ctx_t    *stop = NULL;
+    apr_status_t        rv;
+    int                 k, nbusy = 0;
+
+    if (pp == NULL) {
+        return;
+    }
+    g_dfp_probe_pool = NULL;
+    for (k = 0; k < pp->pp_nthreads; k++) {
+        pw = &pp->pp_workers[k];
+        for (;;) {
+            if (__sync_bool_compare_and_swap(&pw->pw_state, DFP_PW_IDLE,
+                DFP_PW_STOPPED))
+            {
+                break;
+            }
+            /* its reference, before it can see it is detached */
+            __sync_fetch_and_add(&pp->pp_refs, 1);
+            if (__sync_bool_compare_and_swap(&pw->pw_state, DFP_PW_BUSY,
+                DFP_PW_DETACHED))
+            {
+                nbusy++;
+                break;
+            }
+            __sync_fetch_and_sub(&pp->pp_refs, 1);
+            /* posting a result, it will be idle in a moment */
+            apr_sleep(cpe_time_from_msec(1));
+        }
+    }
+    /* wake up the idle ones */
+    for (k = 0; k < pp->pp_nthreads - nbusy; k++) {
+        if (write(pp->pp_jobs[1], &stop, sizeof stop) !=
+            (ssize_t) sizeof stop)
+        {
+            cpe_log(CPE_ERR, "probe stop: %s",
+                cpe_errmsg(APR_FROM_OS_ERROR(errno)));
+        }
+    }
+    for (k = 0; k < pp->pp_nthreads; k++) {
+        pw = &pp->pp_workers[k];
+        if (pw->pw_state == DFP_PW_DETACHED) {
+            apr_thread_detach(pw->pw_thread);
+        } else {
+            apr_thread_join(&rv, pw->pw_thread);
+        }
+    }
+    if (nbusy > 0) {
+        cpe_log(CPE_WARN, "%d probe workers still measuring, not waited for",
+            nbusy);
+    } else if (pp->pp_pool != NULL) {
+        apr_pool_destroy(pp->pp_pool);
+    }
+    dfp_probe_pool_release(pp);
 }
 
 
@@ -163,30 +379,292 @@ dfp_probe_calc_average(dfp_probe_ctx_t *ctx, apr_int32_t *value)
  * just to:
  * 1. get registered at DFP startup
  * 2. tell DFP the measured value each time it is called
+ *
+ * DESIGN POINT
+ * A real probe reads files, runs commands or queries an application: it
+ * blocks, and it blocks longer exactly when the box is overloaded. So the
+ * take_measure callback never runs on the event loop, which must keep
+ * sending the keepalives. dfp_probe_cb() hands the measure to a worker
+ * thread and arms a deadline timer; the worker posts the result back to
+ * the loop with cpe_post(), where it goes in the sample ring. A measure
+ * that misses its deadline is recorded as a degraded sample, and its result
+ * is discarded when it finally comes back. A probe never has two measures
+ * running: while a worker has its measure, the following ticks are degraded
+ * samples too. The probes of different services, each with its own plugin
+ * context, measure in parallel: one stuck does not hold up the others. Nor
+ * does it hold up the exit, see dfp_probe_fini().
+ *
+ * DESIGN POINT
+ * The loop must not take a lock or wait (see the thread model in cpe.h),
+ * so the jobs go to the workers through a pipe, which they wait on, and
+ * the results come back with cpe_post(). Each worker announces what it is
+ * doing with a compare and swap, which dfp_probe_fini() uses to know which
+ * ones it can join.
  */
 
 
+/* Whether \p conf sets the aggregation of the samples to anything but the
+ * defaults, globally or for a service.
+ */
+static int
+dfp_probe_aggr_configured(const dfp_config_t *conf)
+{
+    int k;
+
+    if (strcmp(conf->dc_probe_aggr, DFP_CFG_PROBE_AGGR) != 0 ||
+        conf->dc_probe_window != DFP_CFG_PROBE_WINDOW ||
+        conf->dc_probe_half_life != DFP_CFG_PROBE_HALF_LIFE)
+    {
+        return 1;
+    }
+    for (k = 0; k < conf->dc_nservices; k++) {
+        if (conf->dc_services[k].sc_probe_aggr[0] != '\0') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Value of a degraded sample: like a failed probe, full load. */
+#define DFP_PROBE_DEGRADED 0
+
+
+/* Put a sample in the window. */
+static void
+dfp_probe_record(dfp_probe_ctx_t *ctx, int value)
+{
+    dfp_stats_add(&ctx->dp_window, value);
+    if (ctx->dp_notify != NULL) {
+        ctx->dp_notify(ctx->dp_notify_ctx, ctx->dp_tick_time);
+    }
+}
+
+
 static apr_status_t
 dfp_probe_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
 {
     apr_status_t     rv;
-    int              value = -1;
     dfp_probe_ctx_t *ctx = context;
 
     cpe_log(CPE_DEB, "%s", "collecting data");
     assert(ctx != NULL);
     pfd = NULL;
-    cpe_event_add(e);
-    ctx->dp_count++;
+    e = NULL;   /* periodic, re-armed by CPE */
+
+    ctx->dp_tick_time = cpe_now();
+    if (ctx->dp_busy) {
+        /* Still measuring: if it is already late, this tick is degraded as
+         * well, otherwise the pending result will fill the slot.
+         */
+        if (ctx->dp_late) {
+            ctx->dp_stats.ps_skipped++;
+            dfp_probe_record(ctx, DFP_PROBE_DEGRADED);
+            cpe_log(CPE_INFO, "%s", "probe still stuck, degraded sample");
+        }
+        return APR_SUCCESS;
+    }
+    CHECK(cpe_event_add(ctx->dp_deadline_event));
+    ctx->dp_deadline_armed = 1;
+    ctx->dp_busy = 1;
+    ctx->dp_late = 0;
+    ctx->dp_stats.ps_started++;
+    if (dfp_probe_pool_submit(g_dfp_probe_pool, ctx) != APR_SUCCESS) {
+        /* as if it failed: the deadline will find the probe idle */
+        ctx->dp_busy = 0;
+        ctx->dp_stats.ps_failed++;
+        dfp_probe_record(ctx, DFP_PROBE_DEGRADED);
+    }
+    return APR_SUCCESS;
+}
+
+
+/* The measure in progress missed its deadline. */
+static apr_status_t
+dfp_probe_deadline_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    dfp_probe_ctx_t *ctx = context;
+
+    pfd = NULL;
+    e = NULL;   /* one-shot, re-added by dfp_probe_cb() */
+    ctx->dp_deadline_armed = 0;
+    if (! ctx->dp_busy) {
+        return APR_SUCCESS;
+    }
+    ctx->dp_late = 1;
+    ctx->dp_stats.ps_timeouts++;
+    dfp_probe_record(ctx, DFP_PROBE_DEGRADED);
+    cpe_log(CPE_WARN, "probe missed its deadline (%lld ms), degraded sample",
+        apr_time_as_msec(ctx->dp_deadline));
+    return APR_SUCCESS;
+}
+
+
+/* Posted by a worker: the result of the measure, run by the loop. */
+static apr_status_t
+dfp_probe_result_cb(void *context)
+{
+    dfp_probe_ctx_t *ctx = context;
+    apr_status_t     rv;
+
+    ctx->dp_busy = 0;
+    if (ctx->dp_late) {
+        ctx->dp_stats.ps_discarded++;
+        cpe_log(CPE_INFO, "%s", "late probe result discarded");
+        return APR_SUCCESS;
+    }
+    if (ctx->dp_deadline_armed) {
+        ctx->dp_deadline_armed = 0;
+        CHECK(cpe_event_remove(ctx->dp_deadline_event));
+    }
+    if (ctx->dp_result_rv != APR_SUCCESS) {
+        ctx->dp_stats.ps_failed++;
+        dfp_probe_record(ctx, DFP_PROBE_DEGRADED);
+        cpe_log(CPE_WARN, "probe failed (%s), degraded sample",
+            cpe_errmsg(ctx->dp_result_rv));
+        return APR_SUCCESS;
+    }
+    ctx->dp_stats.ps_completed++;
+    dfp_probe_record(ctx, ctx->dp_result_value);
+    return APR_SUCCESS;
+}
+
+
+/* Drop a reference to \p pp; the last one frees it. The pool of the
+ * threads is not ours to destroy here, see dfp_probe_fini().
+ */
+static void
+dfp_probe_pool_release(dfp_probe_pool_t *pp)
+{
+    if (__sync_sub_and_fetch(&pp->pp_refs, 1) > 0) {
+        return;
+    }
+    close(pp->pp_jobs[0]);
+    close(pp->pp_jobs[1]);
+    free(pp->pp_workers);
+    free(pp);
+}
+
+
+static void * APR_THREAD_FUNC
+dfp_probe_worker(apr_thread_t *thread, void *data)
+{
+    dfp_probe_worker_t *pw = data;
+    dfp_probe_pool_t   *pp = pw->pw_pp;
+    dfp_probe_ctx_t    *ctx;
+    dfp_take_measure_t  take_measure_cb;
+    void               *take_measure_ctx;
+    apr_int32_t         value;
+    apr_status_t        rv;
+    ssize_t             n;
+
+    for (;;) {
+        n = read(pp->pp_jobs[0], &ctx, sizeof ctx);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n != (ssize_t) sizeof ctx || ctx == NULL) {
+            break;
+        }
+        /* ctx is still there: if dfp_probe_fini() has stopped us, it
+         * waits to join us. It may detach us as soon as we are busy, and
+         * ctx may then go while we measure.
+         */
+        take_measure_cb = ctx->dp_take_measure_cb;
+        take_measure_ctx = ctx->dp_take_measure_ctx;
+        if (! __sync_bool_compare_and_swap(&pw->pw_state, DFP_PW_IDLE,
+            DFP_PW_BUSY))
+        {
+            break;  /* stopped */
+        }
+
+        value = -1;
+        rv = take_measure_cb(take_measure_ctx, &value);
+
+        if (! __sync_bool_compare_and_swap(&pw->pw_state, DFP_PW_BUSY,
+            DFP_PW_POSTING))
+        {
+            /* Detached by dfp_probe_fini(): ctx and the loop are gone, and
+             * maybe our thread with the pool it was created from, so not
+             * even apr_thread_exit(). Only pp, which we hold a reference
+             * to, is still there.
+             */
+            dfp_probe_pool_release(pp);
+            return NULL;
+        }
+        /* dfp_probe_fini() waits for us to be idle again. */
+        ctx->dp_result_value = value;
+        ctx->dp_result_rv = rv;
+        rv = cpe_post(ctx->dp_loop, dfp_probe_result_cb, ctx);
+        __sync_bool_compare_and_swap(&pw->pw_state, DFP_PW_POSTING,
+            DFP_PW_IDLE);
+        if (rv != APR_SUCCESS) {
+            /* The probe stays busy: its ticks will be degraded samples. */
+            cpe_log(CPE_ERR, "cpe_post: %s", cpe_errmsg(rv));
+        }
+    }
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
 
-    /* XXX Not sure it is enough to return on failure */
-    CHECK(ctx->dp_take_measure_cb(ctx->dp_take_measure_ctx, &value));
 
-    ctx->dp_samples[ctx->dp_index] = value;
-    /* Increment modulo N */
-    ctx->dp_index++;
-    ctx->dp_index %= DFP_SAMPLES;
+/* Start \p nthreads workers, with their threads in a subpool of \p pool. */
+static apr_status_t
+dfp_probe_pool_init(dfp_probe_pool_t **ppp, int nthreads, apr_pool_t *pool)
+{
+    apr_status_t        rv;
+    dfp_probe_pool_t   *pp;
+    dfp_probe_worker_t *pw;
 
+    *ppp = NULL;
+    if (nthreads <= 0) {
+        cpe_log(CPE_ERR, "invalid number of probe workers (%d)", nthreads);
+        return APR_EINVAL;
+    }
+    pp = calloc(1, sizeof *pp);
+    if (pp == NULL ||
+        (pp->pp_workers = calloc(nthreads, sizeof *pp->pp_workers)) == NULL)
+    {
+        free(pp);
+        return APR_ENOMEM;
+    }
+    if (pipe(pp->pp_jobs) < 0) {
+        rv = APR_FROM_OS_ERROR(errno);
+        cpe_log(CPE_ERR, "pipe: %s", cpe_errmsg(rv));
+        free(pp->pp_workers);
+        free(pp);
+        return rv;
+    }
+    /* The loop never waits on it, the workers do. */
+    fcntl(pp->pp_jobs[1], F_SETFL, O_NONBLOCK);
+    pp->pp_refs = 1;
+    /* From here, dfp_probe_fini() undoes what was done. */
+    *ppp = pp;
+    CHECK(apr_pool_create(&pp->pp_pool, pool));
+    for (pp->pp_nthreads = 0; pp->pp_nthreads < nthreads; pp->pp_nthreads++) {
+        pw = &pp->pp_workers[pp->pp_nthreads];
+        pw->pw_pp = pp;
+        pw->pw_state = DFP_PW_IDLE;
+        CHECK(apr_thread_create(&pw->pw_thread, NULL, dfp_probe_worker, pw,
+            pp->pp_pool));
+    }
     return APR_SUCCESS;
+}
+
+
+/* Hand \p ctx to a worker, from the loop: a write to the job pipe, which
+ * does not block, nor take any lock. A pointer is less than PIPE_BUF, so
+ * each write and read is a whole job.
+ */
+static apr_status_t
+dfp_probe_pool_submit(dfp_probe_pool_t *pp, dfp_probe_ctx_t *ctx)
+{
+    apr_status_t rv;
 
+    if (write(pp->pp_jobs[1], &ctx, sizeof ctx) != (ssize_t) sizeof ctx) {
+        rv = APR_FROM_OS_ERROR(errno);
+        cpe_log(CPE_ERR, "probe job: %s", cpe_errmsg(rv));
+        return rv;
+    }
+    return APR_SUCCESS;
 }
@@ -39,13 +39,40 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define DFP_PROBE_INCLUDED
 
 #include "cpe.h"
+#include "config.h"
 
 typedef struct dfp_probe_ctx_ dfp_probe_ctx_t;
 
+/** Counters of the measures of a probe, see dfp_probe_stats_get(). */
+struct dfp_probe_stats_ {
+    apr_uint32_t ps_started;    /* measures handed to a worker */
+    apr_uint32_t ps_completed;  /* results in time */
+    apr_uint32_t ps_failed;     /* take_measure errors, degraded samples */
+    apr_uint32_t ps_timeouts;   /* deadlines missed, degraded samples */
+    apr_uint32_t ps_skipped;    /* ticks while still late, degraded samples */
+    apr_uint32_t ps_discarded;  /* results back after their deadline */
+};
+typedef struct dfp_probe_stats_ dfp_probe_stats_t;
 
+/** Called on the loop after each sample, see dfp_probe_set_notify().
+ *  \p sample_time is when the poll that produced it started.
+ */
+typedef void (*dfp_probe_notify_t)(void *ctx, apr_time_t sample_time);
+
+
+apr_status_t
+dfp_probe_init(apr_pool_t *pool, const dfp_config_t *conf);
+void
+dfp_probe_fini(void);
 apr_status_t
-dfp_probe_init(apr_pool_t *pool);
+dfp_probe_create(dfp_probe_ctx_t **probe, apr_pool_t *pool,
+    const dfp_config_t *conf, const dfp_service_config_t *service);
 apr_status_t
 dfp_probe_calc_average(dfp_probe_ctx_t *ctx, int *value);
+void
+dfp_probe_stats_get(dfp_probe_ctx_t *ctx, dfp_probe_stats_t *stats);
+void
+dfp_probe_set_notify(dfp_probe_ctx_t *ctx, dfp_probe_notify_t fn,
+    void *fn_ctx);
 
 #endif /* DFP_PROBE_INCLUDED */
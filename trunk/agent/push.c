@@ -0,0 +1,190 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <string.h>
+
+#include "push.h"
+#include "cpe-logging.h"
+
+
+static void
+dfp_push_settle(dfp_push_t *pu);
+static void
+dfp_push_send(dfp_push_t *pu);
+static apr_status_t
+dfp_push_deferred_cb(void *context, apr_pollfd_t *pfd, cpe_event *event);
+
+
+/*****************************************************************************
+ *                                 INTERFACE                                 *
+ *****************************************************************************/
+
+
+/** Set up change-driven reporting: \p changed_cb tells if a weight left
+ * the dead band, \p send_cb sends it, both called with \p ctx. Pushes are
+ * at least \p min_gap apart.
+ */
+apr_status_t
+dfp_push_init(dfp_push_t *pu, apr_time_t min_gap,
+    dfp_push_changed_t changed_cb, dfp_push_send_t send_cb, void *ctx)
+{
+    memset(pu, 0, sizeof *pu);
+    pu->pu_min_gap = min_gap;
+    pu->pu_changed_cb = changed_cb;
+    pu->pu_send_cb = send_cb;
+    pu->pu_ctx = ctx;
+    CHECK_NULL(pu->pu_timer,
+        cpe_event_timer_create(min_gap, dfp_push_deferred_cb, pu));
+    return APR_SUCCESS;
+}
+
+
+/** Called after each probe sample, taken at \p sample_time. Pushes right
+ * away if a weight left the dead band, but never sooner than the minimum
+ * gap after the previous push: a change within the gap is pushed when it
+ * ends, if it still holds. Changes inside the dead band are not pushed;
+ * the keepalive reports them anyway.
+ *
+ * The load step is the first sample out of the band since the last push;
+ * the latency of a push is measured from it.
+ */
+void
+dfp_push_sample(dfp_push_t *pu, apr_time_t sample_time)
+{
+    apr_time_t    earliest;
+    apr_status_t  rv;
+
+    if (! pu->pu_changed_cb(pu->pu_ctx)) {
+        dfp_push_settle(pu);
+        return;
+    }
+    if (! pu->pu_step_pending) {
+        pu->pu_step_pending = 1;
+        pu->pu_step_time = sample_time;
+    }
+    if (pu->pu_pending) {
+        /* already waiting for the gap to end */
+        return;
+    }
+    earliest = pu->pu_last_send + pu->pu_min_gap;
+    if (! pu->pu_sent || cpe_now() >= earliest) {
+        dfp_push_send(pu);
+        return;
+    }
+    pu->pu_stats.pus_deferred++;
+    pu->pu_pending = 1;
+    rv = cpe_event_add2(pu->pu_timer, earliest);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_WARN, "weight push: %s", cpe_errmsg(rv));
+    }
+}
+
+
+/** Copy the push counters into \p stats. */
+void
+dfp_push_stats_get(dfp_push_t *pu, dfp_push_stats_t *stats)
+{
+    *stats = pu->pu_stats;
+}
+
+
+/*****************************************************************************
+ *                               IMPLEMENTATION                              *
+ *****************************************************************************/
+
+
+/* The change of the pending load step is gone before its push: the weight
+ * came back inside the dead band, or a keepalive sent it.
+ */
+static void
+dfp_push_settle(dfp_push_t *pu)
+{
+    if (pu->pu_step_pending) {
+        pu->pu_stats.pus_suppressed++;
+        pu->pu_step_pending = 0;
+    }
+}
+
+
+/* Send now to the managers that need it. The latency runs from the load
+ * step, across the deferrals and the sends that found nobody to send to.
+ */
+static void
+dfp_push_send(dfp_push_t *pu)
+{
+    dfp_push_stats_t *st = &pu->pu_stats;
+    apr_time_t        latency;
+    int               nsent;
+
+    nsent = pu->pu_send_cb(pu->pu_ctx);
+    if (nsent == 0) {
+        /* On APR_EAGAIN, the next sample or keepalive will retry. */
+        return;
+    }
+    pu->pu_sent = 1;
+    pu->pu_last_send = cpe_now();
+    latency = pu->pu_last_send - pu->pu_step_time;
+    pu->pu_step_pending = 0;
+    st->pus_pushes++;
+    st->pus_latency_sum += latency;
+    if (latency > st->pus_latency_max) {
+        st->pus_latency_max = latency;
+    }
+    cpe_log(CPE_INFO, "weights pushed to %d managers, %lld ms after the load "
+        "step (max %lld ms, avg %lld ms over %u pushes)", nsent,
+        apr_time_as_msec(latency), apr_time_as_msec(st->pus_latency_max),
+        apr_time_as_msec(st->pus_latency_sum / st->pus_pushes),
+        st->pus_pushes);
+}
+
+
+/* The minimum gap after the previous send has elapsed. */
+static apr_status_t
+dfp_push_deferred_cb(void *context, apr_pollfd_t *pfd, cpe_event *event)
+{
+    dfp_push_t *pu = context;
+
+    pfd = NULL;
+    event = NULL;   /* one-shot, re-added by dfp_push_sample() */
+    pu->pu_pending = 0;
+    if (! pu->pu_changed_cb(pu->pu_ctx)) {
+        dfp_push_settle(pu);
+        return APR_SUCCESS;
+    }
+    dfp_push_send(pu);
+    return APR_SUCCESS;
+}
@@ -0,0 +1,86 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+#ifndef DFP_PUSH_INCLUDED
+#define DFP_PUSH_INCLUDED
+
+#include "cpe.h"
+
+/** Is a weight outside the dead band for some manager? */
+typedef int (*dfp_push_changed_t)(void *ctx);
+/** Send the weights to the managers outside the dead band.
+ *  @return how many it was sent to; 0 leaves the change to a later try.
+ */
+typedef int (*dfp_push_send_t)(void *ctx);
+
+/** Counters of the pushes, see dfp_push_stats_get(). */
+struct dfp_push_stats_ {
+    apr_uint32_t pus_pushes;        /* sends to one manager or more */
+    apr_uint32_t pus_deferred;      /* changes held until the gap ended */
+    apr_uint32_t pus_suppressed;    /* changes gone before their push */
+    apr_time_t   pus_latency_sum;   /* from the load step to the push */
+    apr_time_t   pus_latency_max;
+};
+typedef struct dfp_push_stats_ dfp_push_stats_t;
+
+/* Change-driven PREF_INFO, see dfp_push_sample(). */
+struct dfp_push_ {
+    apr_time_t          pu_min_gap;
+    dfp_push_changed_t  pu_changed_cb;
+    dfp_push_send_t     pu_send_cb;
+    void               *pu_ctx;
+    int                 pu_sent;        /* pu_last_send is set */
+    apr_time_t          pu_last_send;
+    cpe_event          *pu_timer;       /* deferred push, one-shot */
+    int                 pu_pending;     /* pu_timer is armed */
+    int                 pu_step_pending; /* pu_step_time is set */
+    apr_time_t          pu_step_time;   /* the load step */
+    dfp_push_stats_t    pu_stats;
+};
+typedef struct dfp_push_ dfp_push_t;
+
+
+apr_status_t
+dfp_push_init(dfp_push_t *pu, apr_time_t min_gap,
+    dfp_push_changed_t changed_cb, dfp_push_send_t send_cb, void *ctx);
+void
+dfp_push_sample(dfp_push_t *pu, apr_time_t sample_time);
+void
+dfp_push_stats_get(dfp_push_t *pu, dfp_push_stats_t *stats);
+
+#endif /* DFP_PUSH_INCLUDED */
@@ -0,0 +1,184 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <string.h>
+#include <netinet/in.h>
+
+#include "report.h"
+#include "wire.h"
+#include "cpe-logging.h"
+
+
+/*****************************************************************************
+ *                                 INTERFACE                                 *
+ *****************************************************************************/
+
+
+/** Lay out the Preference Information for the services of \p conf: where
+ * the Host Preferences of each service go, and the size of the whole
+ * message. The probes and the weights are up to the caller.
+ */
+void
+dfp_report_layout(dfp_report_t *rp, const dfp_config_t *conf)
+{
+    dfp_service_t *sv;
+    int            k;
+
+    rp->rp_nservices = conf->dc_nservices;
+    rp->rp_msg_size = sizeof(dfp_msg_header_t);
+    rp->rp_local = 0;
+    for (k = 0; k < rp->rp_nservices; k++) {
+        sv = &rp->rp_services[k];
+        sv->sv_conf = &conf->dc_services[k];
+        sv->sv_nprefs = sv->sv_conf->sc_nhosts;
+        if (sv->sv_nprefs == 0) {
+            rp->rp_local = 1;
+            sv->sv_nprefs = 1;
+        }
+        sv->sv_prefs_offset = rp->rp_msg_size + sizeof(dfp_tlv_load_t);
+        rp->rp_msg_size = sv->sv_prefs_offset +
+            sv->sv_nprefs * sizeof(dfp_tlv_load_preference_t);
+    }
+}
+
+
+/** Set the weight of \p sv, bumping the generation of the report if it
+ * changed.
+ */
+void
+dfp_report_set_weight(dfp_report_t *rp, dfp_service_t *sv, int value)
+{
+    /* XXX should check if we lose data from 32 to 16 */
+    if (value != sv->sv_weight) {
+        rp->rp_generation++;
+    }
+    sv->sv_weight = value;
+}
+
+
+/** Is the weight of a service \p delta or more away from \p last_weights,
+ * the ones last sent to a manager (-1 if none)? Inside this dead band a
+ * change waits for the keepalive.
+ */
+int
+dfp_report_is_change(const dfp_report_t *rp, const int *last_weights,
+    int delta)
+{
+    int d, k;
+
+    for (k = 0; k < rp->rp_nservices; k++) {
+        if (last_weights[k] < 0) {
+            return 1;
+        }
+        d = rp->rp_services[k].sv_weight - last_weights[k];
+        if (d < 0) {
+            d = -d;
+        }
+        if (d >= delta) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/** Encode in \p iobuf a Preference Information message with the current
+ * weights: one Load TLV per service, with a Host Preference for each of its
+ * addresses or, if it has none, for \p ipaddr_v4, the local address of the
+ * connection. Done once per connection: afterwards only the weights change,
+ * see dfp_pref_info_patch().
+ */
+apr_status_t
+dfp_pref_info_encode(dfp_report_t *rp, cpe_io_buf *iobuf,
+    uint32_t ipaddr_v4)
+{
+    const dfp_service_t        *sv;
+    const dfp_service_config_t *sc;
+    apr_status_t                rv;
+    int                         start, k, h;
+    uint                        flags = 0;  /* unused */
+    uint16_t                    bind_id = 0;
+
+    /* Reuse buffer from the beginning. */
+    iobuf->buf_len = 0;
+    CHECK(dfp_msg_pref_info_prepare(iobuf, rp->rp_msg_size, &start));
+    for (k = 0; k < rp->rp_nservices; k++) {
+        sv = &rp->rp_services[k];
+        sc = sv->sv_conf;
+        if (sc->sc_nhosts == 0) {
+            CHECK(dfp_tlv_load_prepare(iobuf, sc->sc_port, sc->sc_protocol,
+                flags, 1));
+            CHECK(dfp_tlv_load_add_hostpref(iobuf, ipaddr_v4, bind_id,
+                sv->sv_weight));
+            continue;
+        }
+        CHECK(dfp_tlv_load_prepare(iobuf, sc->sc_port, sc->sc_protocol,
+            flags, sc->sc_nhosts));
+        for (h = 0; h < sc->sc_nhosts; h++) {
+            CHECK(dfp_tlv_load_add_hostpref(iobuf, sc->sc_hosts[h], bind_id,
+                sv->sv_weight));
+        }
+    }
+    rp->rp_encodings++;
+    return APR_SUCCESS;
+}
+
+
+/** Write the current weights in \p iobuf, a message from
+ * dfp_pref_info_encode(): a 16-bit store per Host Preference, at offsets
+ * fixed by dfp_report_layout(). The result is the same bytes as a new
+ * encode. The Security TLV digest, once supported, goes here too, after
+ * the weights.
+ */
+void
+dfp_pref_info_patch(dfp_report_t *rp, cpe_io_buf *iobuf)
+{
+    const dfp_service_t       *sv;
+    dfp_tlv_load_preference_t *prefs;
+    uint16_t                   weight;
+    int                        k, h;
+
+    for (k = 0; k < rp->rp_nservices; k++) {
+        sv = &rp->rp_services[k];
+        prefs = (dfp_tlv_load_preference_t *) &iobuf->buf[sv->sv_prefs_offset];
+        weight = htons(sv->sv_weight);
+        for (h = 0; h < sv->sv_nprefs; h++) {
+            prefs[h].pref_weight = weight;
+        }
+    }
+    rp->rp_patches++;
+}
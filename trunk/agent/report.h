@@ -0,0 +1,89 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+#ifndef DFP_REPORT_INCLUDED
+#define DFP_REPORT_INCLUDED
+
+#include "cpe.h"
+#include "cpe-network.h"
+#include "config.h"
+#include "probe.h"
+
+/* A service reported in Preference Information, with the weight computed
+ * once per sample of its own probe.
+ */
+typedef struct dfp_service_ {
+    const dfp_service_config_t *sv_conf;
+    dfp_probe_ctx_t            *sv_probe;
+    uint16_t                    sv_weight;
+    int                         sv_prefs_offset; /* in the PREF_INFO */
+    int                         sv_nprefs;
+} dfp_service_t;
+
+/* The weights of all the services, and the Preference Information message
+ * that reports them, one Load TLV per service, shared by all the
+ * connections with the same local address.
+ */
+typedef struct dfp_report_ {
+    dfp_service_t    rp_services[DFP_CFG_MAX_SERVICES];
+    int              rp_nservices;
+    int              rp_msg_size;   /* of the whole PREF_INFO */
+    int              rp_local;      /* a service reports the local address */
+    apr_uint32_t     rp_generation; /* bumped at each change of a weight */
+    apr_uint32_t     rp_msg_generation; /* of the weights in rp_msg */
+    uint32_t         rp_ipaddr_v4;  /* in rp_msg, if rp_local */
+    cpe_io_buf      *rp_msg;        /* empty until the first send */
+    apr_uint32_t     rp_encodings;
+    apr_uint32_t     rp_patches;
+} dfp_report_t;
+
+
+void
+dfp_report_layout(dfp_report_t *rp, const dfp_config_t *conf);
+void
+dfp_report_set_weight(dfp_report_t *rp, dfp_service_t *sv, int value);
+int
+dfp_report_is_change(const dfp_report_t *rp, const int *last_weights,
+    int delta);
+apr_status_t
+dfp_pref_info_encode(dfp_report_t *rp, cpe_io_buf *iobuf,
+    uint32_t ipaddr_v4);
+void
+dfp_pref_info_patch(dfp_report_t *rp, cpe_io_buf *iobuf);
+
+#endif /* DFP_REPORT_INCLUDED */
@@ -0,0 +1,191 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ *
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Configuration: the services given with -s.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <tap.h>
+#include "apr_general.h"
+#include "config.h"
+
+static dfp_config_t g_conf;
+
+/* Parse the options in args, NULL-terminated. */
+static apr_status_t
+parse(const char *arg, ...)
+{
+    const char *argv[64];
+    int         argc = 0;
+    va_list     ap;
+
+    argv[argc++] = "test-dfp-1";
+    va_start(ap, arg);
+    for (; arg != NULL && argc < 63; arg = va_arg(ap, const char *)) {
+        argv[argc++] = arg;
+    }
+    va_end(ap);
+    argv[argc] = NULL;
+    memset(&g_conf, 0xa5, sizeof g_conf);
+    return dfp_agent_config(&g_conf, argc, argv);
+}
+
+static apr_uint32_t
+addr(const char *s)
+{
+    struct in_addr a;
+
+    inet_pton(AF_INET, s, &a);
+    return a.s_addr;
+}
+
+
+static void
+test_default(void)
+{
+    ok1(parse(NULL) == APR_SUCCESS);
+    ok1(g_conf.dc_nservices == 1);
+    ok1(g_conf.dc_services[0].sc_port == 0 &&
+        g_conf.dc_services[0].sc_protocol == 0);
+    ok1(g_conf.dc_services[0].sc_probe_aggr[0] == '\0');
+    ok1(g_conf.dc_services[0].sc_nhosts == 0);
+}
+
+
+static void
+test_services(void)
+{
+    dfp_service_config_t *sc = g_conf.dc_services;
+
+    ok1(parse("-s", "80/tcp:p95@10.0.0.1,10.0.0.2", "-s", "53/udp",
+        "--service", "443/50:ewma", "-s", "8080@192.168.1.7", NULL) ==
+        APR_SUCCESS);
+    ok1(g_conf.dc_nservices == 4);
+
+    ok1(sc[0].sc_port == 80 && sc[0].sc_protocol == IPPROTO_TCP);
+    ok1(strcmp(sc[0].sc_probe_aggr, "p95") == 0);
+    ok1(sc[0].sc_nhosts == 2);
+    ok1(sc[0].sc_hosts[0] == addr("10.0.0.1") &&
+        sc[0].sc_hosts[1] == addr("10.0.0.2"));
+
+    ok1(sc[1].sc_port == 53 && sc[1].sc_protocol == IPPROTO_UDP);
+    ok1(sc[1].sc_probe_aggr[0] == '\0' && sc[1].sc_nhosts == 0);
+
+    ok1(sc[2].sc_port == 443 && sc[2].sc_protocol == 50);
+    ok1(strcmp(sc[2].sc_probe_aggr, "ewma") == 0 && sc[2].sc_nhosts == 0);
+
+    ok1(sc[3].sc_port == 8080 && sc[3].sc_protocol == 0);
+    ok1(sc[3].sc_probe_aggr[0] == '\0');
+    ok1(sc[3].sc_nhosts == 1 && sc[3].sc_hosts[0] == addr("192.168.1.7"));
+}
+
+
+static void
+test_invalid(void)
+{
+    ok(parse("-s", "", NULL) != APR_SUCCESS, "empty port");
+    ok(parse("-s", "http", NULL) != APR_SUCCESS, "port not a number");
+    ok(parse("-s", "65536", NULL) != APR_SUCCESS, "port too big");
+    ok(parse("-s", "-1", NULL) != APR_SUCCESS, "negative port");
+    ok(parse("-s", "80/sctp", NULL) != APR_SUCCESS, "unknown protocol");
+    ok(parse("-s", "80/256", NULL) != APR_SUCCESS, "protocol too big");
+    ok(parse("-s", "80@10.0.0", NULL) != APR_SUCCESS, "bad address");
+    ok(parse("-s", "80@10.0.0.1,", "-s", "x", NULL) != APR_SUCCESS,
+        "bad service after a good one");
+}
+
+
+static void
+test_limits(void)
+{
+    char        hosts[DFP_CFG_MAX_SERVICE_HOSTS + 1][32];
+    char        arg[1024];
+    const char *argv[2 * (DFP_CFG_MAX_SERVICES + 1) + 2];
+    int         k, argc;
+
+    strcpy(arg, "80@");
+    for (k = 0; k <= DFP_CFG_MAX_SERVICE_HOSTS; k++) {
+        snprintf(hosts[k], sizeof hosts[k], "%s10.0.0.%d", k > 0 ? "," : "",
+            k + 1);
+        if (k == DFP_CFG_MAX_SERVICE_HOSTS) {
+            ok(parse("-s", arg, NULL) == APR_SUCCESS &&
+                g_conf.dc_services[0].sc_nhosts == DFP_CFG_MAX_SERVICE_HOSTS,
+                "max addresses in a service");
+        }
+        strcat(arg, hosts[k]);
+    }
+    ok(parse("-s", arg, NULL) != APR_SUCCESS, "too many addresses");
+
+    argc = 0;
+    argv[argc++] = "test-dfp-1";
+    for (k = 0; k <= DFP_CFG_MAX_SERVICES; k++) {
+        argv[argc++] = "-s";
+        argv[argc++] = "80";
+        if (k == DFP_CFG_MAX_SERVICES - 1) {
+            argv[argc] = NULL;
+            ok(dfp_agent_config(&g_conf, argc, argv) == APR_SUCCESS &&
+                g_conf.dc_nservices == DFP_CFG_MAX_SERVICES,
+                "max services");
+        }
+    }
+    argv[argc] = NULL;
+    ok(dfp_agent_config(&g_conf, argc, argv) != APR_SUCCESS,
+        "too many services");
+}
+
+
+int
+main(void)
+{
+    plan_tests(5 + 13 + 8 + 4);
+
+    apr_initialize();
+    cpe_log_init(CPE_WARN);
+
+    test_default();
+    test_services();
+    test_invalid();
+    test_limits();
+
+    apr_terminate();
+    return exit_status();
+}
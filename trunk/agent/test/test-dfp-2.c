@@ -0,0 +1,246 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ *
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Probe statistics: the window, its aggregations and the EWMA.
+ */
+
+#include <string.h>
+#include <tap.h>
+#include "apr_general.h"
+#include "probe-stats.h"
+#include "cpe-logging.h"
+
+static apr_pool_t *g_pool;
+
+
+static void
+test_init(void)
+{
+    dfp_stats_t st;
+    int         v;
+
+    ok1(dfp_stats_init(&st, 0, 1, 1, g_pool) == APR_EINVAL);
+    ok1(dfp_stats_init(&st, DFP_STATS_MAX_WINDOW + 1, 1, 1, g_pool) ==
+        APR_EINVAL);
+    ok1(dfp_stats_init(&st, 10, 0, 1, g_pool) == APR_EINVAL);
+    ok(dfp_stats_init(&st, 10, 2, 1, g_pool) == APR_EINVAL,
+        "half life shorter than the period");
+
+    ok1(dfp_stats_init(&st, 10, 1, 1, g_pool) == APR_SUCCESS);
+    v = -1;
+    ok(dfp_stats_get(&st, DFP_AGGR_SMA, &v) == APR_EINCOMPLETE && v == 0,
+        "empty window: sma");
+    v = -1;
+    ok(dfp_stats_get(&st, DFP_AGGR_EWMA, &v) == APR_EINCOMPLETE && v == 0,
+        "empty window: ewma");
+    v = -1;
+    ok(dfp_stats_get(&st, DFP_AGGR_P95, &v) == APR_EINCOMPLETE && v == 0,
+        "empty window: p95");
+    v = -1;
+    ok(dfp_stats_get(&st, DFP_AGGR_MAX, &v) == APR_EINCOMPLETE && v == 0,
+        "empty window: max");
+}
+
+
+static void
+test_window(void)
+{
+    dfp_stats_t st;
+    int         v;
+
+    dfp_stats_init(&st, 4, 1, 1, g_pool);
+    dfp_stats_add(&st, 10);
+    dfp_stats_add(&st, 20);
+    dfp_stats_add(&st, 30);
+    dfp_stats_add(&st, 40);
+    ok(dfp_stats_get(&st, DFP_AGGR_SMA, &v) == APR_SUCCESS && v == 25,
+        "sma of a full window (%d)", v);
+
+    /* 10 goes out */
+    dfp_stats_add(&st, 50);
+    dfp_stats_get(&st, DFP_AGGR_SMA, &v);
+    ok(v == 35, "sma after an eviction (%d)", v);
+    dfp_stats_get(&st, DFP_AGGR_MIN, &v);
+    ok(v == 20, "min after an eviction (%d)", v);
+    dfp_stats_get(&st, DFP_AGGR_MAX, &v);
+    ok(v == 50, "max (%d)", v);
+    dfp_stats_get(&st, DFP_AGGR_LAST, &v);
+    ok(v == 50, "last (%d)", v);
+
+    /* a full turn of the ring: only 1, 2, 3, 4 left */
+    dfp_stats_add(&st, 1);
+    dfp_stats_add(&st, 2);
+    dfp_stats_add(&st, 3);
+    dfp_stats_add(&st, 4);
+    dfp_stats_get(&st, DFP_AGGR_SMA, &v);
+    ok(v == 2, "sma after a full turn (%d)", v);
+    dfp_stats_get(&st, DFP_AGGR_MAX, &v);
+    ok(v == 4, "max after a full turn (%d)", v);
+
+    /* out of range samples are clamped */
+    dfp_stats_add(&st, -5);
+    dfp_stats_get(&st, DFP_AGGR_MIN, &v);
+    ok(v == 0, "negative sample clamped to 0 (%d)", v);
+    dfp_stats_add(&st, 1000);
+    dfp_stats_get(&st, DFP_AGGR_MAX, &v);
+    ok(v == DFP_STATS_MAX_VALUE, "big sample clamped (%d)", v);
+}
+
+
+static void
+test_percentiles(void)
+{
+    dfp_stats_t st;
+    int         k, v;
+
+    /* 1..100, in a scrambled order */
+    dfp_stats_init(&st, 100, 1, 1, g_pool);
+    for (k = 0; k < 100; k++) {
+        dfp_stats_add(&st, (k * 37) % 100 + 1);
+    }
+    dfp_stats_get(&st, DFP_AGGR_P50, &v);
+    ok(v == 50, "p50 of 1..100 (%d)", v);
+    dfp_stats_get(&st, DFP_AGGR_P95, &v);
+    ok(v == 95, "p95 of 1..100 (%d)", v);
+    dfp_stats_get(&st, DFP_AGGR_P99, &v);
+    ok(v == 99, "p99 of 1..100 (%d)", v);
+    dfp_stats_get(&st, DFP_AGGR_MIN, &v);
+    ok(v == 1, "min of 1..100 (%d)", v);
+    dfp_stats_get(&st, DFP_AGGR_MAX, &v);
+    ok(v == 100, "max of 1..100 (%d)", v);
+
+    /* nearest rank on a small window: 0, 10, .. 90 */
+    dfp_stats_init(&st, 10, 1, 1, g_pool);
+    for (k = 9; k >= 0; k--) {
+        dfp_stats_add(&st, k * 10);
+    }
+    dfp_stats_get(&st, DFP_AGGR_P50, &v);
+    ok(v == 40, "p50 of 10 samples is the 5th (%d)", v);
+    dfp_stats_get(&st, DFP_AGGR_P95, &v);
+    ok(v == 90, "p95 of 10 samples is the 10th (%d)", v);
+    dfp_stats_get(&st, DFP_AGGR_P99, &v);
+    ok(v == 90, "p99 of 10 samples is the 10th (%d)", v);
+
+    /* one sample: all the percentiles are it */
+    dfp_stats_init(&st, 10, 1, 1, g_pool);
+    dfp_stats_add(&st, 42);
+    dfp_stats_get(&st, DFP_AGGR_P50, &v);
+    ok(v == 42, "p50 of one sample (%d)", v);
+    dfp_stats_get(&st, DFP_AGGR_P99, &v);
+    ok(v == 42, "p99 of one sample (%d)", v);
+}
+
+
+static void
+test_ewma(void)
+{
+    dfp_stats_t st;
+    int         k, v;
+
+    /* half life of 4 periods */
+    dfp_stats_init(&st, 10, apr_time_from_sec(1), apr_time_from_sec(4),
+        g_pool);
+    dfp_stats_add(&st, 80);
+    dfp_stats_get(&st, DFP_AGGR_EWMA, &v);
+    ok(v == 80, "first sample seeds the ewma (%d)", v);
+
+    dfp_stats_init(&st, 10, apr_time_from_sec(1), apr_time_from_sec(4),
+        g_pool);
+    dfp_stats_add(&st, 100);
+    for (k = 0; k < 4; k++) {
+        dfp_stats_add(&st, 0);
+    }
+    dfp_stats_get(&st, DFP_AGGR_EWMA, &v);
+    ok(v == 50, "after a half life, the old value weights 1/2 (%d)", v);
+    for (k = 0; k < 4; k++) {
+        dfp_stats_add(&st, 0);
+    }
+    dfp_stats_get(&st, DFP_AGGR_EWMA, &v);
+    ok(v == 25, "after two, 1/4 (%d)", v);
+    /* 9 samples: the seed is still in the window */
+    dfp_stats_get(&st, DFP_AGGR_MAX, &v);
+    ok(v == 100, "max still sees the seed in the window (%d)", v);
+
+    /* half life equal to the period: each sample halves the distance */
+    dfp_stats_init(&st, 10, apr_time_from_sec(1), apr_time_from_sec(1),
+        g_pool);
+    dfp_stats_add(&st, 0);
+    dfp_stats_add(&st, 100);
+    dfp_stats_get(&st, DFP_AGGR_EWMA, &v);
+    ok(v == 50, "half life of one period (%d)", v);
+}
+
+
+static void
+test_names(void)
+{
+    dfp_stats_aggr aggr;
+    int            k, all = 1;
+
+    for (k = DFP_AGGR_SMA; k <= DFP_AGGR_LAST; k++) {
+        if (dfp_stats_aggr_from_string(dfp_stats_aggr2string(k), &aggr) !=
+            APR_SUCCESS || (int) aggr != k)
+        {
+            all = 0;
+        }
+    }
+    ok(all, "aggregation names round trip");
+    ok1(dfp_stats_aggr_from_string("p90", &aggr) == APR_EINVAL);
+    ok1(strcmp(dfp_stats_aggr2string(DFP_AGGR_LAST + 1), "unknown") == 0);
+}
+
+
+int
+main(void)
+{
+    plan_tests(9 + 9 + 10 + 5 + 3);
+
+    apr_initialize();
+    apr_pool_create(&g_pool, NULL);
+    cpe_log_init(CPE_SILENT);
+
+    test_init();
+    test_window();
+    test_percentiles();
+    test_ewma();
+    test_names();
+
+    apr_pool_destroy(g_pool);
+    apr_terminate();
+    return exit_status();
+}
@@ -0,0 +1,268 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ *
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Probes: measures on the workers, with a plugin of our own that is quick,
+ * slow, failing or stuck depending on the service. Checks the deadline,
+ * the degraded samples, the discarded late results, and that the cleanup
+ * at exit does not wait for a stuck measure, which can come back after it
+ * (run under valgrind to check it touches nothing freed).
+ */
+
+#include <string.h>
+#include <tap.h>
+#include "apr_general.h"
+#include "dfp.h"
+#include "dfp-private.h"
+#include "probe.h"
+
+#define POLL_INTERVAL   cpe_time_from_msec(100)
+#define DEADLINE        cpe_time_from_msec(30)
+#define SLOW_MEASURE    cpe_time_from_msec(250)
+#define STUCK_MEASURE   apr_time_from_sec(30)
+#define LOOP_DURATION   cpe_time_from_msec(1050)
+
+/* The service port tells the plugin how to behave. */
+enum { SV_QUICK = 1, SV_SLOW, SV_FAIL, SV_STUCK, SV_COUNT = SV_STUCK };
+
+static const char *g_sv_names[] = { "", "quick", "slow", "failing", "stuck" };
+
+static dfp_config_t     g_conf;
+static dfp_probe_ctx_t *g_probes[SV_COUNT + 1];
+static int              g_notified[SV_COUNT + 1];
+/* The stuck measure returns once released, see test_take_measure(). */
+static volatile int     g_stuck_release;
+static volatile int     g_stuck_returned;
+
+
+static apr_status_t
+test_take_measure(void *context, apr_int32_t *value)
+{
+    const dfp_service_config_t *sc = context;
+    apr_time_t                  start;
+
+    switch (sc->sc_port) {
+    case SV_QUICK:
+        *value = 70;
+        return APR_SUCCESS;
+    case SV_SLOW:
+        apr_sleep(SLOW_MEASURE);
+        *value = 90;
+        return APR_SUCCESS;
+    case SV_FAIL:
+        return APR_EGENERAL;
+    default:
+        start = apr_time_now();
+        while (! __sync_fetch_and_add(&g_stuck_release, 0) &&
+            apr_time_now() - start < STUCK_MEASURE)
+        {
+            apr_sleep(cpe_time_from_msec(10));
+        }
+        *value = 90;
+        __sync_fetch_and_add(&g_stuck_returned, 1);
+        return APR_SUCCESS;
+    }
+}
+
+static apr_status_t
+test_measure_open(const dfp_service_config_t *service, apr_pool_t *pool,
+    void **context)
+{
+    pool = NULL;
+    *context = (void *) service;
+    return APR_SUCCESS;
+}
+
+/* Linked instead of a real plugin. */
+apr_status_t
+plugin_init(
+    char               **probe_name,
+    apr_time_t          *poll_interval,
+    dfp_take_measure_t  *probe_take_measure,
+    dfp_measure_open_t  *probe_measure_open,
+    dfp_calc_average_t  *probe_calc_average)
+{
+    *probe_name         = "test plugin";
+    *poll_interval      = POLL_INTERVAL;
+    *probe_take_measure = test_take_measure;
+    *probe_measure_open = test_measure_open;
+    *probe_calc_average = NULL;
+    return APR_SUCCESS;
+}
+
+
+static void
+notify_cb(void *ctx, apr_time_t sample_time)
+{
+    int *count = ctx;
+
+    sample_time = 0;
+    (*count)++;
+}
+
+
+static void
+conf_init(dfp_config_t *conf)
+{
+    int k;
+
+    memset(conf, 0, sizeof *conf);
+    conf->dc_probe_workers = SV_COUNT;
+    conf->dc_probe_deadline = DEADLINE;
+    conf->dc_probe_window = 10;
+    conf->dc_probe_half_life = apr_time_from_sec(1);
+    apr_cpystrn(conf->dc_probe_aggr, "last", sizeof conf->dc_probe_aggr);
+    conf->dc_nservices = SV_COUNT;
+    for (k = 0; k < SV_COUNT; k++) {
+        conf->dc_services[k].sc_port = k + 1;
+    }
+}
+
+
+int
+main(void)
+{
+    apr_pool_t        *pool;
+    dfp_probe_stats_t  st[SV_COUNT + 1];
+    apr_time_t         start;
+    apr_int32_t        value;
+    apr_status_t       rv;
+    int                k, all;
+
+    plan_tests(4 + 5 + 5 + 4 + 4 + 2);
+
+    ok1(cpe_system_init(CPE_NUM_EVENTS_DEFAULT) == APR_SUCCESS);
+    cpe_log_init(CPE_ERR);
+    apr_pool_create(&pool, NULL);
+    conf_init(&g_conf);
+    ok1(dfp_probe_init(pool, &g_conf) == APR_SUCCESS);
+    all = 1;
+    for (k = 1; k <= SV_COUNT; k++) {
+        if (dfp_probe_create(&g_probes[k], pool, &g_conf,
+            &g_conf.dc_services[k - 1]) != APR_SUCCESS)
+        {
+            all = 0;
+            continue;
+        }
+        dfp_probe_set_notify(g_probes[k], notify_cb, &g_notified[k]);
+    }
+    ok(all, "probes created");
+    ok1(cpe_main_loop(LOOP_DURATION) == APR_SUCCESS);
+    for (k = 1; k <= SV_COUNT; k++) {
+        dfp_probe_stats_get(g_probes[k], &st[k]);
+        diag("%s: %u started, %u completed, %u failed, %u timeouts, "
+            "%u skipped, %u discarded, %d samples", g_sv_names[k],
+            st[k].ps_started, st[k].ps_completed, st[k].ps_failed,
+            st[k].ps_timeouts, st[k].ps_skipped, st[k].ps_discarded,
+            g_notified[k]);
+    }
+
+    /* about 10 ticks */
+    ok(st[SV_QUICK].ps_completed >= 7, "quick: measures in time");
+    ok(st[SV_QUICK].ps_failed == 0 && st[SV_QUICK].ps_timeouts == 0 &&
+        st[SV_QUICK].ps_skipped == 0 && st[SV_QUICK].ps_discarded == 0,
+        "quick: no degraded sample");
+    ok(st[SV_QUICK].ps_started - st[SV_QUICK].ps_completed <= 1,
+        "quick: at most the last measure in flight");
+    rv = g_dfp_probe_calc_average(g_probes[SV_QUICK], &value);
+    ok(rv == APR_SUCCESS && value == 70, "quick: its value (%d)", value);
+    ok(g_notified[SV_QUICK] == (int) st[SV_QUICK].ps_completed,
+        "quick: one sample per measure");
+
+    /* every measure misses the deadline, and its result comes back late */
+    ok(st[SV_SLOW].ps_completed == 0, "slow: no measure in time");
+    /* but the last one, if the loop ended before its deadline */
+    ok(st[SV_SLOW].ps_timeouts >= 2 &&
+        st[SV_SLOW].ps_timeouts + 1 >= st[SV_SLOW].ps_started,
+        "slow: each measure times out");
+    ok(st[SV_SLOW].ps_skipped >= 2, "slow: ticks skipped while late");
+    ok(st[SV_SLOW].ps_discarded >= 2 &&
+        st[SV_SLOW].ps_discarded <= st[SV_SLOW].ps_timeouts,
+        "slow: late results discarded");
+    rv = g_dfp_probe_calc_average(g_probes[SV_SLOW], &value);
+    ok(rv == APR_SUCCESS && value == 0, "slow: degraded value (%d)", value);
+
+    ok(st[SV_FAIL].ps_failed >= 7, "failing: failures counted");
+    ok(st[SV_FAIL].ps_completed == 0 && st[SV_FAIL].ps_timeouts == 0,
+        "failing: nothing else");
+    rv = g_dfp_probe_calc_average(g_probes[SV_FAIL], &value);
+    ok(rv == APR_SUCCESS && value == 0, "failing: degraded value (%d)",
+        value);
+    ok(g_notified[SV_FAIL] == (int) st[SV_FAIL].ps_failed,
+        "failing: one sample per failure");
+
+    ok(st[SV_STUCK].ps_started == 1 && st[SV_STUCK].ps_timeouts == 1,
+        "stuck: one measure, timed out");
+    ok(st[SV_STUCK].ps_skipped >= 7 && st[SV_STUCK].ps_discarded == 0,
+        "stuck: the following ticks skipped");
+    ok(g_notified[SV_STUCK] ==
+        (int) (st[SV_STUCK].ps_timeouts + st[SV_STUCK].ps_skipped),
+        "stuck: one degraded sample per tick");
+    all = 1;
+    for (k = 1; k <= SV_COUNT; k++) {
+        if (g_notified[k] != (int) (st[k].ps_completed + st[k].ps_failed +
+            st[k].ps_timeouts + st[k].ps_skipped))
+        {
+            all = 0;
+        }
+    }
+    ok(all, "every sample notified, none for a discarded result");
+
+    /* the stuck worker is detached, the others joined */
+    start = apr_time_now();
+    dfp_probe_fini();
+    apr_pool_destroy(pool);
+    ok(apr_time_now() - start < apr_time_from_sec(1),
+        "the cleanup does not wait for the stuck measure (%lld ms)",
+        apr_time_as_msec(apr_time_now() - start));
+
+    /* its measure comes back, with the probe and the pool gone: the worker
+     * drops the result and frees the worker pool, its last user
+     */
+    __sync_fetch_and_add(&g_stuck_release, 1);
+    start = apr_time_now();
+    while (! __sync_fetch_and_add(&g_stuck_returned, 0) &&
+        apr_time_now() - start < apr_time_from_sec(1))
+    {
+        apr_sleep(cpe_time_from_msec(10));
+    }
+    /* time for the worker to get through its exit */
+    apr_sleep(cpe_time_from_msec(100));
+    ok(g_stuck_returned == 1, "the stuck measure returns after the cleanup");
+
+    return exit_status();
+}
@@ -0,0 +1,243 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ *
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Preference Information: a message patched with new weights is the same,
+ * byte for byte, as one encoded from scratch. The biggest one is accepted
+ * by the receivers.
+ */
+
+#include <string.h>
+#include <netinet/in.h>
+#include <tap.h>
+#include "report.h"
+#include "wire.h"
+
+#define BUF_SIZE    4096
+#define LOCAL_ADDR  0x0a000063  /* 10.0.0.99 */
+
+static char       g_mem[2][BUF_SIZE];
+static cpe_io_buf g_iobuf[2];
+
+static cpe_io_buf *
+iobuf_reset(int k)
+{
+    memset(&g_iobuf[k], 0, sizeof g_iobuf[k]);
+    memset(g_mem[k], 0, sizeof g_mem[k]);
+    g_iobuf[k].buf = g_mem[k];
+    g_iobuf[k].buf_capacity = sizeof g_mem[k];
+    return &g_iobuf[k];
+}
+
+static void
+service_add(dfp_config_t *conf, int port, int protocol, int nhosts)
+{
+    dfp_service_config_t *sc = &conf->dc_services[conf->dc_nservices++];
+    int                   h;
+
+    memset(sc, 0, sizeof *sc);
+    sc->sc_port = port;
+    sc->sc_protocol = protocol;
+    sc->sc_nhosts = nhosts;
+    for (h = 0; h < nhosts; h++) {
+        sc->sc_hosts[h] = htonl(0xc0a80000 + (port << 4) + h);
+    }
+}
+
+static void
+weights_set(dfp_report_t *rp, int seed)
+{
+    int k;
+
+    for (k = 0; k < rp->rp_nservices; k++) {
+        dfp_report_set_weight(rp, &rp->rp_services[k], (seed + 13 * k) % 101);
+    }
+}
+
+/* Do the Load TLVs of iobuf carry the services of rp, with their weights? */
+static int
+weights_check(dfp_report_t *rp, cpe_io_buf *iobuf)
+{
+    dfp_msg_view_t              msg;
+    const dfp_service_config_t *sc;
+    const dfp_load_view_t      *lv;
+    uint32_t                    ipaddr_v4;
+    uint16_t                    bind_id, weight;
+    int                         k, h;
+
+    if (dfp_msg_decode(iobuf, 0, &msg) != APR_SUCCESS ||
+        msg.mv_type != DFP_MSG_PREF_INFO ||
+        (int) msg.mv_nloads != rp->rp_nservices)
+    {
+        return 0;
+    }
+    for (k = 0; k < rp->rp_nservices; k++) {
+        sc = rp->rp_services[k].sv_conf;
+        lv = &msg.mv_loads[k];
+        if (lv->lv_portn != sc->sc_port || lv->lv_protocol != sc->sc_protocol ||
+            lv->lv_nhosts != rp->rp_services[k].sv_nprefs)
+        {
+            return 0;
+        }
+        for (h = 0; h < lv->lv_nhosts; h++) {
+            dfp_load_view_pref(lv, h, &ipaddr_v4, &bind_id, &weight);
+            if (weight != rp->rp_services[k].sv_weight ||
+                ipaddr_v4 != (sc->sc_nhosts > 0 ? sc->sc_hosts[h] :
+                htonl(LOCAL_ADDR)))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Encode, patch new weights in, compare with a new encode; 5 tests. */
+static void
+test_patch(const char *name, const dfp_config_t *conf)
+{
+    dfp_report_t  rp;
+    cpe_io_buf   *patched = iobuf_reset(0);
+    cpe_io_buf   *encoded = iobuf_reset(1);
+    int           seed, all = 1;
+
+    memset(&rp, 0, sizeof rp);
+    dfp_report_layout(&rp, conf);
+    weights_set(&rp, 7);
+    ok(dfp_pref_info_encode(&rp, patched, htonl(LOCAL_ADDR)) ==
+        APR_SUCCESS && patched->buf_len == rp.rp_msg_size,
+        "%s: encoded, %d bytes as laid out", name, rp.rp_msg_size);
+
+    weights_set(&rp, 50);
+    dfp_pref_info_patch(&rp, patched);
+    dfp_pref_info_encode(&rp, encoded, htonl(LOCAL_ADDR));
+    ok(patched->buf_len == encoded->buf_len &&
+        memcmp(patched->buf, encoded->buf, encoded->buf_len) == 0,
+        "%s: patched == encoded", name);
+    ok(weights_check(&rp, patched), "%s: decoded weights and hosts", name);
+
+    /* over and over, with weights going up and down */
+    for (seed = 0; seed < 101; seed += 3) {
+        weights_set(&rp, seed);
+        dfp_pref_info_patch(&rp, patched);
+        dfp_pref_info_encode(&rp, encoded, htonl(LOCAL_ADDR));
+        if (memcmp(patched->buf, encoded->buf, encoded->buf_len) != 0) {
+            all = 0;
+        }
+    }
+    ok(all, "%s: patched == encoded, 34 more times", name);
+    ok(rp.rp_encodings == 2 + 34 && rp.rp_patches == 1 + 34,
+        "%s: counters (%u encodings, %u patches)", name, rp.rp_encodings,
+        rp.rp_patches);
+}
+
+
+static void
+test_generation(void)
+{
+    dfp_config_t  conf;
+    dfp_report_t  rp;
+    apr_uint32_t  gen;
+
+    memset(&conf, 0, sizeof conf);
+    service_add(&conf, 80, IPPROTO_TCP, 2);
+    memset(&rp, 0, sizeof rp);
+    dfp_report_layout(&rp, &conf);
+    dfp_report_set_weight(&rp, &rp.rp_services[0], 40);
+    gen = rp.rp_generation;
+    dfp_report_set_weight(&rp, &rp.rp_services[0], 40);
+    ok(rp.rp_generation == gen, "same weight, same generation");
+    dfp_report_set_weight(&rp, &rp.rp_services[0], 41);
+    ok(rp.rp_generation == gen + 1, "new weight, new generation");
+}
+
+
+/* All the services, with all their hosts: within what a receiver takes. */
+static void
+test_max_size(void)
+{
+    dfp_config_t conf;
+    dfp_report_t rp;
+    int          k;
+
+    memset(&conf, 0, sizeof conf);
+    for (k = 0; k < DFP_CFG_MAX_SERVICES; k++) {
+        service_add(&conf, 1000 + k, IPPROTO_TCP, DFP_CFG_MAX_SERVICE_HOSTS);
+    }
+    memset(&rp, 0, sizeof rp);
+    dfp_report_layout(&rp, &conf);
+    ok(rp.rp_msg_size <= DFP_MAX_MSG_SIZE,
+        "%d services of %d hosts: %d bytes, max %d", DFP_CFG_MAX_SERVICES,
+        DFP_CFG_MAX_SERVICE_HOSTS, rp.rp_msg_size, DFP_MAX_MSG_SIZE);
+}
+
+
+int
+main(void)
+{
+    dfp_config_t conf;
+    int          k;
+
+    plan_tests(4 * 5 + 2 + 1);
+
+    memset(&conf, 0, sizeof conf);
+    service_add(&conf, 0, 0, 0);
+    test_patch("default service", &conf);
+
+    memset(&conf, 0, sizeof conf);
+    service_add(&conf, 80, IPPROTO_TCP, 3);
+    test_patch("1 service, 3 hosts", &conf);
+
+    memset(&conf, 0, sizeof conf);
+    service_add(&conf, 80, IPPROTO_TCP, 0);
+    service_add(&conf, 53, IPPROTO_UDP, 2);
+    service_add(&conf, 443, IPPROTO_TCP, DFP_CFG_MAX_SERVICE_HOSTS);
+    service_add(&conf, 0, 0, 1);
+    test_patch("4 services, 0 to 16 hosts", &conf);
+
+    memset(&conf, 0, sizeof conf);
+    for (k = 0; k < DFP_CFG_MAX_SERVICES; k++) {
+        service_add(&conf, 1000 + k, IPPROTO_TCP,
+            k % 2 ? DFP_CFG_MAX_SERVICE_HOSTS : 0);
+    }
+    test_patch("16 services, local and 16 hosts", &conf);
+
+    test_generation();
+    test_max_size();
+
+    return exit_status();
+}
@@ -0,0 +1,273 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ *
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Change-driven reporting: the dead band around the weights last sent,
+ * and the pushes on the simulated clock, with the managers faked by
+ * callbacks. Checks the immediate push, the deferral within the minimum
+ * gap, the change gone before its push, the sends that find nobody, and
+ * the latency from the load step, including from a step at time 0.
+ */
+
+#include <string.h>
+#include <netinet/in.h>
+#include <tap.h>
+#include "cpe.h"
+#include "report.h"
+#include "push.h"
+
+#define TICK            cpe_time_from_msec(100)
+#define MIN_GAP         cpe_time_from_msec(500)
+#define LOOP_DURATION   cpe_time_from_msec(2050)
+#define MAX_SENDS       16
+
+/* What happens at each tick, before the sample. */
+enum { T_NONE, T_STEP, T_BACK, T_DOWN, T_UP };
+
+static const int g_script[] = {
+    T_NONE,
+    T_STEP,     /* 100: pushed at once */
+    T_STEP,     /* 200: within the gap, deferred to 600 */
+    T_NONE, T_NONE, T_NONE, T_NONE, T_NONE,
+    T_STEP,     /* 800: deferred to 1100 */
+    T_BACK,     /* 900: gone before its push */
+    T_NONE, T_NONE, T_NONE, T_NONE, T_NONE,
+    T_DOWN,     /* 1500: no manager takes it */
+    T_NONE,     /* 1600: nor now */
+    T_UP,       /* 1700: pushed, 200 ms after the step */
+};
+#define SCRIPT_LEN ((int) (sizeof g_script / sizeof g_script[0]))
+
+static dfp_push_t  g_push;
+static apr_time_t  g_start;
+static int         g_tick;
+static int         g_changed;       /* a weight is out of the band */
+static int         g_managers = 1;  /* that take a send */
+static int         g_attempts;
+static int         g_nsends;
+static apr_time_t  g_sends[MAX_SENDS];  /* ms from g_start */
+static apr_time_t  g_clock;         /* time source of test_push_at_zero() */
+
+
+static int
+changed_cb(void *context)
+{
+    context = NULL;
+    return g_changed;
+}
+
+static int
+send_cb(void *context)
+{
+    context = NULL;
+    g_attempts++;
+    if (g_managers == 0) {
+        return 0;
+    }
+    /* the managers now have the weight */
+    g_changed = 0;
+    if (g_nsends < MAX_SENDS) {
+        g_sends[g_nsends++] = apr_time_as_msec(cpe_now() - g_start);
+    }
+    return g_managers;
+}
+
+static apr_status_t
+tick_cb(void *context, apr_pollfd_t *pfd, cpe_event *event)
+{
+    context = NULL;
+    pfd = NULL;
+    event = NULL;   /* periodic */
+
+    g_tick++;
+    switch (g_tick < SCRIPT_LEN ? g_script[g_tick] : T_NONE) {
+    case T_STEP:
+        g_changed = 1;
+        break;
+    case T_BACK:
+        g_changed = 0;
+        break;
+    case T_DOWN:
+        g_changed = 1;
+        g_managers = 0;
+        break;
+    case T_UP:
+        g_managers = 1;
+        break;
+    }
+    dfp_push_sample(&g_push, cpe_now());
+    return APR_SUCCESS;
+}
+
+
+static void
+test_dead_band(void)
+{
+    dfp_config_t  conf;
+    dfp_report_t  rp;
+    int           last[DFP_CFG_MAX_SERVICES];
+
+    memset(&conf, 0, sizeof conf);
+    conf.dc_nservices = 2;
+    conf.dc_services[0].sc_port = 80;
+    conf.dc_services[0].sc_protocol = IPPROTO_TCP;
+    conf.dc_services[1].sc_port = 443;
+    conf.dc_services[1].sc_protocol = IPPROTO_TCP;
+    memset(&rp, 0, sizeof rp);
+    dfp_report_layout(&rp, &conf);
+    dfp_report_set_weight(&rp, &rp.rp_services[0], 50);
+    dfp_report_set_weight(&rp, &rp.rp_services[1], 20);
+
+    last[0] = 50;
+    last[1] = -1;
+    ok(dfp_report_is_change(&rp, last, 5), "nothing sent yet: a change");
+    last[1] = 20;
+    ok(! dfp_report_is_change(&rp, last, 5), "same weights: no change");
+    last[1] = 24;
+    ok(! dfp_report_is_change(&rp, last, 5), "4 down: inside the band");
+    last[1] = 15;
+    ok(dfp_report_is_change(&rp, last, 5), "5 up: outside the band");
+    last[1] = 20;
+    last[0] = 56;
+    ok(dfp_report_is_change(&rp, last, 5), "6 down, first service: outside");
+}
+
+
+static apr_time_t
+clock_cb(void *context)
+{
+    context = NULL;
+    return g_clock;
+}
+
+
+/* A clock starting at 0, like the simulated one can: a load step at 0 is
+ * still a step, and no push yet means no gap to wait for.
+ */
+static void
+test_push_at_zero(void)
+{
+    dfp_push_t        pu;
+    dfp_push_stats_t  st;
+
+    g_clock = 0;
+    ok1(cpe_clock_set(clock_cb, NULL) == APR_SUCCESS);
+    ok1(dfp_push_init(&pu, MIN_GAP, changed_cb, send_cb, NULL) ==
+        APR_SUCCESS);
+    g_start = 0;
+    g_changed = 1;
+    g_managers = 0;
+    dfp_push_sample(&pu, cpe_now());
+    g_clock = TICK;
+    g_managers = 1;
+    dfp_push_sample(&pu, cpe_now());
+    dfp_push_stats_get(&pu, &st);
+    ok(g_nsends == 1 && g_sends[0] == 100 && st.pus_deferred == 0,
+        "first push not held by a previous one");
+    ok(st.pus_pushes == 1 && st.pus_latency_sum == TICK,
+        "latency from the load step at 0 (%lld ms)",
+        apr_time_as_msec(st.pus_latency_sum));
+    g_clock = 2 * TICK;
+    g_changed = 1;
+    dfp_push_sample(&pu, cpe_now());
+    dfp_push_stats_get(&pu, &st);
+    ok(g_nsends == 1 && st.pus_deferred == 1,
+        "the next change waits for the gap");
+
+    cpe_event_remove(pu.pu_timer);
+    g_changed = 0;
+    g_attempts = 0;
+    g_nsends = 0;
+}
+
+
+static void
+test_push(void)
+{
+    dfp_push_stats_t  st;
+    cpe_event        *tick;
+    int               k, gaps;
+
+    ok1(cpe_clock_set_virtual(0) == APR_SUCCESS);
+    g_start = cpe_clock_now();
+    ok1(dfp_push_init(&g_push, MIN_GAP, changed_cb, send_cb, NULL) ==
+        APR_SUCCESS);
+    tick = cpe_event_timer_create(TICK, tick_cb, NULL);
+    ok(tick != NULL && cpe_event_set_periodic(tick, CPE_PERIODIC_SKIP) ==
+        APR_SUCCESS && cpe_event_add(tick) == APR_SUCCESS, "tick timer");
+    ok1(cpe_main_loop(LOOP_DURATION) == APR_SUCCESS);
+
+    dfp_push_stats_get(&g_push, &st);
+    diag("%d attempts, %d sends, %u pushes, %u deferred, %u suppressed, "
+        "latency sum %lld ms max %lld ms", g_attempts, g_nsends,
+        st.pus_pushes, st.pus_deferred, st.pus_suppressed,
+        apr_time_as_msec(st.pus_latency_sum),
+        apr_time_as_msec(st.pus_latency_max));
+
+    ok(g_nsends == 3 && g_sends[0] == 100 && g_sends[1] == 600 &&
+        g_sends[2] == 1700, "pushed at 100, 600 and 1700 ms");
+    gaps = 1;
+    for (k = 1; k < g_nsends; k++) {
+        if (g_sends[k] - g_sends[k - 1] < apr_time_as_msec(MIN_GAP)) {
+            gaps = 0;
+        }
+    }
+    ok(gaps, "pushes at least the minimum gap apart");
+    ok(g_attempts == 5, "2 more sends that found no manager (%d)",
+        g_attempts - g_nsends);
+    ok(st.pus_pushes == 3, "3 pushes counted");
+    ok(st.pus_deferred == 2, "2 deferred within the gap");
+    ok(st.pus_suppressed == 1, "1 change gone before its push");
+    ok(st.pus_latency_max == cpe_time_from_msec(400),
+        "max latency from the load step at 200 ms");
+    ok(st.pus_latency_sum == cpe_time_from_msec(0 + 400 + 200),
+        "latencies 0, 400 and 200 ms");
+}
+
+
+int
+main(void)
+{
+    plan_tests(5 + 1 + 5 + 4 + 8);
+
+    test_dead_band();
+    ok1(cpe_system_init(CPE_NUM_EVENTS_DEFAULT) == APR_SUCCESS);
+    cpe_log_init(CPE_ERR);
+    test_push_at_zero();
+    test_push();
+    return exit_status();
+}
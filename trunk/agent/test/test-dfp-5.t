@@ -0,0 +1 @@
+test-dfp-1.t
\ No newline at end of file
@@ -44,9 +44,380 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "cpe-algorithms.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 
+/* Initial number of slots of the heap array; it doubles when full. */
+#define CPE_PRIORITYQ_MIN_SIZE 16
+
+/*
+ * The queue is a binary heap (Sedgewick, chapter 9) stored in the array
+ * head->pq_heap, indexed from 1 to head->pq_nelems. Slot 0 is unused, this
+ * keeps the parent/child arithmetic simple. Each node remembers its own
+ * slot in pq_index, which makes removal of an arbitrary node O(log N)
+ * instead of a linear search.
+ *
+ * As in the rest of CPE, priority means expiration time: the "max" of the
+ * queue is the node with the smallest pq_value.
+ *
+ * insert:     O(log N)
+ * remove:     O(log N)
+ * remove_max: O(log N)
+ * find_max:   O(1)
+ * len:        O(1)
+ */
+
+
+/* Return non-zero if node a must come out of the queue before node b. */
+static int
+pq_less(cpe_priorityQ *a, cpe_priorityQ *b)
+{
+    if (a->pq_value != b->pq_value) {
+        return a->pq_value < b->pq_value;
+    }
+    /* Same value: first inserted, first out. Unsigned difference copes with
+     * wrap-around of the sequence counter.
+     */
+    return (int) (a->pq_seq - b->pq_seq) < 0;
+}
+
+
+static void
+pq_set(cpe_priorityQ *head, u_int k, cpe_priorityQ *node)
+{
+    head->pq_heap[k] = node;
+    node->pq_index = k;
+}
+
+
+static void
+pq_fixup(cpe_priorityQ *head, u_int k)
+{
+    cpe_priorityQ *node = head->pq_heap[k];
+
+    while (k > 1 && pq_less(node, head->pq_heap[k / 2])) {
+        pq_set(head, k, head->pq_heap[k / 2]);
+        k /= 2;
+    }
+    pq_set(head, k, node);
+}
+
+
+static void
+pq_fixdown(cpe_priorityQ *head, u_int k)
+{
+    cpe_priorityQ *node = head->pq_heap[k];
+    u_int          j, N = head->pq_nelems;
+
+    while (2 * k <= N) {
+        j = 2 * k;
+        if (j < N && pq_less(head->pq_heap[j + 1], head->pq_heap[j])) {
+            j++;
+        }
+        if (! pq_less(head->pq_heap[j], node)) {
+            break;
+        }
+        pq_set(head, k, head->pq_heap[j]);
+        k = j;
+    }
+    pq_set(head, k, node);
+}
+
+
+/*
+ * Hierarchical timing wheel (Varghese and Lauck, "Hashed and Hierarchical
+ * Timing Wheels"), an alternative to the heap selected with
+ * cpe_priorityQ_create_wheel(). Time is counted in ticks of tw_tick pq_value
+ * units; there are TW_LEVELS wheels of TW_SLOTS slots each, the slots of
+ * level L are TW_SLOTS^L ticks wide. A node with expiration tick t goes in
+ * the lowest level whose current "page" also contains t, so that every node
+ * of level L expires before every node of level L + 1. Nodes too far in the
+ * future sit in an overflow list.
+ *
+ * When the current time moves to another page, the slot of the new page at
+ * the level above is cascaded down. Each node is cascaded at most
+ * TW_LEVELS times, so insert and remove are O(1) and cascades are amortized
+ * O(1). find_max looks at the per-level bitmaps of non-empty slots; only
+ * when the next node is not in level 0 it has to scan one slot, and the
+ * result is cached until it is removed.
+ *
+ * The wheel never moves its current time past the earliest node, see
+ * tw_advance(); a node inserted with an expiration in the past goes in the
+ * current slot. Nodes expiring in the same tick are extracted in insertion
+ * order, NOT in pq_value order: the tick is the resolution of the wheel.
+ */
+#define TW_BITS     8
+#define TW_SLOTS    (1 << TW_BITS)
+#define TW_MASK     (TW_SLOTS - 1)
+#define TW_LEVELS   4
+#define TW_WORDS    (TW_SLOTS / 64)
+/* pq_index of the nodes in the overflow list */
+#define TW_OVERFLOW (TW_LEVELS * TW_SLOTS + 1)
+
+struct tw_list {
+    cpe_priorityQ *first;
+    cpe_priorityQ *last;
+};
+
+struct cpe_timerwheel {
+    int64_t         tw_tick;      /* resolution, in pq_value units */
+    u_int64_t       tw_now;       /* current time, in ticks */
+    cpe_priorityQ  *tw_min;       /* cached find_max, NULL if unknown */
+    u_int64_t       tw_bitmap[TW_LEVELS][TW_WORDS];
+    struct tw_list  tw_slot[TW_LEVELS][TW_SLOTS];
+    struct tw_list  tw_overflow;
+};
+
+
+/* Expiration tick of node; expired nodes count as expiring now. */
+static u_int64_t
+tw_ticks(struct cpe_timerwheel *tw, cpe_priorityQ *node)
+{
+    u_int64_t t;
+
+    t = node->pq_value < 0 ? 0 : (u_int64_t) (node->pq_value / tw->tw_tick);
+    return t < tw->tw_now ? tw->tw_now : t;
+}
+
+
+static struct tw_list *
+tw_list_of(struct cpe_timerwheel *tw, u_int index)
+{
+    if (index == TW_OVERFLOW) {
+        return &tw->tw_overflow;
+    }
+    index--;
+    return &tw->tw_slot[index / TW_SLOTS][index % TW_SLOTS];
+}
+
+
+static int
+tw_ffs(u_int64_t bits)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int n = 0;
+
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+
+/* First non-empty slot of level, starting from slot "from"; -1 if none. */
+static int
+tw_next_slot(struct cpe_timerwheel *tw, u_int level, u_int from)
+{
+    u_int64_t bits;
+    u_int     w;
+
+    if (from >= TW_SLOTS) {
+        return -1;
+    }
+    w = from / 64;
+    bits = tw->tw_bitmap[level][w] & (~0ULL << (from % 64));
+    for (;;) {
+        if (bits != 0) {
+            return w * 64 + tw_ffs(bits);
+        }
+        if (++w == TW_WORDS) {
+            return -1;
+        }
+        bits = tw->tw_bitmap[level][w];
+    }
+}
+
+
+/* The pq_index that node must have, given its expiration and the time. */
+static u_int
+tw_index(struct cpe_timerwheel *tw, cpe_priorityQ *node)
+{
+    u_int64_t t;
+    u_int     level;
+
+    t = tw_ticks(tw, node);
+    for (level = 0; level < TW_LEVELS; level++) {
+        if (t >> (TW_BITS * (level + 1)) ==
+            tw->tw_now >> (TW_BITS * (level + 1)))
+        {
+            return level * TW_SLOTS + ((t >> (TW_BITS * level)) & TW_MASK) + 1;
+        }
+    }
+    return TW_OVERFLOW;
+}
+
+
+static void
+tw_place(struct cpe_timerwheel *tw, cpe_priorityQ *node)
+{
+    struct tw_list *l;
+    u_int           k;
+
+    node->pq_index = tw_index(tw, node);
+    if (node->pq_index != TW_OVERFLOW) {
+        k = node->pq_index - 1;
+        tw->tw_bitmap[k / TW_SLOTS][(k % TW_SLOTS) / 64] |= 1ULL << (k % 64);
+    }
+    l = tw_list_of(tw, node->pq_index);
+    node->pq_next = NULL;
+    node->pq_prev = l->last;
+    if (l->last != NULL) {
+        l->last->pq_next = node;
+    } else {
+        l->first = node;
+    }
+    l->last = node;
+}
+
+
+static void
+tw_unlink(struct cpe_timerwheel *tw, cpe_priorityQ *node)
+{
+    struct tw_list *l;
+    u_int           k;
+
+    l = tw_list_of(tw, node->pq_index);
+    if (node->pq_prev != NULL) {
+        node->pq_prev->pq_next = node->pq_next;
+    } else {
+        l->first = node->pq_next;
+    }
+    if (node->pq_next != NULL) {
+        node->pq_next->pq_prev = node->pq_prev;
+    } else {
+        l->last = node->pq_prev;
+    }
+    if (l->first == NULL && node->pq_index != TW_OVERFLOW) {
+        k = node->pq_index - 1;
+        tw->tw_bitmap[k / TW_SLOTS][(k % TW_SLOTS) / 64] &=
+            ~(1ULL << (k % 64));
+    }
+    node->pq_next = node->pq_prev = NULL;
+    node->pq_index = 0;
+}
+
+
+/* Re-place all the nodes of a slot (or of the overflow list). */
+static void
+tw_cascade(struct cpe_timerwheel *tw, struct tw_list *l, u_int level,
+           u_int slot)
+{
+    cpe_priorityQ *p, *next;
+
+    p = l->first;
+    l->first = l->last = NULL;
+    if (level < TW_LEVELS) {
+        tw->tw_bitmap[level][slot / 64] &= ~(1ULL << (slot % 64));
+    }
+    for (; p != NULL; p = next) {
+        next = p->pq_next;
+        tw_place(tw, p);
+    }
+}
+
+
+static cpe_priorityQ *
+tw_list_min(struct tw_list *l)
+{
+    cpe_priorityQ *p, *min;
+
+    min = l->first;
+    for (p = min; p != NULL; p = p->pq_next) {
+        if (p->pq_value < min->pq_value) {
+            min = p;
+        }
+    }
+    return min;
+}
+
+
+static cpe_priorityQ *
+tw_find_max(struct cpe_timerwheel *tw)
+{
+    u_int level;
+    int   slot;
+
+    if (tw->tw_min != NULL) {
+        return tw->tw_min;
+    }
+    slot = tw_next_slot(tw, 0, tw->tw_now & TW_MASK);
+    if (slot >= 0) {
+        tw->tw_min = tw->tw_slot[0][slot].first;
+        return tw->tw_min;
+    }
+    for (level = 1; level < TW_LEVELS; level++) {
+        slot = tw_next_slot(tw, level,
+            ((tw->tw_now >> (TW_BITS * level)) & TW_MASK) + 1);
+        if (slot >= 0) {
+            tw->tw_min = tw_list_min(&tw->tw_slot[level][slot]);
+            return tw->tw_min;
+        }
+    }
+    tw->tw_min = tw_list_min(&tw->tw_overflow);
+    return tw->tw_min;
+}
+
+
+/*
+ * Move the current time of the wheel to "now", but not past the earliest
+ * node: this way no node is ever left behind in a slot that has already
+ * been passed. Nodes that now belong to a lower level are cascaded, from
+ * the top down.
+ */
+static void
+tw_advance(struct cpe_timerwheel *tw, int64_t now)
+{
+    cpe_priorityQ *min;
+    u_int64_t      old, target, t;
+    u_int          level;
+
+    if (now < 0) {
+        return;
+    }
+    target = (u_int64_t) (now / tw->tw_tick);
+    min = tw_find_max(tw);
+    if (min != NULL) {
+        t = tw_ticks(tw, min);
+        if (t < target) {
+            target = t;
+        }
+    }
+    if (target <= tw->tw_now) {
+        return;
+    }
+    old = tw->tw_now;
+    tw->tw_now = target;
+    if (old >> (TW_BITS * TW_LEVELS) != target >> (TW_BITS * TW_LEVELS)) {
+        tw_cascade(tw, &tw->tw_overflow, TW_LEVELS, 0);
+    }
+    for (level = TW_LEVELS - 1; level > 0; level--) {
+        if (old >> (TW_BITS * level) != target >> (TW_BITS * level)) {
+            t = (target >> (TW_BITS * level)) & TW_MASK;
+            tw_cascade(tw, &tw->tw_slot[level][t], level, t);
+        }
+    }
+}
+
+
+/* Return non-zero if node is linked in the wheel. */
+static int
+tw_contains(struct cpe_timerwheel *tw, cpe_priorityQ *node)
+{
+    if (node->pq_index == 0 || node->pq_index > TW_OVERFLOW) {
+        return 0;
+    }
+    if (node->pq_prev != NULL) {
+        return node->pq_prev->pq_next == node;
+    }
+    return tw_list_of(tw, node->pq_index)->first == node;
+}
+
+
 cpe_priorityQ *
 cpe_priorityQ_create(void)
 {
@@ -58,115 +429,579 @@ cpe_priorityQ_create(void)
     return p;
 }
 
-/*
- * keep a sorted list on pq_value, from min to max. Allow duplicate pq_value.
- * \todo replace with a proper implementation of priority queue
- *       (heap or RB tree)
- * \todo "u" is useless here, refactor code with tests to remove "u"
+
+/*!
+ * Create a queue backed by a timing wheel instead of a heap. The API is the
+ * same, but nodes are ordered only up to a resolution of \p tick (in
+ * pq_value units) and the owner must call cpe_priorityQ_advance() as time
+ * goes by. \p now is the current time, in pq_value units.
+ *
+ * @return the new queue head, NULL if out of memory.
+ */
+cpe_priorityQ *
+cpe_priorityQ_create_wheel(int64_t tick, int64_t now)
+{
+    cpe_priorityQ *p;
+
+    p = cpe_priorityQ_create();
+    if (p == NULL) {
+        return NULL;
+    }
+    p->pq_wheel = calloc(1, sizeof *p->pq_wheel);
+    if (p->pq_wheel == NULL) {
+        free(p);
+        return NULL;
+    }
+    p->pq_wheel->tw_tick = tick > 0 ? tick : 1;
+    p->pq_wheel->tw_now = now > 0 ? (u_int64_t) (now / p->pq_wheel->tw_tick) : 0;
+    return p;
+}
+
+
+/*!
+ * Tell the queue that the current time is \p now. Needed only by the timing
+ * wheel, does nothing for the heap.
  */
 void
+cpe_priorityQ_advance(cpe_priorityQ *head, int64_t now)
+{
+    assert(head != NULL);
+    if (head->pq_wheel != NULL) {
+        tw_advance(head->pq_wheel, now);
+    }
+}
+
+
+/*!
+ * Make room for at least \p nelems nodes, so that following inserts will not
+ * need to allocate memory. Never shrinks the queue.
+ *
+ * @return 1 on success, -1 if out of memory.
+ */
+int
+cpe_priorityQ_reserve(cpe_priorityQ *head, u_int nelems)
+{
+    cpe_priorityQ **heap;
+
+    assert(head != NULL);
+    if (head->pq_wheel != NULL) {
+        /* The wheel doesn't need to allocate anything on insert. */
+        return 1;
+    }
+    if (nelems < head->pq_size) {
+        return 1;
+    }
+    /* + 1 because slot 0 is unused */
+    heap = realloc(head->pq_heap, (nelems + 1) * sizeof *heap);
+    if (heap == NULL) {
+        return -1;
+    }
+    head->pq_heap = heap;
+    head->pq_size = nelems + 1;
+    return 1;
+}
+
+
+/*
+ * Insert node in the heap. Allow duplicate pq_value; nodes with the same
+ * pq_value are extracted in insertion order.
+ *
+ * @return 1 on success, -1 if out of memory.
+ */
+int
 cpe_priorityQ_insert(cpe_priorityQ *head, cpe_priorityQ *node)
 {
-    cpe_priorityQ *p, *u;
+    struct cpe_timerwheel *tw;
+    u_int                  size;
 
     assert(head != NULL);
     assert(node != NULL);
-    for (p = head; p->pq_next != NULL; p = u) {
-        u = p->pq_next;
-        if (node->pq_value < u->pq_value) {
-            break;
+    /* Don't allow duplicate "nodes", they are a bug. */
+    assert(node->pq_index == 0);
+
+    if (head->pq_wheel != NULL) {
+        tw = head->pq_wheel;
+        node->pq_seq = head->pq_seq++;
+        tw_place(tw, node);
+        head->pq_nelems++;
+        if (tw->tw_min != NULL && tw_ticks(tw, node) < tw_ticks(tw, tw->tw_min)) {
+            tw->tw_min = node;
         }
+        return 1;
     }
-    /* Don't allow duplicate "nodes", they are a bug. */
-    assert(p != node);
-    node->pq_next = p->pq_next;
-    p->pq_next = node;
+    if (head->pq_nelems + 1 >= head->pq_size) {
+        size = head->pq_size < CPE_PRIORITYQ_MIN_SIZE ?
+            CPE_PRIORITYQ_MIN_SIZE : 2 * head->pq_size;
+        if (cpe_priorityQ_reserve(head, size) != 1) {
+            return -1;
+        }
+    }
+    node->pq_seq = head->pq_seq++;
+    head->pq_nelems++;
+    pq_set(head, head->pq_nelems, node);
+    pq_fixup(head, head->pq_nelems);
+    return 1;
 }
 
+
 /*!
  * This function doesn't deallocate the memory pointed to by "node" because
  * cpe_priorityQ allows for subclassing. It is responsability of the caller.
+ *
+ * @return 1 if the node has been removed, -1 if it was not in the queue.
  */
 int
 cpe_priorityQ_remove(cpe_priorityQ *head, cpe_priorityQ *node)
 {
-    cpe_priorityQ *p, *u;
+    u_int k;
 
     assert(head != NULL);
     assert(node != NULL);
 
-    for (p = head; p != NULL; p = u) {
-        u = p->pq_next;
-        if (u == node) {
-            p->pq_next = u->pq_next;
-            u->pq_next = NULL;
-            return 1;
+    if (head->pq_wheel != NULL) {
+        if (! tw_contains(head->pq_wheel, node)) {
+            return -1;
         }
+        if (head->pq_wheel->tw_min == node) {
+            head->pq_wheel->tw_min = NULL;
+        }
+        tw_unlink(head->pq_wheel, node);
+        head->pq_nelems--;
+        return 1;
+    }
+    k = node->pq_index;
+    if (k == 0 || k > head->pq_nelems || head->pq_heap[k] != node) {
+        return -1;
     }
-    return -1;
+    node->pq_index = 0;
+    if (k == head->pq_nelems) {
+        head->pq_nelems--;
+        return 1;
+    }
+    /* Move the last node in the hole, then restore the heap property in
+     * whichever direction is needed.
+     */
+    pq_set(head, k, head->pq_heap[head->pq_nelems]);
+    head->pq_nelems--;
+    if (k > 1 && pq_less(head->pq_heap[k], head->pq_heap[k / 2])) {
+        pq_fixup(head, k);
+    } else {
+        pq_fixdown(head, k);
+    }
+    return 1;
 }
 
+
 cpe_priorityQ *
 cpe_priorityQ_find_max(cpe_priorityQ *head)
 {
     assert(head != NULL);
-    return head->pq_next;
+    if (head->pq_nelems == 0) {
+        return NULL;
+    }
+    if (head->pq_wheel != NULL) {
+        return tw_find_max(head->pq_wheel);
+    }
+    return head->pq_heap[1];
 }
 
+
 cpe_priorityQ *
 cpe_priorityQ_remove_max(cpe_priorityQ *head)
 {
     cpe_priorityQ *p;
 
     assert(head != NULL);
-    p = head->pq_next;
+    p = cpe_priorityQ_find_max(head);
     if (p != NULL) {
-        head->pq_next = p->pq_next;
-        p->pq_next = NULL;
+        cpe_priorityQ_remove(head, p);
     }
     return p;
 }
 
+
+/*!
+ * Free all the nodes in the queue (and their pq_data), and the heap array
+ * itself. The head can still be used afterwards.
+ */
 u_int
 cpe_priorityQ_queue_destroy(cpe_priorityQ *head)
 {
-    cpe_priorityQ *p, *u;
-    u_int count = 0;
+    struct cpe_timerwheel *tw;
+    struct tw_list        *l;
+    cpe_priorityQ         *p;
+    u_int                  k, count = 0;
 
     assert(head != NULL);
-    for (p = head->pq_next; p != NULL; p = u) {
-        u = p->pq_next;
+    if (head->pq_wheel != NULL) {
+        tw = head->pq_wheel;
+        for (k = 0; k < TW_OVERFLOW; k++) {
+            l = tw_list_of(tw, k + 1);
+            while ((p = l->first) != NULL) {
+                l->first = p->pq_next;
+                free(p->pq_data);
+                free(p);
+                count++;
+            }
+            l->last = NULL;
+        }
+        memset(tw->tw_bitmap, 0, sizeof tw->tw_bitmap);
+        tw->tw_min = NULL;
+        head->pq_nelems = 0;
+        return count;
+    }
+    for (k = 1; k <= head->pq_nelems; k++) {
+        p = head->pq_heap[k];
         free(p->pq_data);
         free(p);
         count++;
     }
-    head->pq_next = NULL;
+    free(head->pq_heap);
+    head->pq_heap = NULL;
+    head->pq_nelems = 0;
+    head->pq_size = 0;
     return count;
 }
 
 /*!
+ * Print the values in heap (or wheel) order, which is NOT sorted order.
  * \todo add a function pointer to print pq_item
  */
 void
 cpe_priorityQ_print(cpe_priorityQ *head)
 {
     cpe_priorityQ *p;
+    u_int          k;
+
+    assert(head != NULL);
+    if (head->pq_wheel != NULL) {
+        for (k = 0; k < TW_OVERFLOW; k++) {
+            p = tw_list_of(head->pq_wheel, k + 1)->first;
+            for (; p != NULL; p = p->pq_next) {
+                printf("%lld ", (long long) p->pq_value);
+            }
+        }
+        return;
+    }
+    for (k = 1; k <= head->pq_nelems; k++) {
+        printf("%lld ", (long long) head->pq_heap[k]->pq_value);
+    }
+}
+
+
+/*!
+ * Check the heap property and the consistency of the node indexes.
+ * Meant for tests and debugging, it is O(N).
+ *
+ * @return 1 if the queue is consistent, 0 otherwise.
+ */
+static int
+tw_verify(cpe_priorityQ *head)
+{
+    struct cpe_timerwheel *tw = head->pq_wheel;
+    cpe_priorityQ         *p, *prev;
+    u_int                  k, count = 0;
+    int                    empty, marked;
+
+    for (k = 0; k < TW_OVERFLOW; k++) {
+        prev = NULL;
+        p = tw_list_of(tw, k + 1)->first;
+        empty = p == NULL;
+        for (; p != NULL; prev = p, p = p->pq_next) {
+            if (p->pq_index != k + 1 || p->pq_prev != prev ||
+                tw_index(tw, p) != k + 1)
+            {
+                return 0;
+            }
+            count++;
+        }
+        if (tw_list_of(tw, k + 1)->last != prev) {
+            return 0;
+        }
+        if (k + 1 != TW_OVERFLOW) {
+            marked = (tw->tw_bitmap[k / TW_SLOTS][(k % TW_SLOTS) / 64] &
+                (1ULL << (k % 64))) != 0;
+            if (marked == empty) {
+                return 0;
+            }
+        }
+    }
+    return count == head->pq_nelems;
+}
+
+
+int
+cpe_priorityQ_verify(cpe_priorityQ *head)
+{
+    u_int k;
 
     assert(head != NULL);
-    for (p = head->pq_next; p != NULL; p = p->pq_next) {
-        printf("%lld ", p->pq_value);
+    if (head->pq_wheel != NULL) {
+        return tw_verify(head);
+    }
+    for (k = 1; k <= head->pq_nelems; k++) {
+        if (head->pq_heap[k]->pq_index != k) {
+            return 0;
+        }
+        if (k > 1 && pq_less(head->pq_heap[k], head->pq_heap[k / 2])) {
+            return 0;
+        }
     }
+    return 1;
 }
 
+
 u_int
 cpe_priorityQ_len(cpe_priorityQ *head)
 {
-    cpe_priorityQ *p;
-    u_int count = 0;
-
     assert(head != NULL);
-    for (p = head->pq_next; p != NULL; p = p->pq_next) {
-        count++;
+    return head->pq_nelems;
+}
+
+
+/*
+ * Slab allocator.
+ *
+ * Each chunk holds sl_chunk_nobjs slots of sl_objsize bytes, a multiple of
+ * CPE_CACHE_LINE, and is aligned to a cache line: no two objects share a
+ * line. A free slot stores the pointer to the next free slot in its first
+ * word (LIFO, the most recently freed slot is still in cache).
+ *
+ * alloc: O(1), plus a chunk allocation when the free list is empty
+ * free:  O(1)
+ */
+struct cpe_slab {
+    size_t  sl_objsize;
+    u_int   sl_chunk_nobjs;
+    void   *sl_free;            /* first free slot */
+    void  **sl_chunks;
+    u_int   sl_nchunks;
+    u_int   sl_chunks_size;     /* allocated length of sl_chunks */
+    u_int   sl_in_use;
+    u_int   sl_high_water;
+};
+
+
+/*!
+ * @param objsize      size of the objects, rounded up to CPE_CACHE_LINE.
+ * @param chunk_nobjs  objects per chunk, the slab grows by this amount.
+ * @return NULL if out of memory or invalid arguments.
+ */
+cpe_slab *
+cpe_slab_create(size_t objsize, u_int chunk_nobjs)
+{
+    cpe_slab *slab;
+
+    if (objsize == 0 || chunk_nobjs == 0) {
+        return NULL;
     }
-    return count;
+    slab = calloc(1, sizeof *slab);
+    if (slab == NULL) {
+        return NULL;
+    }
+    slab->sl_objsize = (objsize + CPE_CACHE_LINE - 1) &
+        ~(size_t) (CPE_CACHE_LINE - 1);
+    slab->sl_chunk_nobjs = chunk_nobjs;
+    return slab;
+}
+
+
+/* Add a chunk and put all its slots in the free list. */
+static int
+slab_grow(cpe_slab *slab)
+{
+    void  **chunks;
+    char   *chunk;
+    u_int   k, size;
+
+    if (slab->sl_nchunks == slab->sl_chunks_size) {
+        size = slab->sl_chunks_size == 0 ? 4 : 2 * slab->sl_chunks_size;
+        chunks = realloc(slab->sl_chunks, size * sizeof *chunks);
+        if (chunks == NULL) {
+            return -1;
+        }
+        slab->sl_chunks = chunks;
+        slab->sl_chunks_size = size;
+    }
+    if (posix_memalign((void **) &chunk, CPE_CACHE_LINE,
+        slab->sl_chunk_nobjs * slab->sl_objsize) != 0)
+    {
+        return -1;
+    }
+    slab->sl_chunks[slab->sl_nchunks++] = chunk;
+    /* Push in reverse order, so that slots are handed out in address order. */
+    for (k = slab->sl_chunk_nobjs; k > 0; k--) {
+        void *slot = chunk + (k - 1) * slab->sl_objsize;
+
+        *(void **) slot = slab->sl_free;
+        slab->sl_free = slot;
+    }
+    return 1;
+}
+
+
+/*!
+ * @return a zeroed object, or NULL if out of memory.
+ */
+void *
+cpe_slab_alloc(cpe_slab *slab)
+{
+    void *obj;
+
+    assert(slab != NULL);
+    if (slab->sl_free == NULL && slab_grow(slab) != 1) {
+        return NULL;
+    }
+    obj = slab->sl_free;
+    slab->sl_free = *(void **) obj;
+    memset(obj, 0, slab->sl_objsize);
+    slab->sl_in_use++;
+    if (slab->sl_in_use > slab->sl_high_water) {
+        slab->sl_high_water = slab->sl_in_use;
+    }
+    return obj;
+}
+
+
+/*!
+ * Give back an object obtained from cpe_slab_alloc(). Only its first word
+ * is overwritten: the caller can leave a mark (e.g. a magic number) in the
+ * rest to catch a use after free.
+ */
+void
+cpe_slab_free(cpe_slab *slab, void *obj)
+{
+    assert(slab != NULL);
+    assert(slab->sl_in_use > 0);
+    if (obj == NULL) {
+        return;
+    }
+    *(void **) obj = slab->sl_free;
+    slab->sl_free = obj;
+    slab->sl_in_use--;
+}
+
+
+void
+cpe_slab_stats_get(cpe_slab *slab, cpe_slab_stats *stats)
+{
+    assert(slab != NULL);
+    stats->ss_objsize = slab->sl_objsize;
+    stats->ss_in_use = slab->sl_in_use;
+    stats->ss_capacity = slab->sl_nchunks * slab->sl_chunk_nobjs;
+    stats->ss_high_water = slab->sl_high_water;
+    stats->ss_chunks = slab->sl_nchunks;
+}
+
+
+/*!
+ * Release all the chunks, including the objects still allocated.
+ */
+void
+cpe_slab_destroy(cpe_slab *slab)
+{
+    u_int k;
+
+    if (slab == NULL) {
+        return;
+    }
+    for (k = 0; k < slab->sl_nchunks; k++) {
+        free(slab->sl_chunks[k]);
+    }
+    free(slab->sl_chunks);
+    free(slab);
+}
+
+
+/*
+ * Bucket of a value, see CPE_HISTO_SUB_BITS. Bucket g * CPE_HISTO_SUB + sub
+ * (g > 0) holds the values (CPE_HISTO_SUB + sub) << (g - 1) on, bucket sub
+ * (g = 0) the value sub.
+ */
+static u_int
+histogram_bucket(int64_t value)
+{
+    u_int bits;
+
+    if (value < CPE_HISTO_SUB) {
+        return value < 0 ? 0 : value;
+    }
+    bits = 63 - __builtin_clzll(value);
+    if (bits >= CPE_HISTO_MAX_BITS) {
+        return CPE_HISTO_NBUCKETS - 1;
+    }
+    return (bits - CPE_HISTO_SUB_BITS + 1) * CPE_HISTO_SUB +
+        ((value >> (bits - CPE_HISTO_SUB_BITS)) & (CPE_HISTO_SUB - 1));
+}
+
+
+/* Highest value of bucket b. */
+static int64_t
+histogram_bucket_max(u_int b)
+{
+    u_int g = b / CPE_HISTO_SUB, sub = b % CPE_HISTO_SUB;
+
+    if (g == 0) {
+        return sub;
+    }
+    return ((int64_t) (CPE_HISTO_SUB + sub + 1) << (g - 1)) - 1;
+}
+
+
+void
+cpe_histogram_reset(cpe_histogram *h)
+{
+    memset(h, 0, sizeof *h);
+}
+
+
+void
+cpe_histogram_record(cpe_histogram *h, int64_t value)
+{
+    if (h->h_count == 0 || value < h->h_min) {
+        h->h_min = value;
+    }
+    if (h->h_count == 0 || value > h->h_max) {
+        h->h_max = value;
+    }
+    h->h_count++;
+    h->h_sum += value;
+    h->h_buckets[histogram_bucket(value)]++;
+}
+
+
+/*!
+ * Value below which are \p percent (0 to 100) of the recorded ones, to the
+ * precision of the buckets: the highest value of the bucket, capped to the
+ * max recorded. 0 if nothing recorded.
+ */
+int64_t
+cpe_histogram_percentile(const cpe_histogram *h, double percent)
+{
+    uint64_t rank, seen = 0;
+    int64_t  max;
+    u_int    b;
+
+    if (h->h_count == 0) {
+        return 0;
+    }
+    if (percent <= 0) {
+        return h->h_min;
+    }
+    rank = (uint64_t) (percent / 100 * h->h_count + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (b = 0; b < CPE_HISTO_NBUCKETS; b++) {
+        seen += h->h_buckets[b];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    if (b >= CPE_HISTO_NBUCKETS - 1) {
+        /* the last bucket has no upper bound */
+        return h->h_max;
+    }
+    max = histogram_bucket_max(b);
+    return max < h->h_max ? max : h->h_max;
 }
@@ -52,11 +52,28 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * Used to "subclass" struct cpe_priorityQ.
  * XXX yes I know, a 64-bit key. This is because APR uses int64_t for time
  * values.
+ *
+ * The same structure is used both for the queue head and for the nodes:
+ * pq_heap, pq_wheel, pq_nelems and pq_size are meaningful only in the head,
+ * pq_index, pq_next and pq_prev only in a node. pq_index is the position of
+ * the node in the queue (heap slot, or wheel level/slot), 0 means that the
+ * node is not in any queue. pq_seq is a counter in the head and an
+ * insertion stamp in a node; it keeps nodes with the same pq_value in FIFO
+ * order, as the old sorted list did, and tells which nodes were inserted
+ * after a given point. pq_next and pq_prev link the nodes of
+ * the same timing wheel slot.
  */
-#define CPE_PRIORITYQ_HEADER       \
-    struct cpe_priorityQ *pq_next; \
-    void                 *pq_data; \
-    int64_t              pq_value;
+#define CPE_PRIORITYQ_HEADER          \
+    struct cpe_priorityQ  **pq_heap;  \
+    struct cpe_timerwheel  *pq_wheel; \
+    struct cpe_priorityQ   *pq_next;  \
+    struct cpe_priorityQ   *pq_prev;  \
+    u_int                   pq_nelems; \
+    u_int                   pq_size;  \
+    u_int                   pq_index; \
+    u_int                   pq_seq;   \
+    void                   *pq_data;  \
+    int64_t                 pq_value;
 
 struct cpe_priorityQ {
     CPE_PRIORITYQ_HEADER
@@ -75,13 +92,71 @@ typedef struct cpe_priorityQ cpe_priorityQ;
 
 
 cpe_priorityQ *cpe_priorityQ_create(void);
-void           cpe_priorityQ_insert(cpe_priorityQ *head, cpe_priorityQ *node);
+cpe_priorityQ *cpe_priorityQ_create_wheel(int64_t tick, int64_t now);
+void           cpe_priorityQ_advance(cpe_priorityQ *head, int64_t now);
+int            cpe_priorityQ_reserve(cpe_priorityQ *head, u_int nelems);
+int            cpe_priorityQ_insert(cpe_priorityQ *head, cpe_priorityQ *node);
 u_int          cpe_priorityQ_len(cpe_priorityQ *head);
 u_int          cpe_priorityQ_queue_destroy(cpe_priorityQ *head);
 void           cpe_priorityQ_print(cpe_priorityQ *head);
+int            cpe_priorityQ_verify(cpe_priorityQ *head);
 cpe_priorityQ *cpe_priorityQ_find_max(cpe_priorityQ *head);
 cpe_priorityQ *cpe_priorityQ_remove_max(cpe_priorityQ *head);
 int            cpe_priorityQ_remove(cpe_priorityQ *head, cpe_priorityQ *node);
 
 
+/* Slots of a cpe_slab are aligned and rounded to this size. */
+#define CPE_CACHE_LINE 64
+
+/*
+ * Fixed-size object allocator: objects are carved out of chunks allocated
+ * on demand, and recycled through a free list. The memory goes back to the
+ * system only with cpe_slab_destroy().
+ */
+typedef struct cpe_slab cpe_slab;
+
+struct cpe_slab_stats {
+    size_t ss_objsize;      /* slot size */
+    u_int  ss_in_use;       /* objects allocated */
+    u_int  ss_capacity;     /* objects allocated or free */
+    u_int  ss_high_water;   /* max of ss_in_use */
+    u_int  ss_chunks;
+};
+typedef struct cpe_slab_stats cpe_slab_stats;
+
+cpe_slab      *cpe_slab_create(size_t objsize, u_int chunk_nobjs);
+void          *cpe_slab_alloc(cpe_slab *slab);
+void           cpe_slab_free(cpe_slab *slab, void *obj);
+void           cpe_slab_stats_get(cpe_slab *slab, cpe_slab_stats *stats);
+void           cpe_slab_destroy(cpe_slab *slab);
+
+
+/*
+ * Log-linear histogram, HDR style: exact below CPE_HISTO_SUB, then each
+ * power of two is split in CPE_HISTO_SUB buckets, so that a value is
+ * known within 1/CPE_HISTO_SUB (6%). Values from 2^CPE_HISTO_MAX_BITS up
+ * share the last bucket; negative values count as 0. Fixed size, no
+ * allocation: recording is a few instructions.
+ */
+#define CPE_HISTO_SUB_BITS 4
+#define CPE_HISTO_SUB      (1 << CPE_HISTO_SUB_BITS)
+#define CPE_HISTO_MAX_BITS 32
+#define CPE_HISTO_NBUCKETS \
+    (CPE_HISTO_SUB * (CPE_HISTO_MAX_BITS - CPE_HISTO_SUB_BITS + 1))
+
+struct cpe_histogram {
+    uint64_t h_count;
+    int64_t  h_sum;
+    int64_t  h_min;
+    int64_t  h_max;
+    uint32_t h_buckets[CPE_HISTO_NBUCKETS];
+};
+typedef struct cpe_histogram cpe_histogram;
+
+void           cpe_histogram_reset(cpe_histogram *h);
+void           cpe_histogram_record(cpe_histogram *h, int64_t value);
+int64_t        cpe_histogram_percentile(const cpe_histogram *h,
+                   double percent);
+
+
 #endif /* CPE_ALGORITHMS_INCLUDED */
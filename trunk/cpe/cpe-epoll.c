@@ -0,0 +1,272 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * Native Linux epoll backend, used instead of the APR pollset when
+ * CPE_HAVE_EPOLL is defined (see cpe-private.h).
+ *
+ * Compared with apr_pollset:
+ * - interest changes are a single EPOLL_CTL_MOD instead of an O(N)
+ *   apr_pollset_remove() followed by an apr_pollset_add();
+ * - the cpe_event pointer is kept in epoll_data, so there is no lookup
+ *   to map a ready descriptor back to its event;
+ * - the poll timeout is a timerfd, always in the epoll set, with
+ *   microsecond resolution. Since the set is never empty, a system made of
+ *   timers only needs no special case.
+ */
+
+#include "cpe.h"
+#include "cpe-logging.h"
+#include "cpe-private.h"
+
+#ifdef CPE_HAVE_EPOLL
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <apr_portable.h>
+
+static apr_status_t
+cpe_epoll_cleanup(void *data)
+{
+    cpe_epoll_set *ep = data;
+
+    if (ep->ep_timerfd >= 0) {
+        close(ep->ep_timerfd);
+        ep->ep_timerfd = -1;
+    }
+    if (ep->ep_fd >= 0) {
+        close(ep->ep_fd);
+        ep->ep_fd = -1;
+    }
+    return APR_SUCCESS;
+}
+
+
+/*! Create the epoll set and the timerfd used for the poll timeout.
+ * @param ep    The set to initialize, one per event loop.
+ * @param pool  Pool for the event arrays; the descriptors are closed when
+ *              it is destroyed.
+ * @param size  Max number of events returned by a single poll.
+ */
+apr_status_t
+cpe_epoll_init(cpe_epoll_set *ep, apr_pool_t *pool, apr_uint32_t size)
+{
+    struct epoll_event ev;
+    apr_status_t       rv;
+
+    ep->ep_timerfd = -1;
+
+    ep->ep_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ep->ep_fd < 0) {
+        rv = APR_FROM_OS_ERROR(errno);
+        cpe_log(CPE_ERR, "epoll_create1: %s", cpe_errmsg(rv));
+        return rv;
+    }
+    ep->ep_timerfd = timerfd_create(CLOCK_MONOTONIC,
+        TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ep->ep_timerfd < 0) {
+        rv = APR_FROM_OS_ERROR(errno);
+        cpe_log(CPE_ERR, "timerfd_create: %s", cpe_errmsg(rv));
+        cpe_epoll_cleanup(ep);
+        return rv;
+    }
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;         /* NULL marks the timerfd */
+    if (epoll_ctl(ep->ep_fd, EPOLL_CTL_ADD, ep->ep_timerfd, &ev) < 0) {
+        rv = APR_FROM_OS_ERROR(errno);
+        cpe_log(CPE_ERR, "epoll_ctl timerfd: %s", cpe_errmsg(rv));
+        cpe_epoll_cleanup(ep);
+        return rv;
+    }
+    /* + 1 for the timerfd */
+    ep->ep_size = size + 1;
+    ep->ep_events = apr_palloc(pool, ep->ep_size * sizeof *ep->ep_events);
+    ep->ep_ready = apr_palloc(pool, ep->ep_size * sizeof *ep->ep_ready);
+    if (ep->ep_events == NULL || ep->ep_ready == NULL) {
+        cpe_epoll_cleanup(ep);
+        return APR_ENOMEM;
+    }
+    apr_pool_cleanup_register(pool, ep, cpe_epoll_cleanup,
+        apr_pool_cleanup_null);
+    cpe_log(CPE_DEB, "epoll fd %d, timerfd %d", ep->ep_fd, ep->ep_timerfd);
+    return APR_SUCCESS;
+}
+
+
+static apr_status_t
+cpe_epoll_fd(apr_pollfd_t *pfd, int *fd)
+{
+    switch (pfd->desc_type) {
+    case APR_POLL_SOCKET:
+        return apr_os_sock_get(fd, pfd->desc.s);
+    case APR_POLL_FILE:
+        return apr_os_file_get(fd, pfd->desc.f);
+    default:
+        return APR_EINVAL;
+    }
+}
+
+
+static apr_status_t
+cpe_epoll_ctl(cpe_epoll_set *ep, int op, apr_pollfd_t *pfd,
+    apr_int16_t reqevents)
+{
+    struct epoll_event ev;
+    apr_status_t       rv;
+    int                fd;
+
+    assert(ep->ep_fd >= 0);
+    rv = cpe_epoll_fd(pfd, &fd);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    memset(&ev, 0, sizeof ev);
+    if (reqevents & APR_POLLIN) {
+        ev.events |= EPOLLIN;
+    }
+    if (reqevents & APR_POLLPRI) {
+        ev.events |= EPOLLPRI;
+    }
+    if (reqevents & APR_POLLOUT) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.ptr = pfd->client_data;
+    if (epoll_ctl(ep->ep_fd, op, fd, &ev) < 0) {
+        return APR_FROM_OS_ERROR(errno);
+    }
+    return APR_SUCCESS;
+}
+
+
+apr_status_t
+cpe_epoll_add(cpe_epoll_set *ep, apr_pollfd_t *pfd)
+{
+    return cpe_epoll_ctl(ep, EPOLL_CTL_ADD, pfd, pfd->reqevents);
+}
+
+
+apr_status_t
+cpe_epoll_remove(cpe_epoll_set *ep, apr_pollfd_t *pfd)
+{
+    return cpe_epoll_ctl(ep, EPOLL_CTL_DEL, pfd, pfd->reqevents);
+}
+
+
+/*! Change the reqevents of a descriptor already in the set, in place. */
+apr_status_t
+cpe_epoll_update(cpe_epoll_set *ep, apr_pollfd_t *pfd, apr_int16_t reqevents)
+{
+    return cpe_epoll_ctl(ep, EPOLL_CTL_MOD, pfd, reqevents);
+}
+
+
+/*! Same contract as apr_pollset_poll(): APR_TIMEUP if no descriptor is
+ *  ready. A negative timeout waits forever.
+ */
+apr_status_t
+cpe_epoll_poll(cpe_epoll_set *ep, apr_time_t timeout_us, apr_int32_t *num_pfd,
+    const apr_pollfd_t **ret_pfd)
+{
+    struct itimerspec its;
+    apr_int16_t       rtnevents;
+    apr_uint32_t      events;
+    cpe_event        *e;
+    apr_uint64_t      expirations;
+    int               n, k, timeout_ms;
+
+    assert(ep->ep_fd >= 0);
+    *num_pfd = 0;
+    *ret_pfd = ep->ep_ready;
+
+    timeout_ms = timeout_us == 0 ? 0 : -1;
+    if (timeout_us != 0) {
+        /* Arming (or disarming) also clears any stale expiration. */
+        memset(&its, 0, sizeof its);
+        if (timeout_us > 0) {
+            its.it_value.tv_sec = timeout_us / APR_USEC_PER_SEC;
+            its.it_value.tv_nsec = (timeout_us % APR_USEC_PER_SEC) * 1000;
+        }
+        if (timerfd_settime(ep->ep_timerfd, 0, &its, NULL) < 0) {
+            return APR_FROM_OS_ERROR(errno);
+        }
+    }
+    n = epoll_wait(ep->ep_fd, ep->ep_events, ep->ep_size,
+        timeout_ms);
+    if (n < 0) {
+        return APR_FROM_OS_ERROR(errno);
+    }
+    for (k = 0; k < n; k++) {
+        e = ep->ep_events[k].data.ptr;
+        if (e == NULL) {
+            /* The timerfd. Drain it, the caller sees APR_TIMEUP. */
+            if (read(ep->ep_timerfd, &expirations, sizeof expirations) < 0) {
+                cpe_log(CPE_DEB, "read timerfd: %s",
+                    cpe_errmsg(APR_FROM_OS_ERROR(errno)));
+            }
+            continue;
+        }
+        events = ep->ep_events[k].events;
+        rtnevents = 0;
+        if (events & EPOLLIN) {
+            rtnevents |= APR_POLLIN;
+        }
+        if (events & EPOLLPRI) {
+            rtnevents |= APR_POLLPRI;
+        }
+        if (events & EPOLLOUT) {
+            rtnevents |= APR_POLLOUT;
+        }
+        if (events & EPOLLERR) {
+            rtnevents |= APR_POLLERR;
+        }
+        if (events & EPOLLHUP) {
+            rtnevents |= APR_POLLHUP;
+        }
+        ep->ep_ready[*num_pfd] = e->ev_pollfd;
+        ep->ep_ready[*num_pfd].rtnevents = rtnevents;
+        (*num_pfd)++;
+    }
+    return *num_pfd > 0 ? APR_SUCCESS : APR_TIMEUP;
+}
+
+#endif /* CPE_HAVE_EPOLL */
@@ -34,16 +34,56 @@ ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <string.h>
+
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+
+#include "cpe.h"
 #include "cpe-logging.h"
 
 /*!
- * \todo this should be a proper logging library, with in-memory circular
- * buffer and periodic write to disk, rate-limit, under debug flags...,
- * interface to system logger (syslog under unix, foo under windows, ...),
- * timestamp...
+ * Lines go to stdout, either directly or, after cpe_log_async(), through an
+ * in-memory ring written by a background thread: a loop never waits for
+ * the output. A line identical to the previous one is counted instead of
+ * written, see CPE_LOG_REPEAT_USEC.
+ *
+ * \todo interface to system logger (syslog under unix, foo under windows,
+ * ...), timestamp...
  */
 
-static int   g_cpe_log_level = CPE_INFO;
+/* A repeated line is summarized at the latest after this long. */
+#define CPE_LOG_REPEAT_USEC (10 * APR_USEC_PER_SEC)
+
+struct cpe_log_state {
+    char               lg_last[CPE_LOG_LINE_MAX];
+    apr_size_t         lg_last_len;
+    apr_uint32_t       lg_repeats;          /* of lg_last, not written */
+    apr_time_t         lg_repeat_start;
+    apr_uint32_t       lg_dropped;          /* not said yet */
+    cpe_log_stats      lg_stats;
+    /* async mode only */
+    char              *lg_ring;
+    apr_size_t         lg_ring_size;
+    apr_size_t         lg_read;             /* free running */
+    apr_size_t         lg_write;            /* free running */
+    apr_time_t         lg_interval;
+    int                lg_stop;
+#if APR_HAS_THREADS
+    /* From lg_pool, and never cleared: a logger may still hold lg_mutex
+     * when the ring goes away.
+     */
+    apr_pool_t         *lg_pool;
+    apr_thread_mutex_t *lg_mutex;           /* all of the above */
+    apr_thread_mutex_t *lg_drain_mutex;     /* one writer of the ring */
+    apr_thread_cond_t  *lg_cond;
+    apr_thread_t       *lg_thread;
+#endif
+};
+
+int                         g_cpe_log_level = CPE_INFO;
+static struct cpe_log_state g_cpe_log;
 //static char *g_cpe_loglevelstr[] = {
 //    "[DEB]  ",
 //    "[INFO] ",
@@ -51,6 +91,19 @@ static int   g_cpe_log_level = CPE_INFO;
 //    "[ERR]  "
 //};
 
+static int  cpe_log_lock(void);
+static void cpe_log_unlock(int async);
+static int  cpe_log_put(const char *line, apr_size_t len);
+static void cpe_log_emit(const char *line, apr_size_t len);
+static void cpe_log_emit_repeats(void);
+static void cpe_log_emit_dropped(apr_size_t room);
+static void cpe_log_drain(void);
+
+
+/*****************************************************************************
+ *                                 INTERFACE                                 *
+ *****************************************************************************/
+
 /** Init the logging system.
  *  @param min_level Minimum log level to report.
  */
@@ -70,15 +123,410 @@ cpe_log_init(int min_level)
 void
 cpe_log2(int level, char const *fmt, ...)
 {
-    va_list ap;
+    char        line[CPE_LOG_LINE_MAX];
+    va_list     ap;
+    apr_size_t  len;
+    int         n, async;
 
-    va_start(ap, fmt);
-    if (level >= g_cpe_log_level && level < CPE_SILENT) {
-        /** @bug I would like to use stderr, but tap(3) uses stdout, and
-         *  using stderr means the two streams get out of sync. I am not
-         *  sure that using stdout is enough.
-         */
-        vfprintf(stdout, fmt, ap);
+    if (level < g_cpe_log_level || level >= CPE_SILENT) {
+        return;
     }
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof line, fmt, ap);
     va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    len = n;
+    if (len >= sizeof line) {
+        /* truncated, keep the newline */
+        len = sizeof line - 1;
+        line[len - 1] = '\n';
+    }
+
+    /** @bug I would like to use stderr, but tap(3) uses stdout, and
+     *  using stderr means the two streams get out of sync. I am not
+     *  sure that using stdout is enough.
+     */
+    async = cpe_log_lock();
+    if (len == g_cpe_log.lg_last_len &&
+        memcmp(line, g_cpe_log.lg_last, len) == 0)
+    {
+        g_cpe_log.lg_stats.ls_repeated++;
+        if (g_cpe_log.lg_repeats++ == 0) {
+            g_cpe_log.lg_repeat_start = apr_time_now();
+        } else if (apr_time_now() - g_cpe_log.lg_repeat_start >
+            CPE_LOG_REPEAT_USEC)
+        {
+            cpe_log_emit_repeats();
+        }
+        cpe_log_unlock(async);
+        return;
+    }
+    cpe_log_emit_repeats();
+    memcpy(g_cpe_log.lg_last, line, len);
+    g_cpe_log.lg_last_len = len;
+    cpe_log_emit(line, len);
+    cpe_log_unlock(async);
+}
+
+
+/** Write the log lines, repeat and drop counts still pending. To be called
+ *  before exiting, after cpe_log_async().
+ */
+void
+cpe_log_flush(void)
+{
+    int async;
+
+    /* first make room for the counts */
+    cpe_log_drain();
+    async = cpe_log_lock();
+    cpe_log_emit_repeats();
+    cpe_log_emit_dropped(0);
+    cpe_log_unlock(async);
+    cpe_log_drain();
+    fflush(stdout);
+}
+
+
+/** Counters of the logging system. */
+void
+cpe_log_stats_get(cpe_log_stats *stats)
+{
+    int async;
+
+    async = cpe_log_lock();
+    *stats = g_cpe_log.lg_stats;
+    cpe_log_unlock(async);
+}
+
+
+#if APR_HAS_THREADS
+
+/* Background writer of the ring, see cpe_log_async(). */
+static void * APR_THREAD_FUNC
+cpe_log_flusher(apr_thread_t *thread, void *data)
+{
+    data = NULL;
+    apr_thread_mutex_lock(g_cpe_log.lg_mutex);
+    while (! g_cpe_log.lg_stop) {
+        apr_thread_cond_timedwait(g_cpe_log.lg_cond, g_cpe_log.lg_mutex,
+            g_cpe_log.lg_interval);
+        apr_thread_mutex_unlock(g_cpe_log.lg_mutex);
+        cpe_log_drain();
+        apr_thread_mutex_lock(g_cpe_log.lg_mutex);
+    }
+    apr_thread_mutex_unlock(g_cpe_log.lg_mutex);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+/** Stop the flusher of cpe_log_async() and go back to direct writes,
+ *  still under lg_mutex. The ring is written and dropped in one locked
+ *  section, so that a logger either queued its line before, or writes it
+ *  itself after. Done anyway when the pool of the ring is destroyed; a
+ *  no-op if the log is not async.
+ */
+void
+cpe_log_async_stop(void)
+{
+    struct cpe_log_state *lg = &g_cpe_log;
+    apr_status_t          rv;
+    apr_size_t            pos, n;
+
+    if (lg->lg_thread == NULL) {
+        return;
+    }
+    apr_thread_mutex_lock(lg->lg_mutex);
+    lg->lg_stop = 1;
+    apr_thread_cond_signal(lg->lg_cond);
+    apr_thread_mutex_unlock(lg->lg_mutex);
+    apr_thread_join(&rv, lg->lg_thread);
+
+    apr_thread_mutex_lock(lg->lg_drain_mutex);
+    apr_thread_mutex_lock(lg->lg_mutex);
+    if (lg->lg_read != lg->lg_write) {
+        pos = lg->lg_read % lg->lg_ring_size;
+        n = cpe_min(lg->lg_write - lg->lg_read, lg->lg_ring_size - pos);
+        fwrite(&lg->lg_ring[pos], 1, n, stdout);
+        fwrite(lg->lg_ring, 1, lg->lg_write - lg->lg_read - n, stdout);
+        lg->lg_read = lg->lg_write;
+        lg->lg_stats.ls_flushes++;
+    }
+    lg->lg_ring = NULL;
+    lg->lg_thread = NULL;
+    cpe_log_emit_repeats();
+    cpe_log_emit_dropped(0);
+    fflush(stdout);
+    apr_thread_mutex_unlock(lg->lg_mutex);
+    apr_thread_mutex_unlock(lg->lg_drain_mutex);
+}
+
+
+/* Pool cleanup of cpe_log_async(). */
+static apr_status_t
+cpe_log_async_cleanup(void *data)
+{
+    data = NULL;
+    cpe_log_async_stop();
+    return APR_SUCCESS;
+}
+
+
+/** Write the log from now on through a ring of \p ring_size bytes, written
+ *  to stdout by a background thread every \p flush_interval, or as soon as
+ *  it is half full. A line that does not fit is dropped, and counted: the
+ *  caller is never blocked by the output. The number of lines dropped is
+ *  written in their place, once there is room.
+ *
+ *  Call it before starting the threads that log; the ring goes away, after
+ *  a last write, with cpe_log_async_stop() or with \p pool, and the lines
+ *  are written directly again. It can then be called again.
+ */
+apr_status_t
+cpe_log_async(apr_size_t ring_size, apr_time_t flush_interval,
+    apr_pool_t *pool)
+{
+    struct cpe_log_state *lg = &g_cpe_log;
+    apr_threadattr_t     *attr;
+    char                 *ring;
+    apr_status_t          rv;
+
+    if (ring_size < CPE_LOG_LINE_MAX || flush_interval <= 0) {
+        return APR_EINVAL;
+    }
+    /* Once, from a pool of our own, as the loggers use them after the ring
+     * is gone. lg_mutex is set last: until then, the lock of stdout.
+     */
+    if (lg->lg_mutex == NULL &&
+        ((lg->lg_pool == NULL &&
+        (rv = apr_pool_create(&lg->lg_pool, NULL)) != APR_SUCCESS) ||
+        (rv = apr_thread_mutex_create(&lg->lg_drain_mutex,
+            APR_THREAD_MUTEX_DEFAULT, lg->lg_pool)) != APR_SUCCESS ||
+        (rv = apr_thread_cond_create(&lg->lg_cond, lg->lg_pool)) !=
+            APR_SUCCESS ||
+        (rv = apr_thread_mutex_create(&lg->lg_mutex,
+            APR_THREAD_MUTEX_DEFAULT, lg->lg_pool)) != APR_SUCCESS))
+    {
+        return rv;
+    }
+    ring = apr_palloc(pool, ring_size);
+    if (ring == NULL) {
+        return APR_ENOMEM;
+    }
+    apr_thread_mutex_lock(lg->lg_mutex);
+    if (lg->lg_ring != NULL) {
+        apr_thread_mutex_unlock(lg->lg_mutex);
+        return APR_EINVAL;
+    }
+    lg->lg_ring = ring;
+    lg->lg_ring_size = ring_size;
+    lg->lg_read = lg->lg_write = 0;
+    lg->lg_interval = flush_interval;
+    lg->lg_stop = 0;
+    apr_thread_mutex_unlock(lg->lg_mutex);
+    /* The thread from lg_pool: its subpool must outlive the subpools of
+     * pool, destroyed before the cleanup that joins it.
+     */
+    if ((rv = apr_threadattr_create(&attr, pool)) != APR_SUCCESS ||
+        (rv = apr_thread_create(&lg->lg_thread, attr, cpe_log_flusher, NULL,
+            lg->lg_pool)) != APR_SUCCESS)
+    {
+        apr_thread_mutex_lock(lg->lg_mutex);
+        lg->lg_ring = NULL;
+        apr_thread_mutex_unlock(lg->lg_mutex);
+        return rv;
+    }
+    apr_pool_cleanup_register(pool, NULL, cpe_log_async_cleanup,
+        apr_pool_cleanup_null);
+    return APR_SUCCESS;
+}
+
+#else
+
+apr_status_t
+cpe_log_async(apr_size_t ring_size, apr_time_t flush_interval,
+    apr_pool_t *pool)
+{
+    ring_size = 0;
+    flush_interval = 0;
+    pool = NULL;
+    return APR_ENOTIMPL;
+}
+
+void
+cpe_log_async_stop(void)
+{
+}
+
+#endif /* APR_HAS_THREADS */
+
+
+/*****************************************************************************
+ *                               IMPLEMENTATION                              *
+ *****************************************************************************/
+
+/* Protect g_cpe_log: with lg_mutex once cpe_log_async() created it, with
+ * the lock of stdout before. The mode is read once, and handed back to
+ * cpe_log_unlock(), so that a call never unlocks what it did not lock.
+ *
+ * @return 1 if it took lg_mutex.
+ */
+static int
+cpe_log_lock(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex = g_cpe_log.lg_mutex;
+
+    if (mutex != NULL) {
+        apr_thread_mutex_lock(mutex);
+        return 1;
+    }
+#endif
+    flockfile(stdout);
+    return 0;
+}
+
+
+static void
+cpe_log_unlock(int async)
+{
+#if APR_HAS_THREADS
+    if (async) {
+        apr_thread_mutex_unlock(g_cpe_log.lg_mutex);
+        return;
+    }
+#endif
+    async = 0;
+    funlockfile(stdout);
+}
+
+
+/* Write a line, or queue it to the ring. Locked.
+ *
+ * @return 0 if the ring is full.
+ */
+static int
+cpe_log_put(const char *line, apr_size_t len)
+{
+    struct cpe_log_state *lg = &g_cpe_log;
+    apr_size_t            pos, n;
+
+    if (lg->lg_ring == NULL) {
+        fwrite(line, 1, len, stdout);
+        lg->lg_stats.ls_lines++;
+        return 1;
+    }
+    if (lg->lg_write - lg->lg_read + len > lg->lg_ring_size) {
+        return 0;
+    }
+    pos = lg->lg_write % lg->lg_ring_size;
+    n = cpe_min(len, lg->lg_ring_size - pos);
+    memcpy(&lg->lg_ring[pos], line, n);
+    memcpy(lg->lg_ring, line + n, len - n);
+    lg->lg_write += len;
+    lg->lg_stats.ls_lines++;
+#if APR_HAS_THREADS
+    if (lg->lg_write - lg->lg_read > lg->lg_ring_size / 2) {
+        apr_thread_cond_signal(lg->lg_cond);
+    }
+#endif
+    return 1;
+}
+
+
+/* Write a line, or drop it if the ring is full. The lines after a drop
+ * are dropped too until there is room to say so before them. Locked.
+ */
+static void
+cpe_log_emit(const char *line, apr_size_t len)
+{
+    cpe_log_emit_dropped(len);
+    if (g_cpe_log.lg_dropped > 0 || ! cpe_log_put(line, len)) {
+        g_cpe_log.lg_dropped++;
+        g_cpe_log.lg_stats.ls_dropped++;
+    }
+}
+
+
+/* Say how many times the last line was repeated, if any. Locked. */
+static void
+cpe_log_emit_repeats(void)
+{
+    char line[64];
+    int  n;
+
+    if (g_cpe_log.lg_repeats == 0) {
+        return;
+    }
+    n = snprintf(line, sizeof line, "last message repeated %u times\n",
+        g_cpe_log.lg_repeats);
+    g_cpe_log.lg_repeats = 0;
+    cpe_log_emit(line, n);
+}
+
+
+/* Say how many lines were dropped, if any, and if the ring has \p room
+ * left after that for the line that follows. Locked.
+ */
+static void
+cpe_log_emit_dropped(apr_size_t room)
+{
+    struct cpe_log_state *lg = &g_cpe_log;
+    char                  line[64];
+    int                   n;
+
+    if (lg->lg_dropped == 0) {
+        return;
+    }
+    n = snprintf(line, sizeof line, "%u lines dropped\n", lg->lg_dropped);
+    if (lg->lg_ring != NULL &&
+        lg->lg_write - lg->lg_read + n + room > lg->lg_ring_size)
+    {
+        return;
+    }
+    if (cpe_log_put(line, n)) {
+        lg->lg_dropped = 0;
+    }
+}
+
+
+/* Write what is in the ring. The loggers only add after lg_write, so the
+ * bytes before it can be written unlocked; one drainer at a time.
+ */
+static void
+cpe_log_drain(void)
+{
+#if APR_HAS_THREADS
+    struct cpe_log_state *lg = &g_cpe_log;
+    char                 *ring;
+    apr_size_t            start, end, pos, n;
+
+    if (lg->lg_mutex == NULL) {
+        return;
+    }
+    apr_thread_mutex_lock(lg->lg_drain_mutex);
+    apr_thread_mutex_lock(lg->lg_mutex);
+    ring = lg->lg_ring;
+    start = lg->lg_read;
+    end = lg->lg_write;
+    apr_thread_mutex_unlock(lg->lg_mutex);
+    /* the ring is dropped holding lg_drain_mutex too, see
+     * cpe_log_async_stop()
+     */
+    if (ring != NULL && start != end) {
+        pos = start % lg->lg_ring_size;
+        n = cpe_min(end - start, lg->lg_ring_size - pos);
+        fwrite(&ring[pos], 1, n, stdout);
+        fwrite(ring, 1, end - start - n, stdout);
+        fflush(stdout);
+        apr_thread_mutex_lock(lg->lg_mutex);
+        lg->lg_read = end;
+        lg->lg_stats.ls_flushes++;
+        apr_thread_mutex_unlock(lg->lg_mutex);
+    }
+    apr_thread_mutex_unlock(lg->lg_drain_mutex);
+#endif
 }
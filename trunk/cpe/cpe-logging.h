@@ -43,6 +43,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdarg.h>
 #include <stdio.h>
 #include <apr_general.h>
+#include <apr_pools.h>
+#include <apr_time.h>
 
 enum {
     CPE_LOG_FIRST = 0,
@@ -54,11 +56,55 @@ enum {
     CPE_LOG_LAST
 };
 
-/* Using a macro allows to insert the name of the calling function */
-#define cpe_log(level, fmt, ...) \
-    cpe_log2(level, "%s: " fmt "\n", __FUNCTION__, __VA_ARGS__)
+/** Log calls below this level are compiled out, arguments included. A
+ *  build without the hot path debug logs would define
+ *  CPE_LOG_MIN_LEVEL=CPE_INFO.
+ */
+#ifndef CPE_LOG_MIN_LEVEL
+#define CPE_LOG_MIN_LEVEL CPE_DEB
+#endif
+
+#if defined(__GNUC__)
+#define cpe_likely(x)   __builtin_expect(!!(x), 1)
+#define cpe_unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define cpe_likely(x)   (x)
+#define cpe_unlikely(x) (x)
+#endif
+
+/** Max length of a log line, longer ones are truncated. */
+#define CPE_LOG_LINE_MAX 1024
+
+/* Set by cpe_log_init(); read it through cpe_log() only. */
+extern int g_cpe_log_level;
+
+/* Using a macro allows to insert the name of the calling function. The
+ * level is checked before anything else, so that a disabled call costs a
+ * compare, and nothing at all below CPE_LOG_MIN_LEVEL.
+ */
+#define cpe_log(level, fmt, ...) do {                                   \
+    if ((level) >= CPE_LOG_MIN_LEVEL &&                                 \
+        cpe_unlikely((level) >= g_cpe_log_level))                       \
+    {                                                                   \
+        cpe_log2(level, "%s: " fmt "\n", __FUNCTION__, __VA_ARGS__);    \
+    }                                                                   \
+} while (0)
+
+/** Counters of the logging system, see cpe_log_stats_get(). */
+struct cpe_log_stats {
+    apr_uint32_t ls_lines;      /* written, or queued to the ring */
+    apr_uint32_t ls_repeated;   /* same as the previous line, not written */
+    apr_uint32_t ls_dropped;    /* the ring was full */
+    apr_uint32_t ls_flushes;    /* writes of the ring */
+};
+typedef struct cpe_log_stats cpe_log_stats;
 
 apr_status_t cpe_log_init(int min_level);
+apr_status_t cpe_log_async(apr_size_t ring_size, apr_time_t flush_interval,
+                apr_pool_t *pool);
+void         cpe_log_async_stop(void);
+void         cpe_log_flush(void);
+void         cpe_log_stats_get(cpe_log_stats *stats);
 /* __attribute__ is GCC specific, so we might need a workaround for other
  * compilers, like:
  * #if !defined(__attribute__)
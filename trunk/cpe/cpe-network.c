@@ -42,6 +42,17 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <apr_portable.h>
 
 #include "cpe.h"
 #include "cpe-network.h"
@@ -62,6 +73,27 @@ struct cpe_socket_prepare_ctx_ {
     void            *pc_one_shot_ctx;
 };
 
+/* An accepted socket, see cpe_accept_cache. Once closed, its apr_socket_t
+ * wraps the descriptor of a next accept: the memory of a connection is not
+ * lost when it goes.
+ */
+struct cpe_accepted {
+    struct cpe_accepted    *ac_next;        /* free list */
+    apr_socket_t           *ac_sock;        /* key of ac_live */
+    cpe_socket_prepare_ctx *ac_listener;
+};
+typedef struct cpe_accepted cpe_accepted;
+
+/* Max connections taken per readiness of a listening socket. */
+#define CPE_ACCEPT_BATCH 128
+
+/* Max buffers gathered by cpe_sender() in one send, within IOV_MAX. */
+#if defined(IOV_MAX) && IOV_MAX < 128
+#define CPE_SENDV_MAX IOV_MAX
+#else
+#define CPE_SENDV_MAX 128
+#endif
+
 static apr_sockaddr_t *g_cpe_sockaddr_localhost;
 
 
@@ -96,12 +128,41 @@ cpe_socket_client_create(apr_socket_t **sock, apr_sockaddr_t **sockaddr,
 }
 
 
+/* Let the loops of cpe_loops_run() each listen on the same port: the
+ * kernel spreads the incoming connections among them. APR has no option
+ * for it.
+ */
+static apr_status_t
+cpe_socket_reuseport(apr_socket_t *sock)
+{
+#ifdef SO_REUSEPORT
+    apr_os_sock_t fd;
+    apr_status_t  rv;
+    int           one = 1;
+
+    CHECK(apr_os_sock_get(&fd, sock));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) < 0) {
+        rv = APR_FROM_OS_ERROR(errno);
+        cpe_log(CPE_ERR, "setsockopt SO_REUSEPORT: %s", cpe_errmsg(rv));
+        return rv;
+    }
+    return APR_SUCCESS;
+#else
+    sock = NULL;
+    return APR_ENOTIMPL;
+#endif
+}
+
+
 /*! Create a non-blocking server socket, ready to be passed to
  *  cpe_socket_after_accept().
  *
  *  Parameters are as for apr_sockaddr_info_get(), apr_socket_create(),
  *  apr_socket_bind() and apr_socket_listen().
  *
+ *  Called from a loop of cpe_loops_run(), the socket is bound with
+ *  SO_REUSEPORT: each loop creates its own listening socket on the same
+ *  port, and accepts its share of the connections.
  */
 apr_status_t
 cpe_socket_server_create(apr_socket_t **sock, apr_sockaddr_t **sockaddr,
@@ -112,6 +173,9 @@ cpe_socket_server_create(apr_socket_t **sock, apr_sockaddr_t **sockaddr,
 
     CHECK(cpe_socket_client_create(sock, sockaddr, hostname, port, pool));
     CHECK(apr_socket_opt_set(*sock, APR_SO_REUSEADDR, 1));
+    if (cpe_loop_id() >= 0) {
+        CHECK(cpe_socket_reuseport(*sock));
+    }
     CHECK(apr_socket_bind(*sock, *sockaddr));
     CHECK(apr_socket_listen(*sock, backlog));
     return APR_SUCCESS;
@@ -150,8 +214,6 @@ cpe_increment_peers(cpe_socket_prepare_ctx *ctx)
 }
 
 
-/** Called by cpe_socket_cleanup_cb.
- */
 static apr_status_t
 cpe_decrement_peers(cpe_socket_prepare_ctx *ctx)
 {
@@ -166,78 +228,176 @@ cpe_decrement_peers(cpe_socket_prepare_ctx *ctx)
 }
 
 
-/** Cleanup callback called in theory apr_socket_close().
+/* Posted by cpe_socket_close(): the callbacks that were using the socket
+ * are over, it can go to the next accept.
  */
 static apr_status_t
-cpe_socket_cleanup_cb(void *context)
+cpe_accepted_recycle(void *context)
 {
-    apr_status_t            rv;
-    cpe_socket_prepare_ctx *ctx;
+    cpe_accept_cache *cache = &g_cpe_loop->lp_accepted;
+    cpe_accepted     *ac = context;
 
-    cpe_log(CPE_DEB, "%s", "enter");
-    ctx = context;
-    if (ctx == NULL) {
-        /* this is not an error condition */
-        cpe_log(CPE_DEB, "%s", "invoked with NULL args, returning");
-        return APR_SUCCESS;
-    }
-    CHECK(cpe_decrement_peers(ctx));
-    return rv;
+    ac->ac_next = cache->ac_free;
+    cache->ac_free = ac;
+    cache->ac_stats.as_free++;
+    return APR_SUCCESS;
 }
 
 
-/** Wrapper around apr_socket_close() to invoke the cleanup callback.
+/** Close a socket; if it comes from cpe_socket_after_accept(), it makes
+ *  room for another peer, and its memory is reused by a next accept.
+ *
+ *  The socket can still be used as a key until the callbacks in progress
+ *  are over, e.g. for cpe_resource_destroy_users().
  */
 apr_status_t
 cpe_socket_close(apr_socket_t *sock)
 {
-    apr_status_t            rv;
-    void                   *p = NULL;
-
+    cpe_accept_cache *cache = NULL;
+    cpe_accepted     *ac = NULL;
+    apr_status_t      rv;
+
+    if (g_cpe_loop != NULL) {
+        cache = &g_cpe_loop->lp_accepted;
+        if (cache->ac_live != NULL) {
+            ac = apr_hash_get(cache->ac_live, &sock, sizeof sock);
+        }
+    }
     apr_socket_close(sock);
-    CHECK(apr_socket_data_get(&p, "dummykey", sock));
-    CHECK(cpe_socket_cleanup_cb(p));
+    if (ac == NULL) {
+        return APR_SUCCESS;
+    }
+    apr_hash_set(cache->ac_live, &ac->ac_sock, sizeof ac->ac_sock, NULL);
+    cache->ac_stats.as_live--;
+    rv = cpe_decrement_peers(ac->ac_listener);
+    if (cpe_post(g_cpe_loop, cpe_accepted_recycle, ac) != APR_SUCCESS) {
+        cpe_log(CPE_ERR, "cannot recycle socket %p, leaking it", sock);
+    }
     return rv;
 }
 
-/*! Internal use callback associated with cpe_socket_after_accept().
- *  Handle the accept and put the new accepted socket in the event system.
+
+/* The address of sockaddr, in buf. Unlike apr_sockaddr_ip_get(), it takes
+ * no memory from the pool of the socket.
  */
-static apr_status_t
-cpe_socket_accept_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+static const char *
+cpe_sockaddr_ip(apr_sockaddr_t *sockaddr, char *buf, apr_size_t len)
 {
-    apr_socket_t           *newsock;
-    apr_status_t            rv;
-    apr_sockaddr_t         *sockaddr;
-    cpe_socket_prepare_ctx *ctx;
-    cpe_event              *event;
-    char                   *hostip;
+    if (inet_ntop(sockaddr->family, sockaddr->ipaddr_ptr, buf, len) == NULL) {
+        return "?";
+    }
+    return buf;
+}
 
-    ctx = context;
-    assert(ctx != NULL);
-    pfd = NULL;
-    cpe_event_add(e);
 
-    CHECK(rv = apr_socket_accept(&newsock, ctx->pc_orig_socket, g_cpe_pool));
-    rv = apr_socket_addr_get(&sockaddr, APR_REMOTE, newsock);
-    if (rv == APR_SUCCESS) {
-        apr_sockaddr_ip_get(&hostip, sockaddr);
+/* accept(2) a non-blocking connection. */
+static apr_os_sock_t
+cpe_accept_fd(apr_os_sock_t lfd)
+{
+#ifdef SOCK_NONBLOCK
+    return accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    apr_os_sock_t fd;
+
+    fd = accept(lfd, NULL, NULL);
+    if (fd >= 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#endif
+}
+
+
+/* Wrap accepted descriptor fd in an apr_socket_t, taken from the closed
+ * ones if any.
+ */
+static apr_status_t
+cpe_accepted_get(cpe_accepted **acp, apr_os_sock_t fd,
+    cpe_socket_prepare_ctx *ctx)
+{
+    cpe_accept_cache *cache = &g_cpe_loop->lp_accepted;
+    cpe_accepted     *ac;
+    apr_status_t      rv;
+
+    if (cache->ac_live == NULL) {
+        CHECK_NULL(cache->ac_live, apr_hash_make(g_cpe_loop->lp_pool));
+    }
+    if (cache->ac_free != NULL) {
+        ac = cache->ac_free;
+        cache->ac_free = ac->ac_next;
+        cache->ac_stats.as_free--;
     } else {
-        cpe_log(CPE_ERR, "apr_sock_addr_get: %s", cpe_errmsg(rv));
-        cpe_socket_close(newsock);
+        CHECK_NULL(ac, apr_pcalloc(g_cpe_loop->lp_pool, sizeof *ac));
+        cache->ac_stats.as_sockets++;
+    }
+    /* A NULL ac_sock is allocated, else reused. */
+    rv = apr_os_sock_put(&ac->ac_sock, &fd, g_cpe_loop->lp_pool);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_ERR, "apr_os_sock_put: %s", cpe_errmsg(rv));
+        close(fd);
+        cpe_accepted_recycle(ac);
+        return rv;
+    }
+    ac->ac_listener = ctx;
+    ac->ac_next = NULL;
+    apr_hash_set(cache->ac_live, &ac->ac_sock, sizeof ac->ac_sock, ac);
+    cache->ac_stats.as_live++;
+    *acp = ac;
+    return APR_SUCCESS;
+}
+
+
+/* Accept one connection on the listening socket of ctx, and put it in the
+ * event system.
+ *
+ * @return APR_SUCCESS if a connection was taken (even if rejected),
+ *         APR_EAGAIN if there is none left.
+ */
+static apr_status_t
+cpe_socket_accept_one(cpe_socket_prepare_ctx *ctx, apr_os_sock_t lfd)
+{
+    cpe_accept_stats *stats = &g_cpe_loop->lp_accepted.ac_stats;
+    apr_socket_t     *newsock;
+    apr_status_t      rv;
+    apr_sockaddr_t   *sockaddr;
+    cpe_accepted     *ac;
+    cpe_event        *event;
+    apr_os_sock_t     fd;
+    char              hostip[64];
+
+    fd = cpe_accept_fd(lfd);
+    if (fd < 0) {
+        rv = APR_FROM_OS_ERROR(errno);
+        if (APR_STATUS_IS_EINTR(rv) || APR_STATUS_IS_ECONNABORTED(rv)) {
+            return APR_SUCCESS;
+        }
+        if (! APR_STATUS_IS_EAGAIN(rv)) {
+            cpe_log(CPE_ERR, "accept: %s", cpe_errmsg(rv));
+        }
         return rv;
     }
+    stats->as_accepted++;
     if (cpe_increment_peers(ctx) != APR_SUCCESS) {
+        close(fd);
+        stats->as_rejected++;
+        cpe_log(CPE_WARN, "rejected connection (too many, %d)",
+            ctx->pc_num_peers);
+        return APR_SUCCESS;
+    }
+    rv = cpe_accepted_get(&ac, fd, ctx);
+    if (rv != APR_SUCCESS) {
+        cpe_decrement_peers(ctx);
+        return rv;
+    }
+    newsock = ac->ac_sock;
+    rv = apr_socket_addr_get(&sockaddr, APR_REMOTE, newsock);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_ERR, "apr_sock_addr_get: %s", cpe_errmsg(rv));
         cpe_socket_close(newsock);
-        cpe_log(CPE_WARN, "rejected connection from %s %d (too many)",
-            hostip, sockaddr->port);
-        return APR_EGENERAL;
+        stats->as_rejected++;
+        return APR_SUCCESS;
     }
-    /* Useless because APR doesn't call the callback on socket close (as
-     * documented), but on pool destruction. So for the time being we use
-     * our wrapper cpe_socket_close()
-     */
-    CHECK(apr_socket_data_set(newsock, ctx, "dummykey", cpe_socket_cleanup_cb));
 
     /* SECURITY: if the user didn't specify an accept filter, accept
      * only connections from localhost
@@ -249,14 +409,17 @@ cpe_socket_accept_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
     }
     if (rv != APR_SUCCESS) {
         cpe_socket_close(newsock);
+        stats->as_rejected++;
         cpe_log(CPE_WARN, "rejected connection from %s %d (filtered)",
-            hostip, sockaddr->port);
-        return rv;
+            cpe_sockaddr_ip(sockaddr, hostip, sizeof hostip), sockaddr->port);
+        return APR_SUCCESS;
     }
-    cpe_log(CPE_INFO, "accepted connection from %s %d", hostip,
-        sockaddr->port);
+    cpe_log(CPE_INFO, "accepted connection from %s %d",
+        cpe_sockaddr_ip(sockaddr, hostip, sizeof hostip), sockaddr->port);
 
-    /* Critical for CPE: set the socket non-blocking. */
+    /* Critical for CPE: set the socket non-blocking. The descriptor is
+     * already; this is for APR.
+     */
     apr_socket_opt_set(newsock, APR_SO_NONBLOCK, 1);
     apr_socket_timeout_set(newsock, 0);
 
@@ -268,11 +431,62 @@ cpe_socket_accept_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
         (apr_descriptor) newsock, 0, ctx->pc_callback, ctx->pc_ctx1);
     if (event == NULL) {
         cpe_log(CPE_ERR, "%s", "cpe_event_fdesc_create fail");
+        cpe_socket_close(newsock);
         return APR_EGENERAL;
     }
-    CHECK(cpe_event_add(event));
+    rv = cpe_event_add(event);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_ERR, "cpe_event_add: %s", cpe_errmsg(rv));
+        cpe_event_destroy(&event);
+        cpe_socket_close(newsock);
+        return rv;
+    }
     if (ctx->pc_one_shot_cb != NULL) {
-        CHECK(ctx->pc_one_shot_cb(ctx->pc_one_shot_ctx, &event->ev_pollfd, event));
+        rv = ctx->pc_one_shot_cb(ctx->pc_one_shot_ctx, &event->ev_pollfd,
+            event);
+        if (rv != APR_SUCCESS) {
+            cpe_log(CPE_ERR, "one-shot callback: %s", cpe_errmsg(rv));
+            cpe_event_remove(event);
+            cpe_event_destroy(&event);
+            cpe_socket_close(newsock);
+            return rv;
+        }
+    }
+    return APR_SUCCESS;
+}
+
+
+/*! Internal use callback associated with cpe_socket_after_accept().
+ *  Take the pending connections, up to CPE_ACCEPT_BATCH: with many peers
+ *  connecting at once, one wakeup per connection would be too slow.
+ */
+static apr_status_t
+cpe_socket_accept_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    cpe_accept_stats       *stats = &g_cpe_loop->lp_accepted.ac_stats;
+    cpe_socket_prepare_ctx *ctx;
+    apr_os_sock_t           lfd;
+    apr_status_t            rv;
+    apr_uint32_t            n;
+
+    ctx = context;
+    assert(ctx != NULL);
+    pfd = NULL;
+    e = NULL;   /* persistent, stays in the system */
+
+    CHECK(apr_os_sock_get(&lfd, ctx->pc_orig_socket));
+    for (n = 0; n < CPE_ACCEPT_BATCH; n++) {
+        rv = cpe_socket_accept_one(ctx, lfd);
+        if (rv != APR_SUCCESS) {
+            break;
+        }
+    }
+    if (n > stats->as_max_batch) {
+        stats->as_max_batch = n;
+    }
+    if (APR_STATUS_IS_EAGAIN(rv) || n == CPE_ACCEPT_BATCH) {
+        /* the rest at the next readiness */
+        return APR_SUCCESS;
     }
     return rv;
 }
@@ -287,7 +501,8 @@ cpe_socket_accept_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
  * @param pfd_flags    Poll flags for the new socket.
  * @param afilter_cb   Optional accept filter callback. NULL will accept
  *                     connections only from localhost.
- * @param max_peers    Max number of contemporary connections.
+ * @param max_peers    Max number of contemporary connections, see
+ *                     CPE_MAX_PEERS. A connection beyond is closed at once.
  * @param one_shot_cb  Callback that will be called once per newly created
  *                     socket. This allows e.g. to call cpe_queue_init with the
  *                     appropriate pfd.
@@ -315,8 +530,8 @@ cpe_socket_after_accept(
     apr_socket_opt_get(lsock, APR_SO_NONBLOCK, &nonblock);
     assert(nonblock == 1);
 
-    if (max_peers <= 0 || max_peers > CPE_MAX_PEERS) {
-        cpe_log(CPE_DEB, "%s", "max_peers outside range (%d)");
+    if (max_peers <= 0) {
+        cpe_log(CPE_DEB, "max_peers outside range (%d)", max_peers);
         return APR_EINVAL;
     }
     /*
@@ -332,6 +547,7 @@ cpe_socket_after_accept(
     if (event == NULL) {
         return APR_EGENERAL;
     }
+    CHECK(cpe_event_set_persistent(event, 1));
     sp_ctx->pc_afilter      = afilter_cb;
     sp_ctx->pc_callback     = callback;
     sp_ctx->pc_ctx1         = ctx1;
@@ -546,6 +762,75 @@ cpe_recv(apr_socket_t *sock, cpe_io_buf *recvbuf, apr_size_t *howmany)
 }
 
 
+/* Slots per chunk of the queue entry slab. */
+#define CPE_QUEUE_ENTRY_CHUNK 256
+
+/* Append an entry for sendbuf to queue head. */
+static apr_status_t
+cpe_queue_append(cpe_queue_t *head, cpe_io_buf *sendbuf)
+{
+    cpe_iobuf_cache *ic = &g_cpe_loop->lp_iobufs;
+    cpe_queue_entry *entry;
+
+    if (ic->ic_entry_slab == NULL) {
+        ic->ic_entry_slab = cpe_slab_create(sizeof(cpe_queue_entry),
+            CPE_QUEUE_ENTRY_CHUNK);
+        if (ic->ic_entry_slab == NULL) {
+            cpe_log(CPE_ERR, "%s", "out of memory");
+            return APR_ENOMEM;
+        }
+    }
+    entry = cpe_slab_alloc(ic->ic_entry_slab);
+    if (entry == NULL) {
+        cpe_log(CPE_ERR, "%s", "out of memory");
+        return APR_ENOMEM;
+    }
+    entry->qe_next = NULL;
+    entry->qe_iobuf = sendbuf;
+    entry->qe_offset = 0;
+
+    /* FIFO queue, insert at the end */
+    head->cq_nelems++;
+    sendbuf->inqueue++;
+    if (head->cq_next == NULL) {
+        head->cq_next = entry;
+    } else {
+        head->cq_tail->qe_next = entry;
+    }
+    head->cq_tail = entry;
+    head->cq_total_in_queue += sendbuf->buf_len;
+    cpe_log(CPE_DEB, "inserted buf %p in queue %p (nelems %d, refs %d)",
+        sendbuf, head, head->cq_nelems, sendbuf->inqueue);
+
+    return cpe_pollset_update(head->cq_pfd,
+        head->cq_pfd->reqevents | APR_POLLOUT);
+}
+
+
+/* Take the first entry off queue head, dropping its reference to the
+ * buffer; the last reference destroys the buffer if so marked.
+ */
+static void
+cpe_queue_remove_first(cpe_queue_t *head, cpe_network_ctx *nctx)
+{
+    cpe_queue_entry *entry = head->cq_next;
+    cpe_io_buf      *sendbuf = entry->qe_iobuf;
+
+    head->cq_next = entry->qe_next;
+    if (head->cq_next == NULL) {
+        head->cq_tail = NULL;
+    }
+    head->cq_nelems--;
+    cpe_slab_free(g_cpe_loop->lp_iobufs.ic_entry_slab, entry);
+    assert(sendbuf->inqueue > 0);
+    sendbuf->inqueue--;
+    if (sendbuf->inqueue == 0 && sendbuf->destroy) {
+        cpe_log(CPE_DEB, "%s", "iobuf marked to be destroyed");
+        cpe_iobuf_destroy(&sendbuf, nctx);
+    }
+}
+
+
 /** Put buffer sendbuf in send queue head, to be processed by cpe_sender().
  *  Perform synchronization on the pollfd associated with the queue (enables
  *  POLLOUT if needed).
@@ -553,13 +838,32 @@ cpe_recv(apr_socket_t *sock, cpe_io_buf *recvbuf, apr_size_t *howmany)
  *  @remark Memory management (allocation and deallocation) must be done by
  *  the caller; note also that this queue doesn't copy the buffer, so the
  *  buffer is safe to be deallocated/manipulated only if buf->inqueue == 0.
+ *  The buffer must not be on any other queue; to send the same buffer to
+ *  several peers, see cpe_send_enqueue_shared().
  */
 apr_status_t
 cpe_send_enqueue(cpe_queue_t *head, cpe_io_buf *sendbuf)
 {
-    apr_status_t rv;
+    if (sendbuf->inqueue) {
+        cpe_log(CPE_DEB, "buffer %p already in queue %p (nelems %d)", sendbuf,
+            head, head->cq_nelems);
+        return APR_EINVAL;
+    }
+    return cpe_send_enqueue_shared(head, sendbuf);
+}
+
 
-    //assert(sendbuf->buf_offset == 0);
+/** Put buffer sendbuf in send queue head, even if it is already on other
+ *  queues: each queue holds a reference to it, and sends it at its own pace.
+ *  This allows to encode a message once and broadcast it to many peers.
+ *
+ *  The buffer content must not change while buf->inqueue != 0. Once the
+ *  caller is done with it, cpe_iobuf_release() destroys it, right away or
+ *  when the last queue has sent it.
+ */
+apr_status_t
+cpe_send_enqueue_shared(cpe_queue_t *head, cpe_io_buf *sendbuf)
+{
     if (sendbuf->buf_offset != 0) {
         cpe_log(CPE_DEB, "buffer %p has non-zero offset (%d), cannot enqueue",
             sendbuf, sendbuf->buf_offset);
@@ -569,28 +873,51 @@ cpe_send_enqueue(cpe_queue_t *head, cpe_io_buf *sendbuf)
         cpe_log(CPE_DEB, "buffer %p is empty, cannot enqueue", sendbuf);
         return APR_EINVAL;
     }
-    if (sendbuf->inqueue) {
-        cpe_log(CPE_DEB, "buffer %p already in queue %p (nelems %d)", sendbuf,
-            head, head->cq_nelems);
-        return APR_EINVAL;
-    }
+    return cpe_queue_append(head, sendbuf);
+}
 
-    /* FIFO queue, insert at the end */
-    head->cq_nelems++;
-    sendbuf->inqueue = 1;
-    sendbuf->next = NULL;
-    if (head->cq_next == NULL) {
-        head->cq_next = sendbuf;
-    } else {
-        head->cq_tail->next = sendbuf;
+
+/** Drop all the buffers still in queue head, as when its socket is closed.
+ *  Called by the cleanup of the pool of the queue, see cpe_queue_init().
+ */
+void
+cpe_queue_flush(cpe_queue_t *head)
+{
+    while (head->cq_next != NULL) {
+        cpe_queue_remove_first(head, NULL);
     }
-    head->cq_tail = sendbuf;
-    head->cq_total_in_queue += sendbuf->buf_len;
-    cpe_log(CPE_DEB, "inserted buf %p in queue %p (nelems %d)",
-        sendbuf, head, head->cq_nelems);
+}
 
-    rv = cpe_pollset_update(head->cq_pfd, head->cq_pfd->reqevents | APR_POLLOUT);
-    return rv;
+
+/* Take the first howmany bytes sent off the queue: complete buffers are
+ * removed (and destroyed if so marked and not on other queues), a partial
+ * one keeps its offset in its entry.
+ */
+static void
+cpe_sender_advance(cpe_network_ctx *nctx, apr_size_t howmany)
+{
+    cpe_queue_t      *head = nctx->nc_sendQ;
+    cpe_queue_entry  *entry;
+    cpe_io_buf       *sendbuf;
+    apr_size_t        len;
+
+    while (howmany > 0) {
+        entry = head->cq_next;
+        assert(entry != NULL);
+        sendbuf = entry->qe_iobuf;
+        len = sendbuf->buf_len - entry->qe_offset;
+        if (howmany < len) {
+            entry->qe_offset += howmany;
+            sendbuf->total += howmany;
+            return;
+        }
+        howmany -= len;
+        sendbuf->total += len;
+        cpe_log(CPE_DEB,
+            "buffer %p (on queue %p, nelems %d, socket %p) completely sent",
+            sendbuf, head, head->cq_nelems - 1, head->cq_pfd->desc.s);
+        cpe_queue_remove_first(head, nctx);
+    }
 }
 
 
@@ -598,56 +925,83 @@ cpe_send_enqueue(cpe_queue_t *head, cpe_io_buf *sendbuf)
  *  Perform synchronization on the pollfd associated with the queue (disables
  *  POLLOUT if queue is empty).
  *
+ *  The queued buffers are gathered, up to CPE_SENDV_MAX at a time, in one
+ *  apr_socket_sendv(); this goes on until the queue is empty or the socket
+ *  cannot take more.
+ *
  *  @remark Memory management (allocation and deallocation) must be done by
  *  the caller of cpe_send_enqueue().
  */
 apr_status_t
 cpe_sender(cpe_network_ctx *nctx)
 {
-    cpe_io_buf   *sendbuf;
-    apr_size_t    howmany;
-    apr_status_t  rv;
-    cpe_queue_t   *head;
+    struct iovec     vec[CPE_SENDV_MAX];
+    cpe_queue_entry *entry;
+    cpe_io_buf      *sendbuf;
+    apr_size_t       howmany, len;
+    apr_status_t     rv = APR_SUCCESS;
+    cpe_queue_t     *head;
+    int              nvec;
 
     cpe_log(CPE_DEB, "%s", "enter");
     head = nctx->nc_sendQ;
+    while (head->cq_next != NULL) {
+        len = 0;
+        nvec = 0;
+        for (entry = head->cq_next; entry != NULL && nvec < CPE_SENDV_MAX;
+            entry = entry->qe_next)
+        {
+            sendbuf = entry->qe_iobuf;
+            assert(sendbuf->buf_len > entry->qe_offset);
+            vec[nvec].iov_base = &sendbuf->buf[entry->qe_offset];
+            vec[nvec].iov_len = sendbuf->buf_len - entry->qe_offset;
+            len += vec[nvec].iov_len;
+            nvec++;
+        }
+        howmany = 0;
+        rv = apr_socket_sendv(head->cq_pfd->desc.s, vec, nvec, &howmany);
+        cpe_log(CPE_DEB, "sent %d of %d bytes from %d buffers (socket %p)",
+            (int) howmany, (int) len, nvec, head->cq_pfd->desc.s);
+        head->cq_total_sent += howmany;
+        cpe_sender_advance(nctx, howmany);
+        if (rv != APR_SUCCESS) {
+            if (APR_STATUS_IS_EAGAIN(rv)) {
+                rv = APR_SUCCESS;
+            } else {
+                cpe_log(CPE_DEB, "apr_socket_sendv: %s", cpe_errmsg(rv));
+            }
+            break;
+        }
+        if (howmany < len) {
+            /* socket buffer full, wait for the next POLLOUT */
+            break;
+        }
+    }
     if (head->cq_next == NULL) {
         cpe_log(CPE_DEB, "queue %p (socket %p) is empty, disabling POLLOUT",
             head, head->cq_pfd->desc.s);
-        rv = cpe_pollset_update(head->cq_pfd,
-            head->cq_pfd->reqevents & ~APR_POLLOUT);
-        assert(rv == APR_SUCCESS);
-        return rv;
+        CHECK(cpe_pollset_update(head->cq_pfd,
+            head->cq_pfd->reqevents & ~APR_POLLOUT));
     }
+    return rv;
+}
 
-    sendbuf = head->cq_next;
-    howmany = sendbuf->buf_len;
-    assert(howmany > 0);
 
-    rv = cpe_send(head->cq_pfd->desc.s, sendbuf, &howmany);
-    /* XXX what to do with rv ? */
-    head->cq_total_sent += howmany;
-    if (sendbuf->buf_offset == sendbuf->buf_len) {
-        head->cq_nelems--;
-        sendbuf->inqueue = 0;
-        sendbuf->buf_offset = 0;
-        cpe_log(CPE_DEB,
-            "buffer %p (on queue %p, nelems %d, socket %p) completely sent",
-            sendbuf, head, head->cq_nelems, head->cq_pfd->desc.s);
-        /* Update queue to next buffer to send; remove buffer from queue.
-         */
-        if (sendbuf->next != NULL) {
-            head->cq_next = sendbuf->next;
-            sendbuf->next = NULL;
-        } else {
-            head->cq_next = NULL;
-        }
-        if (sendbuf->destroy) {
-            cpe_log(CPE_DEB, "%s", "iobuf marked to be destroyed");
-            cpe_iobuf_destroy(&sendbuf, nctx);
-        }
-    }
-    return APR_SUCCESS;
+/* Close the socket of \p pfd, with its event and the users of the socket
+ * (see cpe_resource_register_user()). The event can be one of them: pfd
+ * is in the event, so it is not touched once the users are destroyed.
+ */
+static void
+cpe_socket_drop(apr_pollfd_t *pfd)
+{
+    apr_socket_t *sock = pfd->desc.s;
+    cpe_event    *event = pfd->client_data;
+
+    cpe_event_remove(event);
+    pfd->client_data = NULL;
+    pfd->desc.s = NULL;
+    cpe_socket_close(sock);
+    cpe_resource_destroy_users(sock);
 }
 
 
@@ -667,12 +1021,16 @@ cpe_sender(cpe_network_ctx *nctx)
  * - second pass: read the full packet, and pass it to the specified consumer
  *   (\p msg_handler_cb)
  *
+ * @param iobufsize       Max message size; a bigger one drops the
+ *                        connection.
+ * @param pool            Unused, the iobufs come from cpe_iobuf_get().
+ *
  * @remark There is no queue; once a packet is read, it is passed to its
- * consumer. Memory for the iobuf is allocated here, from a new pool, and
- * must be deallocated by the consumer (another more advanced option, useful
- * in case the consumer wants to recycle the iobuf, is having the consumer
- * set iobuf->destroy, plus a cpe_send_enqueue(). Then cpe_sender() will
- * deallocate the buffer on behalf of the consumer.
+ * consumer. The iobuf is taken here from the recycled ones, in the size
+ * class of the message, and belongs to the consumer from then on: it can
+ * give it back with cpe_iobuf_destroy(), or keep it. A consumer keeping it
+ * to send it back can set iobuf->destroy, plus a cpe_send_enqueue(); then
+ * cpe_sender() will give it back on behalf of the consumer.
  *
  * @remark There is a general resync problem with protocols on top of a
  * stream-oriented transport like TCP: if I don't find what I expected, how
@@ -691,6 +1049,7 @@ cpe_receiver(cpe_network_ctx *nctx, apr_pollfd_t *pfd, int iobufsize,
     apr_status_t rv;
 
     cpe_log(CPE_DEB, "%s", "enter");
+    pool = NULL;
     if (get_msg_size_cb == NULL || msg_handler_cb == NULL) {
         cpe_log(CPE_ERR, "%s", "NULL callbacks");
         return APR_EINVAL;
@@ -698,7 +1057,8 @@ cpe_receiver(cpe_network_ctx *nctx, apr_pollfd_t *pfd, int iobufsize,
 
     iobuf = nctx->nc_iobuf;
     if (iobuf == NULL) {
-        CHECK(cpe_iobuf_create(&iobuf, iobufsize, pool));
+        /* Enough for the header, replaced once the msg size is known. */
+        CHECK(cpe_iobuf_get(&iobuf, fixed_len));
         nctx->nc_iobuf = iobuf;
     }
 
@@ -715,11 +1075,7 @@ cpe_receiver(cpe_network_ctx *nctx, apr_pollfd_t *pfd, int iobufsize,
                 cpe_log(CPE_ERR, "%s", "cpe_recv() failed in first-pass");
             }
             cpe_iobuf_destroy(&iobuf, nctx);
-            cpe_event_remove(pfd->client_data);
-            pfd->client_data = NULL;
-            cpe_socket_close(pfd->desc.s);
-            cpe_resource_destroy_users(pfd->desc.s);
-            pfd->desc.s = NULL;
+            cpe_socket_drop(pfd);
             return rv;
         }
         if (iobuf->buf_len < fixed_len) {
@@ -734,13 +1090,30 @@ cpe_receiver(cpe_network_ctx *nctx, apr_pollfd_t *pfd, int iobufsize,
                 "error in obtaining msg size, dropping connection");
 
             cpe_iobuf_destroy(&iobuf, nctx);
-            cpe_event_remove(pfd->client_data);
-            pfd->client_data = NULL;
-            cpe_socket_close(pfd->desc.s);
-            cpe_resource_destroy_users(pfd->desc.s);
-            pfd->desc.s = NULL;
+            cpe_socket_drop(pfd);
             return rv;
         }
+        if (nctx->nc_msg_size > iobufsize) {
+            cpe_log(CPE_ERR, "msg size %d bigger than %d, dropping connection",
+                nctx->nc_msg_size, iobufsize);
+
+            cpe_iobuf_destroy(&iobuf, nctx);
+            cpe_socket_drop(pfd);
+            return APR_EGENERAL;
+        }
+        if (nctx->nc_msg_size > iobuf->buf_capacity) {
+            cpe_io_buf *iobuf2;
+
+            /* Move the header to an iobuf of the right size class. */
+            CHECK(cpe_iobuf_get(&iobuf2, nctx->nc_msg_size));
+            memcpy(iobuf2->buf, iobuf->buf, iobuf->buf_len);
+            iobuf2->buf_len = iobuf->buf_len;
+            iobuf2->buf_offset = iobuf->buf_offset;
+            iobuf2->total = iobuf->total;
+            cpe_iobuf_destroy(&iobuf, nctx);
+            iobuf = iobuf2;
+            nctx->nc_iobuf = iobuf;
+        }
         /* we are ready for the second-pass */
     }
 
@@ -759,11 +1132,7 @@ cpe_receiver(cpe_network_ctx *nctx, apr_pollfd_t *pfd, int iobufsize,
                 "not enough data to call consumer", iobuf);
 
                 cpe_iobuf_destroy(&iobuf, nctx);
-                cpe_event_remove(pfd->client_data);
-                pfd->client_data = NULL;
-                cpe_socket_close(pfd->desc.s);
-                cpe_resource_destroy_users(pfd->desc.s);
-                pfd->desc.s = NULL;
+                cpe_socket_drop(pfd);
                 return rv;
             } else {
                 cpe_log(CPE_ERR, "iobuf %p cpe_recv() failed in second-pass but"
@@ -778,10 +1147,230 @@ cpe_receiver(cpe_network_ctx *nctx, apr_pollfd_t *pfd, int iobufsize,
         }
     }
     cpe_log(CPE_DEB, "invoking callback %p on iobuf %p", msg_handler_cb, iobuf);
+    /* From now on the iobuf belongs to the consumer. */
+    nctx->nc_iobuf = NULL;
     return msg_handler_cb(iobuf, nctx);
 }
 
 
+/* Ratio between the ring of cpe_receiver_stream() and the max msg size. */
+#define CPE_RING_MSGS 4
+
+
+/** Drop the connection of a stream receiver: close the socket, with its
+ *  event and ring, and call the callbacks of its users (see
+ *  cpe_resource_register_callback()). For a socket that hung up or failed
+ *  with nothing left to read, which cpe_receiver_stream() never sees.
+ *  An event registered as a user of the socket is destroyed, and \p pfd
+ *  with it.
+ */
+void
+cpe_receiver_stream_drop(cpe_network_ctx *nctx, apr_pollfd_t *pfd)
+{
+    if (nctx->nc_ring != NULL) {
+        cpe_iobuf_destroy(&nctx->nc_ring, NULL);
+    }
+    cpe_socket_drop(pfd);
+}
+
+
+/* Read once, as much as the socket has and the ring can take. In the ring,
+ * buf_offset is the start of the data and buf_len its length; the free
+ * space can wrap around the end, hence the readv().
+ */
+static apr_status_t
+cpe_ring_fill(apr_socket_t *sock, cpe_io_buf *ring, apr_size_t *howmany)
+{
+    struct iovec   iov[2];
+    apr_os_sock_t  fd;
+    apr_status_t   rv;
+    ssize_t        n;
+    int            tail, room;
+
+    *howmany = 0;
+    CHECK(apr_os_sock_get(&fd, sock));
+    tail = (ring->buf_offset + ring->buf_len) % ring->buf_capacity;
+    room = ring->buf_capacity - ring->buf_len;
+    assert(room > 0);
+    iov[0].iov_base = &ring->buf[tail];
+    iov[0].iov_len = cpe_min(room, ring->buf_capacity - tail);
+    iov[1].iov_base = &ring->buf[0];
+    iov[1].iov_len = room - iov[0].iov_len;
+    do {
+        n = readv(fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return APR_FROM_OS_ERROR(errno);
+    }
+    if (n == 0) {
+        return APR_EOF;
+    }
+    ring->buf_len += n;
+    ring->total += n;
+    *howmany = n;
+    cpe_log(CPE_DEB, "received %d bytes in ring %p (socket %p)", (int) n,
+        ring, sock);
+    return APR_SUCCESS;
+}
+
+
+/* Point *data to the first len bytes of the ring. They are copied to
+ * *scratch only if they wrap around the end of the ring.
+ */
+static apr_status_t
+cpe_ring_peek(cpe_io_buf *ring, int len, cpe_io_buf **scratch, char **data)
+{
+    apr_status_t rv;
+    int          first;
+
+    first = ring->buf_capacity - ring->buf_offset;
+    if (len <= first) {
+        *data = &ring->buf[ring->buf_offset];
+        return APR_SUCCESS;
+    }
+    if (*scratch != NULL && (*scratch)->buf_capacity < len) {
+        cpe_iobuf_destroy(scratch, NULL);
+    }
+    if (*scratch == NULL) {
+        CHECK(cpe_iobuf_get(scratch, len));
+    }
+    memcpy((*scratch)->buf, &ring->buf[ring->buf_offset], first);
+    memcpy(&(*scratch)->buf[first], &ring->buf[0], len - first);
+    *data = (*scratch)->buf;
+    return APR_SUCCESS;
+}
+
+
+/** Streaming variant of cpe_receiver(): one read per call, any number of
+ *  messages.
+ *
+ * Read as much as the socket has into a per-connection ring, then pass
+ * every complete message in it to \p msg_handler_cb, in order. A partial
+ * message at the end stays in the ring, where the next read completes it.
+ * An error from \p msg_handler_cb is about that message only: the
+ * following ones are still handled, and the first error is returned. To
+ * stop, the handler drops the connection.
+ *
+ * @param maxmsgsize      Max message size; a bigger one drops the
+ *                        connection.
+ * @param fixed_len       Specify the minimum header size containg enough
+ *                        information for \p get_msg_size_cb.
+ * @param get_msg_size_cb Determine the size of the full msg by looking at the
+ *                        header.
+ * @param msg_handler_cb  Message consumer.
+ *
+ * @remark Unlike with cpe_receiver(), the iobuf is only lent to the
+ * consumer for the duration of the call: it points into the ring (or, for a
+ * message wrapping around the end of the ring, into a scratch copy).
+ * cpe_iobuf_destroy() on it is allowed and does nothing; to keep the
+ * message, copy it.
+ */
+apr_status_t
+cpe_receiver_stream(cpe_network_ctx *nctx, apr_pollfd_t *pfd, int maxmsgsize,
+    int fixed_len, cpe_get_msg_size_t get_msg_size_cb,
+    cpe_handle_msg_t msg_handler_cb)
+{
+    cpe_io_buf   *ring, *scratch = NULL;
+    cpe_io_buf    msg;
+    apr_size_t    howmany;
+    apr_status_t  rv, rv2, rv_handler = APR_SUCCESS;
+    int           msg_size, count = 0;
+
+    cpe_log(CPE_DEB, "%s", "enter");
+    if (get_msg_size_cb == NULL || msg_handler_cb == NULL) {
+        cpe_log(CPE_ERR, "%s", "NULL callbacks");
+        return APR_EINVAL;
+    }
+    if (fixed_len <= 0 || maxmsgsize < fixed_len) {
+        cpe_log(CPE_ERR, "invalid sizes (fixed_len %d, maxmsgsize %d)",
+            fixed_len, maxmsgsize);
+        return APR_EINVAL;
+    }
+
+    ring = nctx->nc_ring;
+    if (ring == NULL) {
+        CHECK(cpe_iobuf_get(&ring, CPE_RING_MSGS * maxmsgsize));
+        nctx->nc_ring = ring;
+    }
+
+    rv = cpe_ring_fill(pfd->desc.s, ring, &howmany);
+    nctx->nc_total_received += howmany;
+    if (APR_STATUS_IS_EAGAIN(rv)) {
+        return APR_SUCCESS;
+    }
+    if (rv != APR_SUCCESS) {
+        if (APR_STATUS_IS_EOF(rv)) {
+            cpe_log(CPE_ERR, "%s", "remote end closed connection");
+        } else {
+            cpe_log(CPE_ERR, "read failed: %s", cpe_errmsg(rv));
+        }
+        cpe_receiver_stream_drop(nctx, pfd);
+        return rv;
+    }
+
+    memset(&msg, 0, sizeof msg);
+    msg.buf_class = CPE_IOBUF_BORROWED;
+    while (ring->buf_len >= fixed_len) {
+        msg.buf_len = msg.buf_capacity = fixed_len;
+        if ((rv = cpe_ring_peek(ring, fixed_len, &scratch, &msg.buf)) !=
+            APR_SUCCESS ||
+            (rv = get_msg_size_cb(&msg, &msg_size)) != APR_SUCCESS)
+        {
+            cpe_log(CPE_ERR, "%s",
+                "error in obtaining msg size, dropping connection");
+            cpe_receiver_stream_drop(nctx, pfd);
+            break;
+        }
+        if (msg_size < fixed_len || msg_size > maxmsgsize) {
+            cpe_log(CPE_ERR, "invalid msg size %d, dropping connection",
+                msg_size);
+            cpe_receiver_stream_drop(nctx, pfd);
+            rv = APR_EGENERAL;
+            break;
+        }
+        if (ring->buf_len < msg_size) {
+            cpe_log(CPE_DEB, "ring %p: partial msg, %d of %d bytes",
+                ring, ring->buf_len, msg_size);
+            break;
+        }
+        msg.buf_len = msg.buf_capacity = msg_size;
+        rv = cpe_ring_peek(ring, msg_size, &scratch, &msg.buf);
+        if (rv != APR_SUCCESS) {
+            break;
+        }
+        ring->buf_offset = (ring->buf_offset + msg_size) % ring->buf_capacity;
+        ring->buf_len -= msg_size;
+        count++;
+        cpe_log(CPE_DEB, "invoking callback %p on msg %d", msg_handler_cb,
+            count);
+        rv2 = msg_handler_cb(&msg, nctx);
+        if (rv2 != APR_SUCCESS) {
+            /* The socket is level-triggered: what is left in the ring would
+             * wait for the peer to send more. Go on with the next msg.
+             */
+            cpe_log(CPE_DEB, "msg %d: handler failed: %s", count,
+                cpe_errmsg(rv2));
+            if (rv_handler == APR_SUCCESS) {
+                rv_handler = rv2;
+            }
+        }
+        if (nctx->nc_ring == NULL) {
+            /* dropped by the handler: pfd may be gone with its event */
+            break;
+        }
+    }
+    if (nctx->nc_ring != NULL && ring->buf_len == 0) {
+        /* start again from the beginning, less wrapping */
+        ring->buf_offset = 0;
+    }
+    if (scratch != NULL) {
+        cpe_iobuf_destroy(&scratch, NULL);
+    }
+    cpe_log(CPE_DEB, "%d msgs from %d bytes", count, (int) howmany);
+    return rv != APR_SUCCESS ? rv : rv_handler;
+}
+
+
 apr_socket_t *
 cpe_queue_get_socket(cpe_queue_t *head)
 {
@@ -791,10 +1380,22 @@ cpe_queue_get_socket(cpe_queue_t *head)
     return head->cq_pfd->desc.s;
 }
 
+/* Pool cleanup of a queue: drop the references to the buffers not sent. */
+static apr_status_t
+cpe_queue_cleanup(void *data)
+{
+    if (g_cpe_loop != NULL) {
+        cpe_queue_flush(data);
+    }
+    return APR_SUCCESS;
+}
+
 /** Create a CPE queue (resource associated to a socket).
  * @param event Resource user that will be destroyed when the resource is
  *              destroyed.
  * @param pfd   The socket associated is the resource we keep track of.
+ * @param pool  The queue lives as long as it; the buffers still in queue
+ *              when it is destroyed are dropped, see cpe_queue_flush().
  */
 apr_status_t
 cpe_queue_init(cpe_queue_t **head, apr_pollfd_t *pfd, apr_pool_t *pool,
@@ -805,6 +1406,8 @@ cpe_queue_init(cpe_queue_t **head, apr_pollfd_t *pfd, apr_pool_t *pool,
     cpe_log(CPE_DEB, "%s", "enter");
     CHECK_NULL(*head, apr_pcalloc(pool, sizeof(cpe_queue_t)));
     (*head)->cq_pfd = pfd;
+    apr_pool_cleanup_register(pool, *head, cpe_queue_cleanup,
+        apr_pool_cleanup_null);
     /* If check fails we leak */
     CHECK(cpe_resource_register_user(pfd->desc.s, event));
     cpe_log(CPE_DEB, "initialized queue %p", *head);
@@ -840,20 +1443,152 @@ cpe_iobuf_create(cpe_io_buf **iobuf, int bufsize, apr_pool_t *parent_pool)
 }
 
 
+/** Take an iobuf of at least \p bufsize bytes from the recycled ones.
+ *
+ * The iobuf and its buffer are a single allocation, in the smallest size
+ * class that fits (CPE_IOBUF_MIN_SIZE, times 4 for each class); a bigger
+ * iobuf is allocated on each call. The buffer content is not zeroed.
+ * Give it back with cpe_iobuf_destroy().
+ */
+apr_status_t
+cpe_iobuf_get(cpe_io_buf **iobuf, int bufsize)
+{
+    cpe_iobuf_cache *ic = &g_cpe_loop->lp_iobufs;
+    cpe_io_buf      *b;
+    int              k, size;
+
+    size = CPE_IOBUF_MIN_SIZE;
+    for (k = 0; k < CPE_IOBUF_NCLASSES && size < bufsize; k++) {
+        size *= 4;
+    }
+    if (k == CPE_IOBUF_NCLASSES) {
+        size = bufsize;
+    }
+    if (k < CPE_IOBUF_NCLASSES && ic->ic_free[k] != NULL) {
+        b = ic->ic_free[k];
+        ic->ic_free[k] = b->next;
+        ic->ic_nfree[k]--;
+        ic->ic_stats.is_free--;
+        ic->ic_stats.is_hits++;
+    } else {
+        b = malloc(sizeof *b + size);
+        if (b == NULL) {
+            cpe_log(CPE_ERR, "%s", "out of memory");
+            return APR_ENOMEM;
+        }
+        ic->ic_stats.is_misses++;
+    }
+    ic->ic_stats.is_in_use++;
+    memset(b, 0, sizeof *b);
+    b->buf = (char *) (b + 1);
+    b->buf_capacity = size;
+    b->buf_class = k;
+    *iobuf = b;
+    return APR_SUCCESS;
+}
+
+
+/** Counters of the iobufs of cpe_iobuf_get(), for the event loop of the
+ * calling thread.
+ */
+void
+cpe_iobuf_stats_get(cpe_iobuf_stats *stats)
+{
+    *stats = g_cpe_loop->lp_iobufs.ic_stats;
+}
+
+
+/** Counters of the sockets accepted by the event loop of the calling
+ * thread, see cpe_socket_after_accept().
+ */
+void
+cpe_accept_stats_get(cpe_accept_stats *stats)
+{
+    *stats = g_cpe_loop->lp_accepted.ac_stats;
+}
+
+
 /**
+ * Give back an iobuf, from cpe_iobuf_create() or cpe_iobuf_get().
  * Since apr_pool_destroy() is void, it should always succeed.
  */
 void
 cpe_iobuf_destroy(cpe_io_buf **iobuf, cpe_network_ctx *nctx)
 {
-    assert((*iobuf)->pool != NULL);
-    cpe_log(CPE_DEB, "destroying iobuf %p, pool %p", *iobuf, (*iobuf)->pool);
-    apr_pool_destroy((*iobuf)->pool);
-    *iobuf = NULL;
-    if (nctx != NULL) {
+    cpe_iobuf_cache *ic;
+    cpe_io_buf      *b = *iobuf;
+
+    if (b->buf_class == CPE_IOBUF_BORROWED) {
+        /* lent by cpe_receiver_stream(), not ours */
+        *iobuf = NULL;
+        return;
+    }
+    assert(! b->inqueue);
+    if (nctx != NULL && nctx->nc_iobuf == b) {
         /* very important for cpe_receiver() */
         nctx->nc_iobuf = NULL;
     }
+    *iobuf = NULL;
+    if (b->pool != NULL) {
+        cpe_log(CPE_DEB, "destroying iobuf %p, pool %p", b, b->pool);
+        apr_pool_destroy(b->pool);
+        return;
+    }
+    cpe_log(CPE_DEB, "recycling iobuf %p, class %d", b, b->buf_class);
+    ic = &g_cpe_loop->lp_iobufs;
+    ic->ic_stats.is_in_use--;
+    if (b->buf_class < CPE_IOBUF_NCLASSES &&
+        ic->ic_nfree[b->buf_class] < CPE_IOBUF_FREE_MAX)
+    {
+        b->next = ic->ic_free[b->buf_class];
+        ic->ic_free[b->buf_class] = b;
+        ic->ic_nfree[b->buf_class]++;
+        ic->ic_stats.is_free++;
+    } else {
+        free(b);
+    }
+}
+
+
+/**
+ * Give up the caller's reference to an iobuf that may still be in send
+ * queues: it is destroyed now if it is in none, otherwise by cpe_sender()
+ * once the last queue holding it has sent it.
+ */
+void
+cpe_iobuf_release(cpe_io_buf **iobuf, cpe_network_ctx *nctx)
+{
+    if ((*iobuf)->inqueue) {
+        (*iobuf)->destroy = 1;
+        *iobuf = NULL;
+        return;
+    }
+    cpe_iobuf_destroy(iobuf, nctx);
+}
+
+
+/*
+ * CPE internal usage only: release the free iobufs of a loop, and the
+ * queue entries.
+ */
+void
+cpe_iobuf_cache_destroy(cpe_iobuf_cache *ic)
+{
+    cpe_io_buf *b;
+    int         k;
+
+    for (k = 0; k < CPE_IOBUF_NCLASSES; k++) {
+        while ((b = ic->ic_free[k]) != NULL) {
+            ic->ic_free[k] = b->next;
+            free(b);
+        }
+        ic->ic_nfree[k] = 0;
+    }
+    ic->ic_stats.is_free = 0;
+    if (ic->ic_entry_slab != NULL) {
+        cpe_slab_destroy(ic->ic_entry_slab);
+        ic->ic_entry_slab = NULL;
+    }
 }
 
 
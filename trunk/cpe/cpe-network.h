@@ -46,28 +46,42 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <apr_network_io.h>
 #include "cpe.h"
 
-/** Max number of peers per listening socket.
- *  @todo perform some scaling tests, I have no idea of how this performs.
+/** A reasonable max number of peers per listening socket, see
+ *  cpe_socket_after_accept(). Not a hard limit: bench-cpe-accept runs with
+ *  100k connections. With epoll the pollset grows as needed; otherwise it
+ *  must be sized for them, see cpe_system_init().
  */
-#define CPE_MAX_PEERS 1000
+#define CPE_MAX_PEERS 100000
 
 /** Main structure used for I/O. */
 typedef struct cpe_io_buf_ cpe_io_buf;
 struct cpe_io_buf_ {
-    cpe_io_buf *next;
-    int         inqueue;
+    cpe_io_buf *next;       /* free list of cpe_iobuf_get() */
+    int         inqueue;    /* number of send queues holding this buf */
     int         total;
     int         destroy; /* should cpe_sender destroy this buf once sent? */
-    apr_pool_t *pool;
+    apr_pool_t *pool;     /* NULL if from cpe_iobuf_get() */
+    int         buf_class; /* size class, if from cpe_iobuf_get() */
     char       *buf;
     int         buf_offset;
     int         buf_len;      /* actual length */
     int         buf_capacity;
 };
 
+/** Send queue entry: a reference to a buffer, with its own offset, so that
+ *  the same buffer can be on several queues at once. See
+ *  cpe_send_enqueue_shared().
+ */
+typedef struct cpe_queue_entry_ cpe_queue_entry;
+struct cpe_queue_entry_ {
+    cpe_queue_entry *qe_next;
+    cpe_io_buf      *qe_iobuf;
+    int              qe_offset;
+};
+
 struct cpe_queue_head_ {
-    cpe_io_buf   *cq_next;
-    cpe_io_buf   *cq_tail;
+    cpe_queue_entry *cq_next;
+    cpe_queue_entry *cq_tail;
     int           cq_nelems;
     apr_pollfd_t *cq_pfd;
     int           cq_total_sent;
@@ -75,16 +89,42 @@ struct cpe_queue_head_ {
 };
 typedef struct cpe_queue_head_ cpe_queue_t;
 
-/** Callback context.
- * @todo Transform the iobufs in pointers to iobufs!
+/** Size classes of the recycled iobufs, see cpe_iobuf_get(). */
+#define CPE_IOBUF_NCLASSES 5
+#define CPE_IOBUF_MIN_SIZE 256  /* each class is 4 times the previous one */
+/** Max number of free iobufs kept per size class. */
+#define CPE_IOBUF_FREE_MAX 64
+/** buf_class of an iobuf lent by cpe_receiver_stream(), not to be kept. */
+#define CPE_IOBUF_BORROWED (-1)
+
+/** Counters of the recycled iobufs. */
+struct cpe_iobuf_stats {
+    apr_uint32_t is_hits;       /* served from a free list */
+    apr_uint32_t is_misses;     /* had to be allocated */
+    apr_uint32_t is_in_use;
+    apr_uint32_t is_free;       /* kept in the free lists */
+};
+typedef struct cpe_iobuf_stats cpe_iobuf_stats;
+
+/** Counters of the accepted sockets, see cpe_accept_stats_get(). */
+struct cpe_accept_stats {
+    apr_uint32_t as_accepted;   /* connections taken by accept() */
+    apr_uint32_t as_rejected;   /* closed at once: max peers, filter */
+    apr_uint32_t as_live;       /* not closed yet */
+    apr_uint32_t as_free;       /* closed, kept for reuse */
+    apr_uint32_t as_sockets;    /* apr_socket_t allocated, live or free */
+    apr_uint32_t as_max_batch;  /* most accepted for one readiness */
+};
+typedef struct cpe_accept_stats cpe_accept_stats;
+
+/** Callback context. One per connection: keep it small.
  */
 struct cpe_network_ctx {
     int          nc_count;
     int          nc_state;
     int          nc_msg_size;   /* set by cpe_get_msg_size_t */
-    cpe_io_buf   nc_send;       /* transform or remove! */
-    cpe_io_buf   nc_recv;       /* transform or remove! */
     cpe_io_buf  *nc_iobuf;      /* used by cpe_receiver() */
+    cpe_io_buf  *nc_ring;       /* used by cpe_receiver_stream() */
     int          nc_total_received;
     cpe_queue_t *nc_sendQ;
     apr_pool_t  *nc_pool;
@@ -125,12 +165,22 @@ cpe_recv(apr_socket_t *sock, cpe_io_buf *recvbuf, apr_size_t *howmany);
 apr_status_t
 cpe_send_enqueue(cpe_queue_t *head, cpe_io_buf *sendbuf);
 apr_status_t
+cpe_send_enqueue_shared(cpe_queue_t *head, cpe_io_buf *sendbuf);
+void
+cpe_queue_flush(cpe_queue_t *head);
+apr_status_t
 cpe_sender(cpe_network_ctx *nctx);
 apr_status_t
 cpe_receiver(cpe_network_ctx *ctx, apr_pollfd_t *pfd, int iobufsize,
     apr_pool_t *pool, int fixed_len, cpe_get_msg_size_t get_msg_size_cb,
     cpe_handle_msg_t chunk_handler_cb);
 apr_status_t
+cpe_receiver_stream(cpe_network_ctx *nctx, apr_pollfd_t *pfd, int maxmsgsize,
+    int fixed_len, cpe_get_msg_size_t get_msg_size_cb,
+    cpe_handle_msg_t msg_handler_cb);
+void
+cpe_receiver_stream_drop(cpe_network_ctx *nctx, apr_pollfd_t *pfd);
+apr_status_t
 cpe_socket_close(apr_socket_t *sock);
 apr_status_t
 cpe_queue_init(cpe_queue_t **head, apr_pollfd_t *pfd, apr_pool_t *pool,
@@ -143,6 +193,14 @@ apr_status_t
 cpe_iobuf_create(cpe_io_buf **iobuf, int bufsize, apr_pool_t *parent_pool);
 void
 cpe_iobuf_destroy(cpe_io_buf **iobuf, cpe_network_ctx *nctx);
+void
+cpe_iobuf_release(cpe_io_buf **iobuf, cpe_network_ctx *nctx);
+apr_status_t
+cpe_iobuf_get(cpe_io_buf **iobuf, int bufsize);
+void
+cpe_iobuf_stats_get(cpe_iobuf_stats *stats);
+void
+cpe_accept_stats_get(cpe_accept_stats *stats);
 
 
 /* @} */
@@ -40,7 +40,36 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef CPE_PRIVATE_INCLUDED
 #define CPE_PRIVATE_INCLUDED
 
+#include <time.h>
+#include <apr_hash.h>
+
 #include "cpe.h"
+#include "cpe-network.h"
+
+/*
+ * On Linux, poll with epoll directly (cpe-epoll.c) instead of the APR
+ * pollset. Define CPE_NO_EPOLL to force the portable APR pollset.
+ */
+#if defined(__linux__) && ! defined(CPE_NO_EPOLL)
+#define CPE_HAVE_EPOLL 1
+#endif
+
+/*
+ * The wakeup descriptor of cpe_post() is an eventfd on Linux, a pipe
+ * elsewhere. Define CPE_NO_EVENTFD to force the pipe.
+ */
+#if defined(__linux__) && ! defined(CPE_NO_EVENTFD)
+#define CPE_HAVE_EVENTFD 1
+#endif
+
+/*
+ * The time of a loop comes from CLOCK_MONOTONIC, immune to the steps of
+ * the wall clock, where available. Define CPE_NO_MONOTONIC to use
+ * apr_time_now().
+ */
+#if defined(CLOCK_MONOTONIC) && ! defined(CPE_NO_MONOTONIC)
+#define CPE_HAVE_MONOTONIC 1
+#endif
 
 /*! Event data structure.
  */
@@ -49,18 +78,137 @@ struct cpe_event {
     int            ev_flags;
     apr_pollfd_t   ev_pollfd;
     apr_time_t     ev_timeout_us;
+    apr_uint32_t   ev_missed;       /* deadlines missed, if periodic */
     cpe_callback_t ev_callback;
     void          *ev_ctx;
     apr_uint32_t   ev_magic;
+    apr_uint32_t   ev_generation;   /* value of lp_generation at creation */
+    cpe_loop_t    *ev_loop;         /* the loop that created it */
+};
+
+/* Per-thread variable, see cpe_loops_run(). */
+#define CPE_THREAD_LOCAL __thread
+
+#ifdef CPE_HAVE_EPOLL
+struct epoll_event;
+
+/* An epoll set, with the timerfd used for the poll timeout. */
+struct cpe_epoll_set {
+    int                 ep_fd;
+    int                 ep_timerfd;
+    int                 ep_size;
+    struct epoll_event *ep_events;
+    apr_pollfd_t       *ep_ready;
 };
+typedef struct cpe_epoll_set cpe_epoll_set;
+#endif
 
-extern apr_pool_t           *g_cpe_pool;
+/* Free iobufs for cpe_iobuf_get(), by size class, and the send queue
+ * entries (created on the first enqueue).
+ */
+struct cpe_iobuf_cache {
+    cpe_io_buf      *ic_free[CPE_IOBUF_NCLASSES];
+    int              ic_nfree[CPE_IOBUF_NCLASSES];
+    cpe_iobuf_stats  ic_stats;
+    cpe_slab        *ic_entry_slab;
+};
+typedef struct cpe_iobuf_cache cpe_iobuf_cache;
+
+/* Sockets accepted by cpe_socket_after_accept(): the live ones by socket,
+ * for cpe_socket_close(), and the closed ones, reused by the next accepts.
+ */
+struct cpe_accept_cache {
+    apr_hash_t           *ac_live;
+    struct cpe_accepted  *ac_free;
+    cpe_accept_stats      ac_stats;
+};
+typedef struct cpe_accept_cache cpe_accept_cache;
+
+/* A function posted to a loop, see cpe_post(). */
+struct cpe_post_node {
+    struct cpe_post_node *pn_next;
+    cpe_post_cb_t         pn_fn;
+    void                 *pn_ctx;
+};
+
+/*! Event loop: the state of an event system, owned by one thread.
+ */
+struct cpe_loop_t {
+    apr_pool_t      *lp_pool;
+    int              lp_id;         /* see cpe_loop_id() */
+    apr_time_t       lp_start_time_us;
+#ifdef CPE_HAVE_EPOLL
+    cpe_epoll_set    lp_epoll;
+#else
+    apr_pollset_t   *lp_pollset;
+#endif
+    /* treat this as read-only, see cpe_pollset_add(), cpe_pollset_remove() */
+    int              lp_pollset_nelems;
+    cpe_priorityQ   *lp_eventQ;
+    int              lp_main_loop_done;
+    /* The persistent event whose callback is running, if any. See
+     * cpe_event_commit_changes().
+     */
+    cpe_event       *lp_dispatching;
+    cpe_slab        *lp_event_slab;
+    /* Incremented before each poll. An event created after the poll has the
+     * current generation: it cannot be among the ready ones.
+     */
+    apr_uint32_t     lp_generation;
+    /* max timers dispatched per loop iteration, 0 for no limit */
+    apr_uint32_t     lp_timer_budget;
+    struct cpe_resource_table *lp_res;
+    cpe_iobuf_cache  lp_iobufs;
+    cpe_accept_cache lp_accepted;
+    /* Posted functions, newest first. Pushed by any thread, taken all at
+     * once by the loop, see cpe_post().
+     */
+    struct cpe_post_node *volatile lp_posts;
+    int              lp_post_fd[2];     /* read, write; the same eventfd */
+    cpe_event       *lp_post_event;     /* lp_post_fd[0] in the pollset */
+    cpe_post_stats   lp_post_stats;
+    /* NULL unless cpe_stats_enable(): one test per use when off */
+    cpe_loop_stats  *lp_stats;
+    cpe_loop_stats  *lp_stats_mem;      /* kept while off, for snapshots */
+    /* Time source, NULL for the monotonic clock, see cpe_clock_set(). */
+    cpe_clock_fn_t   lp_clock;
+    void            *lp_clock_ctx;
+#ifdef CPE_HAVE_MONOTONIC
+    clockid_t        lp_clock_id;       /* see cpe_clock_set_coarse() */
+    apr_time_t       lp_clock_offset;   /* to apr_time_now() at creation */
+#endif
+    /* Time of the loop, read once before and once after each poll, see
+     * cpe_now(). Outside cpe_main_loop(), each use reads the clock.
+     */
+    apr_time_t       lp_now;
+    int              lp_in_main_loop;
+    /* the simulated clock, see cpe_clock_set_virtual() */
+    apr_time_t       lp_virtual_now;
+    apr_time_t       lp_virtual_step;
+};
+
+/* The loop of the calling thread. */
+extern CPE_THREAD_LOCAL cpe_loop_t *g_cpe_loop;
 
 /* from cpe-network.c */
 apr_status_t cpe_network_init(apr_pool_t *pool);
+void         cpe_iobuf_cache_destroy(cpe_iobuf_cache *cache);
+
+#ifdef CPE_HAVE_EPOLL
+/* from cpe-epoll.c */
+apr_status_t cpe_epoll_init(cpe_epoll_set *ep, apr_pool_t *pool,
+                apr_uint32_t size);
+apr_status_t cpe_epoll_add(cpe_epoll_set *ep, apr_pollfd_t *pfd);
+apr_status_t cpe_epoll_remove(cpe_epoll_set *ep, apr_pollfd_t *pfd);
+apr_status_t cpe_epoll_update(cpe_epoll_set *ep, apr_pollfd_t *pfd,
+                apr_int16_t reqevents);
+apr_status_t cpe_epoll_poll(cpe_epoll_set *ep, apr_time_t timeout_us,
+                apr_int32_t *num_pfd, const apr_pollfd_t **ret_pfd);
+#endif
 
 /* from cpe-resources.c */
-apr_status_t cpe_resource_init(void);
+apr_status_t cpe_resource_init(cpe_loop_t *loop);
+void         cpe_resource_table_destroy(cpe_loop_t *loop);
 
 
 #endif /* CPE_PRIVATE_INCLUDED */
@@ -35,6 +35,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "apr_hash.h"
@@ -46,17 +47,30 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 typedef struct cpe_resource_node {
     struct cpe_resource_node *rn_next;
-    cpe_event                *rn_event;
-    /* used only in the head node; one pool per list */
-    apr_pool_t               *rn_pool;
+    cpe_event                *rn_event;     /* or rn_fn(rn_ctx) */
+    cpe_resource_cb_t         rn_fn;
+    void                     *rn_ctx;
+    /* The hash key, the address of the socket. apr_hash keeps a pointer to
+     * the key of the first node inserted, which stays in the list.
+     */
+    apr_socket_t             *rn_sock;
 } cpe_resource_node_t;
 
-/* singleton */
+/* one per event loop, see g_cpe_loop->lp_res */
 struct cpe_resource_table {
     apr_hash_t *hash_table;
-    apr_pool_t *pool;       /* to create subpools */
-} g_cpe_resource_blob;
-struct cpe_resource_table *g_cpe_res = &g_cpe_resource_blob;
+    apr_pool_t *pool;
+    cpe_slab   *slab;       /* the nodes, given back on destroy_users */
+};
+
+/* Slots per chunk of the node slab. */
+#define CPE_RESOURCE_CHUNK 256
+
+
+static cpe_resource_node_t *
+cpe_resource_node_alloc(void);
+static apr_status_t
+cpe_resource_insert(apr_socket_t *sock, cpe_resource_node_t *new_res);
 
 
 /*****************************************************************************
@@ -75,29 +89,45 @@ struct cpe_resource_table *g_cpe_res = &g_cpe_resource_blob;
 apr_status_t
 cpe_resource_register_user(apr_socket_t *sock, cpe_event *event)
 {
-    cpe_resource_node_t *new_res, *old_res;
+    cpe_resource_node_t *new_res;
 
     cpe_log(CPE_DEB, "%s", "enter");
     if (sock == NULL || event == NULL) {
         cpe_log(CPE_DEB, "invalid parms (sock %p, event %p)", sock, event);
         return APR_EINVAL;
     }
-
-    new_res = apr_pcalloc(g_cpe_res->pool, sizeof(cpe_resource_node_t));
+    new_res = cpe_resource_node_alloc();
+    if (new_res == NULL) {
+        return APR_ENOMEM;
+    }
     new_res->rn_event = event;
+    return cpe_resource_insert(sock, new_res);
+}
 
-    old_res = apr_hash_get(g_cpe_res->hash_table, sock, sizeof sock);
-    if (old_res != NULL) {
-        /* key "sock" already present; insert new_res in front */
-        cpe_log(CPE_DEB, "sock %p found, head %p", sock, old_res);
-        new_res->rn_next = old_res;
-    } else {
-        cpe_log(CPE_DEB, "sock %p not found", sock);
-    }
-    cpe_log(CPE_DEB, "inserting sock %p with head %p", sock, new_res);
-    apr_hash_set(g_cpe_res->hash_table, sock, sizeof sock, new_res);
 
-    return APR_SUCCESS;
+/** Have fn(ctx) called when socket \p sock is destroyed, like the events
+ *  registered with cpe_resource_register_user(). It is called from
+ *  cpe_resource_destroy_users(), that is possibly from the middle of a
+ *  network callback of \p sock: memory that the callback may still use
+ *  must not be freed there; cpe_post() can defer it.
+ */
+apr_status_t
+cpe_resource_register_callback(apr_socket_t *sock, cpe_resource_cb_t fn,
+    void *ctx)
+{
+    cpe_resource_node_t *new_res;
+
+    if (sock == NULL || fn == NULL) {
+        cpe_log(CPE_DEB, "invalid parms (sock %p, fn %p)", sock, fn);
+        return APR_EINVAL;
+    }
+    new_res = cpe_resource_node_alloc();
+    if (new_res == NULL) {
+        return APR_ENOMEM;
+    }
+    new_res->rn_fn = fn;
+    new_res->rn_ctx = ctx;
+    return cpe_resource_insert(sock, new_res);
 }
 
 
@@ -106,28 +136,32 @@ cpe_resource_register_user(apr_socket_t *sock, cpe_event *event)
 apr_status_t
 cpe_resource_destroy_users(apr_socket_t *sock)
 {
-    cpe_resource_node_t *head, *p;
+    struct cpe_resource_table *res = g_cpe_loop->lp_res;
+    cpe_resource_node_t       *head, *p;
 
     if (sock == NULL) {
         cpe_log(CPE_DEB, "invalid parms (sock %p)", sock);
         return APR_EINVAL;
     }
-    head = apr_hash_get(g_cpe_res->hash_table, sock, sizeof sock);
+    head = apr_hash_get(res->hash_table, &sock, sizeof sock);
     if (head == NULL) {
         cpe_log(CPE_DEB, "socket %p not present in the resource list", sock);
         return APR_SUCCESS;
     }
-    /* XXX FIXME Here we are leaking node structs
-     * rewrite to use a pool per list; this requires changing in 
-     * cpe_resource_register_user the inserting of the new node; I must 
-     * insert it at the end, so that the head cointains the pool to destroy
-     */
-    for (p = head; p != NULL; p = p->rn_next) {
-        cpe_log(CPE_DEB, "socket %p: destroying event %p", sock, p->rn_event);
-        cpe_event_destroy(&p->rn_event);
+    /* Delete the entry first: its key is in one of the nodes. */
+    apr_hash_set(res->hash_table, &sock, sizeof sock, NULL);
+    while ((p = head) != NULL) {
+        head = p->rn_next;
+        if (p->rn_fn != NULL) {
+            cpe_log(CPE_DEB, "socket %p: calling %p", sock, p->rn_fn);
+            p->rn_fn(p->rn_ctx);
+        } else {
+            cpe_log(CPE_DEB, "socket %p: destroying event %p", sock,
+                p->rn_event);
+            cpe_event_destroy(&p->rn_event);
+        }
+        cpe_slab_free(res->slab, p);
     }
-    /* delete entry */
-    apr_hash_set(g_cpe_res->hash_table, sock, sizeof sock, NULL);
 
     return APR_SUCCESS;
 }
@@ -138,15 +172,70 @@ cpe_resource_destroy_users(apr_socket_t *sock)
  *****************************************************************************/
 
 
-/* Initialize the CPE Resource subsystem. Private use by the CPE framework.
+/* A zeroed node. */
+static cpe_resource_node_t *
+cpe_resource_node_alloc(void)
+{
+    cpe_resource_node_t *node;
+
+    node = cpe_slab_alloc(g_cpe_loop->lp_res->slab);
+    if (node != NULL) {
+        memset(node, 0, sizeof *node);
+    }
+    return node;
+}
+
+
+/* Add a node to the list of socket \p sock. */
+static apr_status_t
+cpe_resource_insert(apr_socket_t *sock, cpe_resource_node_t *new_res)
+{
+    struct cpe_resource_table *res = g_cpe_loop->lp_res;
+    cpe_resource_node_t       *old_res;
+
+    new_res->rn_sock = sock;
+    old_res = apr_hash_get(res->hash_table, &sock, sizeof sock);
+    if (old_res != NULL) {
+        /* key "sock" already present; insert new_res in front */
+        cpe_log(CPE_DEB, "sock %p found, head %p", sock, old_res);
+        new_res->rn_next = old_res;
+    } else {
+        cpe_log(CPE_DEB, "sock %p not found", sock);
+    }
+    cpe_log(CPE_DEB, "inserting sock %p with head %p", sock, new_res);
+    /* An existing entry keeps its key, in the node inserted first. */
+    apr_hash_set(res->hash_table, &new_res->rn_sock, sizeof sock, new_res);
+
+    return APR_SUCCESS;
+}
+
+
+/* Initialize the CPE Resource subsystem of an event loop. Private use by
+ * the CPE framework.
  */
 apr_status_t
-cpe_resource_init(void)
+cpe_resource_init(cpe_loop_t *loop)
 {
-    apr_status_t rv;
-
-    CHECK(apr_pool_create(&g_cpe_res->pool, NULL));
-    apr_pool_tag(g_cpe_res->pool, "cpe_resource");
-    CHECK_NULL(g_cpe_res->hash_table, apr_hash_make(g_cpe_res->pool));
+    struct cpe_resource_table *res;
+    apr_status_t               rv;
+
+    CHECK_NULL(res, apr_pcalloc(loop->lp_pool, sizeof *res));
+    CHECK(apr_pool_create(&res->pool, loop->lp_pool));
+    apr_pool_tag(res->pool, "cpe_resource");
+    CHECK_NULL(res->hash_table, apr_hash_make(res->pool));
+    CHECK_NULL(res->slab, cpe_slab_create(sizeof(cpe_resource_node_t),
+        CPE_RESOURCE_CHUNK));
+    loop->lp_res = res;
     return APR_SUCCESS;
 }
+
+
+/* Release the nodes of the resource table of a loop. Private use by the CPE
+ * framework.
+ */
+void
+cpe_resource_table_destroy(cpe_loop_t *loop)
+{
+    cpe_slab_destroy(loop->lp_res->slab);
+    loop->lp_res->slab = NULL;
+}
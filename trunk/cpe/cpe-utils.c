@@ -35,16 +35,17 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "cpe.h"
+#include "cpe-private.h"
 #include "apr_strings.h"
 
 /** Like apr_strerror(), but doesn't require to provide a buffer. This also
- *  means that this function is non reentrant.
+ *  means that this function is non reentrant (the buffer is per thread).
  */
 const char *
 cpe_errmsg(apr_status_t retvalue)
 {
-    static char buf[80];
-    static char errmsg[60];
+    static CPE_THREAD_LOCAL char buf[80];
+    static CPE_THREAD_LOCAL char errmsg[60];
 
     if (retvalue == APR_SUCCESS) {
         return "success";
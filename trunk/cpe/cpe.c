@@ -39,40 +39,57 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "cpe-private.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef CPE_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+#include <apr_portable.h>
+#include <apr_thread_proc.h>
 
 #define CPE_EV_MAGIC         0xcafefade
+#define CPE_EV_MAGIC_FREED   0xdeadfade
 
-/**
- * @todo The best data structure to keep track of timers seems to be
- *       a priority queue. For the beginning, we focus on making the
- *       library work, so we use a non optimal ordered list implementation
- *       insert: O(N)
- *       find the maximum: O(1)
- *       Later, we will replace with a heap implementation
- *       insert: O(log2 N)
- *       find the maximum: O(1)
- *       or RB tree implementation
- *       insert: O(log2 N)
- *       find the maximum: O(log2 N)
+/*
+ * Timers are kept in a priority queue (a binary heap, see cpe-algorithms.c)
+ *   insert: O(log2 N)
+ *   remove: O(log2 N)
+ *   find the maximum: O(1)
+ * or, if selected with cpe_system_init2(), in a timing wheel
+ *   insert: O(1)
+ *   remove: O(1)
+ *   find the maximum: O(1) amortized
+ * which trades exact ordering for a resolution of one tick.
+ * Every event, timer or fdesc, is in the queue; fdesc events use the queue
+ * for their timeout.
+ *
+ * Events are allocated from a slab (see cpe_slab_create()), which never
+ * returns memory to the system: a destroyed event can still be looked at,
+ * its magic tells that it is dead.
  */
 
-/* For APR internal use only. */
-apr_pool_t            *g_cpe_pool;
-
+/* Process wide, set once by cpe_system_init2(). */
 static int             g_cpe_initialized;
-static apr_time_t      g_cpe_start_time_us;
-static apr_pollset_t  *g_cpe_pollset;
-/* treat this as read-only, see cpe_pollset_add(), cpe_pollset_remove() */
-static int             g_cpe_pollset_nelems;
-static cpe_priorityQ  *g_cpe_eventQ;
-static int             g_cpe_main_loop_done;
+static apr_uint32_t    g_cpe_num_events;
+static cpe_timerq_type g_cpe_timerq;
+static apr_time_t      g_cpe_tick_us;
+
+/* The loop of the calling thread: the default one, created by
+ * cpe_system_init2(), or one of cpe_loops_run().
+ */
+CPE_THREAD_LOCAL cpe_loop_t *g_cpe_loop;
 
 
 static void
 cpe_assert_system_initialized(void)
 {
     assert(g_cpe_initialized != 0);
+    assert(g_cpe_loop != NULL);
 }
 
 
@@ -81,31 +98,558 @@ cpe_assert_event_ok(cpe_event *event)
 {
     assert(event != NULL);
     assert(event->ev_magic == CPE_EV_MAGIC);
+    assert(event->ev_loop == g_cpe_loop);
+}
+
+
+/*
+ * cpe_post(): any thread pushes a node on lp_posts, a lock-free stack
+ * (compare and swap on its head). The loop takes the whole stack at once
+ * (exchange with NULL), so a node is never popped alone and there is no ABA
+ * problem, then reverses it to run the functions in posting order.
+ * Only the push that finds the stack empty writes to the wakeup descriptor:
+ * a burst of posts made while the loop is busy costs a single wakeup.
+ */
+
+static apr_status_t
+cpe_post_cleanup(void *data)
+{
+    cpe_loop_t           *loop = data;
+    struct cpe_post_node *n;
+    int                   dropped = 0;
+
+    while ((n = loop->lp_posts) != NULL) {
+        loop->lp_posts = n->pn_next;
+        free(n);
+        dropped++;
+    }
+    if (dropped > 0) {
+        cpe_log(CPE_WARN, "loop %d, %d posted functions dropped",
+            loop->lp_id, dropped);
+    }
+    close(loop->lp_post_fd[0]);
+#ifndef CPE_HAVE_EVENTFD
+    close(loop->lp_post_fd[1]);
+#endif
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Create the wakeup descriptor and put it in the pollset, as an internal
+ * event which is not in the timer queue: it does not keep the main loop
+ * running and it is not counted by cpe_events_in_system().
+ */
+static apr_status_t
+cpe_post_init(cpe_loop_t *loop)
+{
+    apr_file_t   *file = NULL;
+    cpe_event    *e;
+    apr_status_t  rv;
+
+#ifdef CPE_HAVE_EVENTFD
+    loop->lp_post_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->lp_post_fd[0] < 0) {
+        rv = APR_FROM_OS_ERROR(errno);
+        cpe_log(CPE_ERR, "eventfd: %s", cpe_errmsg(rv));
+        return rv;
+    }
+    loop->lp_post_fd[1] = loop->lp_post_fd[0];
+#else
+    if (pipe(loop->lp_post_fd) < 0) {
+        rv = APR_FROM_OS_ERROR(errno);
+        cpe_log(CPE_ERR, "pipe: %s", cpe_errmsg(rv));
+        return rv;
+    }
+    fcntl(loop->lp_post_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(loop->lp_post_fd[1], F_SETFL, O_NONBLOCK);
+#endif
+    apr_pool_cleanup_register(loop->lp_pool, loop, cpe_post_cleanup,
+        apr_pool_cleanup_null);
+    CHECK(apr_os_pipe_put(&file, &loop->lp_post_fd[0], loop->lp_pool));
+
+    /* From the loop pool, not from the slab: it lives as long as the loop. */
+    CHECK_NULL(e, apr_pcalloc(loop->lp_pool, sizeof *e));
+    e->ev_pollfd.desc_type   = APR_POLL_FILE;
+    e->ev_pollfd.reqevents   = APR_POLLIN;
+    e->ev_pollfd.desc.f      = file;
+    e->ev_pollfd.client_data = e;
+    e->ev_magic              = CPE_EV_MAGIC;
+    e->ev_loop               = loop;
+#ifdef CPE_HAVE_EPOLL
+    CHECK(cpe_epoll_add(&loop->lp_epoll, &e->ev_pollfd));
+#else
+    CHECK(apr_pollset_add(loop->lp_pollset, &e->ev_pollfd));
+#endif
+    loop->lp_pollset_nelems++;
+    loop->lp_post_event = e;
+    return APR_SUCCESS;
+}
+
+
+/* Called by the main loop when the wakeup descriptor is readable. */
+static void
+cpe_post_run(cpe_loop_t *loop)
+{
+    struct cpe_post_node *list, *fifo, *n;
+    char                  buf[64];
+    apr_uint32_t          batch;
+    apr_status_t          rv;
+
+    /* Drain before taking the stack: a post that finds it empty from now
+     * on leaves the descriptor readable for the next poll.
+     */
+    while (read(loop->lp_post_fd[0], buf, sizeof buf) > 0) {
+    }
+    list = __sync_lock_test_and_set(&loop->lp_posts, NULL);
+    for (fifo = NULL; list != NULL; list = n) {
+        n = list->pn_next;
+        list->pn_next = fifo;
+        fifo = list;
+    }
+    for (batch = 0; fifo != NULL; batch++) {
+        n = fifo;
+        fifo = n->pn_next;
+        rv = n->pn_fn(n->pn_ctx);
+        if (rv != APR_SUCCESS) {
+            cpe_log(CPE_WARN, "posted function %p: %s", n->pn_fn,
+                cpe_errmsg(rv));
+        }
+        free(n);
+    }
+    loop->lp_post_stats.ps_run += batch;
+    if (batch > loop->lp_post_stats.ps_max_batch) {
+        loop->lp_post_stats.ps_max_batch = batch;
+    }
+    cpe_log(CPE_DEB, "%u posted functions", batch);
+}
+
+
+/*!
+ * Have fn(ctx) run by the main loop of \p loop, as soon as possible.
+ *
+ * This is the only CPE function that can be called from any thread: a
+ * thread without a loop, another loop, or \p loop itself. It does not
+ * block. The functions posted to a loop run in posting order (for each
+ * posting thread), from its main loop, like a callback. They do not keep
+ * the main loop running: the ones still pending when the loop ends are
+ * dropped. \p loop must stay valid while posting: for the loops of
+ * cpe_loops_run(), until that function returns.
+ *
+ * @param loop  See cpe_loop_current().
+ * @param fn    Function to run. An error it returns is only logged.
+ * @param ctx   Argument to fn.
+ */
+apr_status_t
+cpe_post(cpe_loop_t *loop, cpe_post_cb_t fn, void *ctx)
+{
+    struct cpe_post_node *n, *head;
+
+    if (loop == NULL || fn == NULL) {
+        cpe_log(CPE_ERR, "invalid parms (loop %p, fn %p)", loop, fn);
+        return APR_EINVAL;
+    }
+    n = malloc(sizeof *n);
+    if (n == NULL) {
+        return APR_ENOMEM;
+    }
+    n->pn_fn = fn;
+    n->pn_ctx = ctx;
+    do {
+        head = loop->lp_posts;
+        n->pn_next = head;
+    } while (! __sync_bool_compare_and_swap(&loop->lp_posts, head, n));
+    __sync_fetch_and_add(&loop->lp_post_stats.ps_posted, 1);
+
+    if (head == NULL) {
+        /* The loop has taken all the previous posts: wake it up. */
+#ifdef CPE_HAVE_EVENTFD
+        apr_uint64_t one = 1;
+#else
+        char         one = 1;
+#endif
+        __sync_fetch_and_add(&loop->lp_post_stats.ps_wakeups, 1);
+        if (write(loop->lp_post_fd[1], &one, sizeof one) < 0 &&
+            errno != EAGAIN)
+        {
+            /* EAGAIN: the pipe is full, hence readable */
+            cpe_log(CPE_ERR, "loop %d, wakeup: %s", loop->lp_id,
+                cpe_errmsg(APR_FROM_OS_ERROR(errno)));
+        }
+    }
+    return APR_SUCCESS;
+}
+
+
+/*! Counters of the functions posted to \p loop. Exact from the thread of
+ * the loop; from another thread, they can be slightly behind.
+ */
+void
+cpe_post_stats_get(cpe_loop_t *loop, cpe_post_stats *stats)
+{
+    *stats = loop->lp_post_stats;
+}
+
+
+/*! Turn on or off the instrumentation of the loop of the calling thread,
+ * see cpe_loop_stats. Turning it on starts from zero. When off, it costs
+ * a test of a pointer here and there.
+ */
+apr_status_t
+cpe_stats_enable(int enable)
+{
+    cpe_loop_t *loop = g_cpe_loop;
+
+    cpe_assert_system_initialized();
+    if (! enable) {
+        loop->lp_stats = NULL;
+        return APR_SUCCESS;
+    }
+    if (loop->lp_stats != NULL) {
+        return APR_SUCCESS;
+    }
+    if (loop->lp_stats_mem == NULL) {
+        loop->lp_stats_mem = apr_palloc(loop->lp_pool,
+            sizeof *loop->lp_stats_mem);
+        if (loop->lp_stats_mem == NULL) {
+            return APR_ENOMEM;
+        }
+    }
+    memset(loop->lp_stats_mem, 0, sizeof *loop->lp_stats_mem);
+    loop->lp_stats = loop->lp_stats_mem;
+    return APR_SUCCESS;
+}
+
+
+/*! Copy of the instrumentation of \p loop, as left by the last
+ * cpe_stats_enable(0) if off. APR_EINVAL if it was never on. Like
+ * cpe_post_stats_get(), exact only from the thread of the loop.
+ */
+apr_status_t
+cpe_stats_snapshot(cpe_loop_t *loop, cpe_loop_stats *stats)
+{
+    if (loop == NULL || loop->lp_stats_mem == NULL) {
+        return APR_EINVAL;
+    }
+    *stats = *loop->lp_stats_mem;
+    return APR_SUCCESS;
 }
 
 
+/* The simulated clock of a loop, see cpe_clock_set_virtual(). */
+static apr_time_t
+cpe_clock_virtual(void *ctx)
+{
+    return ((cpe_loop_t *) ctx)->lp_virtual_now;
+}
+
+
+/* The monotonic clock, shifted to apr_time_now() at loop creation, so
+ * that the two can still be compared (as long as the wall clock does not
+ * step).
+ */
+static apr_time_t
+cpe_clock_monotonic(cpe_loop_t *loop)
+{
+#ifdef CPE_HAVE_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(loop->lp_clock_id, &ts);
+    return loop->lp_clock_offset + (apr_time_t) ts.tv_sec * APR_USEC_PER_SEC +
+        ts.tv_nsec / 1000;
+#else
+    loop = NULL;
+    return apr_time_now();
+#endif
+}
+
+
+/* Time of the loop, read from its time source. */
+static apr_time_t
+cpe_loop_time(cpe_loop_t *loop)
+{
+    if (cpe_likely(loop->lp_clock == NULL)) {
+        return cpe_clock_monotonic(loop);
+    }
+    return loop->lp_clock(loop->lp_clock_ctx);
+}
+
+
+/* Read the time source into the cached time of the loop. */
+static apr_time_t
+cpe_loop_update_time(cpe_loop_t *loop)
+{
+    loop->lp_now = cpe_loop_time(loop);
+    return loop->lp_now;
+}
+
+
+/* Time of the loop: cached in cpe_main_loop(), read otherwise. */
+static apr_time_t
+cpe_loop_now(cpe_loop_t *loop)
+{
+    if (cpe_likely(loop->lp_in_main_loop)) {
+        return loop->lp_now;
+    }
+    return cpe_loop_update_time(loop);
+}
+
+
+/*! Use \p fn instead of the monotonic clock as the time source of the
+ * loop of the calling thread, for its timers and its stats; NULL goes back
+ * to the monotonic clock. The loop still waits in the pollset for real.
+ * The time must never go back: change it before adding events, or with a
+ * source that starts at cpe_clock_now().
+ */
+apr_status_t
+cpe_clock_set(cpe_clock_fn_t fn, void *ctx)
+{
+    cpe_assert_system_initialized();
+    g_cpe_loop->lp_clock = fn;
+    g_cpe_loop->lp_clock_ctx = ctx;
+    return APR_SUCCESS;
+}
+
+
+/*! Give the loop of the calling thread a simulated clock, starting at
+ * cpe_clock_now(). The loop no longer waits: it polls the descriptors
+ * without blocking and, if none is ready, jumps to the next deadline.
+ * Timers then fire exactly on time, as fast as the callbacks run, which
+ * makes timer tests quick and reproducible, and a long schedule can be
+ * replayed in a moment.
+ *
+ * @param step_us Time added by each poll that finds a descriptor ready.
+ *                With 0, the time stands still as long as there is I/O,
+ *                and a descriptor always ready (e.g. POLLOUT on an idle
+ *                socket) stops it for good.
+ * @remark Only the I/O done by the loop itself is seen, anything else
+ *         (another thread, the network) happens "instantly" or never.
+ */
+apr_status_t
+cpe_clock_set_virtual(apr_time_t step_us)
+{
+    cpe_loop_t *loop = g_cpe_loop;
+
+    cpe_assert_system_initialized();
+    if (step_us < 0) {
+        return APR_EINVAL;
+    }
+    loop->lp_virtual_now = cpe_loop_time(loop);
+    loop->lp_virtual_step = step_us;
+    loop->lp_clock = cpe_clock_virtual;
+    loop->lp_clock_ctx = loop;
+    return APR_SUCCESS;
+}
+
+
+/*! Move the simulated clock forward, for example to pretend that a
+ * callback took some time. As after a real sleep, cpe_now() keeps the
+ * cached time of the iteration until cpe_clock_now() or the next one.
+ * APR_EINVAL without cpe_clock_set_virtual().
+ */
+apr_status_t
+cpe_clock_advance(apr_time_t delta_us)
+{
+    cpe_assert_system_initialized();
+    if (g_cpe_loop->lp_clock != cpe_clock_virtual || delta_us < 0) {
+        return APR_EINVAL;
+    }
+    g_cpe_loop->lp_virtual_now += delta_us;
+    return APR_SUCCESS;
+}
+
+
+/*! Read the time source of the loop of the calling thread, and update
+ * with it the time returned by cpe_now(). For a callback that runs long
+ * enough for cpe_now() to be too old as a base for its timers.
+ */
+apr_time_t
+cpe_clock_now(void)
+{
+    cpe_assert_system_initialized();
+    return cpe_loop_update_time(g_cpe_loop);
+}
+
+
+/*! Use CLOCK_MONOTONIC_COARSE for the loop of the calling thread: a few
+ * ms of resolution, but cheaper to read. APR_ENOTIMPL where there is no
+ * such clock.
+ */
+apr_status_t
+cpe_clock_set_coarse(int coarse)
+{
+    cpe_assert_system_initialized();
+#if defined(CPE_HAVE_MONOTONIC) && defined(CLOCK_MONOTONIC_COARSE)
+    g_cpe_loop->lp_clock_id = coarse ? CLOCK_MONOTONIC_COARSE :
+        CLOCK_MONOTONIC;
+    return APR_SUCCESS;
+#else
+    return coarse ? APR_ENOTIMPL : APR_SUCCESS;
+#endif
+}
+
+
+/*! Time of the loop of the calling thread, in us, as used for its timers:
+ * to be used instead of apr_time_now() by the callbacks, for example for
+ * the expiration of cpe_event_add2(). In cpe_main_loop(), it is read from
+ * the clock once before and once after each poll: all the callbacks of an
+ * iteration see the same time, and the timers they add or re-arm start
+ * from it, persistent events included. The time is monotonic, and close to apr_time_now() unless the wall clock
+ * stepped.
+ */
+apr_time_t
+cpe_now(void)
+{
+    cpe_assert_system_initialized();
+    return cpe_loop_now(g_cpe_loop);
+}
+
+
+/* Run time of a callback, by function. The table is short and the same
+ * few callbacks come back: a linear scan.
+ */
+static void
+cpe_stats_callback(cpe_loop_stats *st, cpe_callback_t callback,
+    apr_time_t run_us)
+{
+    u_int k;
+
+    st->ls_dispatched++;
+    for (k = 0; k < st->ls_ncallbacks; k++) {
+        if (st->ls_callbacks[k].cs_callback == callback) {
+            cpe_histogram_record(&st->ls_callbacks[k].cs_run_us, run_us);
+            return;
+        }
+    }
+    if (k == CPE_STATS_MAX_CALLBACKS) {
+        cpe_histogram_record(&st->ls_other_run_us, run_us);
+        return;
+    }
+    st->ls_callbacks[k].cs_callback = callback;
+    cpe_histogram_record(&st->ls_callbacks[k].cs_run_us, run_us);
+    st->ls_ncallbacks++;
+}
+
+
+/*
+ * Create an event loop, with all the state of an event system: pollset,
+ * timer queue, event slab, resource table, iobuf cache and the wakeup
+ * descriptor of cpe_post().
+ */
+static apr_status_t
+cpe_loop_create(cpe_loop_t **loop, int id, apr_uint32_t num_events,
+    cpe_timerq_type timerq, apr_time_t tick_us)
+{
+    apr_pool_t   *pool;
+    cpe_loop_t   *lp;
+    apr_status_t  rv;
+
+    CHECK(apr_pool_create(&pool, NULL));
+    CHECK_NULL(lp, apr_pcalloc(pool, sizeof *lp));
+    lp->lp_pool = pool;
+    lp->lp_id = id;
+    lp->lp_timer_budget = CPE_TIMER_BUDGET_DEFAULT;
+#ifdef CPE_HAVE_MONOTONIC
+    lp->lp_clock_id = CLOCK_MONOTONIC;
+    lp->lp_clock_offset = apr_time_now() - cpe_clock_monotonic(lp);
+#endif
+    /* one more descriptor, for the wakeup of cpe_post() */
+#ifdef CPE_HAVE_EPOLL
+    CHECK(cpe_epoll_init(&lp->lp_epoll, pool, num_events + 1));
+#else
+    CHECK(apr_pollset_create(&lp->lp_pollset, num_events + 1, pool, 0));
+#endif
+    switch (timerq) {
+    case CPE_TIMERQ_HEAP:
+        CHECK_NULL(lp->lp_eventQ, cpe_priorityQ_create());
+        break;
+    case CPE_TIMERQ_WHEEL:
+        CHECK_NULL(lp->lp_eventQ,
+            cpe_priorityQ_create_wheel(tick_us, cpe_loop_time(lp)));
+        cpe_log(CPE_DEB, "timing wheel, tick %lld us", tick_us);
+        break;
+    default:
+        cpe_log(CPE_ERR, "unknown timer queue type %d", timerq);
+        return APR_EINVAL;
+    }
+    if (cpe_priorityQ_reserve(lp->lp_eventQ, num_events) != 1) {
+        cpe_log(CPE_ERR, "%s", "out of memory");
+        return APR_ENOMEM;
+    }
+    CHECK_NULL(lp->lp_event_slab,
+        cpe_slab_create(sizeof(cpe_event), num_events));
+    CHECK(cpe_resource_init(lp));
+    CHECK(cpe_post_init(lp));
+
+    lp->lp_start_time_us = cpe_loop_update_time(lp);
+    cpe_log(CPE_DEB, "loop %d, start time: %lld ms", id,
+        apr_time_as_msec(lp->lp_start_time_us));
+    *loop = lp;
+    return APR_SUCCESS;
+}
+
+
+#if APR_HAS_THREADS
+/*
+ * Release a loop created by cpe_loop_create(). Its events must have been
+ * destroyed already, see cpe_system_queue_destroy().
+ */
+static void
+cpe_loop_destroy(cpe_loop_t *loop)
+{
+    cpe_iobuf_cache_destroy(&loop->lp_iobufs);
+    cpe_resource_table_destroy(loop);
+    cpe_slab_destroy(loop->lp_event_slab);
+    cpe_priorityQ_queue_destroy(loop->lp_eventQ);
+    free(loop->lp_eventQ->pq_wheel);
+    free(loop->lp_eventQ);
+    apr_pool_destroy(loop->lp_pool);
+}
+#endif
+
+
 /*! Initialize the event system.
  * @param num_events  Number of events supported.
  * @see CPE_NUM_EVENTS_DEFAULT.
- * @todo we can make the library reentrant by passing all the resources to
- *       cpe_system_init (pool)    
  */
 apr_status_t
 cpe_system_init(apr_uint32_t num_events)
 {
-    apr_status_t rv;
+    return cpe_system_init2(num_events, CPE_TIMERQ_HEAP, 0);
+}
+
 
+/*! Initialize the event system, choosing how timers are kept. The calling
+ * thread gets the default event loop; the loops of cpe_loops_run() are
+ * created with the same parameters.
+ * @param num_events  Number of events supported (per loop).
+ * @param timerq      CPE_TIMERQ_HEAP or CPE_TIMERQ_WHEEL.
+ * @param tick_us     Resolution of the timing wheel, 0 for
+ *                    CPE_TIMERQ_TICK_DEFAULT. Ignored by the heap.
+ */
+apr_status_t
+cpe_system_init2(apr_uint32_t num_events, cpe_timerq_type timerq,
+    apr_time_t tick_us)
+{
+    apr_pool_t   *pool;
+    apr_status_t  rv;
+
+    if (tick_us < 0) {
+        cpe_log(CPE_ERR, "negative tick %lld us", tick_us);
+        return APR_EINVAL;
+    }
+    if (tick_us == 0) {
+        tick_us = CPE_TIMERQ_TICK_DEFAULT;
+    }
     CHECK(rv = apr_initialize());
     atexit(apr_terminate);
-    CHECK(rv = apr_pool_create(&g_cpe_pool, NULL));
-    CHECK(rv = apr_pollset_create(&g_cpe_pollset, num_events, g_cpe_pool, 0));
-    CHECK_NULL(g_cpe_eventQ, cpe_priorityQ_create());
-    CHECK(rv = cpe_network_init(g_cpe_pool));
-    CHECK(cpe_resource_init());
-
-    g_cpe_start_time_us = apr_time_now();
-    cpe_log(CPE_DEB, "start time: %lld ms",
-        apr_time_as_msec(g_cpe_start_time_us));
+    CHECK(rv = apr_pool_create(&pool, NULL));
+    CHECK(rv = cpe_network_init(pool));
+    CHECK(cpe_loop_create(&g_cpe_loop, -1, num_events, timerq, tick_us));
+
+    g_cpe_num_events = num_events;
+    g_cpe_timerq = timerq;
+    g_cpe_tick_us = tick_us;
     g_cpe_initialized = 1;
     return APR_SUCCESS;
 }
@@ -164,13 +708,8 @@ cpe_event_create(
         cpe_log(CPE_ERR, "%s", "invalid event type");
         return NULL;
     }
-    /*!
-     * \bug I don't use apr pool because I cannot release an apr_palloc.
-     *      maybe I am missing something on the usage of pools, don't know.
-     *      I could use a dedicated pool, created at cpe_init and destroyed
-     *      at exit from cpe_main_loop.
-     */
-    e = calloc(1, sizeof *e);
+    /* Not from an apr pool, because an apr_palloc cannot be released. */
+    e = cpe_slab_alloc(g_cpe_loop->lp_event_slab);
     if (e == NULL) {
         cpe_log(CPE_ERR, "%s", "out of memory");
         return NULL;
@@ -188,6 +727,8 @@ cpe_event_create(
     e->ev_callback           = callback;
     e->ev_ctx                = ctx;
     e->ev_magic              = CPE_EV_MAGIC;
+    e->ev_generation         = g_cpe_loop->lp_generation;
+    e->ev_loop               = g_cpe_loop;
 
     cpe_log(CPE_DEB, "created event %p", e);
 
@@ -250,21 +791,28 @@ cpe_event_timer_create(
 }
 
 
-/* keep g_cpe_pollset_nelems in sync */
+/* keep lp_pollset_nelems in sync */
 static apr_status_t
-cpe_pollset_add(apr_pollset_t *pollset, apr_pollfd_t *pfd)
+cpe_pollset_add(apr_pollfd_t *pfd)
 {
     apr_status_t rv;
 
-    rv = apr_pollset_add(pollset, pfd);
+#ifdef CPE_HAVE_EPOLL
+    rv = cpe_epoll_add(&g_cpe_loop->lp_epoll, pfd);
+#else
+    rv = apr_pollset_add(g_cpe_loop->lp_pollset, pfd);
+#endif
     if (rv == APR_SUCCESS) {
-        g_cpe_pollset_nelems++;
+        g_cpe_loop->lp_pollset_nelems++;
+        if (cpe_unlikely(g_cpe_loop->lp_stats != NULL)) {
+            g_cpe_loop->lp_stats->ls_pollset_adds++;
+        }
     }
     return rv;
 }
 
 
-/** keep g_cpe_pollset_nelems in sync
+/** keep lp_pollset_nelems in sync
  *
  * @todo Looking at APR code, it is evident that different pollset
  * implementations behave differently. For example, in the select-based
@@ -278,15 +826,22 @@ cpe_pollset_add(apr_pollset_t *pollset, apr_pollfd_t *pfd)
  * reqevents).
  */
 static apr_status_t
-cpe_pollset_remove(apr_pollset_t *pollset, apr_pollfd_t *pfd)
+cpe_pollset_remove(apr_pollfd_t *pfd)
 {
     apr_status_t rv;
 
-    rv = apr_pollset_remove(pollset, pfd);
+#ifdef CPE_HAVE_EPOLL
+    rv = cpe_epoll_remove(&g_cpe_loop->lp_epoll, pfd);
+#else
+    rv = apr_pollset_remove(g_cpe_loop->lp_pollset, pfd);
+#endif
     if (rv == APR_SUCCESS) {
-        g_cpe_pollset_nelems--;
+        g_cpe_loop->lp_pollset_nelems--;
+        if (cpe_unlikely(g_cpe_loop->lp_stats != NULL)) {
+            g_cpe_loop->lp_stats->ls_pollset_removes++;
+        }
     } else {
-        cpe_log(CPE_ERR, "socket %p, apr_pollset_remove: %s",
+        cpe_log(CPE_ERR, "socket %p, pollset remove: %s",
             pfd->desc.s, cpe_errmsg(rv));
     }
     return rv;
@@ -295,7 +850,8 @@ cpe_pollset_remove(apr_pollset_t *pollset, apr_pollfd_t *pfd)
 
 /*! XXX Performance problem with APR (as I understand it):
  * to update the reqevents, we have to remove and then re-add
- * the pollfd to the pollset, and removal is O(N).
+ * the pollfd to the pollset, and removal is O(N). The epoll backend
+ * updates in place with EPOLL_CTL_MOD.
  *
  * @param pfd       The pfd on which to perform the pollset update. Note that
  *                  pfd itself will have it's reqevents updated too.
@@ -308,7 +864,9 @@ apr_status_t
 cpe_pollset_update(apr_pollfd_t *pfd, apr_int16_t reqevents)
 {
     apr_status_t rv;
+#ifndef CPE_HAVE_EPOLL
     apr_pollfd_t old_pfd;
+#endif
 
     assert(pfd != NULL);
 
@@ -317,13 +875,27 @@ cpe_pollset_update(apr_pollfd_t *pfd, apr_int16_t reqevents)
     if (pfd->reqevents == reqevents) {
         return APR_SUCCESS;
     }
+    if (cpe_unlikely(g_cpe_loop->lp_stats != NULL)) {
+        g_cpe_loop->lp_stats->ls_pollset_updates++;
+    }
+#ifdef CPE_HAVE_EPOLL
+    rv = cpe_epoll_update(&g_cpe_loop->lp_epoll, pfd, reqevents);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_ERR, "socket %p, epoll update: %s",
+            pfd->desc.s, cpe_errmsg(rv));
+        return rv;
+    }
+    pfd->reqevents = reqevents;
+    return APR_SUCCESS;
+#else
     old_pfd = *pfd;
     pfd->reqevents = reqevents;
-    rv = cpe_pollset_remove(g_cpe_pollset, &old_pfd);
+    rv = cpe_pollset_remove(&old_pfd);
     if (rv != APR_SUCCESS) {
         return rv;
     }
-    return cpe_pollset_add(g_cpe_pollset, pfd);
+    return cpe_pollset_add(pfd);
+#endif
 }
 
 
@@ -353,15 +925,21 @@ cpe_event_add3(
         return APR_EGENERAL;
     }
 
-    /*! \todo check if the event is already in the queue, and fail
-     *        if yes. mmhhh, this can become quite expensive...
-     *        maybe just an hash table with the pointer address?
-     */
-
     /*
      * Remember that in the CPE priority queue, priority means expiration time.
      */
+    if (event == g_cpe_loop->lp_dispatching) {
+        /* Persistent event re-added by its own callback: it is still in
+         * the pollset, and the callback has done the re-arm itself.
+         */
+        g_cpe_loop->lp_dispatching = NULL;
+        pollset_add = 0;
+    }
     q = (cpe_priorityQ *) event;
+    if (q->pq_index != 0) {
+        cpe_log(CPE_ERR, "event %p already in queue", event);
+        return APR_EINVAL;
+    }
     if (expiration != 0) {
         /* Explicit expiration, use it. */
         q->pq_value = expiration;
@@ -369,7 +947,7 @@ cpe_event_add3(
             event, apr_time_as_msec(expiration));
     } else {
         /* Implicit expiration, use event timeout. */
-        time_now_us = apr_time_now();
+        time_now_us = cpe_loop_now(g_cpe_loop);
         if (event->ev_timeout_us == 0) { /* block indefinitely */
             /** @bug
              *  XXX HACK WARNING using cpe_PRIORITYQ_AT_THE_END is too big at
@@ -397,14 +975,18 @@ cpe_event_add3(
      * This needs to be changed if we go the way of having a dummy fdesc to be
      * able to keep also timer events in the pollset.
      */
+    if (cpe_priorityQ_insert(g_cpe_loop->lp_eventQ, q) != 1) {
+        cpe_log(CPE_ERR, "%s", "out of memory");
+        return APR_ENOMEM;
+    }
     if (pollset_add && cpe_event_is_fdesc(event)) {
-        rv = cpe_pollset_add(g_cpe_pollset, &event->ev_pollfd);
+        rv = cpe_pollset_add(&event->ev_pollfd);
         if (rv != APR_SUCCESS) {
             cpe_log(CPE_ERR, "pollset_add: %s", cpe_errmsg(rv));
+            cpe_priorityQ_remove(g_cpe_loop->lp_eventQ, q);
             return rv;
         }
     }
-    cpe_priorityQ_insert(g_cpe_eventQ, q);
 
     return APR_SUCCESS;
 }
@@ -459,11 +1041,124 @@ cpe_event_set_timeout(cpe_event *event, apr_time_t timeout_us)
 }
 
 
+/*! Change the context passed to the callback of an event. Useful from a
+ * one-shot callback of cpe_socket_after_accept(), to give each accepted
+ * socket its own context.
+ */
+apr_status_t
+cpe_event_set_context(cpe_event *event, void *ctx)
+{
+    cpe_assert_system_initialized();
+    cpe_assert_event_ok(event);
+
+    event->ev_ctx = ctx;
+    return APR_SUCCESS;
+}
+
+
+/*! Make an event persistent, or one-shot again.
+ *
+ * By default events are one-shot: before invoking the callback the main
+ * loop removes the event from the system, and the callback has to call
+ * cpe_event_add() to be invoked again. A persistent event instead stays in
+ * the pollset, and after the callback returns it is re-armed with its
+ * timeout; the callback opts out by calling cpe_event_remove() or
+ * cpe_event_destroy(). For compatibility, a callback that calls
+ * cpe_event_add() on its persistent event just re-arms it.
+ *
+ * Cannot be changed from the callback of the event itself.
+ */
+apr_status_t
+cpe_event_set_persistent(cpe_event *event, int persistent)
+{
+    cpe_assert_system_initialized();
+    cpe_assert_event_ok(event);
+
+    if (event == g_cpe_loop->lp_dispatching) {
+        cpe_log(CPE_ERR, "event %p is being dispatched", event);
+        return APR_EINVAL;
+    }
+    if (persistent) {
+        event->ev_flags |= CPE_EV_PERSIST;
+    } else {
+        event->ev_flags &= ~CPE_EV_PERSIST;
+    }
+    return APR_SUCCESS;
+}
+
+
+/*! Make a timer event periodic: it is persistent, and it is re-armed from
+ * its previous deadline (prev + timeout) instead of from the time of its
+ * dispatch (see cpe_now()), so that loop lag does not accumulate.
+ *
+ * The schedule starts from the expiration given by cpe_event_add() or
+ * cpe_event_add2(). When the loop falls behind by one or more periods,
+ * CPE_PERIODIC_SKIP jumps to the first deadline in the future, while
+ * CPE_PERIODIC_CATCHUP fires the missed deadlines one per loop iteration.
+ * Either way they are counted, see cpe_event_missed().
+ *
+ * CPE_PERIODIC_NONE makes the event a plain persistent one. Cannot be
+ * changed from the callback of the event itself.
+ */
+apr_status_t
+cpe_event_set_periodic(cpe_event *event, cpe_periodic_policy policy)
+{
+    cpe_assert_system_initialized();
+    cpe_assert_event_ok(event);
+
+    if (event == g_cpe_loop->lp_dispatching) {
+        cpe_log(CPE_ERR, "event %p is being dispatched", event);
+        return APR_EINVAL;
+    }
+    if (cpe_event_is_fdesc(event)) {
+        cpe_log(CPE_ERR, "event %p is not a timer", event);
+        return APR_EINVAL;
+    }
+    event->ev_flags &= ~(CPE_EV_PERIODIC | CPE_EV_CATCHUP);
+    switch (policy) {
+    case CPE_PERIODIC_NONE:
+        break;
+    case CPE_PERIODIC_CATCHUP:
+        event->ev_flags |= CPE_EV_CATCHUP;
+        /* fall through */
+    case CPE_PERIODIC_SKIP:
+        event->ev_flags |= CPE_EV_PERIODIC | CPE_EV_PERSIST;
+        break;
+    default:
+        cpe_log(CPE_ERR, "invalid periodic policy %d", policy);
+        return APR_EINVAL;
+    }
+    return APR_SUCCESS;
+}
+
+
+/** Number of deadlines of a periodic event that were missed (skipped, or
+ * fired when the next one was already due).
+ */
+apr_uint32_t
+cpe_event_missed(cpe_event *event)
+{
+    cpe_assert_event_ok(event);
+    return event->ev_missed;
+}
+
+
 int
 cpe_events_in_system(void)
 {
     cpe_assert_system_initialized();
-    return cpe_priorityQ_len(g_cpe_eventQ);
+    return cpe_priorityQ_len(g_cpe_loop->lp_eventQ);
+}
+
+
+/** Occupancy of the event allocator: events created and not yet destroyed,
+ * whether in the system or not.
+ */
+void
+cpe_event_slab_stats(cpe_slab_stats *stats)
+{
+    cpe_assert_system_initialized();
+    cpe_slab_stats_get(g_cpe_loop->lp_event_slab, stats);
 }
 
 
@@ -479,7 +1174,7 @@ cpe_system_queue_destroy(void)
      *        cpe_priorityQ_queue_destroy() with a callback to clean up the
      *        subclassed event
      */
-    while ( (q = cpe_priorityQ_find_max(g_cpe_eventQ)) != NULL) {
+    while ( (q = cpe_priorityQ_find_max(g_cpe_loop->lp_eventQ)) != NULL) {
         e = (cpe_event *) q;
         /* We assume that cpe_event_destroy() also removes from queue. */
         cpe_event_destroy(&e);
@@ -495,26 +1190,46 @@ cpe_system_queue_destroy(void)
  * select() can be used with empty fd_sets just as a timer.
  *
  * This forces us to test wether the pollset is empty or not
- * and take different actions.
+ * and take different actions. The epoll backend doesn't have this problem,
+ * its timerfd is always in the set.
  */
 static apr_status_t
 cpe_pollset_poll(apr_time_t timeout_us, apr_int32_t *num_pfd,
     const apr_pollfd_t **ret_pfd)
 {
-    apr_status_t rv;
-    apr_time_t   start, stop;
+    cpe_loop_t   *loop = g_cpe_loop;
+    apr_status_t  rv;
+    apr_time_t    start, stop, virtual_wait = 0;
 
     *num_pfd = 0;
     *ret_pfd = NULL;
     rv = APR_TIMEUP;
-    if (timeout_us == 0 && g_cpe_pollset_nelems == 0) {
+    if (timeout_us == 0 && loop->lp_pollset_nelems == 0) {
         cpe_log(CPE_DEB, "%s", "timeout 0 and pollset empty, skipping wait");
         return rv;
     }
-    start = apr_time_now();
+    if (cpe_unlikely(loop->lp_clock == cpe_clock_virtual)) {
+        /* only look, the time passes below */
+        virtual_wait = timeout_us;
+        timeout_us = 0;
+    }
+    start = loop->lp_now;
     cpe_log(CPE_DEB, "will_wait %lld ms, pollset_nelems %d",
-        apr_time_as_msec(timeout_us), g_cpe_pollset_nelems);
-    if (g_cpe_pollset_nelems == 0) {
+        apr_time_as_msec(timeout_us), loop->lp_pollset_nelems);
+#ifdef CPE_HAVE_EPOLL
+    {
+        int count = 0;
+        do {
+            rv = cpe_epoll_poll(&loop->lp_epoll, timeout_us, num_pfd,
+                ret_pfd);
+        } while (APR_STATUS_IS_EINTR(rv) && count++ < 5);
+        if (rv != APR_SUCCESS && ! APR_STATUS_IS_TIMEUP(rv)) {
+            cpe_log(CPE_ERR, "epoll_wait: %s", cpe_errmsg(rv));
+            return rv;
+        }
+    }
+#else
+    if (loop->lp_pollset_nelems == 0) {
         /* System contains only timer events. */
         if (timeout_us < 0) {
             cpe_log(CPE_ERR, "%s", "waiting forever on a timer event");
@@ -524,14 +1239,24 @@ cpe_pollset_poll(apr_time_t timeout_us, apr_int32_t *num_pfd,
     } else {
         int count = 0;
         do {
-            rv = apr_pollset_poll(g_cpe_pollset, timeout_us, num_pfd, ret_pfd);
+            rv = apr_pollset_poll(loop->lp_pollset, timeout_us, num_pfd,
+                ret_pfd);
         } while (APR_STATUS_IS_EINTR(rv) && count++ < 5);
         if (rv != APR_SUCCESS && ! APR_STATUS_IS_TIMEUP(rv)) {
             cpe_log(CPE_ERR, "apr_pollset_poll: %s", cpe_errmsg(rv));
             return rv;
         }
     }
-    stop = apr_time_now();
+#endif
+    if (cpe_unlikely(loop->lp_clock == cpe_clock_virtual)) {
+        loop->lp_virtual_now += *num_pfd > 0 ? loop->lp_virtual_step :
+            virtual_wait;
+    }
+    stop = cpe_loop_update_time(loop);
+    if (cpe_unlikely(loop->lp_stats != NULL)) {
+        loop->lp_stats->ls_polls++;
+        cpe_histogram_record(&loop->lp_stats->ls_poll_wait_us, stop - start);
+    }
     cpe_log(CPE_DEB, "waited %lld ms, time_now %lld, desc_ready %d, rv %d",
         apr_time_as_msec(stop - start), apr_time_as_msec(stop), *num_pfd, rv);
 
@@ -564,16 +1289,24 @@ cpe_event_destroy(cpe_event **event)
     cpe_assert_event_ok(*event);
 
     q = (cpe_priorityQ *) *event;
-    /* Remove from priority queue. This will stop the timer. */
-    if (cpe_priorityQ_remove(g_cpe_eventQ, q) != 1) {
-        /* This is not an errror only if the event has not been added
-         * to the system via cpe_event_add().
+    if (*event == g_cpe_loop->lp_dispatching) {
+        /* Persistent event destroyed by its own callback: it is not in the
+         * queue but, if fdesc, still in the pollset.
+         */
+        g_cpe_loop->lp_dispatching = NULL;
+        if (cpe_event_is_fdesc(*event)) {
+            rv = cpe_pollset_remove(&(*event)->ev_pollfd);
+        }
+    } else if (cpe_priorityQ_remove(g_cpe_loop->lp_eventQ, q) != 1) {
+        /* Never added, or removed already, e.g. by a dropped connection
+         * before the users of its socket are destroyed.
          */
-        cpe_log(CPE_WARN, "event %p not in priority queue", *event);
+        cpe_log(CPE_DEB, "event %p not in priority queue", *event);
     } else if (cpe_event_is_fdesc(*event)) {
-        rv = cpe_pollset_remove(g_cpe_pollset, &(*event)->ev_pollfd);
+        rv = cpe_pollset_remove(&(*event)->ev_pollfd);
     }
-    free(*event);
+    (*event)->ev_magic = CPE_EV_MAGIC_FREED;
+    cpe_slab_free(g_cpe_loop->lp_event_slab, *event);
     *event = NULL;
     return rv;
 }
@@ -590,14 +1323,22 @@ cpe_event_remove(cpe_event *event)
     cpe_assert_event_ok(event);
 
     cpe_log(CPE_DEB, "removing event %p", event);
+    if (event == g_cpe_loop->lp_dispatching) {
+        /* Persistent event opting out from its own callback. */
+        g_cpe_loop->lp_dispatching = NULL;
+        if (cpe_event_is_fdesc(event)) {
+            rv = cpe_pollset_remove(&event->ev_pollfd);
+        }
+        return rv;
+    }
     q = (cpe_priorityQ *) event;
     /* Remove from priority queue. This will stop the timer. */
-    if (cpe_priorityQ_remove(g_cpe_eventQ, q) != 1) {
+    if (cpe_priorityQ_remove(g_cpe_loop->lp_eventQ, q) != 1) {
         cpe_log(CPE_ERR, "event %p not in priority queue", event);
         return APR_EGENERAL;
     }
     if (cpe_event_is_fdesc(event)) {
-        rv = cpe_pollset_remove(g_cpe_pollset, &event->ev_pollfd);
+        rv = cpe_pollset_remove(&event->ev_pollfd);
         //rv = cpe_schedule_pollset_removal(event);
     }
     return rv;
@@ -609,7 +1350,7 @@ cpe_event_find_max(void)
 {
     cpe_priorityQ *q;
 
-    q = cpe_priorityQ_find_max(g_cpe_eventQ);
+    q = cpe_priorityQ_find_max(g_cpe_loop->lp_eventQ);
     return (cpe_event *) q;
 }
 
@@ -621,42 +1362,96 @@ cpe_event_remove_max(cpe_event **max)
     cpe_priorityQ *q;
     apr_status_t  rv = APR_SUCCESS;
 
-    q = cpe_priorityQ_remove_max(g_cpe_eventQ);
+    q = cpe_priorityQ_remove_max(g_cpe_loop->lp_eventQ);
     *max = (cpe_event *) q;
 
-    if (cpe_event_is_fdesc(*max)) {
-        rv = cpe_pollset_remove(g_cpe_pollset, &(*max)->ev_pollfd);
+    /* A persistent event stays in the pollset. */
+    if (cpe_event_is_fdesc(*max) && ! ((*max)->ev_flags & CPE_EV_PERSIST)) {
+        rv = cpe_pollset_remove(&(*max)->ev_pollfd);
         //rv = cpe_schedule_pollset_removal(event);
     }
     return rv;
 }
 
 
+/*
+ * Next deadline of a periodic event, from its previous one (still in
+ * pq_value after the removal from the queue).
+ */
+static apr_time_t
+cpe_event_next_deadline(cpe_event *e, apr_time_t time_now_us)
+{
+    apr_time_t next;
+    apr_int64_t missed;
+
+    next = ((cpe_priorityQ *) e)->pq_value + e->ev_timeout_us;
+    if (next > time_now_us) {
+        return next;
+    }
+    if (e->ev_flags & CPE_EV_CATCHUP) {
+        /* already due: fired late, in the next iteration */
+        e->ev_missed++;
+        return next;
+    }
+    missed = (time_now_us - next) / e->ev_timeout_us + 1;
+    e->ev_missed += missed;
+    cpe_log(CPE_DEB, "event %p, skipping %lld deadlines", e, missed);
+    return next + missed * e->ev_timeout_us;
+}
+
+
+/*
+ * Called after each callback. If the event just dispatched is persistent
+ * and its callback didn't remove, destroy or re-add it, put it back in the
+ * queue with a new expiration (from its previous deadline if periodic). It
+ * is still in the pollset.
+ */
 static apr_status_t
 cpe_event_commit_changes(void)
 {
-    // XXX WRITE ME!!!
-#if 0
-    if (e->ev_flags & CPE_EV_ONE_SHOT) {
-        cpe_event_destroy(&e);
-    } else {
-        /** @bug XXX
-         * this code doesn't take into consideration the case when, on
-         * return from cpe_poll without a timeout, one of the events that
-         * triggered (for I/O) is also _the_ event we removed from the
-         * queue. The code will re-add the event with the same expiration,
-         * effectively scheduling it one time too much.
-         */
-        if (APR_STATUS_IS_TIMEUP(rv)) {
-            /* next expiration */
-            cpe_event_add3(e, q->pq_value + e->ev_timeout_us, 0);
+    cpe_event  *e = g_cpe_loop->lp_dispatching;
+    apr_time_t  now;
+
+    if (e == NULL) {
+        return APR_SUCCESS;
+    }
+    g_cpe_loop->lp_dispatching = NULL;
+    now = cpe_loop_now(g_cpe_loop);
+    if (e->ev_flags & CPE_EV_PERIODIC) {
+        return cpe_event_add3(e, cpe_event_next_deadline(e, now), 0);
+    }
+    if (e->ev_timeout_us == 0) {
+        return cpe_event_add3(e, 0, 0);
+    }
+    return cpe_event_add3(e, now + e->ev_timeout_us, 0);
+}
+
+
+/* Invoke the callback of event e, timed if the stats are on. */
+static apr_status_t
+cpe_event_dispatch(cpe_event *e)
+{
+    cpe_loop_stats *st = g_cpe_loop->lp_stats;
+    cpe_callback_t  callback = e->ev_callback;
+    apr_time_t      start;
+
+    if (e->ev_flags & CPE_EV_PERSIST) {
+        g_cpe_loop->lp_dispatching = e;
+    }
+    if (callback != NULL) {
+        if (cpe_unlikely(st != NULL)) {
+            start = cpe_loop_time(g_cpe_loop);
+            callback(e->ev_ctx, &e->ev_pollfd, e);
+            /* the callback may have turned the stats off */
+            if (g_cpe_loop->lp_stats != NULL) {
+                cpe_stats_callback(st, callback,
+                    cpe_loop_time(g_cpe_loop) - start);
+            }
         } else {
-            /* same expiration */
-            cpe_event_add3(e, q->pq_value, 0);
+            callback(e->ev_ctx, &e->ev_pollfd, e);
         }
     }
-#endif
-    return APR_SUCCESS;
+    return cpe_event_commit_changes();
 }
 
 
@@ -665,7 +1460,74 @@ cpe_event_commit_changes(void)
 void
 cpe_main_loop_terminate(void)
 {
-    g_cpe_main_loop_done = 1;
+    g_cpe_loop->lp_main_loop_done = 1;
+}
+
+
+/** Set the max number of expired timers dispatched in one loop iteration.
+ * The remaining ones are dispatched in the next iteration, after polling
+ * the sockets, so that a timer storm cannot starve I/O.
+ *
+ * @param max_timers  0 means no limit.
+ * @see CPE_TIMER_BUDGET_DEFAULT
+ */
+void
+cpe_main_loop_set_budget(apr_uint32_t max_timers)
+{
+    g_cpe_loop->lp_timer_budget = max_timers;
+}
+
+
+/*
+ * Dispatch, in expiration order, the events expired at time now, within
+ * the budget. The batch stops at the first event inserted after it
+ * started (for example re-added by its callback with an expiration in the
+ * past): each event is dispatched at most once per iteration.
+ *
+ * @param master  set to 1 if the master timer elapsed.
+ */
+static apr_status_t
+cpe_event_dispatch_expired(apr_time_t now, int *master)
+{
+    cpe_loop_t    *loop = g_cpe_loop;
+    cpe_priorityQ *q;
+    cpe_event     *e;
+    apr_uint32_t   count;
+    u_int          seq_end;
+    apr_status_t   rv;
+
+    *master = 0;
+    seq_end = loop->lp_eventQ->pq_seq;
+    for (count = 0;
+        loop->lp_timer_budget == 0 || count < loop->lp_timer_budget; count++)
+    {
+        q = cpe_priorityQ_find_max(loop->lp_eventQ);
+        if (q == NULL || q->pq_value > now ||
+            (int) (q->pq_seq - seq_end) >= 0)
+        {
+            break;
+        }
+        e = (cpe_event *) q;
+        if (e->ev_flags & CPE_EV_MASTER_TIMER) {
+            cpe_log(CPE_DEB, "%s", "master timer elapsed");
+            cpe_event_dispatch(e);
+            cpe_event_destroy(&e);
+            *master = 1;
+            return APR_SUCCESS;
+        }
+        if (cpe_unlikely(loop->lp_stats != NULL)) {
+            loop->lp_stats->ls_timeouts++;
+            cpe_histogram_record(&loop->lp_stats->ls_timer_late_us,
+                now - q->pq_value);
+        }
+        /* It is the callback responsability to re-add the event, unless it
+         * is persistent.
+         */
+        CHECK(cpe_event_remove_max(&e));
+        CHECK(cpe_event_dispatch(e));
+    }
+    cpe_log(CPE_DEB, "%u timer events", count);
+    return APR_SUCCESS;
 }
 
 
@@ -686,8 +1548,9 @@ cpe_master_timer_cb(void *ctx, apr_pollfd_t *pfd, cpe_event *e)
 apr_status_t
 cpe_main_loop(apr_time_t max_wait_us)
 {
-    u_int        loop_count = 1;
-    apr_status_t rv = APR_EGENERAL;
+    cpe_loop_t   *loop = g_cpe_loop;
+    u_int         loop_count = 1;
+    apr_status_t  rv = APR_EGENERAL;
 
     cpe_assert_system_initialized();
 
@@ -714,16 +1577,25 @@ cpe_main_loop(apr_time_t max_wait_us)
         cpe_log(CPE_DEB, "%s", "max_wait 0, will loop forever");
     }
 
+    loop->lp_in_main_loop = 1;
     while (1) {
-        apr_time_t          timeout_us, time_now_us;
+        apr_time_t          timeout_us, time_now_us, expiration;
         cpe_priorityQ       *q_max;
         cpe_event          *e_max;
         apr_int32_t         num_pfd;
         const apr_pollfd_t *ret_pfd;
+        int                 master;
+        cpe_loop_stats     *st = loop->lp_stats;
+        apr_uint64_t        dispatched = 0;
 
-        time_now_us = apr_time_now();
+        if (cpe_unlikely(st != NULL)) {
+            st->ls_iterations++;
+            dispatched = st->ls_dispatched;
+        }
+        time_now_us = cpe_loop_update_time(loop);
         cpe_log(CPE_DEB, "enter_loop %5u (time_now %lld ms)",
             loop_count++, apr_time_as_msec(time_now_us));
+        cpe_priorityQ_advance(loop->lp_eventQ, time_now_us);
 
         e_max = cpe_event_find_max();
         if (e_max == NULL) {
@@ -735,13 +1607,15 @@ cpe_main_loop(apr_time_t max_wait_us)
         cpe_log(CPE_DEB, "event_max %p, expiration %lld ms",
             e_max, apr_time_as_msec(q_max->pq_value));
 
-        timeout_us = q_max->pq_value - time_now_us;
+        expiration = q_max->pq_value;
+        timeout_us = expiration - time_now_us;
         if (timeout_us < 0) {
             cpe_log(CPE_DEB, "delayed %lld ms",
                 apr_time_as_msec(timeout_us));
             timeout_us = 0;
         }
 
+        loop->lp_generation++;
         rv = cpe_pollset_poll(timeout_us, &num_pfd, &ret_pfd);
         if (APR_STATUS_IS_EINTR(rv)) {
             /* XXX not really sure of what we should do here... */
@@ -752,64 +1626,249 @@ cpe_main_loop(apr_time_t max_wait_us)
             break;
         }
         if (num_pfd > 0) {      /* Fdesc event(s). */
-            int k;
+            apr_status_t rv2 = APR_SUCCESS;
+            int          k;
 
             cpe_log(CPE_DEB, "%d fdesc events", num_pfd);
             /* scan the active files/sockets and invoke callbacks */
             for (k = 0; k < num_pfd; k++) {
                 cpe_event *e2 = ret_pfd[k].client_data;
 
-                cpe_assert_event_ok(e2);
-
-                if (e2 == e_max && APR_STATUS_IS_TIMEUP(rv)) {
-                    /* Assure callback will be invoked only once by skipping
-                     * it now, will be called as a timed out event.
-                     * NB: the sequencing is critical.
+                if (e2 == loop->lp_post_event) {
+                    cpe_post_run(loop);
+                    continue;
+                }
+                if (e2->ev_magic != CPE_EV_MAGIC ||
+                    e2->ev_generation == loop->lp_generation)
+                {
+                    /* destroyed by a previous callback of this round, and
+                     * maybe its slot reused by a new event
                      */
-                    cpe_log(CPE_INFO, "%s",
-                        "fdesc event is ready AND timed-out");
-                    assert((e2->ev_flags & CPE_EV_MASTER_TIMER) == 0);
+                    cpe_log(CPE_DEB, "event %p destroyed, skipping", e2);
                     continue;
                 }
+                /* An event both ready and timed out gets only this call:
+                 * it leaves the queue here, and re-enters it with a new
+                 * expiration.
+                 */
+                cpe_assert_event_ok(e2);
 
-                /* It is the callback responsability to re-add the event. */
-                cpe_event_remove(e2);
+                if (e2->ev_flags & CPE_EV_PERSIST) {
+                    /* Stays in the pollset, stop only its timeout. */
+                    if (cpe_priorityQ_remove(loop->lp_eventQ,
+                        (cpe_priorityQ *) e2) != 1)
+                    {
+                        /* removed by a previous callback of this round */
+                        cpe_log(CPE_DEB, "event %p gone, skipping", e2);
+                        continue;
+                    }
+                } else {
+                    /* It is the callback responsability to re-add the
+                     * event.
+                     */
+                    cpe_event_remove(e2);
+                }
 
-                e2->ev_pollfd = ret_pfd[k];
+                /* Only the returned events: a previous callback of this
+                 * round may have changed the interest of a persistent one.
+                 */
+                e2->ev_pollfd.rtnevents = ret_pfd[k].rtnevents;
                 cpe_log(CPE_DEB, "Returned events %#x", e2->ev_pollfd.rtnevents);
                 assert(e2->ev_callback != NULL);
-                e2->ev_callback(e2->ev_ctx, &e2->ev_pollfd, e2);
-            }
-        }
-        if (timeout_us == 0 || APR_STATUS_IS_TIMEUP(rv)) {     /* Timer event. */
-            cpe_log(CPE_DEB, "%s", "timer event");
-            /* It is the callback responsability to re-add the event. */
-            rv = cpe_event_remove_max(&e_max);
-            if (rv != APR_SUCCESS) {
-                break;
-            }
-            if (e_max->ev_callback) {
-                e_max->ev_callback(e_max->ev_ctx, &e_max->ev_pollfd, e_max);
+                rv2 = cpe_event_dispatch(e2);
+                if (rv2 != APR_SUCCESS) {
+                    break;
+                }
             }
-            if (e_max->ev_flags & CPE_EV_MASTER_TIMER) {
-                cpe_log(CPE_DEB, "%s", "master timer elapsed");
-                rv = APR_SUCCESS;
+            if (rv2 != APR_SUCCESS) {
+                rv = rv2;
                 break;
             }
         }
-        rv = cpe_event_commit_changes();
-        if (rv != APR_SUCCESS) {
+        /* Timer events: all the expired ones, after the I/O callbacks and
+         * with a single timestamp.
+         */
+        /* updated by the poll, unless skipped */
+        time_now_us = loop->lp_now;
+        if (APR_STATUS_IS_TIMEUP(rv) && num_pfd == 0 &&
+            time_now_us < expiration)
+        {
+            /* the poll can return a bit early (timeout resolution) */
+            time_now_us = expiration;
+        }
+        rv = cpe_event_dispatch_expired(time_now_us, &master);
+        if (cpe_unlikely(st != NULL) && loop->lp_stats == st) {
+            cpe_histogram_record(&st->ls_per_wakeup,
+                st->ls_dispatched - dispatched);
+        }
+        if (rv != APR_SUCCESS || master) {
             break;
         }
-        if (g_cpe_main_loop_done) {
+        if (loop->lp_main_loop_done) {
             cpe_log(CPE_DEB, "%s", "exiting from main loop as requested");
             break;
         }
     }
     /* Out of main loop. */
+    loop->lp_in_main_loop = 0;
     if (rv != APR_SUCCESS) {
         return rv;
     }
     rv = cpe_system_queue_destroy();
     return rv;
 }
+
+
+/** The event loop of the calling thread. */
+cpe_loop_t *
+cpe_loop_current(void)
+{
+    return g_cpe_loop;
+}
+
+
+/** Index of the event loop of the calling thread, from 0 to nloops - 1 for
+ * the loops of cpe_loops_run(), -1 for the default loop.
+ */
+int
+cpe_loop_id(void)
+{
+    cpe_assert_system_initialized();
+    return g_cpe_loop->lp_id;
+}
+
+
+#if APR_HAS_THREADS
+/* What a thread of cpe_loops_run() needs to start its loop. */
+struct cpe_loop_start {
+    int              ls_id;
+    cpe_loop_init_t  ls_init_cb;
+    void            *ls_ctx;
+    apr_time_t       ls_max_wait_us;
+    apr_uint32_t     ls_timer_budget;
+};
+
+
+/* Pin the calling thread to a core, round robin on the online ones. */
+static void
+cpe_loop_pin(int id)
+{
+#if defined(__linux__) && defined(CPU_SET)
+    cpu_set_t set;
+    long      ncpu;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 0) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(id % ncpu, &set);
+    if (sched_setaffinity(0, sizeof set, &set) < 0) {
+        cpe_log(CPE_WARN, "loop %d, sched_setaffinity: %s", id,
+            cpe_errmsg(APR_FROM_OS_ERROR(errno)));
+        return;
+    }
+    cpe_log(CPE_DEB, "loop %d pinned to cpu %ld", id, id % ncpu);
+#else
+    id = 0;
+#endif
+}
+
+
+static void * APR_THREAD_FUNC
+cpe_loop_thread(apr_thread_t *thread, void *data)
+{
+    struct cpe_loop_start *ls = data;
+    apr_status_t           rv;
+
+    cpe_loop_pin(ls->ls_id);
+    rv = cpe_loop_create(&g_cpe_loop, ls->ls_id, g_cpe_num_events,
+        g_cpe_timerq, g_cpe_tick_us);
+    if (rv == APR_SUCCESS) {
+        g_cpe_loop->lp_timer_budget = ls->ls_timer_budget;
+        rv = ls->ls_init_cb(ls->ls_ctx, ls->ls_id);
+        if (rv == APR_SUCCESS) {
+            rv = cpe_main_loop(ls->ls_max_wait_us);
+        }
+        if (rv != APR_SUCCESS) {
+            cpe_log(CPE_ERR, "loop %d: %s", ls->ls_id, cpe_errmsg(rv));
+            cpe_system_queue_destroy();
+        }
+        cpe_loop_destroy(g_cpe_loop);
+        g_cpe_loop = NULL;
+    }
+    apr_thread_exit(thread, rv);
+    return NULL;
+}
+#endif /* APR_HAS_THREADS */
+
+
+/*!
+ * Run \p nloops event loops, each in its own thread pinned to a core, and
+ * wait for all of them to return.
+ *
+ * Each thread creates its loop, with the parameters given to
+ * cpe_system_init2() and the timer budget of the calling thread, calls
+ * init_cb(ctx, id) with id from 0 to nloops - 1 to add its first events,
+ * then runs cpe_main_loop(max_wait_us). From that thread, the CPE API
+ * works on that loop only: events, sockets and iobufs must not be passed
+ * from one loop to another. A server calls cpe_socket_server_create() from
+ * each init_cb, on the same port: thanks to SO_REUSEPORT each loop gets its
+ * share of the incoming connections.
+ *
+ * The calling thread keeps its own loop, which is not run.
+ *
+ * @return APR_SUCCESS, or the error of the first loop that failed.
+ */
+apr_status_t
+cpe_loops_run(int nloops, cpe_loop_init_t init_cb, void *ctx,
+    apr_time_t max_wait_us)
+{
+#if APR_HAS_THREADS
+    struct cpe_loop_start *starts;
+    apr_thread_t         **threads;
+    apr_pool_t            *pool;
+    apr_status_t           rv, rv2;
+    int                    k, nstarted;
+
+    cpe_assert_system_initialized();
+    if (nloops <= 0 || init_cb == NULL || max_wait_us < 0) {
+        cpe_log(CPE_ERR, "invalid parms (nloops %d, init_cb %p)", nloops,
+            init_cb);
+        return APR_EINVAL;
+    }
+    CHECK(apr_pool_create(&pool, NULL));
+    starts = apr_pcalloc(pool, nloops * sizeof *starts);
+    threads = apr_pcalloc(pool, nloops * sizeof *threads);
+    if (starts == NULL || threads == NULL) {
+        apr_pool_destroy(pool);
+        return APR_ENOMEM;
+    }
+    rv = APR_SUCCESS;
+    for (nstarted = 0; nstarted < nloops; nstarted++) {
+        starts[nstarted].ls_id = nstarted;
+        starts[nstarted].ls_init_cb = init_cb;
+        starts[nstarted].ls_ctx = ctx;
+        starts[nstarted].ls_max_wait_us = max_wait_us;
+        starts[nstarted].ls_timer_budget = g_cpe_loop->lp_timer_budget;
+        rv = apr_thread_create(&threads[nstarted], NULL, cpe_loop_thread,
+            &starts[nstarted], pool);
+        if (rv != APR_SUCCESS) {
+            cpe_log(CPE_ERR, "apr_thread_create: %s", cpe_errmsg(rv));
+            break;
+        }
+    }
+    for (k = 0; k < nstarted; k++) {
+        apr_thread_join(&rv2, threads[k]);
+        if (rv == APR_SUCCESS) {
+            rv = rv2;
+        }
+    }
+    apr_pool_destroy(pool);
+    return rv;
+#else
+    nloops = 0; init_cb = NULL; ctx = NULL; max_wait_us = 0;
+    cpe_log(CPE_ERR, "%s", "APR built without thread support");
+    return APR_ENOTIMPL;
+#endif
+}
@@ -42,14 +42,24 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *  An event is an opaque handle returned by cpe_event_timer_create() 
  *  (timer event) or cpe_event_fdesc_create() (file or socket event, with
  *  optional timeout). Each event has an associated callback and its context.
- *  An event is one-shot; it is the callback responsability to re-add the
- *  event to the system with cpe_event_add().
+ *  By default an event is one-shot; it is the callback responsability to
+ *  re-add the event to the system with cpe_event_add(). An event made
+ *  persistent with cpe_event_set_persistent() instead stays in the system,
+ *  and is re-armed with its timeout after each callback, until the
+ *  callback calls cpe_event_remove() or cpe_event_destroy(); a periodic
+ *  timer (cpe_event_set_periodic()) is persistent.
  *
  *  @par CPE Thread model
- *  CPE is an event system, and assumes only one thread. Do not use
- *  any APR thread or synchronization primitives, otherwise CPE behavior
- *  is undefined. If you think this is a bug, let me say it again: CPE
- *  is an event system.
+ *  CPE is an event system: an event loop (cpe_loop_t) belongs to one
+ *  thread, and the CPE API always works on the loop of the calling thread.
+ *  cpe_system_init() creates the loop of the main thread. To use more
+ *  cores, cpe_loops_run() starts N loops, each in its own pinned thread;
+ *  the loops share nothing, and an event, socket or iobuf created in one
+ *  loop must never be used from another one. The only exception is
+ *  cpe_post(), which any thread can call to have a function run by a given
+ *  loop: that is how work is handed to a loop. Do not use APR thread or
+ *  synchronization primitives from a callback, otherwise CPE behavior is
+ *  undefined.
  *
  *  @par Callbacks must be non blocking
  *  Avoid any blocking call in a callback function associated with an
@@ -87,6 +97,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *  cpe_socket_after_connect() <br>
  *  cpe_main_loop()
  *
+ *  @par Listening socket, one loop per core
+ *  cpe_system_init()          <br>
+ *  cpe_loops_run(), whose init_cb does: <br>
+ *  &nbsp; cpe_socket_server_create() <br>
+ *  &nbsp; cpe_socket_after_accept()
+ *
  *  @{
  */
 
@@ -117,22 +133,99 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
 #define cpe_min(a,b) ((a) < (b) ? (a) : (b))
+#define cpe_max(a,b) ((a) > (b) ? (a) : (b))
 
 #define ONE_SI_KILO 1000
 #define ONE_SI_MEGA 1000000
 
 
 enum cpe_ev_flags {
+    /** Stay in the system after dispatch, see cpe_event_set_persistent(). */
+    CPE_EV_PERSIST      = 0x00000001,
+    /** Re-armed from its previous deadline, see cpe_event_set_periodic(). */
+    CPE_EV_PERIODIC     = 0x00000002,
+    /** Periodic, fire the missed deadlines instead of skipping them. */
+    CPE_EV_CATCHUP      = 0x00000004,
     /* below only CPE internal events */
     CPE_EV_MASTER_TIMER = 0x01000000,
 };
 typedef enum cpe_ev_flags cpe_ev_flags;
 
+/** How a periodic timer is re-armed, see cpe_event_set_periodic(). */
+enum cpe_periodic_policy {
+    CPE_PERIODIC_NONE,      /**< from the time of the dispatch (default) */
+    CPE_PERIODIC_SKIP,      /**< from the previous deadline, skip missed */
+    CPE_PERIODIC_CATCHUP,   /**< from the previous deadline, fire missed */
+};
+typedef enum cpe_periodic_policy cpe_periodic_policy;
+
+/** How the event system keeps its timers, see cpe_system_init2(). */
+enum cpe_timerq_type {
+    CPE_TIMERQ_HEAP,    /**< binary heap, exact ordering (default) */
+    CPE_TIMERQ_WHEEL,   /**< timing wheel, O(1) add and cancel */
+};
+typedef enum cpe_timerq_type cpe_timerq_type;
+
+/** Default max number of timers dispatched per loop iteration. */
+#define CPE_TIMER_BUDGET_DEFAULT 64
+
+/** Default resolution of the timing wheel. */
+#define CPE_TIMERQ_TICK_DEFAULT 1000
+
 typedef struct cpe_event cpe_event; /***< Opaque event handle. */
 typedef apr_status_t (* cpe_callback_t)(void *ctx, apr_pollfd_t *pfd,
     cpe_event *e);
+typedef struct cpe_loop_t cpe_loop_t; /***< Opaque event loop handle. */
+/** Called by each loop of cpe_loops_run() before entering its main loop. */
+typedef apr_status_t (* cpe_loop_init_t)(void *ctx, int loop_id);
+/** Run by a loop on behalf of any thread, see cpe_post(). */
+typedef apr_status_t (* cpe_post_cb_t)(void *ctx);
+/** Called when a socket goes, see cpe_resource_register_callback(). */
+typedef void (* cpe_resource_cb_t)(void *ctx);
+/** Time source of a loop, in us, see cpe_clock_set(). */
+typedef apr_time_t (* cpe_clock_fn_t)(void *ctx);
+
+/** Counters of cpe_post(), see cpe_post_stats_get(). */
+struct cpe_post_stats {
+    apr_uint32_t ps_posted;     /**< functions posted to the loop */
+    apr_uint32_t ps_wakeups;    /**< writes to its wakeup descriptor */
+    apr_uint32_t ps_run;        /**< functions run by the loop */
+    apr_uint32_t ps_max_batch;  /**< most functions run for one wakeup */
+};
+typedef struct cpe_post_stats cpe_post_stats;
+
+/** Callbacks with their own run time histogram, see cpe_loop_stats. */
+#define CPE_STATS_MAX_CALLBACKS 16
+
+/** Run time of the callbacks of one function. */
+struct cpe_callback_stats {
+    cpe_callback_t cs_callback;
+    cpe_histogram  cs_run_us;
+};
+typedef struct cpe_callback_stats cpe_callback_stats;
+
+/** Instrumentation of a loop, see cpe_stats_enable(). Times in us. */
+struct cpe_loop_stats {
+    apr_uint64_t  ls_iterations;
+    apr_uint64_t  ls_polls;             /**< waits in the pollset */
+    apr_uint64_t  ls_dispatched;        /**< callbacks run */
+    apr_uint64_t  ls_timeouts;          /**< of which on expiration */
+    apr_uint64_t  ls_pollset_adds;
+    apr_uint64_t  ls_pollset_removes;
+    apr_uint64_t  ls_pollset_updates;
+    cpe_histogram ls_poll_wait_us;      /**< time spent in each wait */
+    cpe_histogram ls_timer_late_us;     /**< dispatch time - deadline */
+    cpe_histogram ls_per_wakeup;        /**< callbacks run per iteration */
+    /** by callback function, in order of first call */
+    u_int              ls_ncallbacks;
+    cpe_callback_stats ls_callbacks[CPE_STATS_MAX_CALLBACKS];
+    cpe_histogram      ls_other_run_us; /**< callbacks beyond the table */
+};
+typedef struct cpe_loop_stats cpe_loop_stats;
 
 apr_status_t  cpe_system_init(apr_uint32_t pollset_size);
+apr_status_t  cpe_system_init2(apr_uint32_t pollset_size,
+                cpe_timerq_type timerq, apr_time_t tick_us);
 cpe_event    *cpe_event_fdesc_create(apr_datatype_e desc_type,
                 apr_int16_t reqevents, apr_descriptor desc,
                 apr_time_t timeout_us, cpe_callback_t callback, void *ctx);
@@ -142,11 +235,32 @@ apr_status_t  cpe_event_destroy(cpe_event **event);
 apr_status_t  cpe_event_add(cpe_event *event);
 apr_status_t  cpe_event_add2(cpe_event *event, apr_time_t expiration);
 apr_status_t  cpe_event_set_timeout(cpe_event *event, apr_time_t timeout_us);
+apr_status_t  cpe_event_set_context(cpe_event *event, void *ctx);
+apr_status_t  cpe_event_set_persistent(cpe_event *event, int persistent);
+apr_status_t  cpe_event_set_periodic(cpe_event *event,
+                cpe_periodic_policy policy);
+apr_uint32_t  cpe_event_missed(cpe_event *event);
 int           cpe_events_in_system(void);
+void          cpe_event_slab_stats(cpe_slab_stats *stats);
 apr_status_t  cpe_event_remove(cpe_event *event);
 apr_status_t  cpe_pollset_update(apr_pollfd_t *pfd, apr_int16_t reqevents);
 apr_status_t  cpe_main_loop(apr_time_t timeout_us);
 void          cpe_main_loop_terminate(void);
+void          cpe_main_loop_set_budget(apr_uint32_t max_timers);
+apr_status_t  cpe_loops_run(int nloops, cpe_loop_init_t init_cb, void *ctx,
+                apr_time_t max_wait_us);
+cpe_loop_t   *cpe_loop_current(void);
+int           cpe_loop_id(void);
+apr_status_t  cpe_post(cpe_loop_t *loop, cpe_post_cb_t fn, void *ctx);
+void          cpe_post_stats_get(cpe_loop_t *loop, cpe_post_stats *stats);
+apr_status_t  cpe_stats_enable(int enable);
+apr_status_t  cpe_clock_set(cpe_clock_fn_t fn, void *ctx);
+apr_status_t  cpe_clock_set_virtual(apr_time_t step_us);
+apr_status_t  cpe_clock_advance(apr_time_t delta_us);
+apr_time_t    cpe_clock_now(void);
+apr_status_t  cpe_clock_set_coarse(int coarse);
+apr_time_t    cpe_now(void);
+apr_status_t  cpe_stats_snapshot(cpe_loop_t *loop, cpe_loop_stats *stats);
 
 /* from cpe-utils.c */
 const char   *cpe_errmsg(apr_status_t rv);
@@ -157,6 +271,9 @@ apr_time_t    cpe_time_from_hour(int hour);
 apr_status_t
 cpe_resource_register_user(apr_socket_t *sock, cpe_event *event);
 apr_status_t
+cpe_resource_register_callback(apr_socket_t *sock, cpe_resource_cb_t fn,
+    void *ctx);
+apr_status_t
 cpe_resource_destroy_users(apr_socket_t *sock);
 
 
@@ -0,0 +1,355 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+/*
+ * Connection scaling benchmark of cpe_socket_after_accept(). Not a test, it
+ * is not run by "scons test".
+ *
+ * BENCH_CONNS loopback connections (argument, default 100k) are opened to
+ * BENCH_PORTS listening sockets, BENCH_BATCH at a time, and accepted by the
+ * loop; the client side is plain non-blocking descriptors, not in the
+ * loop. Reported: the accept rate, the RSS growth and the memory per
+ * connection. Then all the connections are closed by the clients, and
+ * opened again: the server side must reuse the memory of the first ones.
+ * The three phases run in one main loop, each started by a timer once the
+ * server has seen the end of the previous one.
+ *
+ * Needs two descriptors per connection: the limit is raised if the hard
+ * limit allows, otherwise fewer connections are opened.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "cpe.h"
+#include "cpe-logging.h"
+#include "cpe-network.h"
+
+#define BENCH_ADDR      "127.0.0.1"
+#define BENCH_PORT      12400       /* the first one */
+#define BENCH_PORTS     8           /* ~28k ephemeral ports per server port */
+#define BENCH_CONNS     100000
+#define BENCH_BATCH     1000        /* connects per timer tick */
+#define BENCH_MAX_MSEC  (3 * 120000)
+
+enum { BENCH_OPEN, BENCH_CLOSE, BENCH_REOPEN, BENCH_DONE };
+
+static const char *g_phase_names[] = { "open:", "close:", "reopen:" };
+
+static int         g_nconns;
+static int        *g_fds;           /* client side */
+static int         g_phase;
+static int         g_opened;
+static int         g_closed;        /* seen by the server */
+static long        g_rss;           /* before the first open */
+static apr_time_t  g_start, g_stop;
+
+static apr_status_t phase_cb(void *context, apr_pollfd_t *pfd, cpe_event *e);
+
+/* Resident memory, in bytes. */
+static long
+bench_rss(void)
+{
+    FILE *f;
+    long  size, rss;
+
+    f = fopen("/proc/self/statm", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    if (fscanf(f, "%ld %ld", &size, &rss) != 2) {
+        rss = -1;
+    }
+    fclose(f);
+    return rss < 0 ? -1 : rss * sysconf(_SC_PAGESIZE);
+}
+
+static int
+bench_connect(int port)
+{
+    struct sockaddr_in sin;
+    int                fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&sin, 0, sizeof sin);
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = inet_addr(BENCH_ADDR);
+    if (connect(fd, (struct sockaddr *) &sin, sizeof sin) < 0 &&
+        errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Once the server has seen the end of the phase, start the next one, out
+ * of the callbacks of the connections.
+ */
+static void
+bench_check_done(void)
+{
+    cpe_accept_stats  stats;
+    cpe_event        *e;
+    int               done;
+
+    if (g_stop != 0) {
+        return;
+    }
+    cpe_accept_stats_get(&stats);
+    if (g_phase == BENCH_CLOSE) {
+        done = g_closed == g_nconns && stats.as_live == 0;
+    } else {
+        done = g_opened == g_nconns && (int) stats.as_live == g_nconns;
+    }
+    if (! done) {
+        return;
+    }
+    g_stop = apr_time_now();
+    e = cpe_event_timer_create(cpe_time_from_msec(1), phase_cb, NULL);
+    if (e == NULL || cpe_event_add(e) != APR_SUCCESS) {
+        fprintf(stderr, "cannot start the next phase\n");
+        cpe_main_loop_terminate();
+    }
+}
+
+/* server: the only event expected is the close by the client */
+static apr_status_t
+server_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    apr_socket_t *sock = pfd->desc.s;
+    char          buf[64];
+    apr_size_t    len = sizeof buf;
+
+    context = NULL;
+    e = NULL;   /* persistent */
+    if (apr_socket_recv(sock, buf, &len) == APR_SUCCESS && len > 0) {
+        return APR_SUCCESS;
+    }
+    /* the event first, out of the pollset while the socket is open */
+    cpe_resource_destroy_users(sock);
+    cpe_socket_close(sock);
+    g_closed++;
+    bench_check_done();
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+accepted_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    apr_status_t rv;
+
+    context = NULL;
+    CHECK(cpe_event_set_persistent(e, 1));
+    CHECK(cpe_resource_register_user(pfd->desc.s, e));
+    bench_check_done();
+    return APR_SUCCESS;
+}
+
+/* client: open the next batch */
+static apr_status_t
+connect_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    int k, n;
+
+    context = NULL;
+    pfd = NULL;
+    n = cpe_min(g_nconns - g_opened, BENCH_BATCH);
+    for (k = 0; k < n; k++) {
+        g_fds[g_opened] = bench_connect(BENCH_PORT + g_opened % BENCH_PORTS);
+        if (g_fds[g_opened] < 0) {
+            fprintf(stderr, "connect %d: %s\n", g_opened, strerror(errno));
+            cpe_main_loop_terminate();
+            return APR_EGENERAL;
+        }
+        g_opened++;
+    }
+    if (g_opened < g_nconns) {
+        return cpe_event_add(e);
+    }
+    return cpe_event_destroy(&e);
+}
+
+/* Open g_nconns connections, BENCH_BATCH per tick. */
+static apr_status_t
+bench_open_start(void)
+{
+    cpe_event *e;
+
+    g_opened = 0;
+    g_stop = 0;
+    g_start = apr_time_now();
+    CHECK_NULL(e, cpe_event_timer_create(cpe_time_from_msec(1), connect_cb,
+        NULL));
+    return cpe_event_add(e);
+}
+
+/* Close the client side, for the server to see them all. */
+static void
+bench_close_start(void)
+{
+    int k;
+
+    g_closed = 0;
+    g_stop = 0;
+    g_start = apr_time_now();
+    for (k = 0; k < g_nconns; k++) {
+        close(g_fds[k]);
+    }
+}
+
+static void
+bench_report(const char *what)
+{
+    cpe_accept_stats stats;
+    cpe_slab_stats   slab;
+    long             rss = bench_rss();
+
+    cpe_accept_stats_get(&stats);
+    cpe_event_slab_stats(&slab);
+    printf("%-7s %d connections in %.0f ms, %.0f conn/s, max %u per "
+        "wakeup\n", what, g_nconns, (g_stop - g_start) / 1e3,
+        g_nconns / ((g_stop - g_start) / 1e6), stats.as_max_batch);
+    printf("        RSS %.1f MB (+%.1f MB), %.0f bytes per connection; "
+        "%u sockets allocated, %u events\n", rss / 1e6,
+        (rss - g_rss) / 1e6, (double) (rss - g_rss) / g_nconns,
+        stats.as_sockets, slab.ss_in_use);
+}
+
+/* The end of a phase: report it, start the next one. */
+static apr_status_t
+phase_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    apr_status_t rv = APR_SUCCESS;
+
+    context = NULL;
+    pfd = NULL;
+    bench_report(g_phase_names[g_phase]);
+    switch (++g_phase) {
+    case BENCH_CLOSE:
+        bench_close_start();
+        break;
+    case BENCH_REOPEN:
+        /* the same again: the memory of the closed ones is reused */
+        rv = bench_open_start();
+        break;
+    default:
+        cpe_main_loop_terminate();
+        break;
+    }
+    if (rv != APR_SUCCESS) {
+        cpe_main_loop_terminate();
+    }
+    cpe_event_destroy(&e);
+    return rv;
+}
+
+int
+main(int argc, const char *const *argv)
+{
+    apr_socket_t   *lsock;
+    apr_sockaddr_t *sockaddr;
+    apr_pool_t     *pool;
+    struct rlimit   rl;
+    int             k;
+
+    if (apr_app_initialize(&argc, &argv, NULL) != APR_SUCCESS) {
+        return 1;
+    }
+    g_nconns = argc > 1 ? atoi(argv[1]) : BENCH_CONNS;
+    if (g_nconns <= 0) {
+        fprintf(stderr, "usage: %s [nconns]\n", argv[0]);
+        return 1;
+    }
+    /* two descriptors per connection */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+        rl.rlim_cur < (rlim_t) 2 * g_nconns + 64)
+    {
+        rl.rlim_cur = cpe_min(rl.rlim_max, (rlim_t) 2 * g_nconns + 64);
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if ((rlim_t) 2 * g_nconns + 64 > rl.rlim_cur) {
+            g_nconns = (rl.rlim_cur - 64) / 2;
+            printf("descriptor limit %ld, %d connections only\n",
+                (long) rl.rlim_cur, g_nconns);
+        }
+    }
+    if (cpe_system_init(g_nconns + 64) != APR_SUCCESS) {
+        return 1;
+    }
+    cpe_log_init(CPE_WARN);
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        return 1;
+    }
+    g_fds = malloc(g_nconns * sizeof *g_fds);
+    if (g_fds == NULL) {
+        return 1;
+    }
+    for (k = 0; k < BENCH_PORTS; k++) {
+        if (cpe_socket_server_create(&lsock, &sockaddr, BENCH_ADDR,
+                BENCH_PORT + k, SOMAXCONN, pool) != APR_SUCCESS ||
+            cpe_socket_after_accept(lsock, server_cb, NULL, APR_POLLIN,
+                cpe_filter_any, g_nconns, accepted_cb, NULL, pool) !=
+                APR_SUCCESS)
+        {
+            fprintf(stderr, "cannot listen on port %d\n", BENCH_PORT + k);
+            return 1;
+        }
+    }
+
+    g_rss = bench_rss();
+    g_phase = BENCH_OPEN;
+    if (bench_open_start() != APR_SUCCESS ||
+        cpe_main_loop(cpe_time_from_msec(BENCH_MAX_MSEC)) != APR_SUCCESS)
+    {
+        return 1;
+    }
+    if (g_phase != BENCH_DONE) {
+        fprintf(stderr, "%s timeout: %d of %d connections opened, %d "
+            "closed\n", g_phase_names[g_phase], g_opened, g_nconns,
+            g_closed);
+        return 1;
+    }
+    return 0;
+}
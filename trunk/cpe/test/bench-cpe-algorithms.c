@@ -0,0 +1,129 @@
+/*
+ * Cisco Portable Events (CPE)
+ *
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Scaling benchmark for cpe_priorityQ. Not a test, it is not run by
+ * "scons test".
+ *
+ * For each queue size N (10 to 1M) it measures the average cost of:
+ * - insert:     fill an empty queue with N nodes
+ * - reschedule: remove a random node and insert it again with a later
+ *               value, which is what cpe_main_loop() does for every ready
+ *               fdesc event
+ * - remove_max: drain the queue
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include "cpe-algorithms.h"
+
+#define BENCH_MAX_N     1000000
+#define BENCH_RESCHED   1000000
+
+static double
+bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+bench_run(unsigned int N, cpe_priorityQ *nodes)
+{
+    cpe_priorityQ *head, *p;
+    unsigned int   i, k;
+    double         t0, t_insert, t_resched, t_remove;
+
+    head = cpe_priorityQ_create();
+    assert(head != NULL);
+    for (i = 0; i < N; i++) {
+        nodes[i].pq_index = 0;
+        nodes[i].pq_value = random();
+    }
+
+    t0 = bench_now_ns();
+    for (i = 0; i < N; i++) {
+        cpe_priorityQ_insert(head, &nodes[i]);
+    }
+    t_insert = bench_now_ns() - t0;
+
+    t0 = bench_now_ns();
+    for (i = 0; i < BENCH_RESCHED; i++) {
+        k = random() % N;
+        cpe_priorityQ_remove(head, &nodes[k]);
+        nodes[k].pq_value += random() % 1000;
+        cpe_priorityQ_insert(head, &nodes[k]);
+    }
+    t_resched = bench_now_ns() - t0;
+    assert(cpe_priorityQ_verify(head));
+
+    t0 = bench_now_ns();
+    while ((p = cpe_priorityQ_remove_max(head)) != NULL) {
+        ;
+    }
+    t_remove = bench_now_ns() - t0;
+
+    printf("%8u %12.1f %12.1f %12.1f\n", N, t_insert / N,
+        t_resched / BENCH_RESCHED, t_remove / N);
+
+    /* the nodes belong to the caller, free only the heap array */
+    cpe_priorityQ_queue_destroy(head);
+    free(head);
+}
+
+int
+main(void)
+{
+    cpe_priorityQ *nodes;
+    unsigned int   N;
+
+    nodes = calloc(BENCH_MAX_N, sizeof *nodes);
+    assert(nodes != NULL);
+    srandom(42);
+
+    printf("%8s %12s %12s %12s  (ns/op)\n", "N", "insert", "reschedule",
+        "remove_max");
+    for (N = 10; N <= BENCH_MAX_N; N *= 10) {
+        bench_run(N, nodes);
+    }
+    free(nodes);
+    return 0;
+}
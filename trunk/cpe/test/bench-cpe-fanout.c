@@ -0,0 +1,279 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+/*
+ * Benchmark of a broadcast to many peers, as the agent sends its weight to
+ * all the managers. Not a test, it is not run by "scons test".
+ *
+ * BENCH_PEERS socket pairs (argument, default 1000), each with a send
+ * queue. On each of BENCH_ROUNDS rounds a BENCH_MSGLEN bytes message is
+ * queued to all the peers, and the round ends when all the queues are
+ * drained. Two ways to do it:
+ *
+ * copy:   one iobuf per peer, the message copied in each, as with
+ *         cpe_send_enqueue();
+ * shared: one iobuf for all, with cpe_send_enqueue_shared().
+ *
+ * Reported: time per round and for the enqueue part only, and the iobufs
+ * allocated (not from the recycled ones) per round.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "cpe.h"
+#include "cpe-logging.h"
+#include "cpe-network.h"
+
+#define BENCH_PEERS     1000
+#define BENCH_ROUNDS    2000
+#define BENCH_MSGLEN    64
+#define BENCH_MAX_MSEC  60000
+
+enum bench_mode { BENCH_COPY, BENCH_SHARED };
+
+struct peer {
+    cpe_network_ctx pe_nctx;
+    int             pe_fd[2];   /* send, receive */
+    int             pe_round;   /* last round drained */
+};
+
+static enum bench_mode  g_mode;
+static struct peer     *g_peers;
+static int              g_npeers;
+static int              g_ready;
+static int              g_round;
+static int              g_pending;      /* peers to drain this round */
+static char             g_msg[BENCH_MSGLEN];
+static apr_time_t       g_round_start;
+static apr_time_t       g_total, g_enqueue;
+
+static apr_status_t
+round_start(void)
+{
+    cpe_io_buf   *iobuf;
+    apr_status_t  rv;
+    apr_time_t    now;
+    int           k;
+
+    g_round++;
+    g_pending = g_npeers;
+    g_round_start = apr_time_now();
+    if (g_mode == BENCH_SHARED) {
+        CHECK(cpe_iobuf_get(&iobuf, BENCH_MSGLEN));
+        memcpy(iobuf->buf, g_msg, BENCH_MSGLEN);
+        iobuf->buf_len = BENCH_MSGLEN;
+        for (k = 0; k < g_npeers; k++) {
+            CHECK(cpe_send_enqueue_shared(g_peers[k].pe_nctx.nc_sendQ, iobuf));
+        }
+        cpe_iobuf_release(&iobuf, NULL);
+    } else {
+        for (k = 0; k < g_npeers; k++) {
+            CHECK(cpe_iobuf_get(&iobuf, BENCH_MSGLEN));
+            memcpy(iobuf->buf, g_msg, BENCH_MSGLEN);
+            iobuf->buf_len = BENCH_MSGLEN;
+            iobuf->destroy = 1;
+            CHECK(cpe_send_enqueue(g_peers[k].pe_nctx.nc_sendQ, iobuf));
+        }
+    }
+    now = apr_time_now();
+    g_enqueue += now - g_round_start;
+    return APR_SUCCESS;
+}
+
+/* All the queues are drained: empty the receiving ends, untimed, and go on
+ * with the next round.
+ */
+static apr_status_t
+round_done(void)
+{
+    char buf[BENCH_MSGLEN];
+    int  k;
+
+    g_total += apr_time_now() - g_round_start;
+    for (k = 0; k < g_npeers; k++) {
+        while (recv(g_peers[k].pe_fd[1], buf, sizeof buf, MSG_DONTWAIT) > 0) {
+        }
+    }
+    if (g_round == BENCH_ROUNDS) {
+        cpe_main_loop_terminate();
+        return APR_SUCCESS;
+    }
+    return round_start();
+}
+
+/* POLLOUT: the first time set up the queue, then send. */
+static apr_status_t
+peer_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct peer  *pe = context;
+    apr_status_t  rv;
+
+    if (pe->pe_nctx.nc_sendQ == NULL) {
+        CHECK(cpe_queue_init(&pe->pe_nctx.nc_sendQ, pfd, pe->pe_nctx.nc_pool,
+            e));
+        g_ready++;
+    }
+    CHECK(cpe_sender(&pe->pe_nctx));
+    if (g_round > 0 && pe->pe_round < g_round &&
+        pe->pe_nctx.nc_sendQ->cq_nelems == 0)
+    {
+        pe->pe_round = g_round;
+        if (--g_pending == 0) {
+            return round_done();
+        }
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+peer_init(struct peer *pe, apr_pool_t *pool)
+{
+    apr_socket_t *sock = NULL;
+    cpe_event    *e;
+    apr_status_t  rv;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pe->pe_fd) != 0) {
+        return APR_FROM_OS_ERROR(errno);
+    }
+    CHECK(apr_os_sock_put(&sock, &pe->pe_fd[0], pool));
+    CHECK(apr_socket_timeout_set(sock, 0));
+    pe->pe_nctx.nc_pool = pool;
+    CHECK_NULL(e, cpe_event_fdesc_create(APR_POLL_SOCKET, APR_POLLOUT,
+        (apr_descriptor) sock, 0, peer_cb, pe));
+    CHECK(cpe_event_set_persistent(e, 1));
+    return cpe_event_add(e);
+}
+
+/* the first round, once all the queues are set up */
+static apr_status_t
+start_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    context = NULL;
+    pfd = NULL;
+    if (g_ready < g_npeers) {
+        return cpe_event_add(e);
+    }
+    return round_start();
+}
+
+static apr_status_t
+bench_run(enum bench_mode mode)
+{
+    cpe_iobuf_stats  before, after;
+    cpe_event       *e;
+    apr_status_t     rv;
+    int              k;
+
+    g_mode = mode;
+    g_round = 0;
+    g_total = 0;
+    g_enqueue = 0;
+    for (k = 0; k < g_npeers; k++) {
+        g_peers[k].pe_round = 0;
+    }
+    cpe_iobuf_stats_get(&before);
+    CHECK_NULL(e, cpe_event_timer_create(cpe_time_from_msec(1), start_cb,
+        NULL));
+    CHECK(cpe_event_add(e));
+    CHECK(cpe_main_loop(cpe_time_from_msec(BENCH_MAX_MSEC)));
+    CHECK(cpe_event_destroy(&e));
+    cpe_iobuf_stats_get(&after);
+    if (g_round != BENCH_ROUNDS || g_pending != 0) {
+        fprintf(stderr, "%d of %d rounds done\n", g_round, BENCH_ROUNDS);
+        return APR_EGENERAL;
+    }
+    printf("%-7s %d peers x %d rounds: %.1f us per round, enqueue %.1f us "
+        "(%.0f ns per peer), %.1f iobufs allocated per round\n",
+        mode == BENCH_SHARED ? "shared:" : "copy:", g_npeers, BENCH_ROUNDS,
+        (double) g_total / BENCH_ROUNDS, (double) g_enqueue / BENCH_ROUNDS,
+        1e3 * g_enqueue / ((double) BENCH_ROUNDS * g_npeers),
+        (double) (after.is_misses - before.is_misses) / BENCH_ROUNDS);
+    return APR_SUCCESS;
+}
+
+int
+main(int argc, const char *const *argv)
+{
+    struct rlimit  rl;
+    apr_pool_t    *pool;
+    int            k;
+
+    if (apr_app_initialize(&argc, &argv, NULL) != APR_SUCCESS) {
+        return 1;
+    }
+    g_npeers = argc > 1 ? atoi(argv[1]) : BENCH_PEERS;
+    if (g_npeers <= 0) {
+        fprintf(stderr, "usage: %s [npeers]\n", argv[0]);
+        return 1;
+    }
+    /* two descriptors per peer */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+        rl.rlim_cur < (rlim_t) 2 * g_npeers + 64)
+    {
+        rl.rlim_cur = cpe_min(rl.rlim_max, (rlim_t) 2 * g_npeers + 64);
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (cpe_system_init(g_npeers + 16) != APR_SUCCESS) {
+        return 1;
+    }
+    cpe_log_init(CPE_WARN);
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        return 1;
+    }
+    g_peers = calloc(g_npeers, sizeof *g_peers);
+    if (g_peers == NULL) {
+        return 1;
+    }
+    for (k = 0; k < g_npeers; k++) {
+        if (peer_init(&g_peers[k], pool) != APR_SUCCESS) {
+            fprintf(stderr, "peer %d: %s\n", k, strerror(errno));
+            return 1;
+        }
+    }
+    memset(g_msg, 'x', sizeof g_msg);
+
+    if (bench_run(BENCH_COPY) != APR_SUCCESS) {
+        return 1;
+    }
+    if (bench_run(BENCH_SHARED) != APR_SUCCESS) {
+        return 1;
+    }
+    return 0;
+}
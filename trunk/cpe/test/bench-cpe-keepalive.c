@@ -0,0 +1,184 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Replay of a long keepalive schedule on the simulated clock, see
+ * cpe_clock_set_virtual(). Not a test, it is not run by "scons test".
+ *
+ * BENCH_PEERS peers (first argument), each with a periodic keepalive
+ * timer (BENCH_KEEPALIVE_SEC, spread over the period) and a hold timer
+ * (BENCH_HOLD_SEC) restarted by each keepalive, as a protocol with dead
+ * peer detection does. The schedule runs for BENCH_HOURS hours (second
+ * argument) of simulated time, on the heap or, if the third argument is
+ * "wheel", on the timing wheel.
+ *
+ * Reported: real time taken, timers fired, and the lateness from the loop
+ * stats, which must be 0.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cpe.h"
+#include "cpe-logging.h"
+
+#define BENCH_PEERS         10000
+#define BENCH_HOURS         24
+#define BENCH_KEEPALIVE_SEC 30
+#define BENCH_HOLD_SEC      90
+
+struct peer {
+    cpe_event *pe_hold;
+    long       pe_keepalives;
+};
+
+static struct peer *g_peers;
+static int          g_npeers;
+static long         g_expired;          /* hold timers, must stay 0 */
+
+static apr_status_t
+keepalive_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct peer  *pe = context;
+    apr_status_t  rv;
+
+    pfd = NULL;
+    e = NULL;           /* periodic */
+    pe->pe_keepalives++;
+    CHECK(cpe_event_remove(pe->pe_hold));
+    return cpe_event_add(pe->pe_hold);
+}
+
+static apr_status_t
+hold_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    context = NULL;
+    pfd = NULL;
+    e = NULL;
+    g_expired++;
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+peer_init(struct peer *pe, int k)
+{
+    cpe_event    *e;
+    apr_status_t  rv;
+
+    CHECK_NULL(pe->pe_hold, cpe_event_timer_create(
+        apr_time_from_sec(BENCH_HOLD_SEC), hold_cb, pe));
+    CHECK(cpe_event_add(pe->pe_hold));
+    CHECK_NULL(e, cpe_event_timer_create(apr_time_from_sec(
+        BENCH_KEEPALIVE_SEC), keepalive_cb, pe));
+    CHECK(cpe_event_set_periodic(e, CPE_PERIODIC_SKIP));
+    /* spread the first keepalives over the period */
+    CHECK(cpe_event_add2(e, cpe_clock_now() +
+        apr_time_from_sec(BENCH_KEEPALIVE_SEC) * k / g_npeers + 1));
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+bench_run(const char *name, apr_time_t duration)
+{
+    cpe_loop_stats *st;
+    apr_time_t      start;
+    apr_status_t    rv;
+    long            keepalives = 0;
+    int             k;
+
+    CHECK(cpe_clock_set_virtual(0));
+    CHECK(cpe_stats_enable(1));
+    for (k = 0; k < g_npeers; k++) {
+        g_peers[k].pe_keepalives = 0;
+        CHECK(peer_init(&g_peers[k], k));
+    }
+    g_expired = 0;
+    start = apr_time_now();
+    CHECK(cpe_main_loop(duration));
+    start = apr_time_now() - start;
+    for (k = 0; k < g_npeers; k++) {
+        keepalives += g_peers[k].pe_keepalives;
+    }
+    CHECK_NULL(st, calloc(1, sizeof *st));
+    CHECK(cpe_stats_snapshot(cpe_loop_current(), st));
+    printf("%-6s %d peers, %lld h in %.3f s (x%.0f): %ld keepalives, "
+        "%ld hold expired, %llu timeouts, late max %lld us\n", name,
+        g_npeers, (long long) (duration / apr_time_from_sec(3600)),
+        (double) start / APR_USEC_PER_SEC, (double) duration / start,
+        keepalives, g_expired, (unsigned long long) st->ls_timeouts,
+        (long long) st->ls_timer_late_us.h_max);
+    free(st);
+    return APR_SUCCESS;
+}
+
+int
+main(int argc, const char *const *argv)
+{
+    cpe_timerq_type timerq = CPE_TIMERQ_HEAP;
+    apr_time_t      duration;
+    int             hours;
+
+    if (apr_app_initialize(&argc, &argv, NULL) != APR_SUCCESS) {
+        return 1;
+    }
+    g_npeers = argc > 1 ? atoi(argv[1]) : BENCH_PEERS;
+    hours = argc > 2 ? atoi(argv[2]) : BENCH_HOURS;
+    if (argc > 3 && strcmp(argv[3], "wheel") == 0) {
+        timerq = CPE_TIMERQ_WHEEL;
+    }
+    if (g_npeers <= 0 || hours <= 0) {
+        fprintf(stderr, "usage: %s [npeers [hours [wheel]]]\n", argv[0]);
+        return 1;
+    }
+    duration = apr_time_from_sec(3600) * hours;
+    g_peers = calloc(g_npeers, sizeof *g_peers);
+    if (g_peers == NULL) {
+        return 1;
+    }
+    /* two timers per peer */
+    if (cpe_system_init2(2 * g_npeers + 16, timerq,
+            CPE_TIMERQ_TICK_DEFAULT) != APR_SUCCESS)
+    {
+        return 1;
+    }
+    cpe_log_init(CPE_WARN);
+    if (bench_run(timerq == CPE_TIMERQ_WHEEL ? "wheel:" : "heap:",
+            duration) != APR_SUCCESS)
+    {
+        return 1;
+    }
+    return 0;
+}
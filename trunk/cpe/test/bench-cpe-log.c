@@ -0,0 +1,169 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Benchmark of cpe_log(). Not a test, it is not run by "scons test".
+ *
+ * Cost per call of:
+ *
+ * disabled: a level below the one given to cpe_log_init();
+ * elided:   a level below CPE_LOG_MIN_LEVEL, removed at compile time;
+ * sync:     lines written to stdout, here /dev/null, by the caller;
+ * async:    lines queued to the ring of cpe_log_async();
+ * repeated: the same line over and over, counted and not written.
+ *
+ * The results are printed on a copy of the original stdout.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "cpe.h"
+#include "cpe-logging.h"
+
+#define BENCH_CALLS     (1000 * 1000)
+#define BENCH_RING      (1024 * 1024)
+
+static FILE          *g_out;
+static cpe_log_stats  g_prev;
+
+static void
+report(const char *name, apr_time_t start, int calls)
+{
+    cpe_log_stats st;
+
+    cpe_log_stats_get(&st);
+    fprintf(g_out, "%-9s %.1f ns per call (lines %u, repeated %u, "
+        "dropped %u, flushes %u)\n", name,
+        1e3 * (apr_time_now() - start) / calls,
+        st.ls_lines - g_prev.ls_lines, st.ls_repeated - g_prev.ls_repeated,
+        st.ls_dropped - g_prev.ls_dropped, st.ls_flushes - g_prev.ls_flushes);
+    g_prev = st;
+}
+
+static void
+bench_disabled(int calls)
+{
+    apr_time_t start = apr_time_now();
+    int        k;
+
+    for (k = 0; k < calls; k++) {
+        cpe_log(CPE_DEB, "disabled %d of %d", k, calls);
+    }
+    report("disabled:", start, calls);
+}
+
+static void
+bench_enabled(const char *name, int calls)
+{
+    apr_time_t start = apr_time_now();
+    int        k;
+
+    for (k = 0; k < calls; k++) {
+        cpe_log(CPE_INFO, "line %d of %d", k, calls);
+    }
+    cpe_log_flush();
+    report(name, start, calls);
+}
+
+static void
+bench_repeated(int calls)
+{
+    apr_time_t start = apr_time_now();
+    int        k;
+
+    for (k = 0; k < calls; k++) {
+        cpe_log(CPE_INFO, "always the same, %d", calls);
+    }
+    cpe_log_flush();
+    report("repeated:", start, calls);
+}
+
+/* From here on, the debug calls are compiled out. */
+#undef  CPE_LOG_MIN_LEVEL
+#define CPE_LOG_MIN_LEVEL CPE_INFO
+
+static void
+bench_elided(int calls)
+{
+    apr_time_t start = apr_time_now();
+    int        k;
+
+    for (k = 0; k < calls; k++) {
+        cpe_log(CPE_DEB, "elided %d of %d", k, calls);
+    }
+    report("elided:", start, calls);
+}
+
+int
+main(int argc, const char *const *argv)
+{
+    apr_pool_t *pool;
+    int         calls;
+
+    if (apr_app_initialize(&argc, &argv, NULL) != APR_SUCCESS) {
+        return 1;
+    }
+    calls = argc > 1 ? atoi(argv[1]) : BENCH_CALLS;
+    if (calls <= 0) {
+        fprintf(stderr, "usage: %s [calls]\n", argv[0]);
+        return 1;
+    }
+    g_out = fdopen(dup(STDOUT_FILENO), "w");
+    if (g_out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        return 1;
+    }
+    setvbuf(g_out, NULL, _IOLBF, 0);
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        return 1;
+    }
+    cpe_log_init(CPE_INFO);
+
+    bench_disabled(calls);
+    bench_elided(calls);
+    bench_enabled("sync:", calls);
+    bench_repeated(calls);
+    if (cpe_log_async(BENCH_RING, cpe_time_from_msec(10), pool) !=
+        APR_SUCCESS)
+    {
+        fprintf(stderr, "cpe_log_async failed\n");
+        return 1;
+    }
+    bench_enabled("async:", calls);
+    apr_pool_destroy(pool);
+    fclose(g_out);
+    return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Multi-core scaling benchmark of cpe_loops_run(). Not a test, it is not
+ * run by "scons test".
+ *
+ * For n = 1, 2, 4, ... up to max_loops (argument, default half the online
+ * cpus, so that each thread gets its own core), n server loops listen on
+ * the same port (SO_REUSEPORT) and n client loops open BENCH_CONNS
+ * connections each, then ping-pong BENCH_MSGLEN bytes on every connection
+ * until the end of the run. Reported: connections accepted per second and
+ * round trips per second, with the speedup over a single loop.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "cpe.h"
+#include "cpe-logging.h"
+#include "cpe-network.h"
+
+#define BENCH_ADDR      "127.0.0.1"
+#define BENCH_PORT      12346
+#define BENCH_CONNS     32              /* per client loop */
+#define BENCH_MSGLEN    64
+#define BENCH_MAX_LOOPS 64
+#define BENCH_RUN_MSEC  1000
+
+/* Written only by the thread of its loop. */
+struct bench_loop {
+    apr_pool_t  *bl_pool;
+    apr_time_t   bl_start;          /* client: connects issued */
+    apr_time_t   bl_last_conn;      /* server: last accept */
+    int          bl_conns;
+    long         bl_round_trips;
+    char         bl_buf[BENCH_MSGLEN];
+};
+
+static struct bench_loop g_bench[2 * BENCH_MAX_LOOPS];
+static int               g_nservers;
+static char              g_msg[BENCH_MSGLEN];
+
+static apr_status_t
+accepted_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct bench_loop *bl = context;
+
+    pfd = NULL;
+    e = NULL;
+    bl->bl_conns++;
+    bl->bl_last_conn = apr_time_now();
+    return APR_SUCCESS;
+}
+
+/* echo */
+static apr_status_t
+server_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct bench_loop *bl = context;
+    apr_size_t         len = sizeof bl->bl_buf;
+
+    if (apr_socket_recv(pfd->desc.s, bl->bl_buf, &len) != APR_SUCCESS) {
+        return APR_SUCCESS;
+    }
+    apr_socket_send(pfd->desc.s, bl->bl_buf, &len);
+    return cpe_event_add(e);
+}
+
+/* first ping, once connected */
+static apr_status_t
+connected_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    apr_size_t len = sizeof g_msg;
+
+    context = NULL;
+    e = NULL;
+    return apr_socket_send(pfd->desc.s, g_msg, &len);
+}
+
+/* pong received, ping again */
+static apr_status_t
+client_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct bench_loop *bl = context;
+    apr_size_t         len = sizeof bl->bl_buf;
+
+    if (apr_socket_recv(pfd->desc.s, bl->bl_buf, &len) != APR_SUCCESS) {
+        return APR_SUCCESS;
+    }
+    bl->bl_round_trips++;
+    apr_socket_send(pfd->desc.s, bl->bl_buf, &len);
+    return cpe_event_add(e);
+}
+
+/* the server loops are listening by now */
+static apr_status_t
+connect_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct bench_loop *bl = context;
+    apr_socket_t      *csock;
+    apr_sockaddr_t    *sockaddr;
+    apr_status_t       rv;
+    int                k;
+
+    pfd = NULL;
+    e = NULL;
+    bl->bl_start = apr_time_now();
+    for (k = 0; k < BENCH_CONNS; k++) {
+        CHECK(cpe_socket_client_create(&csock, &sockaddr, BENCH_ADDR,
+            BENCH_PORT, bl->bl_pool));
+        CHECK(cpe_socket_after_connect(csock, sockaddr, 0, client_cb, bl,
+            APR_POLLIN, connected_cb, bl, bl->bl_pool));
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+bench_init_cb(void *ctx, int loop_id)
+{
+    struct bench_loop *bl = &g_bench[loop_id];
+    apr_socket_t      *lsock;
+    apr_sockaddr_t    *sockaddr;
+    cpe_event         *e;
+    apr_status_t       rv;
+
+    ctx = NULL;
+    memset(bl, 0, sizeof *bl);
+    CHECK(apr_pool_create(&bl->bl_pool, NULL));
+    if (loop_id < g_nservers) {
+        CHECK(cpe_socket_server_create(&lsock, &sockaddr, BENCH_ADDR,
+            BENCH_PORT, BENCH_CONNS * BENCH_MAX_LOOPS, bl->bl_pool));
+        CHECK(cpe_socket_after_accept(lsock, server_cb, bl, APR_POLLIN,
+            NULL, CPE_MAX_PEERS, accepted_cb, bl, bl->bl_pool));
+    } else {
+        CHECK_NULL(e, cpe_event_timer_create(cpe_time_from_msec(20),
+            connect_cb, bl));
+        CHECK(cpe_event_add(e));
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+bench_run(int n, double *conn_rate, double *rtt_rate)
+{
+    apr_time_t   start = 0, last = 0;
+    long         round_trips = 0;
+    int          k, conns = 0;
+    apr_status_t rv;
+
+    g_nservers = n;
+    CHECK(cpe_loops_run(2 * n, bench_init_cb, NULL,
+        cpe_time_from_msec(BENCH_RUN_MSEC)));
+    for (k = 0; k < n; k++) {
+        conns += g_bench[k].bl_conns;
+        if (g_bench[k].bl_last_conn > last) {
+            last = g_bench[k].bl_last_conn;
+        }
+        if (start == 0 || g_bench[n + k].bl_start < start) {
+            start = g_bench[n + k].bl_start;
+        }
+        round_trips += g_bench[n + k].bl_round_trips;
+        apr_pool_destroy(g_bench[k].bl_pool);
+        apr_pool_destroy(g_bench[n + k].bl_pool);
+    }
+    if (conns != n * BENCH_CONNS || last <= start) {
+        fprintf(stderr, "%d loops: %d of %d connections accepted\n", n,
+            conns, n * BENCH_CONNS);
+        return APR_EGENERAL;
+    }
+    *conn_rate = conns / ((last - start) / 1e6);
+    *rtt_rate = round_trips / (BENCH_RUN_MSEC / 1e3);
+    return APR_SUCCESS;
+}
+
+int
+main(int argc, const char *const *argv)
+{
+    double conn_rate, rtt_rate, conn_base = 0, rtt_base = 0;
+    long   max_loops;
+    int    n;
+
+    if (apr_app_initialize(&argc, &argv, NULL) != APR_SUCCESS) {
+        return 1;
+    }
+    if (argc > 1) {
+        max_loops = atoi(argv[1]);
+    } else {
+        max_loops = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+    }
+    if (max_loops < 1) {
+        max_loops = 1;
+    } else if (max_loops > BENCH_MAX_LOOPS) {
+        max_loops = BENCH_MAX_LOOPS;
+    }
+    /* each loop gets at most BENCH_CONNS * 2 * max_loops events */
+    if (cpe_system_init(4 * BENCH_CONNS * max_loops) != APR_SUCCESS) {
+        return 1;
+    }
+    cpe_log_init(CPE_WARN);
+
+    printf("%d connections per client loop, %d byte ping-pong, %d ms\n",
+        BENCH_CONNS, BENCH_MSGLEN, BENCH_RUN_MSEC);
+    printf("%5s %12s %8s %12s %8s\n", "loops", "conn/s", "speedup",
+        "round-trip/s", "speedup");
+    for (n = 1; n <= max_loops; n *= 2) {
+        if (bench_run(n, &conn_rate, &rtt_rate) != APR_SUCCESS) {
+            return 1;
+        }
+        if (n == 1) {
+            conn_base = conn_rate;
+            rtt_base = rtt_rate;
+        }
+        printf("%5d %12.0f %8.2f %12.0f %8.2f\n", n, conn_rate,
+            conn_rate / conn_base, rtt_rate, rtt_rate / rtt_base);
+    }
+    return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Benchmark of cpe_post() between two loops, each in its own thread. Not a
+ * test, it is not run by "scons test".
+ *
+ * latency:    loop 0 posts to loop 1, which posts back, BENCH_PINGS times.
+ *             Both loops are idle in between, so every post wakes a loop
+ *             up: this is the cost of a wakeup, as seen by the poster.
+ * throughput: loop 1 posts BENCH_POSTS functions to loop 0 as fast as it
+ *             can, reported with the number of wakeups this took.
+ */
+
+#include <stdio.h>
+#include "cpe.h"
+#include "cpe-logging.h"
+
+#define BENCH_PINGS     100000
+#define BENCH_POSTS     1000000
+#define BENCH_MAX_MSEC  30000
+
+enum bench_mode { BENCH_LATENCY, BENCH_THROUGHPUT };
+
+static enum bench_mode  g_mode;
+static cpe_loop_t      *g_loops[2];
+/* Written by loop 0 only, read after cpe_loops_run(). */
+static long             g_count;
+static apr_time_t       g_start, g_stop;
+static cpe_post_stats   g_stats;
+
+static apr_status_t
+stop_fn(void *ctx)
+{
+    ctx = NULL;
+    cpe_main_loop_terminate();
+    return APR_SUCCESS;
+}
+
+/* loop 0: the last function is run, stop both loops */
+static apr_status_t
+bench_done(void)
+{
+    g_stop = apr_time_now();
+    cpe_post_stats_get(cpe_loop_current(), &g_stats);
+    cpe_main_loop_terminate();
+    return cpe_post(g_loops[1], stop_fn, NULL);
+}
+
+static apr_status_t pong_fn(void *ctx);
+
+/* loop 1 */
+static apr_status_t
+ping_fn(void *ctx)
+{
+    return cpe_post(g_loops[0], pong_fn, ctx);
+}
+
+/* loop 0 */
+static apr_status_t
+pong_fn(void *ctx)
+{
+    if (++g_count < BENCH_PINGS) {
+        return cpe_post(g_loops[1], ping_fn, ctx);
+    }
+    return bench_done();
+}
+
+/* loop 0 */
+static apr_status_t
+sink_fn(void *ctx)
+{
+    ctx = NULL;
+    if (++g_count < BENCH_POSTS) {
+        return APR_SUCCESS;
+    }
+    return bench_done();
+}
+
+/* loop 0 for the latency, loop 1 for the throughput */
+static apr_status_t
+start_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    apr_status_t rv;
+    long         k;
+
+    context = NULL;
+    pfd = NULL;
+    e = NULL;
+    g_start = apr_time_now();
+    if (g_mode == BENCH_LATENCY) {
+        return cpe_post(g_loops[1], ping_fn, NULL);
+    }
+    for (k = 0; k < BENCH_POSTS; k++) {
+        CHECK(cpe_post(g_loops[0], sink_fn, NULL));
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+bench_init_cb(void *ctx, int loop_id)
+{
+    cpe_event    *e;
+    apr_status_t  rv;
+
+    ctx = NULL;
+    g_loops[loop_id] = cpe_loop_current();
+    if (loop_id == (g_mode == BENCH_LATENCY ? 0 : 1)) {
+        /* give the other loop the time to start */
+        CHECK_NULL(e, cpe_event_timer_create(cpe_time_from_msec(20),
+            start_cb, NULL));
+        CHECK(cpe_event_add(e));
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+bench_run(enum bench_mode mode, long expected)
+{
+    apr_status_t rv;
+
+    g_mode = mode;
+    g_count = 0;
+    g_stop = 0;
+    CHECK(cpe_loops_run(2, bench_init_cb, NULL,
+        cpe_time_from_msec(BENCH_MAX_MSEC)));
+    if (g_count != expected || g_stop <= g_start) {
+        fprintf(stderr, "%ld of %ld posts run\n", g_count, expected);
+        return APR_EGENERAL;
+    }
+    return APR_SUCCESS;
+}
+
+int
+main(int argc, const char *const *argv)
+{
+    double elapsed;
+
+    if (apr_app_initialize(&argc, &argv, NULL) != APR_SUCCESS) {
+        return 1;
+    }
+    if (cpe_system_init(CPE_NUM_EVENTS_DEFAULT) != APR_SUCCESS) {
+        return 1;
+    }
+    cpe_log_init(CPE_WARN);
+
+    if (bench_run(BENCH_LATENCY, BENCH_PINGS) != APR_SUCCESS) {
+        return 1;
+    }
+    elapsed = (g_stop - g_start) / 1e3;
+    printf("latency:    %d round trips in %.0f ms, %.2f us per post\n",
+        BENCH_PINGS, elapsed, elapsed * 1e3 / (2.0 * BENCH_PINGS));
+
+    if (bench_run(BENCH_THROUGHPUT, BENCH_POSTS) != APR_SUCCESS) {
+        return 1;
+    }
+    elapsed = (g_stop - g_start) / 1e3;
+    printf("throughput: %d posts in %.0f ms, %.0f posts/s, "
+        "%u wakeups (%.0f posts per wakeup)\n", BENCH_POSTS, elapsed,
+        BENCH_POSTS / (elapsed / 1e3), g_stats.ps_wakeups,
+        (double) BENCH_POSTS / g_stats.ps_wakeups);
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Cisco Portable Events (CPE)
+ *
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Timer churn benchmark, heap vs timing wheel. Not a test, it is not run by
+ * "scons test".
+ *
+ * BENCH_TIMERS timers with a period of about one second are driven by a
+ * simulated clock advancing 1 ms per step, as cpe_main_loop() would do:
+ * - expire:  advance the queue, then remove_max and re-arm every expired
+ *            timer (BENCH_TIMERS re-arms per simulated second)
+ * - cancel:  remove a random timer and insert it again with a new
+ *            expiration, as an fdesc event whose timeout is reset by
+ *            activity (another BENCH_TIMERS per simulated second)
+ * and the average cost of each operation is reported for both backends.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include "cpe-algorithms.h"
+
+#define BENCH_TIMERS    100000
+#define BENCH_SECONDS   10
+#define BENCH_STEP_US   1000
+#define BENCH_PERIOD_US 1000000
+#define BENCH_TICK_US   1000
+
+static double
+bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+bench_run(const char *name, cpe_priorityQ *head, cpe_priorityQ *nodes)
+{
+    cpe_priorityQ *p;
+    unsigned int   i, k, n_expire = 0, n_cancel = 0;
+    int64_t        now = 0;
+    double         t0, t_expire = 0, t_cancel = 0;
+    unsigned int   cancel_per_step;
+
+    srandom(42);
+    for (i = 0; i < BENCH_TIMERS; i++) {
+        nodes[i].pq_index = 0;
+        nodes[i].pq_value = random() % BENCH_PERIOD_US;
+        cpe_priorityQ_insert(head, &nodes[i]);
+    }
+    cancel_per_step = BENCH_TIMERS / (BENCH_PERIOD_US / BENCH_STEP_US);
+
+    while (now < (int64_t) BENCH_SECONDS * BENCH_PERIOD_US) {
+        now += BENCH_STEP_US;
+
+        t0 = bench_now_ns();
+        cpe_priorityQ_advance(head, now);
+        while ((p = cpe_priorityQ_find_max(head)) != NULL &&
+            p->pq_value <= now)
+        {
+            cpe_priorityQ_remove_max(head);
+            p->pq_value = now + BENCH_PERIOD_US - 500 + random() % 1000;
+            cpe_priorityQ_insert(head, p);
+            n_expire++;
+        }
+        t_expire += bench_now_ns() - t0;
+
+        t0 = bench_now_ns();
+        for (i = 0; i < cancel_per_step; i++) {
+            k = random() % BENCH_TIMERS;
+            cpe_priorityQ_remove(head, &nodes[k]);
+            nodes[k].pq_value = now + BENCH_PERIOD_US - 500 + random() % 1000;
+            cpe_priorityQ_insert(head, &nodes[k]);
+            n_cancel++;
+        }
+        t_cancel += bench_now_ns() - t0;
+    }
+    assert(cpe_priorityQ_verify(head));
+    assert(cpe_priorityQ_len(head) == BENCH_TIMERS);
+
+    printf("%-6s %10u %12.1f %10u %12.1f\n", name, n_expire,
+        t_expire / n_expire, n_cancel, t_cancel / n_cancel);
+
+    /* the nodes belong to the caller, free only the queue itself */
+    while (cpe_priorityQ_remove_max(head) != NULL) {
+        ;
+    }
+    cpe_priorityQ_queue_destroy(head);
+    free(head);
+}
+
+int
+main(void)
+{
+    cpe_priorityQ *nodes, *head;
+
+    nodes = calloc(BENCH_TIMERS, sizeof *nodes);
+    assert(nodes != NULL);
+
+    printf("%u timers, %d s, tick %d us\n", BENCH_TIMERS, BENCH_SECONDS,
+        BENCH_TICK_US);
+    printf("%-6s %10s %12s %10s %12s  (ns/op)\n", "", "expired", "re-arm",
+        "cancelled", "re-arm");
+
+    head = cpe_priorityQ_create();
+    assert(head != NULL);
+    bench_run("heap", head, nodes);
+
+    head = cpe_priorityQ_create_wheel(BENCH_TICK_US, 0);
+    assert(head != NULL);
+    bench_run("wheel", head, nodes);
+
+    free(nodes);
+    return 0;
+}
@@ -37,9 +37,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "test-cpe-common.h"
 
 
-/* NOTE in this test, we are using only timer events. This means that the
- * CPE/APR code that will be tested for timeout is apr_sleep(), not
- * apr_pollset_poll().
+/* NOTE in this test, we are using only timer events, on the simulated
+ * clock (see cpe_clock_set_virtual()): the 3 s schedule is replayed at
+ * once, and every timer fires exactly on time.
  */
 static void
 test_timer_events(apr_time_t loop_duration)
@@ -59,7 +59,8 @@ test_timer_events(apr_time_t loop_duration)
     cpe_event     *event;
     u_int          count;
 
-    time_now = apr_time_now();
+    ok(cpe_clock_set_virtual(0) == APR_SUCCESS, "simulated clock");
+    time_now = cpe_clock_now();
 
     cbdata1.last_seen = time_now;
     cbdata1.timeout = apr_time_from_sec(1);
@@ -127,10 +128,9 @@ test_timer_events(apr_time_t loop_duration)
     ok(cbdata8.expected_count == cbdata8.count, "cb8, expected %d, seen %d",
         cbdata8.expected_count, cbdata8.count);
 
-    // TODO this should be a percentage
-    runtime = apr_time_now() - time_now;
-    ok(runtime > loop_duration, "runtime > loop duration (delta %lld ms)",
-        apr_time_as_msec(runtime - loop_duration));
+    runtime = cpe_clock_now() - time_now;
+    ok(runtime == loop_duration, "runtime == loop duration (delta %lld us)",
+        runtime - loop_duration);
 
 }
 
@@ -140,7 +140,7 @@ test_init(conf_t *conf)
     conf->co_debug = CPE_INFO;
     conf->co_loop_duration = apr_time_from_sec(3);
 
-    plan_tests(93);
+    plan_tests(94);
 
     return APR_SUCCESS;
 }
@@ -0,0 +1,221 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <string.h>
+#include "test-cpe-common.h"
+
+/* Timer storm: many timers expiring at the same instant are dispatched in
+ * batches, at most "budget" per loop iteration, with socket I/O in between.
+ */
+
+#define MYBUFSIZE ONE_SI_MEGA
+#define STORM_SIZE 300
+/* Simulated time per poll with I/O ready, see cpe_clock_set_virtual(). */
+#define IO_STEP_USEC 10
+
+struct storm_data {
+    int              fired;         /* storm callbacks invoked so far */
+    int              in_order;      /* 1 if fired in insertion order */
+    int              index[STORM_SIZE];
+    int              io_first;      /* client I/O count at first fire */
+    int              io_last;       /* client I/O count at last fire */
+    cpe_network_ctx *io_ctx;
+};
+
+static struct storm_data g_storm;
+
+static apr_status_t
+storm_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    int *index = context;
+
+    pfd = NULL;
+    e = NULL;
+    if (*index != g_storm.fired) {
+        g_storm.in_order = 0;
+    }
+    if (g_storm.fired == 0) {
+        g_storm.io_first = g_storm.io_ctx->nc_count;
+    }
+    g_storm.io_last = g_storm.io_ctx->nc_count;
+    g_storm.fired++;
+    return APR_SUCCESS;
+}
+
+/* send */
+static apr_status_t
+server_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    cpe_network_ctx *ctx = (cpe_network_ctx *) context;
+    cpe_io_buf      *sendbuf = ctx->nc_user_data;
+    apr_status_t     rv;
+    apr_size_t       len;
+
+    ctx->nc_count++;
+    len = sendbuf->buf_len - sendbuf->buf_offset;
+    rv = apr_socket_send(pfd->desc.s, &sendbuf->buf[sendbuf->buf_offset], &len);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_DEB, "apr_socket_send: %s", cpe_errmsg(rv));
+    }
+    sendbuf->buf_offset += len;
+    sendbuf->total += len;
+    if (sendbuf->buf_offset < sendbuf->buf_len) {
+        cpe_event_add(e);
+    }
+    return APR_SUCCESS;
+}
+
+/* receive */
+static apr_status_t
+client_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    cpe_network_ctx *ctx = (cpe_network_ctx *) context;
+    cpe_io_buf      *recvbuf = ctx->nc_user_data;
+    apr_status_t     rv;
+    apr_size_t       len;
+
+    ctx->nc_count++;
+    len = recvbuf->buf_capacity - recvbuf->buf_offset;
+    rv = apr_socket_recv(pfd->desc.s, &recvbuf->buf[recvbuf->buf_offset], &len);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_DEB, "apr_socket_recv: %s", cpe_errmsg(rv));
+    }
+    recvbuf->buf_offset += len;
+    recvbuf->total += len;
+    recvbuf->buf_len += len;
+    if (recvbuf->buf_offset < recvbuf->buf_capacity) {
+        cpe_event_add(e);
+    }
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_init(conf_t *conf)
+{
+    apr_status_t rv;
+
+    conf->co_debug = CPE_INFO;
+    conf->co_listen_port = SERVER_PORT;
+    conf->co_loop_duration = cpe_time_from_msec(300);
+    CHECK(apr_pool_create(&conf->co_pool, NULL));
+
+    plan_tests(28);
+
+    return APR_SUCCESS;
+}
+
+/* Add STORM_SIZE timers, all already expired. */
+static int
+storm_setup(cpe_network_ctx *io_ctx)
+{
+    apr_time_t expiration;
+    int        k;
+
+    memset(&g_storm, 0, sizeof g_storm);
+    g_storm.in_order = 1;
+    g_storm.io_ctx = io_ctx;
+    expiration = cpe_now();
+    for (k = 0; k < STORM_SIZE; k++) {
+        cpe_event *e;
+
+        g_storm.index[k] = k;
+        e = cpe_event_timer_create(1, storm_cb, &g_storm.index[k]);
+        if (e == NULL || cpe_event_add2(e, expiration) != APR_SUCCESS) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Transfer MYBUFSIZE bytes on localhost during a timer storm. */
+static void
+storm_run(conf_t *conf)
+{
+    cpe_network_ctx s_ctx, c_ctx;
+    cpe_io_buf      s_send, c_recv;
+    apr_time_t      runtime;
+
+    ok(storm_setup(&c_ctx), "setup storm");
+
+    memset(&s_ctx, 0, sizeof s_ctx);
+    memset(&s_send, 0, sizeof s_send);
+    s_ctx.nc_user_data = &s_send;
+    s_send.buf = apr_pcalloc(conf->co_pool, MYBUFSIZE);
+    s_send.buf_capacity = MYBUFSIZE;
+    s_send.buf_len = MYBUFSIZE;
+    memset(s_send.buf, 'x', MYBUFSIZE);
+
+    memset(&c_ctx, 0, sizeof c_ctx);
+    memset(&c_recv, 0, sizeof c_recv);
+    c_ctx.nc_user_data = &c_recv;
+    c_recv.buf = apr_pcalloc(conf->co_pool, MYBUFSIZE);
+    c_recv.buf_capacity = MYBUFSIZE;
+
+    test_network_io1(conf, &runtime,
+        server_cb, &s_ctx, APR_POLLOUT, NULL, NULL,
+        client_cb, &c_ctx, APR_POLLIN, NULL, NULL);
+
+    ok(g_storm.fired == STORM_SIZE, "all fired (seen %d)", g_storm.fired);
+    ok(g_storm.in_order, "fired in expiration order");
+    ok(c_recv.total == MYBUFSIZE, "total received (r %d e %d)",
+        c_recv.total, MYBUFSIZE);
+}
+
+apr_status_t
+test_run(conf_t *conf)
+{
+    /* The transfer must be over before the end of the loop, whatever the
+     * speed of the machine: on the simulated clock, it takes IO_STEP_USEC
+     * per poll.
+     */
+    ok(cpe_clock_set_virtual(IO_STEP_USEC) == APR_SUCCESS, "simulated clock");
+
+    /* No budget: the whole storm in the first iteration. */
+    cpe_main_loop_set_budget(0);
+    storm_run(conf);
+    ok(g_storm.io_last == g_storm.io_first,
+        "no I/O during the storm (client cb %d -> %d)", g_storm.io_first,
+        g_storm.io_last);
+
+    /* Budget of 4 timers per iteration: I/O is interleaved. */
+    cpe_main_loop_set_budget(4);
+    conf->co_listen_port++;
+    storm_run(conf);
+    ok(g_storm.io_last > g_storm.io_first,
+        "I/O during the storm (client cb %d -> %d)", g_storm.io_first,
+        g_storm.io_last);
+
+    return APR_SUCCESS;
+}
@@ -0,0 +1,164 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <string.h>
+#include "test-cpe-common.h"
+
+/* Periodic timers: deadlines at start + k * INTERVAL, whatever the time
+ * spent in the callback. On the simulated clock, the time spent is
+ * cpe_clock_advance(), and the schedule is exact.
+ */
+
+#define INTERVAL      cpe_time_from_msec(20)
+#define LOOP_DURATION cpe_time_from_msec(210)
+#define MAX_FIRED     32
+
+struct periodic_data {
+    apr_time_t   start;
+    apr_time_t   sleep_first;   /* time spent in the first callback */
+    apr_time_t   sleep_each;    /* time spent in every callback */
+    int          fired;
+    apr_uint32_t missed;
+    apr_time_t   when[MAX_FIRED];
+};
+
+static apr_status_t
+periodic_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct periodic_data *data = context;
+
+    pfd = NULL;
+    if (data->fired < MAX_FIRED) {
+        data->when[data->fired] = cpe_clock_now();
+    }
+    if (data->fired++ == 0) {
+        cpe_clock_advance(data->sleep_first);
+    }
+    cpe_clock_advance(data->sleep_each);
+    data->missed = cpe_event_missed(e);
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_init(conf_t *conf)
+{
+    apr_status_t rv;
+
+    conf->co_debug = CPE_INFO;
+    CHECK(apr_pool_create(&conf->co_pool, NULL));
+
+    plan_tests(19);
+
+    return APR_SUCCESS;
+}
+
+/* Run the main loop with one timer, first deadline at start + INTERVAL. */
+static void
+periodic_run(struct periodic_data *data, cpe_periodic_policy policy)
+{
+    cpe_event *event;
+    int        rv = 0;
+
+    event = cpe_event_timer_create(INTERVAL, periodic_cb, data);
+    if (event != NULL) {
+        data->start = cpe_now();
+        rv = (policy == CPE_PERIODIC_NONE ?
+                cpe_event_set_persistent(event, 1) :
+                cpe_event_set_periodic(event, policy)) == APR_SUCCESS &&
+            cpe_event_add2(event, data->start + INTERVAL) == APR_SUCCESS;
+    }
+    ok(rv, "setup timer");
+    ok(cpe_main_loop(LOOP_DURATION) == APR_SUCCESS, "event main loop");
+}
+
+apr_status_t
+test_run(conf_t *conf)
+{
+    struct periodic_data d_drift, d_skip, d_catchup, d_plain;
+    apr_time_t           late, late_max;
+    cpe_event           *event;
+    int                  k;
+
+    conf = NULL;
+    ok(cpe_clock_set_virtual(0) == APR_SUCCESS, "simulated clock");
+
+    /* Callback latency doesn't accumulate. */
+    memset(&d_drift, 0, sizeof d_drift);
+    d_drift.sleep_each = cpe_time_from_msec(5);
+    periodic_run(&d_drift, CPE_PERIODIC_SKIP);
+    ok(d_drift.fired == 10, "fired every period (seen %d)", d_drift.fired);
+    ok(d_drift.missed == 0, "no deadline missed (seen %u)", d_drift.missed);
+    late_max = 0;
+    for (k = 0; k < d_drift.fired && k < MAX_FIRED; k++) {
+        late = d_drift.when[k] - (d_drift.start + (k + 1) * INTERVAL);
+        if (late < 0 || late > late_max) {
+            late_max = late < 0 ? INTERVAL : late;
+        }
+    }
+    ok(late_max == 0, "on schedule (max late %lld us)", late_max);
+
+    /* Re-armed from the time of its dispatch: the first callback takes
+     * 75 ms, the second call is late, and the following ones keep its
+     * lag: 20, 95, 115 ... 195 ms.
+     */
+    memset(&d_plain, 0, sizeof d_plain);
+    d_plain.sleep_first = cpe_time_from_msec(75);
+    periodic_run(&d_plain, CPE_PERIODIC_NONE);
+    ok(d_plain.fired == 7 &&
+        d_plain.when[1] - d_plain.start == cpe_time_from_msec(95) &&
+        d_plain.when[2] - d_plain.start == cpe_time_from_msec(115),
+        "persistent drifts (seen %d)", d_plain.fired);
+
+    /* First callback takes 3.5 periods: deadlines 40, 60 and 80 ms missed. */
+    memset(&d_skip, 0, sizeof d_skip);
+    d_skip.sleep_first = cpe_time_from_msec(70);
+    periodic_run(&d_skip, CPE_PERIODIC_SKIP);
+    ok(d_skip.fired == 7, "skip: fired (seen %d)", d_skip.fired);
+    ok(d_skip.missed == 3, "skip: missed (seen %u)", d_skip.missed);
+
+    memset(&d_catchup, 0, sizeof d_catchup);
+    d_catchup.sleep_first = cpe_time_from_msec(70);
+    periodic_run(&d_catchup, CPE_PERIODIC_CATCHUP);
+    ok(d_catchup.fired == 10, "catchup: fired (seen %d)", d_catchup.fired);
+    ok(d_catchup.missed == 3, "catchup: missed (seen %u)",
+        d_catchup.missed);
+
+    event = cpe_event_timer_create(INTERVAL, periodic_cb, &d_plain);
+    ok(event != NULL && cpe_event_set_periodic(event, 42) == APR_EINVAL,
+        "invalid policy");
+    cpe_event_destroy(&event);
+
+    return APR_SUCCESS;
+}
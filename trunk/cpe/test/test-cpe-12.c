@@ -0,0 +1,291 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <string.h>
+#include "test-cpe-common.h"
+
+/* Streaming receive: a burst of small messages of varying size, parsed by
+ * cpe_receiver_stream() out of a ring that wraps many times. Then again
+ * with a handler failing on some of them, one of which is next to last: the
+ * last msg must still be handled, although no more bytes follow it. Last,
+ * a few messages with a handler that drops the connection in the middle.
+ */
+
+#define NMSGS      2000
+#define MAXMSGSIZE 512
+#define DROP_NMSGS 20       /* sent at once: no send to a dropped peer */
+#define DROP_AT    10
+
+typedef struct {
+    uint32_t msg_length;    /* header included */
+    uint32_t msg_seq;
+} msg_hdr_t;
+
+struct stream_data {
+    int received;
+    int in_order;
+    int payload_ok;
+    int fail_every;     /* handler fails on these seqs (0: never) */
+    int failed;         /* handler failures */
+    int errors;         /* cpe_receiver_stream() errors */
+    int drop_at;        /* handler drops the connection on this seq */
+    apr_pollfd_t *pfd;  /* of the connection, for the drop */
+};
+
+static int
+msg_size(int seq)
+{
+    return sizeof(msg_hdr_t) + (seq * 37) % (MAXMSGSIZE - sizeof(msg_hdr_t));
+}
+
+/* Fill buf with NMSGS messages, return the total length. */
+static int
+burst_prepare(char *buf)
+{
+    msg_hdr_t *hdr;
+    int        seq, k, len, offset = 0;
+
+    for (seq = 0; seq < NMSGS; seq++) {
+        len = msg_size(seq);
+        hdr = (msg_hdr_t *) &buf[offset];
+        hdr->msg_length = htonl(len);
+        hdr->msg_seq = htonl(seq);
+        for (k = sizeof *hdr; k < len; k++) {
+            buf[offset + k] = (seq + k) & 0xff;
+        }
+        offset += len;
+    }
+    return offset;
+}
+
+static apr_status_t
+get_msg_size_cb(cpe_io_buf *iobuf, int *msg_len)
+{
+    msg_hdr_t *hdr;
+
+    hdr = (msg_hdr_t *) &iobuf->buf[0];
+    *msg_len = ntohl(hdr->msg_length);
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+msg_handler_cb(cpe_io_buf *iobuf, cpe_network_ctx *nctx)
+{
+    struct stream_data *data = nctx->nc_user_data;
+    msg_hdr_t          *hdr;
+    int                 seq, k;
+
+    hdr = (msg_hdr_t *) &iobuf->buf[0];
+    seq = ntohl(hdr->msg_seq);
+    if (seq != data->received || iobuf->buf_len != msg_size(seq)) {
+        data->in_order = 0;
+    }
+    for (k = sizeof *hdr; k < iobuf->buf_len; k++) {
+        if ((unsigned char) iobuf->buf[k] != ((seq + k) & 0xff)) {
+            data->payload_ok = 0;
+        }
+    }
+    data->received++;
+    cpe_iobuf_destroy(&iobuf, nctx);
+    if (data->drop_at > 0 && seq == data->drop_at) {
+        cpe_receiver_stream_drop(nctx, data->pfd);
+        return APR_SUCCESS;
+    }
+    if (data->fail_every > 0 &&
+        (seq % data->fail_every == 0 || seq == NMSGS - 2))
+    {
+        data->failed++;
+        return APR_EGENERAL;
+    }
+    return APR_SUCCESS;
+}
+
+/* send the burst */
+static apr_status_t
+server_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    cpe_network_ctx *ctx = (cpe_network_ctx *) context;
+    cpe_io_buf      *sendbuf = ctx->nc_user_data;
+    apr_status_t     rv;
+    apr_size_t       len;
+
+    ctx->nc_count++;
+    len = sendbuf->buf_len - sendbuf->buf_offset;
+    rv = apr_socket_send(pfd->desc.s, &sendbuf->buf[sendbuf->buf_offset], &len);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_DEB, "apr_socket_send: %s", cpe_errmsg(rv));
+    }
+    sendbuf->buf_offset += len;
+    sendbuf->total += len;
+    if (sendbuf->buf_offset < sendbuf->buf_len) {
+        cpe_event_add(e);
+    }
+    return APR_SUCCESS;
+}
+
+/* receive */
+static apr_status_t
+client_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    cpe_network_ctx    *ctx = (cpe_network_ctx *) context;
+    struct stream_data *data = ctx->nc_user_data;
+    apr_status_t        rv;
+
+    cpe_event_add(e);
+    ctx->nc_count++;
+    data->pfd = pfd;
+    rv = cpe_receiver_stream(ctx, pfd, MAXMSGSIZE, sizeof(msg_hdr_t),
+        get_msg_size_cb, msg_handler_cb);
+    if (rv != APR_SUCCESS) {
+        data->errors++;
+    }
+    return rv;
+}
+
+apr_status_t
+test_init(conf_t *conf)
+{
+    apr_status_t rv;
+
+    conf->co_debug = CPE_INFO;
+    conf->co_listen_port = SERVER_PORT;
+    conf->co_loop_duration = cpe_time_from_msec(300);
+    CHECK(apr_pool_create(&conf->co_pool, NULL));
+
+    plan_tests(1 + 2 * (8 + 5) + 3 + 8 + 2);
+
+    return APR_SUCCESS;
+}
+
+/* Send the burst, receive it with a handler failing on every fail_every
+ * seq; 5 + 8 tests.
+ */
+static void
+burst_run(conf_t *conf, int fail_every, struct stream_data *data)
+{
+    cpe_network_ctx    s_ctx, c_ctx;
+    cpe_io_buf         s_send;
+    apr_time_t         runtime;
+    int                len;
+
+    memset(&s_ctx, 0, sizeof s_ctx);
+    memset(&s_send, 0, sizeof s_send);
+    s_ctx.nc_user_data = &s_send;
+    s_send.buf = apr_pcalloc(conf->co_pool, NMSGS * MAXMSGSIZE);
+    len = burst_prepare(s_send.buf);
+    s_send.buf_capacity = len;
+    s_send.buf_len = len;
+
+    memset(data, 0, sizeof *data);
+    data->in_order = 1;
+    data->payload_ok = 1;
+    data->fail_every = fail_every;
+    memset(&c_ctx, 0, sizeof c_ctx);
+    c_ctx.nc_user_data = data;
+
+    test_network_io1(conf, &runtime,
+        server_cb, &s_ctx, APR_POLLOUT, NULL, NULL,
+        client_cb, &c_ctx, APR_POLLIN, NULL, NULL);
+
+    ok(data->received == NMSGS, "all msgs received (%d of %d)",
+        data->received, NMSGS);
+    ok(data->in_order, "msgs received in order, with their length");
+    ok(data->payload_ok, "msg payloads intact");
+    ok(c_ctx.nc_total_received == len, "total received (r %d e %d)",
+        c_ctx.nc_total_received, len);
+    ok(c_ctx.nc_count < NMSGS / 4, "many msgs per read (%d reads)",
+        c_ctx.nc_count);
+}
+
+/* The first DROP_NMSGS msgs of the burst, with a handler dropping the
+ * connection on DROP_AT; 8 + 2 tests.
+ */
+static void
+drop_run(conf_t *conf, struct stream_data *data)
+{
+    cpe_network_ctx    s_ctx, c_ctx;
+    cpe_io_buf         s_send;
+    apr_time_t         runtime;
+    int                seq, len;
+
+    memset(&s_ctx, 0, sizeof s_ctx);
+    memset(&s_send, 0, sizeof s_send);
+    s_ctx.nc_user_data = &s_send;
+    s_send.buf = apr_pcalloc(conf->co_pool, NMSGS * MAXMSGSIZE);
+    burst_prepare(s_send.buf);
+    for (len = 0, seq = 0; seq < DROP_NMSGS; seq++) {
+        len += msg_size(seq);
+    }
+    s_send.buf_capacity = len;
+    s_send.buf_len = len;
+
+    memset(data, 0, sizeof *data);
+    data->in_order = 1;
+    data->payload_ok = 1;
+    data->drop_at = DROP_AT;
+    memset(&c_ctx, 0, sizeof c_ctx);
+    c_ctx.nc_user_data = data;
+
+    test_network_io1(conf, &runtime,
+        server_cb, &s_ctx, APR_POLLOUT, NULL, NULL,
+        client_cb, &c_ctx, APR_POLLIN, NULL, NULL);
+
+    ok(data->received == DROP_AT + 1 && data->in_order,
+        "no msg handled after the drop (%d of %d)", data->received,
+        DROP_NMSGS);
+    ok(c_ctx.nc_ring == NULL, "ring given back with the connection");
+}
+
+apr_status_t
+test_run(conf_t *conf)
+{
+    struct stream_data data;
+    int                fail_every = 97;
+
+    burst_run(conf, 0, &data);
+    ok(data.errors == 0, "no receive errors (%d)", data.errors);
+
+    conf->co_listen_port++;
+    burst_run(conf, fail_every, &data);
+    ok(data.failed == (NMSGS - 1) / fail_every + 2,
+        "handler failures (%d)", data.failed);
+    ok(data.errors > 0 && data.errors <= data.failed,
+        "handler failures returned (%d)", data.errors);
+
+    conf->co_listen_port++;
+    drop_run(conf, &data);
+
+    return APR_SUCCESS;
+}
@@ -0,0 +1,213 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include "test-cpe-common.h"
+
+/* Vectored send: a long queue of small iobufs, drained by cpe_sender() with
+ * few sends, and received in order by cpe_receiver_stream().
+ */
+
+#define NMSGS      2000
+#define MAXMSGSIZE 512
+
+typedef struct {
+    uint32_t msg_length;    /* header included */
+    uint32_t msg_seq;
+} msg_hdr_t;
+
+struct stream_data {
+    int received;
+    int in_order;
+    int payload_ok;
+};
+
+static int
+msg_size(int seq)
+{
+    return sizeof(msg_hdr_t) + (seq * 37) % (MAXMSGSIZE - sizeof(msg_hdr_t));
+}
+
+/* Queue NMSGS messages, each in its own iobuf, to be destroyed once sent. */
+static apr_status_t
+burst_enqueue(cpe_network_ctx *nctx)
+{
+    cpe_io_buf   *iobuf;
+    msg_hdr_t    *hdr;
+    apr_status_t  rv;
+    int           seq, k, len;
+
+    for (seq = 0; seq < NMSGS; seq++) {
+        len = msg_size(seq);
+        CHECK(cpe_iobuf_get(&iobuf, len));
+        hdr = (msg_hdr_t *) &iobuf->buf[0];
+        hdr->msg_length = htonl(len);
+        hdr->msg_seq = htonl(seq);
+        for (k = sizeof *hdr; k < len; k++) {
+            iobuf->buf[k] = (seq + k) & 0xff;
+        }
+        iobuf->buf_len = len;
+        iobuf->destroy = 1;
+        CHECK(cpe_send_enqueue(nctx->nc_sendQ, iobuf));
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+get_msg_size_cb(cpe_io_buf *iobuf, int *msg_len)
+{
+    msg_hdr_t *hdr;
+
+    hdr = (msg_hdr_t *) &iobuf->buf[0];
+    *msg_len = ntohl(hdr->msg_length);
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+msg_handler_cb(cpe_io_buf *iobuf, cpe_network_ctx *nctx)
+{
+    struct stream_data *data = nctx->nc_user_data;
+    msg_hdr_t          *hdr;
+    int                 seq, k;
+
+    hdr = (msg_hdr_t *) &iobuf->buf[0];
+    seq = ntohl(hdr->msg_seq);
+    if (seq != data->received || iobuf->buf_len != msg_size(seq)) {
+        data->in_order = 0;
+    }
+    for (k = sizeof *hdr; k < iobuf->buf_len; k++) {
+        if ((unsigned char) iobuf->buf[k] != ((seq + k) & 0xff)) {
+            data->payload_ok = 0;
+        }
+    }
+    data->received++;
+    cpe_iobuf_destroy(&iobuf, nctx);
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+server_one_shot_cb(void *context, apr_pollfd_t *pfd, cpe_event *event)
+{
+    apr_status_t     rv;
+    cpe_network_ctx *ctx = (cpe_network_ctx *) context;
+
+    CHECK(cpe_queue_init(&ctx->nc_sendQ, pfd, ctx->nc_pool, event));
+    return rv;
+}
+
+/* queue the burst on the first call, then drain it */
+static apr_status_t
+server_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    cpe_network_ctx *ctx = (cpe_network_ctx *) context;
+    apr_status_t     rv;
+
+    pfd = NULL;
+    cpe_event_add(e);
+    if (ctx->nc_count++ == 0) {
+        CHECK(burst_enqueue(ctx));
+    }
+    return cpe_sender(ctx);
+}
+
+/* receive */
+static apr_status_t
+client_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    cpe_network_ctx *ctx = (cpe_network_ctx *) context;
+
+    cpe_event_add(e);
+    ctx->nc_count++;
+    return cpe_receiver_stream(ctx, pfd, MAXMSGSIZE, sizeof(msg_hdr_t),
+        get_msg_size_cb, msg_handler_cb);
+}
+
+apr_status_t
+test_init(conf_t *conf)
+{
+    apr_status_t rv;
+
+    conf->co_debug = CPE_INFO;
+    conf->co_listen_port = SERVER_PORT;
+    conf->co_loop_duration = cpe_time_from_msec(300);
+    CHECK(apr_pool_create(&conf->co_pool, NULL));
+
+    plan_tests(16);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_run(conf_t *conf)
+{
+    cpe_network_ctx    s_ctx, c_ctx;
+    struct stream_data data = {0, 1, 1};
+    cpe_iobuf_stats    stats;
+    apr_time_t         runtime;
+    int                len, seq;
+
+    len = 0;
+    for (seq = 0; seq < NMSGS; seq++) {
+        len += msg_size(seq);
+    }
+
+    memset(&s_ctx, 0, sizeof s_ctx);
+    s_ctx.nc_pool = conf->co_pool;
+
+    memset(&c_ctx, 0, sizeof c_ctx);
+    c_ctx.nc_pool = conf->co_pool;
+    c_ctx.nc_user_data = &data;
+
+    test_network_io1(conf, &runtime,
+        server_cb, &s_ctx, APR_POLLOUT, server_one_shot_cb, &s_ctx,
+        client_cb, &c_ctx, APR_POLLIN, NULL, NULL);
+
+    ok(data.received == NMSGS, "all msgs received (%d of %d)",
+        data.received, NMSGS);
+    ok(data.in_order, "msgs received in order, with their length");
+    ok(data.payload_ok, "msg payloads intact");
+    ok(s_ctx.nc_sendQ->cq_total_sent == len, "total sent (s %d e %d)",
+        s_ctx.nc_sendQ->cq_total_sent, len);
+    ok(s_ctx.nc_sendQ->cq_nelems == 0 && s_ctx.nc_sendQ->cq_next == NULL,
+        "send queue drained (nelems %d)", s_ctx.nc_sendQ->cq_nelems);
+    ok(s_ctx.nc_count < NMSGS / 100, "many iobufs per send (%d sends)",
+        s_ctx.nc_count);
+    cpe_iobuf_stats_get(&stats);
+    ok(stats.is_in_use == 1, "sent iobufs released (in use %u)",
+        stats.is_in_use);
+
+    return APR_SUCCESS;
+}
@@ -0,0 +1,215 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include "test-cpe-common.h"
+
+/* Event loops on several threads: NSERVERS loops listen on the same port,
+ * one more loop opens NCONN connections and sends MSGLEN bytes on each.
+ */
+
+#define NSERVERS 4
+#define NLOOPS   (NSERVERS + 1)
+#define NCONN    64
+#define MSGLEN   1000
+
+/* Written only by the thread of its loop, read after cpe_loops_run(). */
+struct loop_data {
+    int          ld_id;
+    cpe_loop_t  *ld_loop;
+    apr_pool_t  *ld_pool;
+    int          ld_wrong_loop;  /* callbacks run from another loop */
+    int          ld_accepted;
+    int          ld_received;
+    int          ld_sent;
+};
+
+static struct loop_data g_loops[NLOOPS];
+static char             g_msg[MSGLEN];
+
+static void
+check_loop(struct loop_data *ld)
+{
+    if (cpe_loop_id() != ld->ld_id || cpe_loop_current() != ld->ld_loop) {
+        ld->ld_wrong_loop++;
+    }
+}
+
+static apr_status_t
+accepted_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct loop_data *ld = context;
+
+    pfd = NULL;
+    e = NULL;
+    check_loop(ld);
+    ld->ld_accepted++;
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+server_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct loop_data *ld = context;
+    char              buf[MSGLEN];
+    apr_size_t        len = sizeof buf;
+    apr_status_t      rv;
+
+    check_loop(ld);
+    rv = apr_socket_recv(pfd->desc.s, buf, &len);
+    ld->ld_received += len;
+    if (rv == APR_SUCCESS) {
+        cpe_event_add(e);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+client_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct loop_data *ld = context;
+    apr_size_t        len = sizeof g_msg;
+
+    e = NULL;
+    check_loop(ld);
+    apr_socket_send(pfd->desc.s, g_msg, &len);
+    ld->ld_sent += len;
+    return APR_SUCCESS;
+}
+
+/* give the server loops the time to listen, then connect */
+static apr_status_t
+connect_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct loop_data *ld = context;
+    apr_socket_t     *csock;
+    apr_sockaddr_t   *sockaddr;
+    apr_status_t      rv;
+    int               k;
+
+    pfd = NULL;
+    e = NULL;   /* one-shot */
+    check_loop(ld);
+    for (k = 0; k < NCONN; k++) {
+        CHECK(cpe_socket_client_create(&csock, &sockaddr, SERVER_ADDR,
+            g_conf.co_listen_port, ld->ld_pool));
+        CHECK(cpe_socket_after_connect(csock, sockaddr, 0, client_cb, ld,
+            APR_POLLOUT, NULL, NULL, ld->ld_pool));
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+loop_init_cb(void *ctx, int loop_id)
+{
+    struct loop_data *ld = &g_loops[loop_id];
+    apr_socket_t     *lsock;
+    apr_sockaddr_t   *sockaddr;
+    cpe_event        *e;
+    apr_status_t      rv;
+
+    ctx = NULL;
+    ld->ld_id = loop_id;
+    ld->ld_loop = cpe_loop_current();
+    CHECK(apr_pool_create(&ld->ld_pool, NULL));
+    if (loop_id < NSERVERS) {
+        CHECK(cpe_socket_server_create(&lsock, &sockaddr, SERVER_ADDR,
+            g_conf.co_listen_port, NCONN, ld->ld_pool));
+        CHECK(cpe_socket_after_accept(lsock, server_cb, ld, APR_POLLIN,
+            NULL, NCONN, accepted_cb, ld, ld->ld_pool));
+    } else {
+        CHECK_NULL(e, cpe_event_timer_create(cpe_time_from_msec(50),
+            connect_cb, ld));
+        CHECK(cpe_event_add(e));
+    }
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_init(conf_t *conf)
+{
+    apr_status_t rv;
+
+    conf->co_debug = CPE_INFO;
+    conf->co_listen_port = SERVER_PORT;
+    conf->co_loop_duration = cpe_time_from_msec(300);
+    CHECK(apr_pool_create(&conf->co_pool, NULL));
+
+    plan_tests(10);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_run(conf_t *conf)
+{
+    int k, sent, received, accepted, busy, wrong_loop, distinct;
+
+    ok(cpe_loops_run(0, loop_init_cb, NULL, conf->co_loop_duration) ==
+        APR_EINVAL, "no loops, EINVAL");
+    cpe_log_init(CPE_WARN);     /* one line per accept otherwise */
+    ok(cpe_loops_run(NLOOPS, loop_init_cb, NULL, conf->co_loop_duration) ==
+        APR_SUCCESS, "cpe_loops_run");
+
+    sent = received = accepted = busy = wrong_loop = 0;
+    distinct = 1;
+    for (k = 0; k < NLOOPS; k++) {
+        sent += g_loops[k].ld_sent;
+        received += g_loops[k].ld_received;
+        accepted += g_loops[k].ld_accepted;
+        wrong_loop += g_loops[k].ld_wrong_loop;
+        if (k < NSERVERS && g_loops[k].ld_accepted > 0) {
+            busy++;
+        }
+        if (g_loops[k].ld_loop == cpe_loop_current() ||
+            (k > 0 && g_loops[k].ld_loop == g_loops[k - 1].ld_loop))
+        {
+            distinct = 0;
+        }
+    }
+    ok(distinct, "each thread has its own loop");
+    ok(wrong_loop == 0, "callbacks run in the loop of their event (%d)",
+        wrong_loop);
+    ok(sent == NCONN * MSGLEN, "all sent (%d of %d)", sent, NCONN * MSGLEN);
+    ok(received == sent, "all received (%d of %d)", received, sent);
+    ok(accepted == NCONN, "all accepted (%d of %d)", accepted, NCONN);
+    ok(busy > 1, "connections spread over %d of %d server loops", busy,
+        NSERVERS);
+    ok(cpe_loop_id() == -1 && cpe_events_in_system() == 0,
+        "default loop untouched");
+
+    return APR_SUCCESS;
+}
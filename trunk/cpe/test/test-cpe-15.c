@@ -0,0 +1,222 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include "test-cpe-common.h"
+
+/* Cross-loop posting: loop 1 posts a burst of NPOSTS functions to loop 0
+ * while loop 0 is busy in a callback; loop 0 must run them in order, for a
+ * single wakeup. Then loop 1 posts NDEFAULT functions to the default loop,
+ * run after cpe_loops_run().
+ */
+
+#define NLOOPS   2
+#define NPOSTS   1000
+#define NDEFAULT 10
+
+/* Written only by the thread of loop 0, read after cpe_loops_run(). */
+struct consumer {
+    int             cs_run;
+    int             cs_disorder;
+    int             cs_wrong_loop;
+    int             cs_self;
+    cpe_post_stats  cs_stats;
+};
+
+static cpe_loop_t      *g_loops[NLOOPS];
+static cpe_loop_t      *g_default;
+static struct consumer  g_consumer;
+static int              g_default_run;
+static int              g_default_wrong_loop;
+static volatile int     g_burst_posted;
+
+static apr_status_t
+burst_fn(void *ctx)
+{
+    int k = (int) (long) ctx;
+
+    if (cpe_loop_id() != 0) {
+        g_consumer.cs_wrong_loop++;
+    }
+    if (k != g_consumer.cs_run) {
+        g_consumer.cs_disorder++;
+    }
+    g_consumer.cs_run++;
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+self_fn(void *ctx)
+{
+    ctx = NULL;
+    if (cpe_loop_id() == 0) {
+        g_consumer.cs_self++;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+default_fn(void *ctx)
+{
+    ctx = NULL;
+    if (cpe_loop_id() != -1) {
+        g_default_wrong_loop++;
+    }
+    g_default_run++;
+    return APR_SUCCESS;
+}
+
+/* loop 0, once the burst is over */
+static apr_status_t
+stats_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    context = NULL;
+    pfd = NULL;
+    e = NULL;
+    cpe_post_stats_get(cpe_loop_current(), &g_consumer.cs_stats);
+    return APR_SUCCESS;
+}
+
+/* loop 0, before the burst: stay busy until it is all posted */
+static apr_status_t
+busy_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    int k;
+
+    context = NULL;
+    pfd = NULL;
+    e = NULL;
+    for (k = 0; k < 100 && ! g_burst_posted; k++) {
+        apr_sleep(cpe_time_from_msec(2));
+    }
+    return APR_SUCCESS;
+}
+
+/* loop 1, once loop 0 is busy */
+static apr_status_t
+burst_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    apr_status_t rv;
+    long         k;
+
+    context = NULL;
+    pfd = NULL;
+    e = NULL;
+    for (k = 0; k < NPOSTS; k++) {
+        CHECK(cpe_post(g_loops[0], burst_fn, (void *) k));
+    }
+    __sync_synchronize();
+    g_burst_posted = 1;
+    for (k = 0; k < NDEFAULT; k++) {
+        CHECK(cpe_post(g_default, default_fn, NULL));
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+loop_init_cb(void *ctx, int loop_id)
+{
+    cpe_event    *e;
+    apr_status_t  rv;
+
+    ctx = NULL;
+    g_loops[loop_id] = cpe_loop_current();
+    if (loop_id == 0) {
+        CHECK(cpe_post(cpe_loop_current(), self_fn, NULL));
+        CHECK_NULL(e, cpe_event_timer_create(cpe_time_from_msec(40),
+            busy_cb, NULL));
+        CHECK(cpe_event_add(e));
+        CHECK_NULL(e, cpe_event_timer_create(cpe_time_from_msec(250),
+            stats_cb, NULL));
+    } else {
+        CHECK_NULL(e, cpe_event_timer_create(cpe_time_from_msec(50),
+            burst_cb, NULL));
+    }
+    CHECK(cpe_event_add(e));
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_init(conf_t *conf)
+{
+    apr_status_t rv;
+
+    conf->co_debug = CPE_INFO;
+    conf->co_loop_duration = cpe_time_from_msec(300);
+    CHECK(apr_pool_create(&conf->co_pool, NULL));
+
+    plan_tests(12);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_run(conf_t *conf)
+{
+    cpe_post_stats *st = &g_consumer.cs_stats;
+    apr_status_t    rv;
+
+    g_default = cpe_loop_current();
+    ok(cpe_post(NULL, default_fn, NULL) == APR_EINVAL &&
+        cpe_post(g_default, NULL, NULL) == APR_EINVAL, "invalid parms");
+    ok(cpe_loops_run(NLOOPS, loop_init_cb, NULL, conf->co_loop_duration) ==
+        APR_SUCCESS, "cpe_loops_run");
+
+    ok(g_consumer.cs_run == NPOSTS, "all posts run (%d of %d)",
+        g_consumer.cs_run, NPOSTS);
+    ok(g_consumer.cs_disorder == 0, "in posting order (%d out of order)",
+        g_consumer.cs_disorder);
+    ok(g_consumer.cs_wrong_loop == 0, "by the loop posted to (%d wrong)",
+        g_consumer.cs_wrong_loop);
+    ok(g_consumer.cs_self == 1, "a loop can post to itself");
+    ok(st->ps_posted == NPOSTS + 1 && st->ps_run == st->ps_posted,
+        "stats posted %u run %u", st->ps_posted, st->ps_run);
+    /* one for the post to itself, one for the burst */
+    ok(st->ps_wakeups == 2 && st->ps_max_batch == NPOSTS,
+        "wakeups batched (%u wakeups, max batch %u)", st->ps_wakeups,
+        st->ps_max_batch);
+
+    /* the posts to the default loop are pending, but there is no event */
+    cpe_main_loop(0);
+    ok(g_default_run == 0, "posts alone do not keep the main loop running");
+    rv = cpe_main_loop(cpe_time_from_msec(50));
+    ok(rv == APR_SUCCESS && g_default_run == NDEFAULT &&
+        g_default_wrong_loop == 0, "default loop ran the posts (%d of %d)",
+        g_default_run, NDEFAULT);
+    ok(cpe_events_in_system() == 0, "default loop events released");
+
+    return APR_SUCCESS;
+}
@@ -0,0 +1,230 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "test-cpe-common.h"
+
+/* Shared send: one iobuf queued to NPEERS sockets at once with
+ * cpe_send_enqueue_shared(), each peer getting all of it, and the iobuf
+ * given back once the last queue has sent it. Also, a queue destroyed with
+ * its pool drops its references.
+ */
+
+#define NPEERS 8
+#define MSGLEN 300
+/* Simulated time per poll with I/O ready, see cpe_clock_set_virtual(). */
+#define IO_STEP_USEC 10
+
+struct peer {
+    cpe_network_ctx pe_nctx;
+    int             pe_fd[2];   /* send, receive */
+};
+
+static struct peer g_peers[NPEERS];
+static int         g_ready;
+static int         g_drained;
+static cpe_io_buf *g_msg;
+
+/* Queue g_msg to all the peers, then give it up. */
+static apr_status_t
+fan_out(void)
+{
+    apr_status_t rv;
+    int          k;
+
+    CHECK(cpe_iobuf_get(&g_msg, MSGLEN));
+    for (k = 0; k < MSGLEN; k++) {
+        g_msg->buf[k] = k & 0xff;
+    }
+    g_msg->buf_len = MSGLEN;
+    for (k = 0; k < NPEERS; k++) {
+        CHECK(cpe_send_enqueue_shared(g_peers[k].pe_nctx.nc_sendQ, g_msg));
+    }
+    ok(g_msg->inqueue == NPEERS, "iobuf in %d queues (%d)", NPEERS,
+        g_msg->inqueue);
+    ok(cpe_send_enqueue(g_peers[0].pe_nctx.nc_sendQ, g_msg) == APR_EINVAL,
+        "exclusive enqueue of a queued iobuf refused");
+    cpe_iobuf_release(&g_msg, NULL);
+    ok(g_msg == NULL, "iobuf released");
+    return APR_SUCCESS;
+}
+
+/* POLLOUT: the first time set up the queue, then send. */
+static apr_status_t
+peer_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct peer  *pe = context;
+    apr_status_t  rv;
+
+    if (pe->pe_nctx.nc_sendQ == NULL) {
+        CHECK(cpe_queue_init(&pe->pe_nctx.nc_sendQ, pfd, pe->pe_nctx.nc_pool,
+            e));
+        if (++g_ready == NPEERS) {
+            CHECK(fan_out());
+        }
+    }
+    CHECK(cpe_sender(&pe->pe_nctx));
+    if (g_ready == NPEERS && pe->pe_nctx.nc_sendQ->cq_nelems == 0 &&
+        pe->pe_nctx.nc_count++ == 0 && ++g_drained == NPEERS)
+    {
+        cpe_main_loop_terminate();
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+peer_init(struct peer *pe, apr_pool_t *pool)
+{
+    apr_socket_t *sock = NULL;
+    cpe_event    *e;
+    apr_status_t  rv;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pe->pe_fd) != 0) {
+        return APR_FROM_OS_ERROR(errno);
+    }
+    CHECK(apr_os_sock_put(&sock, &pe->pe_fd[0], pool));
+    CHECK(apr_socket_timeout_set(sock, 0));
+    pe->pe_nctx.nc_pool = pool;
+    CHECK_NULL(e, cpe_event_fdesc_create(APR_POLL_SOCKET, APR_POLLOUT,
+        (apr_descriptor) sock, 0, peer_cb, pe));
+    CHECK(cpe_event_set_persistent(e, 1));
+    return cpe_event_add(e);
+}
+
+/* Check what a peer received. */
+static int
+peer_received_ok(struct peer *pe)
+{
+    char    buf[2 * MSGLEN];
+    ssize_t len;
+    int     k;
+
+    len = read(pe->pe_fd[1], buf, sizeof buf);
+    if (len != MSGLEN) {
+        return 0;
+    }
+    for (k = 0; k < MSGLEN; k++) {
+        if ((unsigned char) buf[k] != (k & 0xff)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Two queues hold an iobuf; destroying the pool of one drops its
+ * reference only.
+ */
+static void
+test_flush(conf_t *conf)
+{
+    apr_pool_t   *pool;
+    cpe_queue_t  *head;
+    cpe_io_buf   *iobuf;
+    cpe_event    *user;
+
+    /* a second queue on the socket of peer 0 */
+    apr_pool_create(&pool, conf->co_pool);
+    user = cpe_event_timer_create(cpe_time_from_msec(100), peer_cb, NULL);
+    cpe_queue_init(&head, g_peers[0].pe_nctx.nc_sendQ->cq_pfd, pool, user);
+    cpe_iobuf_get(&iobuf, MSGLEN);
+    iobuf->buf_len = MSGLEN;
+    cpe_send_enqueue_shared(head, iobuf);
+    cpe_send_enqueue_shared(g_peers[1].pe_nctx.nc_sendQ, iobuf);
+    ok(iobuf->inqueue == 2, "iobuf in 2 queues (%d)", iobuf->inqueue);
+    apr_pool_destroy(pool);
+    ok(iobuf->inqueue == 1, "flushed with the pool of its queue (%d)",
+        iobuf->inqueue);
+    cpe_queue_flush(g_peers[1].pe_nctx.nc_sendQ);
+    ok(iobuf->inqueue == 0 && g_peers[1].pe_nctx.nc_sendQ->cq_next == NULL,
+        "queue flushed");
+    cpe_iobuf_release(&iobuf, NULL);
+}
+
+apr_status_t
+test_init(conf_t *conf)
+{
+    apr_status_t rv;
+
+    conf->co_debug = CPE_INFO;
+    conf->co_loop_duration = cpe_time_from_msec(1000);
+    CHECK(apr_pool_create(&conf->co_pool, NULL));
+
+    plan_tests(13 + NPEERS);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_run(conf_t *conf)
+{
+    cpe_iobuf_stats stats;
+    apr_uint32_t    in_use;
+    apr_status_t    rv;
+    int             k;
+
+    cpe_log_init(conf->co_debug);
+    /* POLLOUT is always ready: on the simulated clock, the loop still ends
+     * after its duration if the queues never drain, however fast it spins.
+     */
+    ok(cpe_clock_set_virtual(IO_STEP_USEC) == APR_SUCCESS, "simulated clock");
+    cpe_iobuf_stats_get(&stats);
+    in_use = stats.is_in_use;
+    for (k = 0; k < NPEERS; k++) {
+        rv = peer_init(&g_peers[k], conf->co_pool);
+        if (rv != APR_SUCCESS) {
+            break;
+        }
+    }
+    ok(rv == APR_SUCCESS, "%d socket pairs (%s)", NPEERS, cpe_errmsg(rv));
+
+    ok(cpe_main_loop(conf->co_loop_duration) == APR_SUCCESS, "main loop");
+    ok(g_drained == NPEERS, "all queues drained (%d of %d)", g_drained,
+        NPEERS);
+    for (k = 0; k < NPEERS; k++) {
+        ok(peer_received_ok(&g_peers[k]), "peer %d received the msg", k);
+    }
+    cpe_iobuf_stats_get(&stats);
+    ok(stats.is_in_use == in_use, "iobuf given back after the last send "
+        "(in use %d, before %d)", stats.is_in_use, in_use);
+
+    test_flush(conf);
+    cpe_iobuf_stats_get(&stats);
+    ok(stats.is_in_use == in_use, "no iobuf left (in use %d)",
+        stats.is_in_use);
+    return APR_SUCCESS;
+}
@@ -0,0 +1,224 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "test-cpe-common.h"
+
+/* Loop instrumentation: a periodic timer, a one-shot timer and a socket
+ * pair read by a persistent event. The counters must match what the
+ * callbacks saw, and stay still once the stats are off. On the simulated
+ * clock, the run times and the lateness are exact.
+ */
+
+#define TICK_MSEC   20
+#define NTICKS      10
+#define NWRITES     5
+
+static int          g_fd[2];
+static int          g_ticks;
+static int          g_reads;
+static int          g_one_shots;
+static cpe_event   *g_read_event;
+
+static apr_status_t
+tick_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    context = NULL;
+    pfd = NULL;
+    if (++g_ticks <= NWRITES) {
+        if (write(g_fd[0], "x", 1) != 1) {
+            return APR_EGENERAL;
+        }
+    }
+    if (g_ticks == NTICKS) {
+        return cpe_event_destroy(&e);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+one_shot_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    context = NULL;
+    pfd = NULL;
+    e = NULL;
+    g_one_shots++;
+    cpe_clock_advance(cpe_time_from_msec(5));
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+read_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    char c;
+
+    context = NULL;
+    e = NULL;
+    if (pfd->rtnevents & APR_POLLIN) {
+        if (read(g_fd[1], &c, 1) == 1) {
+            g_reads++;
+        }
+    }
+    return APR_SUCCESS;
+}
+
+/* the run time histogram of callback, NULL if none */
+static cpe_callback_stats *
+find_callback(cpe_loop_stats *st, cpe_callback_t callback)
+{
+    u_int k;
+
+    for (k = 0; k < st->ls_ncallbacks; k++) {
+        if (st->ls_callbacks[k].cs_callback == callback) {
+            return &st->ls_callbacks[k];
+        }
+    }
+    return NULL;
+}
+
+static apr_status_t
+setup(void)
+{
+    apr_socket_t *sock = NULL;
+    cpe_event    *e;
+    apr_status_t  rv;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, g_fd) != 0) {
+        return APR_EGENERAL;
+    }
+    CHECK(apr_os_sock_put(&sock, &g_fd[1], g_conf.co_pool));
+    CHECK_NULL(g_read_event, cpe_event_fdesc_create(APR_POLL_SOCKET,
+        APR_POLLIN, (apr_descriptor) sock, 0, read_cb, NULL));
+    CHECK(cpe_event_set_persistent(g_read_event, 1));
+    CHECK(cpe_event_add(g_read_event));
+    CHECK_NULL(e, cpe_event_timer_create(cpe_time_from_msec(TICK_MSEC),
+        tick_cb, NULL));
+    CHECK(cpe_event_set_periodic(e, CPE_PERIODIC_SKIP));
+    CHECK(cpe_event_add(e));
+    CHECK_NULL(e, cpe_event_timer_create(cpe_time_from_msec(TICK_MSEC / 2),
+        one_shot_cb, NULL));
+    CHECK(cpe_event_add(e));
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_init(conf_t *conf)
+{
+    apr_status_t rv;
+
+    conf->co_debug = CPE_INFO;
+    conf->co_loop_duration = cpe_time_from_msec(TICK_MSEC * (NTICKS + 2));
+    CHECK(apr_pool_create(&conf->co_pool, NULL));
+
+    plan_tests(1 + 13);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_run(conf_t *conf)
+{
+    cpe_loop_stats     *st, *st2;
+    cpe_callback_stats *cs;
+    apr_status_t        rv;
+    int64_t             late;
+
+    st = calloc(1, sizeof *st);
+    st2 = calloc(1, sizeof *st2);
+    assert(st != NULL && st2 != NULL);
+
+    ok(cpe_clock_set_virtual(0) == APR_SUCCESS, "simulated clock");
+    ok(cpe_stats_snapshot(cpe_loop_current(), st) == APR_EINVAL,
+        "no snapshot before the first enable");
+    ok(cpe_stats_enable(1) == APR_SUCCESS, "stats on");
+    ok(setup() == APR_SUCCESS, "events set up");
+    rv = cpe_main_loop(conf->co_loop_duration);
+    ok(rv == APR_SUCCESS && g_ticks == NTICKS && g_reads == NWRITES &&
+        g_one_shots == 1, "main loop (ticks %d, reads %d)", g_ticks,
+        g_reads);
+    ok(cpe_stats_snapshot(cpe_loop_current(), st) == APR_SUCCESS,
+        "snapshot");
+
+    cs = find_callback(st, tick_cb);
+    ok(cs != NULL && cs->cs_run_us.h_count == NTICKS,
+        "tick_cb run %llu times", cs ? (unsigned long long)
+        cs->cs_run_us.h_count : 0ULL);
+    cs = find_callback(st, read_cb);
+    ok(cs != NULL && cs->cs_run_us.h_count == NWRITES,
+        "read_cb run %llu times", cs ? (unsigned long long)
+        cs->cs_run_us.h_count : 0ULL);
+    cs = find_callback(st, one_shot_cb);
+    ok(cs != NULL && cs->cs_run_us.h_count == 1 &&
+        cs->cs_run_us.h_max == cpe_time_from_msec(5),
+        "one_shot_cb run time %lld us", cs ? (long long)
+        cs->cs_run_us.h_max : 0LL);
+
+    /* ticks and one shot; the master timer ends the loop, it is not late */
+    late = cpe_histogram_percentile(&st->ls_timer_late_us, 100);
+    ok(st->ls_timeouts == NTICKS + 1 &&
+        st->ls_timer_late_us.h_count == st->ls_timeouts &&
+        late == 0,
+        "timer lateness: %llu timeouts, max %lld us",
+        (unsigned long long) st->ls_timeouts, (long long) late);
+    /* plus one shot and master timer */
+    ok(st->ls_dispatched == NTICKS + NWRITES + 1 + 1 &&
+        st->ls_per_wakeup.h_sum == (int64_t) st->ls_dispatched &&
+        st->ls_per_wakeup.h_count == st->ls_iterations,
+        "%llu callbacks over %llu iterations",
+        (unsigned long long) st->ls_dispatched,
+        (unsigned long long) st->ls_iterations);
+    ok(st->ls_pollset_adds == 1 && st->ls_pollset_removes == 1 &&
+        st->ls_polls > 0 && st->ls_poll_wait_us.h_count == st->ls_polls,
+        "pollset adds %llu removes %llu, %llu polls",
+        (unsigned long long) st->ls_pollset_adds,
+        (unsigned long long) st->ls_pollset_removes,
+        (unsigned long long) st->ls_polls);
+
+    /* off: nothing moves */
+    cpe_stats_enable(0);
+    g_ticks = 0;
+    CHECK(setup());
+    CHECK(cpe_main_loop(conf->co_loop_duration));
+    cpe_stats_snapshot(cpe_loop_current(), st2);
+    ok(memcmp(st, st2, sizeof *st) == 0 && g_ticks == NTICKS,
+        "stats off, unchanged");
+
+    close(g_fd[0]);
+    free(st);
+    free(st2);
+    return APR_SUCCESS;
+}
@@ -0,0 +1,143 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "test-cpe-common.h"
+
+/* Cached loop time: cpe_now() is the same for all the callbacks of an
+ * iteration, follows the clock from one iteration to the next, and the
+ * timers added by a callback start from it. The loop runs on the simulated
+ * clock, the first callback taking SLEEP with cpe_clock_advance().
+ */
+
+#define NTIMERS     4
+#define TIMEOUT     cpe_time_from_msec(20)
+#define SLEEP       cpe_time_from_msec(10)
+
+static apr_time_t g_seen[NTIMERS];
+static apr_time_t g_second_now;
+static int        g_fired;
+static int        g_second;
+
+static apr_status_t
+second_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    context = NULL;
+    pfd = NULL;
+    e = NULL;
+    g_second++;
+    g_second_now = cpe_now();
+    return APR_SUCCESS;
+}
+
+/* all expire together; the first one sleeps, the others must not see it */
+static apr_status_t
+timer_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    apr_status_t rv;
+
+    context = NULL;
+    pfd = NULL;
+    e = NULL;
+    g_seen[g_fired] = cpe_now();
+    if (g_fired++ == 0) {
+        cpe_clock_advance(SLEEP);
+        /* from the cached time, not from now */
+        CHECK_NULL(e, cpe_event_timer_create(TIMEOUT, second_cb, NULL));
+        CHECK(cpe_event_add(e));
+    }
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_init(conf_t *conf)
+{
+    apr_status_t rv;
+
+    conf->co_debug = CPE_INFO;
+    conf->co_loop_duration = 3 * TIMEOUT;
+    CHECK(apr_pool_create(&conf->co_pool, NULL));
+
+    plan_tests(1 + 8);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_run(conf_t *conf)
+{
+    apr_time_t   t1, t2, wall, expiration;
+    cpe_event   *e;
+    apr_status_t rv;
+    int          k, same;
+
+    t1 = cpe_now();
+    wall = apr_time_now();
+    t2 = cpe_now();
+    ok(t2 >= t1 && t1 - wall < APR_USEC_PER_SEC &&
+        wall - t1 < APR_USEC_PER_SEC,
+        "outside the loop, cpe_now() reads the clock, close to "
+        "apr_time_now() (%lld us)", (long long) (t1 - wall));
+
+    rv = cpe_clock_set_coarse(1);
+    ok(rv == APR_SUCCESS || rv == APR_ENOTIMPL, "coarse clock (%s)",
+        rv == APR_SUCCESS ? "available" : "not available");
+    cpe_clock_set_coarse(0);
+
+    ok(cpe_clock_set_virtual(0) == APR_SUCCESS, "simulated clock");
+    expiration = cpe_now() + TIMEOUT;
+    for (k = 0; k < NTIMERS; k++) {
+        CHECK_NULL(e, cpe_event_timer_create(TIMEOUT, timer_cb, NULL));
+        CHECK(cpe_event_add2(e, expiration));
+    }
+    ok(cpe_main_loop(conf->co_loop_duration) == APR_SUCCESS,
+        "event main loop");
+    ok(g_fired == NTIMERS && g_second == 1, "all fired (%d, %d)", g_fired,
+        g_second);
+
+    same = 1;
+    for (k = 1; k < NTIMERS; k++) {
+        if (g_seen[k] != g_seen[0]) {
+            same = 0;
+        }
+    }
+    ok(same && g_seen[0] >= expiration,
+        "same time for the callbacks of an iteration");
+    ok(g_second_now - g_seen[0] == TIMEOUT,
+        "timer added by a callback starts from the cached time (%lld us)",
+        (long long) (g_second_now - g_seen[0]));
+    ok(cpe_now() >= g_second_now, "monotonic");
+
+    return APR_SUCCESS;
+}
@@ -0,0 +1,221 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <string.h>
+#include <unistd.h>
+#include "test-cpe-common.h"
+
+/* Logging: a repeated line is summarized, a long one truncated, and in
+ * async mode a line that does not fit in the ring is dropped and counted.
+ * stdout is redirected to a file for the time of each test, to read back
+ * what was written.
+ */
+
+#define OUT_MAX     (4 * CPE_LOG_LINE_MAX)
+#define RING_LINE   300     /* 3 fit in a ring of CPE_LOG_LINE_MAX */
+
+static FILE *g_capture;
+static int   g_saved_fd = -1;
+static char  g_out[OUT_MAX];
+
+static void
+capture_start(void)
+{
+    fflush(stdout);
+    g_capture = tmpfile();
+    assert(g_capture != NULL);
+    g_saved_fd = dup(STDOUT_FILENO);
+    dup2(fileno(g_capture), STDOUT_FILENO);
+}
+
+/* @return the length of what was written to stdout, in g_out */
+static int
+capture_end(void)
+{
+    size_t n;
+
+    fflush(stdout);
+    dup2(g_saved_fd, STDOUT_FILENO);
+    close(g_saved_fd);
+    rewind(g_capture);
+    n = fread(g_out, 1, sizeof g_out - 1, g_capture);
+    fclose(g_capture);
+    g_out[n] = '\0';
+    return n;
+}
+
+static int
+count_lines(const char *s)
+{
+    int n = 0;
+
+    for (; *s != '\0'; s++) {
+        if (*s == '\n') {
+            n++;
+        }
+    }
+    return n;
+}
+
+static void
+test_repeat(void)
+{
+    cpe_log_stats before, after;
+    int           k;
+
+    cpe_log_stats_get(&before);
+    capture_start();
+    for (k = 0; k < 3; k++) {
+        cpe_log(CPE_INFO, "%s", "same");
+    }
+    cpe_log(CPE_INFO, "%s", "other");
+    capture_end();
+    cpe_log_stats_get(&after);
+
+    ok(strcmp(g_out, "test_repeat: same\n"
+        "last message repeated 2 times\n"
+        "test_repeat: other\n") == 0, "repeats summarized:\n%s", g_out);
+    ok(after.ls_repeated - before.ls_repeated == 2 &&
+        after.ls_lines - before.ls_lines == 3,
+        "counted 2 repeated, 3 lines written");
+}
+
+static void
+test_truncate(void)
+{
+    char *big;
+    int   len;
+
+    big = malloc(2 * CPE_LOG_LINE_MAX);
+    assert(big != NULL);
+    memset(big, 'x', 2 * CPE_LOG_LINE_MAX - 1);
+    big[2 * CPE_LOG_LINE_MAX - 1] = '\0';
+    capture_start();
+    cpe_log(CPE_INFO, "%s", big);
+    len = capture_end();
+    free(big);
+
+    ok(len == CPE_LOG_LINE_MAX - 1, "truncated to %d bytes (%d)",
+        CPE_LOG_LINE_MAX - 1, len);
+    ok(strncmp(g_out, "test_truncate: xxx", 18) == 0 &&
+        g_out[len - 1] == '\n' && g_out[len - 2] == 'x',
+        "the start kept, still ends with a newline");
+}
+
+/* The flusher cannot write while we hold the lock of stdout: the ring
+ * stays full, and the loggers must not wait for it.
+ */
+static void
+test_ring_full(conf_t *conf)
+{
+    cpe_log_stats  before, after;
+    apr_pool_t    *pool;
+    char           line[RING_LINE];
+    apr_status_t   rv;
+    int            k;
+
+    ok(apr_pool_create(&pool, conf->co_pool) == APR_SUCCESS, "ring pool");
+    ok(cpe_log_async(CPE_LOG_LINE_MAX / 2, apr_time_from_sec(10), pool) ==
+        APR_EINVAL, "ring smaller than a line refused");
+    ok(cpe_log_async(CPE_LOG_LINE_MAX, apr_time_from_sec(10), pool) ==
+        APR_SUCCESS, "async logging");
+    capture_start();
+    memset(line, 'r', sizeof line - 1);
+    line[sizeof line - 1] = '\0';
+    cpe_log_stats_get(&before);
+    flockfile(stdout);
+    for (k = 0; k < 5; k++) {
+        cpe_log(CPE_INFO, "%d %s", k, line);
+    }
+    funlockfile(stdout);
+    cpe_log_stats_get(&after);
+    cpe_log_flush();
+    capture_end();
+
+    ok(after.ls_lines - before.ls_lines == 3 &&
+        after.ls_dropped - before.ls_dropped == 2,
+        "ring full: 3 lines queued, 2 dropped (%u, %u)",
+        after.ls_lines - before.ls_lines,
+        after.ls_dropped - before.ls_dropped);
+    ok(count_lines(g_out) == 4 && strncmp(g_out, "test_ring_full: 0 ", 18)
+        == 0 && strstr(g_out, "\n2 lines dropped\n") != NULL,
+        "the 3 queued and the drop count written by the flush");
+
+    /* the ring goes with the pool, the lines are written directly again */
+    capture_start();
+    cpe_log(CPE_INFO, "%s", "before cleanup");
+    apr_pool_destroy(pool);
+    cpe_log(CPE_INFO, "%s", "after cleanup");
+    capture_end();
+    ok(strcmp(g_out, "test_ring_full: before cleanup\n"
+        "test_ring_full: after cleanup\n") == 0,
+        "ring written at cleanup, then direct writes:\n%s", g_out);
+
+    /* or stopped before, then the cleanup has nothing left to do */
+    apr_pool_create(&pool, conf->co_pool);
+    capture_start();
+    rv = cpe_log_async(CPE_LOG_LINE_MAX, apr_time_from_sec(10), pool);
+    cpe_log(CPE_INFO, "%s", "before stop");
+    cpe_log_async_stop();
+    cpe_log(CPE_INFO, "%s", "after stop");
+    apr_pool_destroy(pool);
+    capture_end();
+    ok(rv == APR_SUCCESS && strcmp(g_out, "test_ring_full: before stop\n"
+        "test_ring_full: after stop\n") == 0,
+        "ring written at stop, then direct writes:\n%s", g_out);
+}
+
+apr_status_t
+test_init(conf_t *conf)
+{
+    apr_status_t rv;
+
+    conf->co_debug = CPE_INFO;
+    CHECK(apr_pool_create(&conf->co_pool, NULL));
+
+    plan_tests(1 + 2 + 2 + 7);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_run(conf_t *conf)
+{
+    cpe_log_init(CPE_INFO);
+    test_repeat();
+    test_truncate();
+    test_ring_full(conf);
+    return APR_SUCCESS;
+}
@@ -42,6 +42,9 @@ struct fdesc_data {
 #define SERVER 1
 #define CLIENT 2
 
+/* Simulated time per poll with I/O ready, see cpe_clock_set_virtual(). */
+#define IO_STEP_USEC 10
+
 /* NOTE This test is incomplete, it doesn't handle short writes.
  */
 static apr_status_t
@@ -148,7 +151,7 @@ test_init(conf_t *conf)
     conf->co_loop_duration = apr_time_from_sec(1);
     CHECK(apr_pool_create(&conf->co_pool, NULL));
 
-    plan_tests(26);
+    plan_tests(27);
 
     return APR_SUCCESS;
 }
@@ -171,15 +174,18 @@ test_run(conf_t *conf)
     client_ctx.nc_user_data = &client_data;
     client_data.what = CLIENT;
 
+    /* On the simulated clock, the exchange takes no time and the loop ends
+     * exactly at its duration.
+     */
+    ok(cpe_clock_set_virtual(IO_STEP_USEC) == APR_SUCCESS, "simulated clock");
     s_flags = c_flags = APR_POLLIN | APR_POLLOUT;
     test_network_io1(conf, &runtime,
         client_or_server_cb, &server_ctx, s_flags, NULL, NULL,
         client_or_server_cb, &client_ctx, c_flags, NULL, NULL);
 
-    // As is, this is a bit too coarse grained.
-    ok(runtime > conf->co_loop_duration,
-        "runtime > loop duration (delta %lld ms)",
-        apr_time_as_msec(runtime - conf->co_loop_duration));
+    ok(runtime == conf->co_loop_duration,
+        "runtime == loop duration (delta %lld us)",
+        runtime - conf->co_loop_duration);
 
     return APR_SUCCESS;
 }
@@ -0,0 +1,230 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "test-cpe-common.h"
+
+/* Dropped connections: NCONNS clients in turn connect, send a message and
+ * close. The server side reads with cpe_receiver_stream() from a
+ * persistent event registered as a user of its socket, as the agent does:
+ * each drop must destroy the event, the events in use coming back to
+ * where they were before every connect.
+ */
+
+#define NCONNS     5
+#define TICK_MSEC  20
+
+typedef struct {
+    uint32_t msg_length;    /* header included */
+} msg_hdr_t;
+
+static cpe_network_ctx g_nctx;
+static int             g_fd = -1;
+static int             g_ticks;
+static int             g_accepted;
+static int             g_received;
+static int             g_closed;
+static apr_uint32_t    g_in_use[NCONNS + 1];    /* before each connect */
+
+static int
+client_connect(int port)
+{
+    struct sockaddr_in sin;
+    msg_hdr_t          hdr;
+    int                fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&sin, 0, sizeof sin);
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = inet_addr(SERVER_ADDR);
+    hdr.msg_length = htonl(sizeof hdr);
+    if (connect(fd, (struct sockaddr *) &sin, sizeof sin) < 0 ||
+        write(fd, &hdr, sizeof hdr) != sizeof hdr)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* client: connect on the even ticks, close on the odd ones */
+static apr_status_t
+tick_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    cpe_slab_stats slab;
+
+    context = NULL;
+    pfd = NULL;
+    if (g_ticks % 2 == 0) {
+        cpe_event_slab_stats(&slab);
+        g_in_use[g_ticks / 2] = slab.ss_in_use;
+        if (g_ticks / 2 == NCONNS) {
+            return cpe_event_destroy(&e);
+        }
+        g_fd = client_connect(g_conf.co_listen_port);
+    } else if (g_fd >= 0) {
+        close(g_fd);
+        g_fd = -1;
+    }
+    g_ticks++;
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+get_msg_size_cb(cpe_io_buf *iobuf, int *msg_len)
+{
+    msg_hdr_t *hdr;
+
+    hdr = (msg_hdr_t *) &iobuf->buf[0];
+    *msg_len = ntohl(hdr->msg_length);
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+msg_handler_cb(cpe_io_buf *iobuf, cpe_network_ctx *nctx)
+{
+    iobuf = NULL;
+    nctx = NULL;
+    g_received++;
+    return APR_SUCCESS;
+}
+
+static void
+conn_closed_cb(void *context)
+{
+    context = NULL;
+    g_closed++;
+}
+
+/* server, on the accepted socket */
+static apr_status_t
+server_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    cpe_network_ctx *nctx = context;
+
+    e = NULL;   /* persistent, see accepted_cb() */
+    if (pfd->rtnevents & APR_POLLIN) {
+        return cpe_receiver_stream(nctx, pfd, 64, sizeof(msg_hdr_t),
+            get_msg_size_cb, msg_handler_cb);
+    }
+    if (pfd->rtnevents & (APR_POLLHUP | APR_POLLERR)) {
+        cpe_receiver_stream_drop(nctx, pfd);
+        return APR_EOF;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+accepted_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    apr_status_t rv;
+
+    context = NULL;
+    g_accepted++;
+    memset(&g_nctx, 0, sizeof g_nctx);
+    CHECK(cpe_event_set_persistent(e, 1));
+    CHECK(cpe_event_set_context(e, &g_nctx));
+    CHECK(cpe_resource_register_user(pfd->desc.s, e));
+    CHECK(cpe_resource_register_callback(pfd->desc.s, conn_closed_cb, NULL));
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_init(conf_t *conf)
+{
+    apr_status_t rv;
+
+    conf->co_debug = CPE_INFO;
+    conf->co_listen_port = SERVER_PORT;
+    conf->co_loop_duration = cpe_time_from_msec(TICK_MSEC *
+        (2 * NCONNS + 3));
+    CHECK(apr_pool_create(&conf->co_pool, NULL));
+
+    plan_tests(1 + 7);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_run(conf_t *conf)
+{
+    apr_socket_t   *lsock;
+    apr_sockaddr_t *sockaddr;
+    cpe_slab_stats  start, end;
+    cpe_event      *e;
+    apr_status_t    rv;
+    int             k, same;
+
+    cpe_event_slab_stats(&start);
+    rv = cpe_socket_server_create(&lsock, &sockaddr, SERVER_ADDR,
+        conf->co_listen_port, 1, conf->co_pool);
+    ok(rv == APR_SUCCESS, "cpe_socket_server_create");
+    rv = cpe_socket_after_accept(lsock, server_cb, NULL, APR_POLLIN, NULL,
+        1, accepted_cb, NULL, conf->co_pool);
+    ok(rv == APR_SUCCESS, "cpe_socket_after_accept");
+    CHECK_NULL(e, cpe_event_timer_create(cpe_time_from_msec(TICK_MSEC),
+        tick_cb, NULL));
+    CHECK(cpe_event_set_periodic(e, CPE_PERIODIC_SKIP));
+    CHECK(cpe_event_add(e));
+
+    rv = cpe_main_loop(conf->co_loop_duration);
+    ok(rv == APR_SUCCESS && g_ticks == 2 * NCONNS, "main loop (%d ticks)",
+        g_ticks);
+    ok(g_accepted == NCONNS && g_received == NCONNS,
+        "%d connections accepted, %d msgs received", g_accepted, g_received);
+    ok(g_closed == NCONNS, "%d connections dropped", g_closed);
+
+    same = 1;
+    for (k = 1; k <= NCONNS; k++) {
+        if (g_in_use[k] != g_in_use[0]) {
+            same = 0;
+        }
+    }
+    ok(same, "events in use back to %u after each drop (last %u)",
+        g_in_use[0], g_in_use[NCONNS]);
+    cpe_event_slab_stats(&end);
+    ok(cpe_events_in_system() == 0 && end.ss_in_use == start.ss_in_use,
+        "no event left after the loop (%u in use, %u before)",
+        end.ss_in_use, start.ss_in_use);
+    return APR_SUCCESS;
+}
@@ -34,15 +34,32 @@ ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <sys/socket.h>
 #include "test-cpe-common.h"
 
 
 /* NOTE in this test we use fdesc events, but without I/O, so to test the
  * timeout code of apr_pollset_poll().
  *
- * BUG: on Linux, I get I/O events (I don't understand why) and this breaks
- * the test. Need to investigate more.
+ * The descriptors are one end of idle socket pairs: a TCP socket never
+ * connected, as this test used to create, is "hung up" for poll() on Linux
+ * and its events fire at once. The loop runs on the simulated clock, so
+ * that the timers fire exactly on time, in a few ms.
  */
+
+/* one end of a new socket pair, nothing is ever written to the other */
+static apr_status_t
+idle_socket(apr_socket_t **sock, apr_pool_t *pool)
+{
+    int fd[2];
+
+    *sock = NULL;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) != 0) {
+        return APR_EGENERAL;
+    }
+    return apr_os_sock_put(sock, &fd[0], pool);
+}
+
 static void
 test_fdesc_events2(conf_t *conf)
 {
@@ -54,19 +71,18 @@ test_fdesc_events2(conf_t *conf)
     struct timer_data cbdata3 = {0, 0, 0, 0, 0, "cb3"};
     struct timer_data cbdata4 = {0, 0, 0, 0, 0, "cb4"};
     struct timer_data cbdata5 = {0, 0, 0, 0, 0, "cb5"};
-    apr_time_t     time_now, runtime;
-    cpe_event     *event;
+    apr_time_t      time_now, runtime, real_start;
+    cpe_event      *event;
     apr_socket_t   *sock;
-    apr_sockaddr_t *sockaddr;
-    char           *hostname = "127.0.0.1";
-    apr_port_t      port;
+    cpe_loop_stats *st;
     int             count;
 
-    time_now = apr_time_now();
+    ok(cpe_clock_set_virtual(0) == APR_SUCCESS, "simulated clock");
+    cpe_stats_enable(1);
+    real_start = apr_time_now();
+    time_now = cpe_clock_now();
 
-    port = 5001;
-    ok(cpe_socket_client_create(&sock, &sockaddr, hostname, port,
-        conf->co_pool) == APR_SUCCESS, "cpe_socket_client_create");
+    ok(idle_socket(&sock, conf->co_pool) == APR_SUCCESS, "idle socket");
     CBDATA_INIT2(cbdata1, cpe_time_from_msec(500), time_now,
         conf->co_loop_duration);
     event = cpe_event_fdesc_create(APR_POLL_SOCKET, APR_POLLIN,
@@ -74,9 +90,7 @@ test_fdesc_events2(conf_t *conf)
     ok(event != NULL, "create event 1");
     ok(cpe_event_add(event) == APR_SUCCESS, "add event 1");
 
-    port = 5002;
-    ok(cpe_socket_client_create(&sock, &sockaddr, hostname, port,
-        conf->co_pool) == APR_SUCCESS, "cpe_socket_client_create");
+    ok(idle_socket(&sock, conf->co_pool) == APR_SUCCESS, "idle socket");
     CBDATA_INIT2(cbdata2, apr_time_from_sec(1), time_now,
         conf->co_loop_duration);
     event = cpe_event_fdesc_create(APR_POLL_SOCKET, APR_POLLIN,
@@ -84,9 +98,7 @@ test_fdesc_events2(conf_t *conf)
     ok(event != NULL, "create event 2");
     ok(cpe_event_add(event) == APR_SUCCESS, "add event 2");
 
-    port = 5003;
-    ok(cpe_socket_client_create(&sock, &sockaddr, hostname, port,
-        conf->co_pool) == APR_SUCCESS, "cpe_socket_client_create");
+    ok(idle_socket(&sock, conf->co_pool) == APR_SUCCESS, "idle socket");
     CBDATA_INIT2(cbdata3, apr_time_from_sec(3), time_now,
         conf->co_loop_duration);
     event = cpe_event_fdesc_create(APR_POLL_SOCKET, APR_POLLIN,
@@ -94,9 +106,7 @@ test_fdesc_events2(conf_t *conf)
     ok(event != NULL, "create event 3");
     ok(cpe_event_add(event) == APR_SUCCESS, "add event 3");
 
-    port = 5004;
-    ok(cpe_socket_client_create(&sock, &sockaddr, hostname, port,
-        conf->co_pool) == APR_SUCCESS, "cpe_socket_client_create");
+    ok(idle_socket(&sock, conf->co_pool) == APR_SUCCESS, "idle socket");
     CBDATA_INIT2(cbdata4, cpe_time_from_msec(100), time_now,
         conf->co_loop_duration);
     event = cpe_event_fdesc_create(APR_POLL_SOCKET, APR_POLLIN,
@@ -104,9 +114,7 @@ test_fdesc_events2(conf_t *conf)
     ok(event != NULL, "create event 4");
     ok(cpe_event_add(event) == APR_SUCCESS, "add event 4");
 
-    port = 5005;
-    ok(cpe_socket_client_create(&sock, &sockaddr, hostname, port,
-        conf->co_pool) == APR_SUCCESS, "cpe_socket_client_create");
+    ok(idle_socket(&sock, conf->co_pool) == APR_SUCCESS, "idle socket");
     CBDATA_INIT2(cbdata5, cpe_time_from_msec(90), time_now,
         conf->co_loop_duration);
     event = cpe_event_fdesc_create(APR_POLL_SOCKET, APR_POLLIN,
@@ -118,7 +126,7 @@ test_fdesc_events2(conf_t *conf)
     //diag("entering main loop for %d s", apr_time_sec(loop_duration));
     conf->co_loop_duration += cpe_time_from_msec(50);
     ok(cpe_main_loop(conf->co_loop_duration) == APR_SUCCESS, "event main loop");
-    runtime = apr_time_now() - time_now;
+    runtime = cpe_clock_now() - time_now;
 
     count = cpe_events_in_system();
     ok(count == 0, "after main loop, event system empty (%d)", count);
@@ -134,10 +142,22 @@ test_fdesc_events2(conf_t *conf)
     ok(cbdata5.expected_count == cbdata5.count, "cb5, expected %d, seen %d",
         cbdata5.expected_count, cbdata5.count);
 
-    // TODO this should be a percentage
-    ok(runtime > conf->co_loop_duration,
-        "runtime > loop duration (delta %lld ms)",
-        apr_time_as_msec(runtime - conf->co_loop_duration));
+    ok(runtime == conf->co_loop_duration,
+        "runtime == loop duration (delta %lld us)",
+        runtime - conf->co_loop_duration);
+
+    st = calloc(1, sizeof *st);
+    assert(st != NULL);
+    cpe_stats_snapshot(cpe_loop_current(), st);
+    ok(st->ls_timer_late_us.h_count == 73 && st->ls_timer_late_us.h_max == 0,
+        "%llu timeouts, none late (max %lld us)",
+        (unsigned long long) st->ls_timer_late_us.h_count,
+        (long long) st->ls_timer_late_us.h_max);
+    free(st);
+    runtime = apr_time_now() - real_start;
+    ok(runtime < conf->co_loop_duration / 10,
+        "%lld ms of simulated time in %lld ms", apr_time_as_msec(
+        conf->co_loop_duration), apr_time_as_msec(runtime));
 
 }
 
@@ -151,7 +171,7 @@ test_init(conf_t *conf)
     conf->co_loop_duration = apr_time_from_sec(3);
     CHECK(apr_pool_create(&conf->co_pool, NULL));
 
-    plan_tests(97);
+    plan_tests(100);
 
     return APR_SUCCESS;
 }
@@ -37,6 +37,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "test-cpe-common.h"
 
 #define MYBUFSIZE   10 * ONE_SI_MEGA
+/* Simulated time per poll with I/O ready, see cpe_clock_set_virtual(). */
+#define IO_STEP_USEC 10
 
 static int g_expected_total;
 
@@ -47,7 +49,7 @@ static apr_status_t
 server_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
 {
     cpe_network_ctx *ctx = (cpe_network_ctx *) context;
-    cpe_io_buf      *sendbuf = &ctx->nc_send;
+    cpe_io_buf      *sendbuf = ctx->nc_user_data;
     apr_status_t     rv;
     apr_size_t       howmany;
 
@@ -74,7 +76,7 @@ static apr_status_t
 client_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
 {
     cpe_network_ctx *ctx = (cpe_network_ctx *) context;
-    cpe_io_buf      *recvbuf = &ctx->nc_recv;
+    cpe_io_buf      *recvbuf = ctx->nc_user_data;
     apr_status_t     rv;
     apr_size_t       howmany;
 
@@ -104,7 +106,7 @@ test_init(conf_t *conf)
     conf->co_loop_duration = cpe_time_from_msec(1000);
     CHECK(apr_pool_create(&conf->co_pool, NULL));
 
-    plan_tests(12);
+    plan_tests(13);
 
     return APR_SUCCESS;
 }
@@ -116,27 +118,36 @@ apr_status_t
 test_run(conf_t *conf)
 {
     cpe_network_ctx  s_ctx, c_ctx;
+    cpe_io_buf       s_send, c_recv;
     unsigned int     i;
     int             *buf_as_int;
     apr_int16_t      s_flags, c_flags;
     apr_time_t       runtime;
 
     memset(&s_ctx, 0, sizeof s_ctx);
-    s_ctx.nc_send.buf = apr_pcalloc(conf->co_pool, MYBUFSIZE);
-    s_ctx.nc_send.buf_capacity = MYBUFSIZE;
-    assert(s_ctx.nc_send.buf != NULL);
+    memset(&s_send, 0, sizeof s_send);
+    s_ctx.nc_user_data = &s_send;
+    s_send.buf = apr_pcalloc(conf->co_pool, MYBUFSIZE);
+    s_send.buf_capacity = MYBUFSIZE;
+    assert(s_send.buf != NULL);
 
     memset(&c_ctx, 0, sizeof c_ctx);
-    c_ctx.nc_recv.buf = apr_pcalloc(conf->co_pool, MYBUFSIZE);
-    c_ctx.nc_recv.buf_capacity = MYBUFSIZE;
-    assert(c_ctx.nc_recv.buf != NULL);
-
-    buf_as_int = (int *) s_ctx.nc_send.buf;
-    for (i = 0; i < s_ctx.nc_send.buf_capacity / sizeof(int); i++) {
+    memset(&c_recv, 0, sizeof c_recv);
+    c_ctx.nc_user_data = &c_recv;
+    c_recv.buf = apr_pcalloc(conf->co_pool, MYBUFSIZE);
+    c_recv.buf_capacity = MYBUFSIZE;
+    assert(c_recv.buf != NULL);
+
+    buf_as_int = (int *) s_send.buf;
+    for (i = 0; i < s_send.buf_capacity / sizeof(int); i++) {
         buf_as_int[i] = rand();
     }
-    s_ctx.nc_send.buf_len = s_ctx.nc_send.buf_capacity;
+    s_send.buf_len = s_send.buf_capacity;
 
+    /* On the simulated clock, the loop duration no longer depends on the
+     * speed of the machine: only IO_STEP_USEC per poll.
+     */
+    ok(cpe_clock_set_virtual(IO_STEP_USEC) == APR_SUCCESS, "simulated clock");
     s_flags = APR_POLLOUT;
     c_flags = APR_POLLIN;
     test_network_io1(conf, &runtime,
@@ -147,12 +158,12 @@ test_run(conf_t *conf)
      * this case we expect to finish *earlier* than the loop duration.
      */
 
-    ok(s_ctx.nc_send.total == c_ctx.nc_recv.total,
-        "total sent = total received (s %d r %d)", s_ctx.nc_send.total,
-        c_ctx.nc_recv.total);
-    ok(s_ctx.nc_send.total == MYBUFSIZE, "total sent as expected (s %d e %d)",
-        s_ctx.nc_send.total, MYBUFSIZE);
-    ok(memcmp(s_ctx.nc_send.buf, c_ctx.nc_recv.buf, s_ctx.nc_send.buf_len) == 0,
+    ok(s_send.total == c_recv.total,
+        "total sent = total received (s %d r %d)", s_send.total,
+        c_recv.total);
+    ok(s_send.total == MYBUFSIZE, "total sent as expected (s %d e %d)",
+        s_send.total, MYBUFSIZE);
+    ok(memcmp(s_send.buf, c_recv.buf, s_send.buf_len) == 0,
         "send and receive buffers are identical");
     return APR_SUCCESS;
 }
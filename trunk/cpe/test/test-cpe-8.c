@@ -225,7 +225,7 @@ test_init(conf_t *conf)
     conf->co_loop_duration = cpe_time_from_msec(500);
     CHECK(apr_pool_create(&conf->co_pool, NULL));
 
-    plan_tests(15);
+    plan_tests(16);
 
     return APR_SUCCESS;
 }
@@ -251,6 +251,7 @@ test_run(conf_t *conf)
     apr_int16_t      s_flags, c_flags;
     apr_time_t       runtime;
     cpe_queue_t      *c_sendQ, *s_sendQ;
+    cpe_iobuf_stats   stats;
 
     /* Setup server context.
      */
@@ -285,6 +286,10 @@ test_run(conf_t *conf)
     ok(s_sendQ->cq_total_sent == c_ctx.nc_total_received,
         "total sent server side == total received client side (s %d r %d)",
         s_sendQ->cq_total_sent, c_ctx.nc_total_received);
+    cpe_iobuf_stats_get(&stats);
+    ok(stats.is_hits > stats.is_misses,
+        "received iobufs recycled (hits %u misses %u)", stats.is_hits,
+        stats.is_misses);
 
     return APR_SUCCESS;
 }
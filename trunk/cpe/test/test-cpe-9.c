@@ -0,0 +1,356 @@
+/*
+ * Cisco Portable Events (CPE)
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "test-cpe-common.h"
+
+/* Persistent events: the callbacks below never call cpe_event_add() on
+ * their own event, except legacy_cb. Two socket pairs check that a change
+ * of interest made by a callback sticks, even if the event it changes is
+ * ready in the same round.
+ */
+
+#define MYBUFSIZE ONE_SI_MEGA
+
+struct persist_data {
+    int          count;
+    int          max_count;
+    apr_status_t set_rv;
+};
+
+/* opt out with cpe_event_remove() after max_count calls */
+static apr_status_t
+remove_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct persist_data *data = context;
+
+    pfd = NULL;
+    if (data->count++ == 0) {
+        data->set_rv = cpe_event_set_persistent(e, 0);
+    }
+    if (data->count == data->max_count) {
+        cpe_event_remove(e);
+    }
+    return APR_SUCCESS;
+}
+
+/* opt out with cpe_event_destroy() after max_count calls */
+static apr_status_t
+destroy_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct persist_data *data = context;
+
+    pfd = NULL;
+    if (++data->count == data->max_count) {
+        cpe_event_destroy(&e);
+    }
+    return APR_SUCCESS;
+}
+
+/* a callback written for one-shot events still works */
+static apr_status_t
+legacy_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct persist_data *data = context;
+
+    pfd = NULL;
+    cpe_event_add(e);
+    data->count++;
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+persist_one_shot_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    context = NULL;
+    pfd = NULL;
+    return cpe_event_set_persistent(e, 1);
+}
+
+/* Two persistent readers, each with a byte to read in the first round and
+ * after the timer of the second; in the second, the first to run adds
+ * POLLOUT to the other, which drains it away.
+ */
+struct pair_data {
+    int            fd[2][2];
+    cpe_event     *event[2];
+    apr_pollfd_t  *pfd[2];
+    int            count[2];
+    int            round2;          /* calls in the second round */
+    int            saw_pollout;     /* in the reqevents of the second one */
+    apr_status_t   rv;
+};
+
+static apr_status_t
+pair_cb(struct pair_data *data, int k, apr_pollfd_t *pfd)
+{
+    char c;
+
+    data->count[k]++;
+    if (read(data->fd[k][1], &c, 1) != 1) {
+        /* only POLLOUT, which should be gone */
+        return APR_SUCCESS;
+    }
+    data->pfd[k] = pfd;
+    if (data->count[k] < 2) {
+        return APR_SUCCESS;
+    }
+    if (data->round2++ == 0) {
+        data->rv = cpe_pollset_update(data->pfd[1 - k],
+            APR_POLLIN | APR_POLLOUT);
+    } else {
+        data->saw_pollout = (pfd->reqevents & APR_POLLOUT) != 0;
+        data->rv = cpe_pollset_update(pfd, pfd->reqevents & ~APR_POLLOUT);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+pair0_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    e = NULL;
+    return pair_cb(context, 0, pfd);
+}
+
+static apr_status_t
+pair1_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    e = NULL;
+    return pair_cb(context, 1, pfd);
+}
+
+/* both readable again, for the same round */
+static apr_status_t
+pair_write_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    struct pair_data *data = context;
+
+    pfd = NULL;
+    e = NULL;
+    if (write(data->fd[0][0], "x", 1) != 1 ||
+        write(data->fd[1][0], "x", 1) != 1)
+    {
+        return APR_EGENERAL;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+pair_setup(struct pair_data *data, apr_pool_t *pool)
+{
+    cpe_callback_t  cbs[2] = { pair0_cb, pair1_cb };
+    apr_socket_t   *sock;
+    cpe_event      *e;
+    apr_status_t    rv;
+    int             k;
+
+    for (k = 0; k < 2; k++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, data->fd[k]) != 0 ||
+            write(data->fd[k][0], "x", 1) != 1)
+        {
+            return APR_EGENERAL;
+        }
+        sock = NULL;
+        CHECK(apr_os_sock_put(&sock, &data->fd[k][1], pool));
+        CHECK_NULL(data->event[k], cpe_event_fdesc_create(APR_POLL_SOCKET,
+            APR_POLLIN, (apr_descriptor) sock, 0, cbs[k], data));
+        CHECK(cpe_event_set_persistent(data->event[k], 1));
+        CHECK(cpe_event_add(data->event[k]));
+    }
+    CHECK_NULL(e, cpe_event_timer_create(cpe_time_from_msec(20),
+        pair_write_cb, data));
+    CHECK(cpe_event_add(e));
+    return APR_SUCCESS;
+}
+
+/* send */
+static apr_status_t
+server_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    cpe_network_ctx *ctx = (cpe_network_ctx *) context;
+    cpe_io_buf      *sendbuf = ctx->nc_user_data;
+    apr_status_t     rv;
+    apr_size_t       len;
+
+    e = NULL;
+    ctx->nc_count++;
+
+    len = sendbuf->buf_len - sendbuf->buf_offset;
+    rv = apr_socket_send(pfd->desc.s, &sendbuf->buf[sendbuf->buf_offset], &len);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_DEB, "apr_socket_send: %s", cpe_errmsg(rv));
+    }
+    sendbuf->buf_offset += len;
+    sendbuf->total += len;
+    if (sendbuf->buf_offset >= sendbuf->buf_len) {
+        rv = cpe_pollset_update(pfd, pfd->reqevents & ~APR_POLLOUT);
+        assert(rv == APR_SUCCESS);
+    }
+    return APR_SUCCESS;
+}
+
+/* receive */
+static apr_status_t
+client_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
+{
+    cpe_network_ctx *ctx = (cpe_network_ctx *) context;
+    cpe_io_buf      *recvbuf = ctx->nc_user_data;
+    apr_status_t     rv;
+    apr_size_t       len;
+
+    e = NULL;
+    ctx->nc_count++;
+    len = recvbuf->buf_capacity - recvbuf->buf_offset;
+    if (len == 0) {
+        return APR_SUCCESS;
+    }
+    rv = apr_socket_recv(pfd->desc.s, &recvbuf->buf[recvbuf->buf_offset], &len);
+    if (rv != APR_SUCCESS) {
+        cpe_log(CPE_DEB, "apr_socket_recv: %s", cpe_errmsg(rv));
+    }
+    recvbuf->buf_offset += len;
+    recvbuf->total += len;
+    recvbuf->buf_len += len;
+    return APR_SUCCESS;
+}
+
+apr_status_t
+test_init(conf_t *conf)
+{
+    apr_status_t rv;
+
+    conf->co_debug = CPE_INFO;
+    conf->co_listen_port = SERVER_PORT;
+    conf->co_loop_duration = cpe_time_from_msec(300);
+    CHECK(apr_pool_create(&conf->co_pool, NULL));
+
+    plan_tests(22);
+
+    return APR_SUCCESS;
+}
+
+static cpe_event *
+persist_timer(apr_time_t timeout, cpe_callback_t cb, void *ctx)
+{
+    cpe_event *event;
+
+    event = cpe_event_timer_create(timeout, cb, ctx);
+    if (event == NULL) {
+        return NULL;
+    }
+    if (cpe_event_set_persistent(event, 1) != APR_SUCCESS ||
+        cpe_event_add(event) != APR_SUCCESS)
+    {
+        cpe_event_destroy(&event);
+    }
+    return event;
+}
+
+apr_status_t
+test_run(conf_t *conf)
+{
+    cpe_network_ctx     s_ctx, c_ctx;
+    cpe_io_buf          s_send, c_recv;
+    struct persist_data d_remove = {0, 5, APR_SUCCESS};
+    struct persist_data d_destroy = {0, 3, APR_SUCCESS};
+    struct persist_data d_legacy = {0, 0, APR_SUCCESS};
+    apr_int16_t         s_flags, c_flags;
+    apr_time_t          runtime;
+    cpe_slab_stats      stats;
+    cpe_event          *e_remove;
+    struct pair_data    d_pair;
+
+    e_remove = persist_timer(cpe_time_from_msec(20), remove_cb, &d_remove);
+    ok(e_remove != NULL &&
+        persist_timer(cpe_time_from_msec(30), destroy_cb, &d_destroy) != NULL
+        && persist_timer(cpe_time_from_msec(70), legacy_cb, &d_legacy) != NULL,
+        "add persistent timers");
+    memset(&d_pair, 0, sizeof d_pair);
+    ok(pair_setup(&d_pair, conf->co_pool) == APR_SUCCESS,
+        "add persistent readers");
+
+    memset(&s_ctx, 0, sizeof s_ctx);
+    memset(&s_send, 0, sizeof s_send);
+    s_ctx.nc_user_data = &s_send;
+    s_send.buf = apr_pcalloc(conf->co_pool, MYBUFSIZE);
+    s_send.buf_capacity = MYBUFSIZE;
+    s_send.buf_len = MYBUFSIZE;
+    memset(s_send.buf, 'x', MYBUFSIZE);
+
+    memset(&c_ctx, 0, sizeof c_ctx);
+    memset(&c_recv, 0, sizeof c_recv);
+    c_ctx.nc_user_data = &c_recv;
+    c_recv.buf = apr_pcalloc(conf->co_pool, MYBUFSIZE);
+    c_recv.buf_capacity = MYBUFSIZE;
+
+    s_flags = APR_POLLOUT;
+    c_flags = APR_POLLIN;
+    test_network_io1(conf, &runtime,
+        server_cb, &s_ctx, s_flags, persist_one_shot_cb, NULL,
+        client_cb, &c_ctx, c_flags, persist_one_shot_cb, NULL);
+
+    ok(d_remove.count == 5, "opt out with remove (seen %d)", d_remove.count);
+    ok(d_remove.set_rv == APR_EINVAL, "no change from own callback");
+    ok(d_destroy.count == 3, "opt out with destroy (seen %d)",
+        d_destroy.count);
+    ok(d_legacy.count == 4, "re-added by callback (seen %d)",
+        d_legacy.count);
+    ok(s_send.total == MYBUFSIZE, "total sent (s %d e %d)",
+        s_send.total, MYBUFSIZE);
+    ok(c_recv.total == MYBUFSIZE, "total received (r %d e %d)",
+        c_recv.total, MYBUFSIZE);
+    ok(memcmp(s_send.buf, c_recv.buf, MYBUFSIZE) == 0,
+        "send and receive buffers are identical");
+    ok(runtime >= conf->co_loop_duration, "runtime >= loop duration");
+    ok(d_pair.round2 == 2 && d_pair.saw_pollout && d_pair.rv == APR_SUCCESS,
+        "POLLOUT added by a callback of the same round kept");
+    ok(d_pair.count[0] == 2 && d_pair.count[1] == 2,
+        "and cleared by the drain (calls %d %d)", d_pair.count[0],
+        d_pair.count[1]);
+    /* removed from the system by its callback, but still ours */
+    cpe_event_destroy(&e_remove);
+    cpe_event_destroy(&d_pair.event[0]);
+    cpe_event_destroy(&d_pair.event[1]);
+    cpe_event_slab_stats(&stats);
+    ok(stats.ss_in_use == 0 && stats.ss_high_water > 0,
+        "all events released (in use %u high water %u)", stats.ss_in_use,
+        stats.ss_high_water);
+
+    return APR_SUCCESS;
+}
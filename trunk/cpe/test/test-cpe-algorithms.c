@@ -99,16 +99,11 @@ test_insert(unsigned int N, int unsorted[])
     ok(cpe_priorityQ_len(head1) == N, "inserted %d elements", N);
     ok(cpe_priorityQ_len(head2) == N, "inserted %d elements", N);
 
-    /* Verify that the queue is correctly sorted. */
-    success = 1;
-    for (p1 = head1->pq_next, i = 0; p1 != NULL; p1 = p1->pq_next, i++) {
-        if (p1->pq_value != sorted[i]) {
-            success = 0;
-            break;
-        }
-    }
+    /* Verify the heap invariant; the sorted order is verified below by
+     * find and remove max.
+     */
+    success = cpe_priorityQ_verify(head1) && cpe_priorityQ_verify(head2);
     ok(success, "correct order");
-    ok(i == N, "correct size (%d)", i);
 
     /* Verify find and remove max */
     for (i = 0; i < N; i++) {
@@ -142,7 +137,7 @@ static void
 test_remove(unsigned int N, int unsorted[])
 {
     unsigned int i;
-    cpe_priorityQ *p1, *head1, *q1, *q2;
+    cpe_priorityQ *p1, *head1, *q2;
     cpe_priorityQ **pointers;
 
     pointers = calloc(N, sizeof *pointers);
@@ -163,10 +158,10 @@ test_remove(unsigned int N, int unsorted[])
     }
     ok(cpe_priorityQ_len(head1) == N, "inserted %d elements", N);
 
-    q1 = NULL;
-    q2 = (cpe_priorityQ *) 0xcafefade;
-    //ok(cpe_priorityQ_remove(head1, q1) == -1, "remove element fail");
+    /* A node that has never been inserted. */
+    q2 = cpe_priorityQ_create();
     ok(cpe_priorityQ_remove(head1, q2) == -1, "remove element fail");
+    FREE(q2);
 
     for (i = 0; i < N; i++) {
         ok(cpe_priorityQ_remove(head1, pointers[i]) == 1, "remove element ok");
@@ -182,7 +177,7 @@ test_sentinel(void)
 {
     int64_t       a1[] = {CPE_PRIORITYQ_AT_THE_END, 1, 15};
     int64_t       a2[] = {1, 15, CPE_PRIORITYQ_AT_THE_END};
-    cpe_priorityQ *p1, *head1;
+    cpe_priorityQ *p1, *head1, *nodes[3];
     unsigned int  i, N, N2;
     int success;
 
@@ -196,16 +191,21 @@ test_sentinel(void)
     }
     ok(cpe_priorityQ_len(head1) == N, "inserted %d elements", N);
 
-    /* Verify that the queue is correctly sorted. */
+    /* Verify that the queue is correctly sorted, by draining it and then
+     * putting the nodes back.
+     */
     success = 1;
-    for (p1 = head1->pq_next, i = 0; p1 != NULL; p1 = p1->pq_next, i++) {
+    for (i = 0; (p1 = cpe_priorityQ_remove_max(head1)) != NULL; i++) {
+        nodes[i] = p1;
         if (p1->pq_value != a2[i]) {
             success = 0;
-            break;
         }
     }
     ok(success, "correct order");
     ok(i == N, "correct size (%d)", i);
+    for (i = 0; i < N; i++) {
+        cpe_priorityQ_insert(head1, nodes[i]);
+    }
 
     /* Verify queue destroy */
     N2 = cpe_priorityQ_queue_destroy(head1);
@@ -216,13 +216,293 @@ test_sentinel(void)
     FREE(head1);
 }
 
+/* Remove every other node from the middle of the heap, then check that what
+ * is left still comes out sorted. Also check that equal values come out in
+ * insertion order.
+ */
+static void
+test_remove_middle(unsigned int N, int unsorted[])
+{
+    unsigned int i, n;
+    cpe_priorityQ *p1, *head1;
+    cpe_priorityQ **pointers;
+    int64_t last;
+    int success;
+
+    pointers = calloc(N, sizeof *pointers);
+    assert(pointers);
+
+    head1 = cpe_priorityQ_create();
+    for (i = 0; i < N; i++) {
+        p1 = cpe_priorityQ_create();
+        p1->pq_value = unsorted[i];
+        cpe_priorityQ_insert(head1, p1);
+        pointers[i] = p1;
+    }
+    success = 1;
+    for (i = 0; i < N; i += 2) {
+        if (cpe_priorityQ_remove(head1, pointers[i]) != 1) {
+            success = 0;
+        }
+        FREE(pointers[i]);
+    }
+    ok(success && cpe_priorityQ_verify(head1), "remove from the middle");
+
+    success = 1;
+    last = INT_MIN;
+    for (n = 0; (p1 = cpe_priorityQ_remove_max(head1)) != NULL; n++) {
+        if (p1->pq_value < last) {
+            success = 0;
+        }
+        last = p1->pq_value;
+        FREE(p1);
+    }
+    ok(success && n == N / 2, "sorted after remove from the middle (%d)", n);
+
+    /* Same value: FIFO. */
+    for (i = 0; i < N; i++) {
+        pointers[i] = cpe_priorityQ_create();
+        pointers[i]->pq_value = 42;
+        cpe_priorityQ_insert(head1, pointers[i]);
+    }
+    success = 1;
+    for (i = 0; i < N; i++) {
+        p1 = cpe_priorityQ_remove_max(head1);
+        if (p1 != pointers[i]) {
+            success = 0;
+        }
+        FREE(pointers[i]);
+    }
+    ok(success, "equal values in insertion order");
+    ok(cpe_priorityQ_len(head1) == 0, "empty queue");
+
+    cpe_priorityQ_queue_destroy(head1);
+    FREE(head1);
+    FREE(pointers);
+}
+
+/*
+ * Timing wheel: nodes spread over all the levels and the overflow list,
+ * drained while time goes by and half of them re-armed, as the event loop
+ * does.
+ */
+static void
+test_wheel(void)
+{
+    unsigned int i, n, N = 5000, rearmed = 0;
+    cpe_priorityQ *p1, *head1;
+    cpe_priorityQ **pointers;
+    int64_t tick = 10, now = 1000, last;
+    int success, consistent;
+
+    pointers = calloc(N, sizeof *pointers);
+    assert(pointers);
+    srand(42);
+
+    head1 = cpe_priorityQ_create_wheel(tick, now);
+    ok(head1 != NULL, "wheel created");
+    for (i = 0; i < N; i++) {
+        p1 = cpe_priorityQ_create();
+        p1->pq_value = now + rand() % (1 << 30);
+        cpe_priorityQ_insert(head1, p1);
+        pointers[i] = p1;
+    }
+    for (i = 0; i < 3; i++) {
+        p1 = cpe_priorityQ_create();
+        p1->pq_value = CPE_PRIORITYQ_AT_THE_END;
+        cpe_priorityQ_insert(head1, p1);
+    }
+    ok(cpe_priorityQ_verify(head1) && cpe_priorityQ_len(head1) == N + 3,
+        "wheel insert");
+
+    success = 1;
+    for (i = 0; i < N; i += 3) {
+        if (cpe_priorityQ_remove(head1, pointers[i]) != 1) {
+            success = 0;
+        }
+        if (cpe_priorityQ_remove(head1, pointers[i]) != -1) {
+            success = 0;
+        }
+        FREE(pointers[i]);
+    }
+    n = N - (N + 2) / 3;
+    ok(success && cpe_priorityQ_verify(head1) &&
+        cpe_priorityQ_len(head1) == n + 3, "wheel remove from the middle");
+
+    success = consistent = 1;
+    last = 0;
+    for (i = 0; cpe_priorityQ_len(head1) > 3; i++) {
+        /* Sleep until the next expiration. */
+        now = cpe_priorityQ_find_max(head1)->pq_value;
+        cpe_priorityQ_advance(head1, now);
+        p1 = cpe_priorityQ_remove_max(head1);
+        if (p1->pq_value / tick < last || p1->pq_value > now + tick) {
+            success = 0;
+        }
+        last = p1->pq_value / tick;
+        if (i % 2 == 0 && rearmed < N) {
+            p1->pq_value = now + rand() % 100000;
+            cpe_priorityQ_insert(head1, p1);
+            rearmed++;
+        } else {
+            free(p1);
+        }
+        if (i % 100 == 0 && ! cpe_priorityQ_verify(head1)) {
+            consistent = 0;
+        }
+    }
+    ok(success, "wheel drained in tick order");
+    ok(consistent, "wheel consistent while draining");
+    ok(i == n + rearmed, "wheel drained all the nodes (%u)", i);
+
+    p1 = cpe_priorityQ_create();
+    p1->pq_value = 5;
+    cpe_priorityQ_insert(head1, p1);
+    ok(cpe_priorityQ_find_max(head1) == p1, "wheel expired node first");
+    cpe_priorityQ_remove(head1, p1);
+    FREE(p1);
+
+    p1 = cpe_priorityQ_remove_max(head1);
+    ok(p1 != NULL && p1->pq_value == CPE_PRIORITYQ_AT_THE_END,
+        "wheel overflow");
+    FREE(p1);
+
+    ok(cpe_priorityQ_queue_destroy(head1) == 2, "wheel destroy");
+    ok(cpe_priorityQ_len(head1) == 0 && cpe_priorityQ_verify(head1),
+        "wheel empty");
+    FREE(pointers);
+}
+
+
+/*
+ * Slab: alignment, growth by chunks, LIFO reuse of the freed slots.
+ */
+static void
+test_slab(void)
+{
+    cpe_slab       *slab;
+    cpe_slab_stats  stats;
+    char           *objs[40];
+    char           *p1, *p2;
+    unsigned int    i, j, N = 40;
+    int             aligned, zeroed, disjoint;
+
+    ok(cpe_slab_create(0, 16) == NULL && cpe_slab_create(100, 0) == NULL,
+        "slab invalid arguments");
+    slab = cpe_slab_create(100, 16);
+    ok(slab != NULL, "slab created");
+
+    aligned = zeroed = 1;
+    for (i = 0; i < N; i++) {
+        objs[i] = cpe_slab_alloc(slab);
+        assert(objs[i]);
+        if ((uintptr_t) objs[i] % CPE_CACHE_LINE != 0) {
+            aligned = 0;
+        }
+        for (j = 0; j < 100; j++) {
+            if (objs[i][j] != 0) {
+                zeroed = 0;
+            }
+        }
+        memset(objs[i], 0xff, 100);
+    }
+    ok(aligned, "slab slots aligned to cache line");
+    ok(zeroed, "slab objects zeroed");
+    disjoint = 1;
+    for (i = 0; i < N; i++) {
+        for (j = i + 1; j < N; j++) {
+            if (objs[i] < objs[j] + 128 && objs[j] < objs[i] + 128) {
+                disjoint = 0;
+            }
+        }
+    }
+    ok(disjoint, "slab slots disjoint");
+    cpe_slab_stats_get(slab, &stats);
+    ok(stats.ss_objsize == 128 && stats.ss_in_use == N &&
+        stats.ss_capacity == 48 && stats.ss_chunks == 3,
+        "slab grown by chunks (size %zu in use %u capacity %u chunks %u)",
+        stats.ss_objsize, stats.ss_in_use, stats.ss_capacity,
+        stats.ss_chunks);
+
+    cpe_slab_free(slab, objs[7]);
+    cpe_slab_free(slab, objs[3]);
+    p1 = cpe_slab_alloc(slab);
+    p2 = cpe_slab_alloc(slab);
+    ok(p1 == objs[3] && p2 == objs[7], "slab reuses freed slots, LIFO");
+
+    for (i = 0; i < N; i++) {
+        cpe_slab_free(slab, objs[i]);
+    }
+    cpe_slab_stats_get(slab, &stats);
+    ok(stats.ss_in_use == 0 && stats.ss_high_water == N &&
+        stats.ss_capacity == 48, "slab empty (in use %u high water %u)",
+        stats.ss_in_use, stats.ss_high_water);
+    cpe_slab_destroy(slab);
+}
+
+
+/*
+ * Histogram: exact small values, bounded relative error above, percentiles.
+ */
+static void
+test_histogram(void)
+{
+    cpe_histogram h;
+    int64_t       v, p;
+    int           k, bounded;
+
+    cpe_histogram_reset(&h);
+    ok(cpe_histogram_percentile(&h, 50) == 0, "histogram empty");
+
+    for (k = 1; k <= 10; k++) {
+        cpe_histogram_record(&h, k);
+    }
+    ok(h.h_count == 10 && h.h_sum == 55 && h.h_min == 1 && h.h_max == 10,
+        "histogram count, sum, min, max");
+    ok(cpe_histogram_percentile(&h, 50) == 5 &&
+        cpe_histogram_percentile(&h, 90) == 9 &&
+        cpe_histogram_percentile(&h, 100) == 10 &&
+        cpe_histogram_percentile(&h, 0) == 1,
+        "histogram small values exact");
+
+    bounded = 1;
+    for (v = 16; v < ((int64_t) 1 << 32); v = v * 3 / 2 + 7) {
+        cpe_histogram_reset(&h);
+        cpe_histogram_record(&h, v);
+        cpe_histogram_record(&h, (int64_t) 1 << 40);
+        p = cpe_histogram_percentile(&h, 50);
+        if (p < v || p > v + v / CPE_HISTO_SUB) {
+            bounded = 0;
+            diag("value %lld percentile %lld", (long long) v, (long long) p);
+        }
+    }
+    ok(bounded, "histogram error within 1/%d", CPE_HISTO_SUB);
+
+    cpe_histogram_reset(&h);
+    cpe_histogram_record(&h, -5);
+    cpe_histogram_record(&h, (int64_t) 1 << 50);
+    ok(cpe_histogram_percentile(&h, 50) == 0 &&
+        cpe_histogram_percentile(&h, 100) == (int64_t) 1 << 50,
+        "histogram out of range values");
+
+    cpe_histogram_reset(&h);
+    for (k = 0; k < 1000; k++) {
+        cpe_histogram_record(&h, k < 990 ? 100 : 100000);
+    }
+    p = cpe_histogram_percentile(&h, 99);
+    v = cpe_histogram_percentile(&h, 99.9);
+    ok(p >= 100 && p <= 106 && v >= 100000 && v <= 100000 + 100000 / 16,
+        "histogram tail (p99 %lld p99.9 %lld)", (long long) p, (long long) v);
+}
+
+
 int
 main(void)
 {
     cpe_priorityQ *head;
     unsigned int N;
 
-    plan_tests(502);
+    plan_tests(522);
 
     head = cpe_priorityQ_create();
     ok(head != NULL, "cpe_priorityQ_create");
@@ -237,6 +517,7 @@ main(void)
 #define ARGS(x) sizeof x / sizeof x[0], x
 
     test_remove(ARGS(g_a4));
+    test_remove_middle(ARGS(g_a7));
 
     test_insert(ARGS(g_a1));
     test_insert(ARGS(g_a2));
@@ -250,6 +531,9 @@ main(void)
 #undef ARGS
 
     test_sentinel();
+    test_wheel();
+    test_slab();
+    test_histogram();
 
     return exit_status();
 }
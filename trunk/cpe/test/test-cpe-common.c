@@ -142,7 +142,7 @@ test_timer_cb(void *arg, apr_pollfd_t *pfd, cpe_event *e)
     if (! cb->one_shot) {
         cpe_event_add(e);
     }
-    time_now = apr_time_now();
+    time_now = cpe_clock_now();
     measured_timeout = time_now - cb->last_seen;
     delta = measured_timeout - cb->timeout;
     if (delta < 0) {
@@ -212,10 +212,10 @@ test_network_io1(conf_t *conf, apr_time_t *runtime,
     //    apr_time_sec(conf->co_loop_duration));
     count = cpe_events_in_system();
     //diag("before entering main loop, events in system: %d", count);
-    time_now = apr_time_now();
+    time_now = cpe_clock_now();
     ok(cpe_main_loop(conf->co_loop_duration) == APR_SUCCESS,
         "event main loop");
-    *runtime = apr_time_now() - time_now;
+    *runtime = cpe_clock_now() - time_now;
     cpe_log(CPE_DEB, "Elapsed time %" APR_TIME_T_FMT " ms", apr_time_as_msec(*runtime));
 
     count = cpe_events_in_system();
@@ -248,65 +248,45 @@ client_one_shot_cb(void *context, apr_pollfd_t *pfd, cpe_event *event)
 
 
 static apr_status_t
-dfp_handle_msg_preference_info(cpe_io_buf *iobuf, int payload_offset,
-    int payload_len)
+dfp_handle_msg_preference_info(const dfp_msg_view_t *msg)
 {
-    apr_status_t rv;
-    uint32_t     pref_ipaddr_v4;
-    uint16_t     pref_bind_id;
-    uint16_t     pref_weight;
-    char         ipaddr_str[20];
-
-    CHECK(dfp_parse_load(iobuf, payload_offset, payload_len,
-        &pref_ipaddr_v4, &pref_bind_id, &pref_weight));
-
-    apr_snprintf(ipaddr_str, sizeof ipaddr_str, "%pA",
-        (struct in_addr *) &pref_ipaddr_v4);
-    cpe_log(CPE_INFO,
-        "received Preference Info msg, server %s, bindId %d, weight %d",
-        ipaddr_str, pref_bind_id, pref_weight);
-
-    return APR_SUCCESS;
+    return dfp_log_load(msg);
 }
 
 
 /** State machine to handle a received DFP message.
- * @remark We must deallocate the iobuf once done.
+ * @remark The iobuf is lent by cpe_receiver_stream() for this call only;
+ * cpe_iobuf_destroy() on it does nothing.
  * This is symmetrical to the agent state machine
  */
 static apr_status_t
 dfp_msg_handler_cb(cpe_io_buf *iobuf, cpe_network_ctx *nctx)
 {
-    dfp_msg_header_t *hdr;
-    uint16_t          msg_type;
-    int32_t           msg_len;
-    int               payload_offset;
-    int               payload_len;
-
-    hdr = (dfp_msg_header_t *) &iobuf->buf[0];
+    dfp_msg_view_t msg;
+    uint16_t       msg_type;
 
     /* Version has already been tested by dfp_get_msg_size_cb(). */
-    msg_type = ntohs(hdr->msg_type);
-    msg_len = ntohl(hdr->msg_len);
-    if (msg_len < 0) {
-        msg_len = 0;
+    if (dfp_msg_decode(iobuf, 0, &msg) != APR_SUCCESS) {
+        cpe_log(CPE_WARN, "malformed msg (iobuf len %d), discarding",
+            iobuf->buf_len);
+        cpe_iobuf_destroy(&iobuf, nctx);
+        return APR_SUCCESS;
     }
+    msg_type = msg.mv_type;
     cpe_log(CPE_DEB, "received msg version %#x, type '%s' (%#x), len %u, "
-        "iobuf len %d", hdr->msg_version, dfp_msg_type2string(msg_type),
-        msg_type, msg_len, iobuf->buf_len);
+        "iobuf len %d", msg.mv_version, dfp_msg_type2string(msg_type),
+        msg_type, msg.mv_len, iobuf->buf_len);
 
-    if (msg_len != iobuf->buf_len) {
+    if (msg.mv_len != (uint32_t) iobuf->buf_len) {
         cpe_log(CPE_DEB,
-            "lenght mismatch (declared %d, real %d), trying to proceed anyway",
-            msg_len, iobuf->buf_len);
+            "lenght mismatch (declared %u, real %d), ignoring the excess",
+            msg.mv_len, iobuf->buf_len);
     }
-    payload_offset = sizeof(dfp_msg_header_t);
-    payload_len = cpe_min(msg_len, iobuf->buf_len) - payload_offset;
 
     switch (msg_type) {
 
     case DFP_MSG_PREF_INFO:
-        dfp_handle_msg_preference_info(iobuf, payload_offset, payload_len);
+        dfp_handle_msg_preference_info(&msg);
     break;
 
     case DFP_MSG_BIND_REPORT:
@@ -361,7 +341,7 @@ static apr_status_t
 client_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
 {
     cpe_network_ctx *nctx = (cpe_network_ctx *) context;
-    apr_status_t     rv;
+    apr_status_t     rv = APR_SUCCESS;
 
     cpe_event_add(e);
     nctx->nc_count++;
@@ -370,8 +350,7 @@ client_cb(void *context, apr_pollfd_t *pfd, cpe_event *e)
         rv = cpe_sender(nctx);
     }
     if (pfd->rtnevents & APR_POLLIN) {
-        /* XXX FIXME 2000 */
-        rv = cpe_receiver(nctx, pfd, 2000, nctx->nc_pool,
+        rv = cpe_receiver_stream(nctx, pfd, DFP_MAX_MSG_SIZE,
             sizeof(dfp_msg_header_t), dfp_get_msg_size_cb, dfp_msg_handler_cb);
     }
     return rv;
@@ -0,0 +1,150 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ *
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Throughput benchmark for dfp_msg_decode(). Not a test, it is not run by
+ * "scons test".
+ *
+ * A buffer holds BENCH_MSGS PREF_INFO messages back to back, each with
+ * "loads" Load TLVs of "hosts" preferences. The buffer is decoded message
+ * by message, reading every preference, and the rate is reported in
+ * messages/s and MB/s.
+ *
+ * Usage: bench-wire-decode [hosts [loads]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "wire.h"
+
+#define BENCH_MSGS      1000
+#define BENCH_ROUNDS    1000
+
+static double
+bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+bench_fill(cpe_io_buf *iobuf, uint hosts, uint loads)
+{
+    uint i, j, k;
+    int  start, reqlen;
+
+    reqlen = sizeof(dfp_msg_header_t) + loads * (sizeof(dfp_tlv_load_t) +
+        hosts * sizeof(dfp_tlv_load_preference_t));
+    for (i = 0; i < BENCH_MSGS; i++) {
+        if (dfp_msg_pref_info_prepare(iobuf, reqlen, &start) != APR_SUCCESS) {
+            abort();
+        }
+        for (j = 0; j < loads; j++) {
+            dfp_tlv_load_prepare(iobuf, 80 + j, 6, 0, hosts);
+            for (k = 0; k < hosts; k++) {
+                dfp_tlv_load_add_hostpref(iobuf, htonl(0x0a000000 + k), k,
+                    (i + k) & 0xffff);
+            }
+        }
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    cpe_io_buf      iobuf;
+    dfp_msg_view_t  msg;
+    uint            hosts = 1, loads = 1;
+    uint            r, j, k;
+    int             start, size;
+    uint32_t        ipaddr_v4;
+    uint16_t        bind_id, weight;
+    unsigned long   sum = 0;
+    double          t0, elapsed, nmsgs;
+
+    if (argc > 1) {
+        hosts = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        loads = atoi(argv[2]);
+    }
+    if (loads > DFP_MSG_MAX_LOADS) {
+        loads = DFP_MSG_MAX_LOADS;
+    }
+    size = BENCH_MSGS * (sizeof(dfp_msg_header_t) + loads *
+        (sizeof(dfp_tlv_load_t) + hosts * sizeof(dfp_tlv_load_preference_t)));
+
+    iobuf.buf = malloc(size);
+    assert(iobuf.buf != NULL);
+    iobuf.buf_offset = 0;
+    iobuf.buf_len = 0;
+    iobuf.buf_capacity = size;
+    bench_fill(&iobuf, hosts, loads);
+    assert(iobuf.buf_len == size);
+
+    t0 = bench_now_ns();
+    for (r = 0; r < BENCH_ROUNDS; r++) {
+        for (start = 0; start < iobuf.buf_len; start += msg.mv_len) {
+            if (dfp_msg_decode(&iobuf, start, &msg) != APR_SUCCESS) {
+                abort();
+            }
+            for (j = 0; j < msg.mv_nloads; j++) {
+                for (k = 0; k < msg.mv_loads[j].lv_nhosts; k++) {
+                    dfp_load_view_pref(&msg.mv_loads[j], k, &ipaddr_v4,
+                        &bind_id, &weight);
+                    sum += weight;
+                }
+            }
+        }
+    }
+    elapsed = (bench_now_ns() - t0) / 1e9;
+    nmsgs = (double) BENCH_MSGS * BENCH_ROUNDS;
+
+    printf("hosts %u, loads %u, msg size %d bytes\n", hosts, loads,
+        size / BENCH_MSGS);
+    printf("%.0f msgs/s, %.1f MB/s, %.1f ns per msg (checksum %lu)\n",
+        nmsgs / elapsed, nmsgs * (size / BENCH_MSGS) / elapsed / 1e6,
+        elapsed * 1e9 / nmsgs, sum);
+
+    free(iobuf.buf);
+    return 0;
+}
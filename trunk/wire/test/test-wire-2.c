@@ -0,0 +1,371 @@
+/*
+ * Portable implementation of the Dynamic Feedback Protocol (DFP)
+ *
+ * $Id$
+ */
+
+/*
+The Cisco-style BSD License
+Copyright (c) 2007, Cisco Systems, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+Neither the name of Cisco Systems, Inc. nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Decoding: round trip through the encoders, then malformed messages.
+ */
+
+#include <string.h>
+#include <netinet/in.h>
+#include <tap.h>
+#include "wire.h"
+
+#define BUF_SIZE 1024
+
+static char       g_mem[BUF_SIZE];
+static cpe_io_buf g_iobuf;
+
+static cpe_io_buf *
+iobuf_reset(void)
+{
+    memset(&g_iobuf, 0, sizeof g_iobuf);
+    memset(g_mem, 0, sizeof g_mem);
+    g_iobuf.buf = g_mem;
+    g_iobuf.buf_capacity = sizeof g_mem;
+    return &g_iobuf;
+}
+
+/* Overwrite the 16-bit field at \p offset. */
+static void
+poke16(cpe_io_buf *iobuf, int offset, uint16_t value)
+{
+    uint16_t v = htons(value);
+
+    memcpy(&iobuf->buf[offset], &v, sizeof v);
+}
+
+static void
+poke32(cpe_io_buf *iobuf, int offset, uint32_t value)
+{
+    uint32_t v = htonl(value);
+
+    memcpy(&iobuf->buf[offset], &v, sizeof v);
+}
+
+
+/* A PREF_INFO with two Load TLVs of 3 and 1 hosts. */
+static int
+build_pref_info(cpe_io_buf *iobuf)
+{
+    int start, reqlen;
+    uint k;
+
+    reqlen = sizeof(dfp_msg_header_t) +
+        2 * sizeof(dfp_tlv_load_t) + 4 * sizeof(dfp_tlv_load_preference_t);
+    dfp_msg_pref_info_prepare(iobuf, reqlen, &start);
+    dfp_tlv_load_prepare(iobuf, 80, 6, 0, 3);
+    for (k = 0; k < 3; k++) {
+        dfp_tlv_load_add_hostpref(iobuf, htonl(0x0a000001 + k), k, 100 + k);
+    }
+    dfp_tlv_load_prepare(iobuf, 53, 17, 0, 1);
+    dfp_tlv_load_add_hostpref(iobuf, htonl(0x0a000009), 7, 0xffff);
+    return start;
+}
+
+
+static void
+test_pref_info(void)
+{
+    cpe_io_buf     *iobuf = iobuf_reset();
+    dfp_msg_view_t  msg;
+    uint32_t        ipaddr_v4;
+    uint16_t        bind_id, weight;
+    uint            k;
+    int             all;
+
+    build_pref_info(iobuf);
+    ok1(dfp_msg_decode(iobuf, 0, &msg) == APR_SUCCESS);
+    ok1(msg.mv_version == DFP_MSG_VERSION_1);
+    ok1(msg.mv_type == DFP_MSG_PREF_INFO);
+    ok1(msg.mv_len == (uint32_t) iobuf->buf_len);
+    ok1(msg.mv_nloads == 2);
+    ok1(! msg.mv_has_security && ! msg.mv_has_keepalive &&
+        ! msg.mv_has_bind_table && msg.mv_nunknown == 0);
+
+    ok1(msg.mv_loads[0].lv_portn == 80 && msg.mv_loads[0].lv_protocol == 6);
+    ok1(msg.mv_loads[0].lv_nhosts == 3);
+    all = 1;
+    for (k = 0; k < 3; k++) {
+        dfp_load_view_pref(&msg.mv_loads[0], k, &ipaddr_v4, &bind_id, &weight);
+        all = all && ipaddr_v4 == htonl(0x0a000001 + k) && bind_id == k &&
+            weight == 100 + k;
+    }
+    ok(all, "all the preferences of the first Load TLV");
+
+    ok1(msg.mv_loads[1].lv_portn == 53 && msg.mv_loads[1].lv_protocol == 17);
+    ok1(msg.mv_loads[1].lv_nhosts == 1);
+    dfp_load_view_pref(&msg.mv_loads[1], 0, &ipaddr_v4, &bind_id, &weight);
+    ok1(ipaddr_v4 == htonl(0x0a000009) && bind_id == 7 && weight == 0xffff);
+
+    /* The views point into the iobuf. */
+    ok1((const char *) msg.mv_loads[0].lv_prefs ==
+        &iobuf->buf[sizeof(dfp_msg_header_t) + sizeof(dfp_tlv_load_t)]);
+}
+
+
+static void
+test_cursor(void)
+{
+    cpe_io_buf       *iobuf = iobuf_reset();
+    dfp_tlv_cursor_t  cur;
+    dfp_tlv_view_t    tlv;
+
+    build_pref_info(iobuf);
+    ok1(dfp_tlv_cursor_init(&cur, iobuf, 0) == APR_SUCCESS);
+    ok1(dfp_tlv_next(&cur, &tlv) == APR_SUCCESS);
+    ok1(tlv.tv_type == DFP_TLV_LOAD && tlv.tv_u.load.lv_nhosts == 3);
+    ok1(tlv.tv_len == sizeof(dfp_tlv_load_t) +
+        3 * sizeof(dfp_tlv_load_preference_t));
+    ok1(dfp_tlv_next(&cur, &tlv) == APR_SUCCESS);
+    ok1(tlv.tv_type == DFP_TLV_LOAD && tlv.tv_u.load.lv_nhosts == 1);
+    ok1(dfp_tlv_next(&cur, &tlv) == APR_EOF);
+    ok1(dfp_tlv_next(&cur, &tlv) == APR_EOF);
+}
+
+
+static void
+test_two_messages(void)
+{
+    cpe_io_buf     *iobuf = iobuf_reset();
+    dfp_msg_view_t  msg;
+    int             start1, start2;
+
+    start1 = build_pref_info(iobuf);
+    dfp_msg_dfp_parameters_complete(iobuf, &start2, 30);
+    ok1(start2 > start1);
+
+    /* The first message ends where its header says, not at buf_len. */
+    ok1(dfp_msg_decode(iobuf, start1, &msg) == APR_SUCCESS);
+    ok1(msg.mv_type == DFP_MSG_PREF_INFO && msg.mv_nloads == 2);
+    ok1(! msg.mv_has_keepalive);
+
+    ok1(dfp_msg_decode(iobuf, start2, &msg) == APR_SUCCESS);
+    ok1(msg.mv_type == DFP_MSG_DFP_PARAMS && msg.mv_nloads == 0);
+    ok1(msg.mv_has_keepalive && msg.mv_keepalive.kv_interval_sec == 30);
+}
+
+
+static void
+test_bind_report(void)
+{
+    cpe_io_buf              *iobuf = iobuf_reset();
+    dfp_msg_view_t           msg;
+    dfp_tlv_bind_id_t       *entry;
+    uint16_t                 bind_id;
+    uint32_t                 ipaddr_v4, netmask_v4;
+    int                      start, reqlen;
+
+    /* The empty table the agent sends back to a BindId Request. */
+    reqlen = sizeof(dfp_msg_header_t) + sizeof(dfp_tlv_bind_id_table_t);
+    dfp_msg_bind_report_prepare(iobuf, reqlen, &start);
+    dfp_msg_tlv_bind_table_prepare(iobuf, 0, 0, 0, 0);
+    ok1(dfp_msg_decode(iobuf, start, &msg) == APR_SUCCESS);
+    ok1(msg.mv_has_bind_table && msg.mv_bind_table.bv_nentries == 0);
+
+    /* A table with 2 entries, appended by hand. */
+    iobuf = iobuf_reset();
+    reqlen = sizeof(dfp_msg_header_t) + sizeof(dfp_tlv_bind_id_table_t) +
+        2 * sizeof(dfp_tlv_bind_id_t);
+    dfp_msg_bind_report_prepare(iobuf, reqlen, &start);
+    dfp_msg_tlv_bind_table_prepare(iobuf, htonl(0xc0a80001), 443, 6, 2);
+    entry = (dfp_tlv_bind_id_t *) &iobuf->buf[iobuf->buf_len];
+    entry[0].bid_id = htons(1);
+    entry[0].bid_ipaddr_v4 = htonl(0x0a000000);
+    entry[0].bid_netmask_v4 = htonl(0xff000000);
+    entry[1].bid_id = htons(2);
+    entry[1].bid_ipaddr_v4 = htonl(0xac100000);
+    entry[1].bid_netmask_v4 = htonl(0xfff00000);
+    iobuf->buf_len += 2 * sizeof(dfp_tlv_bind_id_t);
+
+    ok1(dfp_msg_decode(iobuf, start, &msg) == APR_SUCCESS);
+    ok1(msg.mv_has_bind_table);
+    ok1(msg.mv_bind_table.bv_ipaddr_v4 == htonl(0xc0a80001));
+    ok1(msg.mv_bind_table.bv_portn == 443 &&
+        msg.mv_bind_table.bv_protocol == 6);
+    ok1(msg.mv_bind_table.bv_nentries == 2);
+    dfp_bind_table_view_entry(&msg.mv_bind_table, 1, &bind_id, &ipaddr_v4,
+        &netmask_v4);
+    ok1(bind_id == 2 && ipaddr_v4 == htonl(0xac100000) &&
+        netmask_v4 == htonl(0xfff00000));
+}
+
+
+static void
+test_security(void)
+{
+    cpe_io_buf         *iobuf = iobuf_reset();
+    dfp_msg_view_t      msg;
+    dfp_tlv_security_t *sec;
+    int                 start, reqlen, seclen;
+
+    /* Security (md5), then Keepalive. */
+    seclen = sizeof(dfp_tlv_security_t) + sizeof(dfp_tlv_security_md5_t);
+    reqlen = sizeof(dfp_msg_header_t) + seclen + sizeof(dfp_tlv_keepalive_t);
+    dfp_msg_pref_info_prepare(iobuf, reqlen, &start);
+    sec = (dfp_tlv_security_t *) &iobuf->buf[iobuf->buf_len];
+    sec->sec_header.tlv_type = htons(DFP_TLV_SECURITY);
+    sec->sec_header.tlv_len = htons(seclen);
+    sec->sec_algorithm = htonl(DFP_MD5_SECURITY);
+    iobuf->buf_len += seclen;
+    dfp_tlv_keepalive_prepare(iobuf, 5);
+
+    ok1(dfp_msg_decode(iobuf, start, &msg) == APR_SUCCESS);
+    ok1(msg.mv_has_security &&
+        msg.mv_security.sv_algorithm == DFP_MD5_SECURITY);
+    ok1(msg.mv_security.sv_data_len == sizeof(dfp_tlv_security_md5_t));
+    ok1((const char *) msg.mv_security.sv_data ==
+        &iobuf->buf[start + sizeof(dfp_msg_header_t) +
+        sizeof(dfp_tlv_security_t)]);
+    ok1(msg.mv_has_keepalive && msg.mv_keepalive.kv_interval_sec == 5);
+
+    /* Keepalive, then Security: not allowed. */
+    iobuf = iobuf_reset();
+    dfp_msg_pref_info_prepare(iobuf, reqlen, &start);
+    dfp_tlv_keepalive_prepare(iobuf, 5);
+    sec = (dfp_tlv_security_t *) &iobuf->buf[iobuf->buf_len];
+    sec->sec_header.tlv_type = htons(DFP_TLV_SECURITY);
+    sec->sec_header.tlv_len = htons(seclen);
+    iobuf->buf_len += seclen;
+    ok(dfp_msg_decode(iobuf, start, &msg) != APR_SUCCESS,
+        "Security TLV not first is rejected");
+}
+
+
+static void
+test_malformed(void)
+{
+    cpe_io_buf     *iobuf;
+    dfp_msg_view_t  msg;
+    int             load, len;
+
+    /* Offsets in the PREF_INFO of build_pref_info(). */
+    load = sizeof(dfp_msg_header_t);
+
+    iobuf = iobuf_reset();
+    build_pref_info(iobuf);
+    len = iobuf->buf_len;
+    iobuf->buf_len = len - 1;
+    ok(dfp_msg_decode(iobuf, 0, &msg) != APR_SUCCESS,
+        "truncated message is rejected");
+
+    iobuf = iobuf_reset();
+    build_pref_info(iobuf);
+    poke32(iobuf, 4, len - 1);
+    ok(dfp_msg_decode(iobuf, 0, &msg) != APR_SUCCESS,
+        "TLV crossing the end of the message is rejected");
+
+    iobuf = iobuf_reset();
+    build_pref_info(iobuf);
+    iobuf->buf[0] = 2;
+    ok(dfp_msg_decode(iobuf, 0, &msg) != APR_SUCCESS,
+        "unknown version is rejected");
+
+    iobuf = iobuf_reset();
+    build_pref_info(iobuf);
+    poke32(iobuf, 4, 4);
+    ok(dfp_msg_decode(iobuf, 0, &msg) != APR_SUCCESS,
+        "message length shorter than its header is rejected");
+
+    iobuf = iobuf_reset();
+    build_pref_info(iobuf);
+    poke16(iobuf, load + 2, 2);
+    ok(dfp_msg_decode(iobuf, 0, &msg) != APR_SUCCESS,
+        "TLV length shorter than its header is rejected");
+
+    iobuf = iobuf_reset();
+    build_pref_info(iobuf);
+    poke16(iobuf, load + 2, sizeof(dfp_tlv_load_t) - 1);
+    ok(dfp_msg_decode(iobuf, 0, &msg) != APR_SUCCESS,
+        "Load TLV shorter than its fixed part is rejected");
+
+    /* nhosts 4 does not fit in a TLV sized for 3. */
+    iobuf = iobuf_reset();
+    build_pref_info(iobuf);
+    poke16(iobuf, load + 8, 4);
+    ok(dfp_msg_decode(iobuf, 0, &msg) != APR_SUCCESS,
+        "Load TLV with more hosts than its length is rejected");
+
+    /* An unknown TLV type is skipped, the rest still decoded. */
+    iobuf = iobuf_reset();
+    build_pref_info(iobuf);
+    poke16(iobuf, load, 0x0250);
+    ok1(dfp_msg_decode(iobuf, 0, &msg) == APR_SUCCESS);
+    ok1(msg.mv_nunknown == 1 && msg.mv_nloads == 1);
+
+    iobuf = iobuf_reset();
+    ok(dfp_msg_decode(iobuf, 0, &msg) != APR_SUCCESS,
+        "empty iobuf is rejected");
+    ok(dfp_msg_decode(iobuf, -1, &msg) != APR_SUCCESS,
+        "negative start is rejected");
+}
+
+
+static void
+test_many_loads(void)
+{
+    cpe_io_buf     *iobuf = iobuf_reset();
+    dfp_msg_view_t  msg;
+    int             start, reqlen;
+    uint            k, n = DFP_MSG_MAX_LOADS + 2;
+
+    reqlen = sizeof(dfp_msg_header_t) + n * sizeof(dfp_tlv_load_t);
+    dfp_msg_pref_info_prepare(iobuf, reqlen, &start);
+    for (k = 0; k < n; k++) {
+        dfp_tlv_load_prepare(iobuf, k, 6, 0, 0);
+    }
+    ok1(dfp_msg_decode(iobuf, start, &msg) == APR_SUCCESS);
+    ok1(msg.mv_nloads == DFP_MSG_MAX_LOADS && msg.mv_nloads_dropped == 2);
+    ok1(msg.mv_loads[DFP_MSG_MAX_LOADS - 1].lv_portn ==
+        DFP_MSG_MAX_LOADS - 1);
+}
+
+
+int
+main(void)
+{
+    plan_tests(13 + 8 + 7 + 8 + 6 + 11 + 3);
+
+    test_pref_info();
+    test_cursor();
+    test_two_messages();
+    test_bind_report();
+    test_security();
+    test_malformed();
+    test_many_loads();
+
+    return exit_status();
+}
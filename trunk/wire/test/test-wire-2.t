@@ -0,0 +1 @@
+test-wire-1.t
\ No newline at end of file
@@ -43,6 +43,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 static apr_status_t
 dfp_msg_header_prepare(cpe_io_buf *iobuf, int reqlen, uint16_t msg_type,
     int *start);
+static apr_status_t
+dfp_tlv_view_set(dfp_tlv_view_t *tlv, uint index);
 
 
 /*****************************************************************************
@@ -136,11 +138,10 @@ dfp_msg_pref_info_prepare(cpe_io_buf *iobuf, int reqlen, int *start)
 }
 
 
-/** PREF_INFO message (agent => manager)
+/** PREF_INFO message (agent => manager), for the local address of \p sock.
  *
  * @param iobuf  iobuf containing one or more DFP messages.
  * @param start  will be set to the start of this message.
- * @param reqlen length of this message.
  */
 apr_status_t
 dfp_msg_pref_info_complete(cpe_io_buf *iobuf, int *start,
@@ -148,13 +149,27 @@ dfp_msg_pref_info_complete(cpe_io_buf *iobuf, int *start,
 {
     apr_status_t    rv;
     apr_sockaddr_t *sockaddr;
-    uint32_t       *ipaddr_v4;
-    uint            flags, nhosts;
-    int             reqlen;
 
     /* Extract IP address from the socket. */
     CHECK(apr_socket_addr_get(&sockaddr, APR_LOCAL, sock));
-    ipaddr_v4 = (uint32_t *) sockaddr->ipaddr_ptr;
+    return dfp_msg_pref_info_complete2(iobuf, start,
+        *(uint32_t *) sockaddr->ipaddr_ptr, bind_id, weight);
+}
+
+
+/** PREF_INFO message (agent => manager)
+ *
+ * @param iobuf     iobuf containing one or more DFP messages.
+ * @param start     will be set to the start of this message.
+ * @param ipaddr_v4 Assumed to be already in network byte order.
+ */
+apr_status_t
+dfp_msg_pref_info_complete2(cpe_io_buf *iobuf, int *start,
+    uint32_t ipaddr_v4, uint16_t bind_id, uint16_t weight)
+{
+    apr_status_t    rv;
+    uint            flags, nhosts;
+    int             reqlen;
 
     /* Build msg header and Load TLV for 1 host */
     nhosts = 1;
@@ -166,7 +181,7 @@ dfp_msg_pref_info_complete(cpe_io_buf *iobuf, int *start,
         flags, nhosts));
 
     /* Build hostpref TLV */
-    CHECK(dfp_tlv_load_add_hostpref(iobuf, *ipaddr_v4, bind_id, weight));
+    CHECK(dfp_tlv_load_add_hostpref(iobuf, ipaddr_v4, bind_id, weight));
 
     return APR_SUCCESS;
 }
@@ -244,6 +259,8 @@ dfp_msg_tlv_bind_table_prepare(
     }
 
     tlv = (dfp_tlv_bind_id_table_t *) &iobuf->buf[iobuf->buf_len];
+    tlv->btable_header.tlv_type = htons(DFP_TLV_BIND_ID_TABLE);
+    tlv->btable_header.tlv_len  = htons(reqlen);
     tlv->btable_ip_addr_v4 = ip_addr_v4;
     tlv->btable_port_n     = htons(port_n);
     tlv->btable_protocol   = protocol;
@@ -343,6 +360,181 @@ dfp_tlv_load_add_hostpref(cpe_io_buf *iobuf, uint32_t ipaddr_v4,
 }
 
 
+/*
+ * Decoding
+ */
+
+
+/** Position \p cur on the first TLV of the message starting at \p start.
+ *  The message header is validated; its declared length must fit in the
+ *  iobuf.
+ */
+apr_status_t
+dfp_tlv_cursor_init(dfp_tlv_cursor_t *cur, const cpe_io_buf *iobuf,
+    int start)
+{
+    const dfp_msg_header_t *hdr;
+    uint32_t                msg_len, avail;
+
+    if (start < 0 || iobuf->buf_len < start ||
+        (uint32_t) (iobuf->buf_len - start) < sizeof(dfp_msg_header_t)) {
+        cpe_log(CPE_DEB, "no room for msg header (start %d, iobuf len %d)",
+            start, iobuf->buf_len);
+        return APR_EGENERAL;
+    }
+    avail = iobuf->buf_len - start;
+    hdr = (const dfp_msg_header_t *) &iobuf->buf[start];
+    if (hdr->msg_version != DFP_MSG_VERSION_1) {
+        cpe_log(CPE_DEB, "unsupported msg version %#x", hdr->msg_version);
+        return APR_EGENERAL;
+    }
+    msg_len = ntohl(hdr->msg_len);
+    if (msg_len < sizeof(dfp_msg_header_t) || msg_len > avail) {
+        cpe_log(CPE_DEB, "bad msg len %u (available %u)", msg_len, avail);
+        return APR_EGENERAL;
+    }
+
+    cur->tc_buf   = (const uint8_t *) iobuf->buf;
+    cur->tc_off   = start + sizeof(dfp_msg_header_t);
+    cur->tc_end   = start + msg_len;
+    cur->tc_ntlvs = 0;
+    return APR_SUCCESS;
+}
+
+
+/** Yield the next TLV of the message.
+ *
+ * @return APR_SUCCESS and \p tlv set, APR_EOF at the end of the message, or
+ *         APR_EGENERAL if the TLV is malformed; in this case the cursor does
+ *         not advance.
+ */
+apr_status_t
+dfp_tlv_next(dfp_tlv_cursor_t *cur, dfp_tlv_view_t *tlv)
+{
+    const dfp_tlv_header_t *hdr;
+    uint32_t                left;
+    apr_status_t            rv;
+
+    if (cur->tc_off >= cur->tc_end) {
+        return APR_EOF;
+    }
+    left = cur->tc_end - cur->tc_off;
+    if (left < sizeof(dfp_tlv_header_t)) {
+        cpe_log(CPE_DEB, "trailing %u bytes, too short for a TLV", left);
+        return APR_EGENERAL;
+    }
+    hdr = (const dfp_tlv_header_t *) &cur->tc_buf[cur->tc_off];
+    tlv->tv_type  = ntohs(hdr->tlv_type);
+    tlv->tv_len   = ntohs(hdr->tlv_len);
+    tlv->tv_value = (const uint8_t *) (hdr + 1);
+    if (tlv->tv_len < sizeof(dfp_tlv_header_t) || tlv->tv_len > left) {
+        cpe_log(CPE_DEB, "TLV %#x: bad len %u (left in msg %u)",
+            tlv->tv_type, tlv->tv_len, left);
+        return APR_EGENERAL;
+    }
+    rv = dfp_tlv_view_set(tlv, cur->tc_ntlvs);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    cur->tc_off += tlv->tv_len;
+    cur->tc_ntlvs++;
+    return APR_SUCCESS;
+}
+
+
+/** Decode the message starting at \p start in one pass over its TLVs.
+ *  On success \p msg refers to \p iobuf; nothing has been copied.
+ *  Unknown TLVs are skipped; a repeated Keepalive, Security or BindId Table
+ *  TLV replaces the previous one.
+ */
+apr_status_t
+dfp_msg_decode(const cpe_io_buf *iobuf, int start, dfp_msg_view_t *msg)
+{
+    const dfp_msg_header_t *hdr;
+    dfp_tlv_cursor_t        cur;
+    dfp_tlv_view_t          tlv;
+    apr_status_t            rv;
+
+    rv = dfp_tlv_cursor_init(&cur, iobuf, start);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    hdr = (const dfp_msg_header_t *) &iobuf->buf[start];
+    msg->mv_version        = hdr->msg_version;
+    msg->mv_type           = ntohs(hdr->msg_type);
+    msg->mv_len            = ntohl(hdr->msg_len);
+    msg->mv_has_security   = 0;
+    msg->mv_has_keepalive  = 0;
+    msg->mv_has_bind_table = 0;
+    msg->mv_nloads         = 0;
+    msg->mv_nloads_dropped = 0;
+    msg->mv_nunknown       = 0;
+
+    while ((rv = dfp_tlv_next(&cur, &tlv)) == APR_SUCCESS) {
+        switch (tlv.tv_type) {
+
+        case DFP_TLV_LOAD:
+            if (msg->mv_nloads < DFP_MSG_MAX_LOADS) {
+                msg->mv_loads[msg->mv_nloads++] = tlv.tv_u.load;
+            } else {
+                msg->mv_nloads_dropped++;
+            }
+        break;
+        case DFP_TLV_KEEPALIVE:
+            msg->mv_keepalive = tlv.tv_u.keepalive;
+            msg->mv_has_keepalive = 1;
+        break;
+        case DFP_TLV_SECURITY:
+            msg->mv_security = tlv.tv_u.security;
+            msg->mv_has_security = 1;
+        break;
+        case DFP_TLV_BIND_ID_TABLE:
+            msg->mv_bind_table = tlv.tv_u.bind_table;
+            msg->mv_has_bind_table = 1;
+        break;
+        default:
+            msg->mv_nunknown++;
+        }
+    }
+    return APR_STATUS_IS_EOF(rv) ? APR_SUCCESS : rv;
+}
+
+
+/** Host Preference \p k of a Load TLV view.
+ *  @param ipaddr_v4 Will be in network byte order.
+ */
+void
+dfp_load_view_pref(const dfp_load_view_t *load, uint k,
+    uint32_t *ipaddr_v4, uint16_t *bind_id, uint16_t *weight)
+{
+    const dfp_tlv_load_preference_t *lpref;
+
+    assert(k < load->lv_nhosts);
+    lpref = &load->lv_prefs[k];
+    *ipaddr_v4 = lpref->pref_ipaddr_v4;
+    *bind_id   = ntohs(lpref->pref_bind_id);
+    *weight    = ntohs(lpref->pref_weight);
+}
+
+
+/** Entry \p k of a BindId Table TLV view.
+ *  @param ipaddr_v4  Will be in network byte order.
+ *  @param netmask_v4 Will be in network byte order.
+ */
+void
+dfp_bind_table_view_entry(const dfp_bind_table_view_t *table, uint k,
+    uint16_t *bind_id, uint32_t *ipaddr_v4, uint32_t *netmask_v4)
+{
+    const dfp_tlv_bind_id_t *entry;
+
+    assert(k < table->bv_nentries);
+    entry = &table->bv_entries[k];
+    *bind_id    = ntohs(entry->bid_id);
+    *ipaddr_v4  = entry->bid_ipaddr_v4;
+    *netmask_v4 = entry->bid_netmask_v4;
+}
+
 char *
 dfp_msg_type2string(uint16_t type)
 {
@@ -410,3 +602,94 @@ dfp_msg_header_prepare(cpe_io_buf *iobuf, int reqlen, uint16_t msg_type,
 
     return APR_SUCCESS;
 }
+
+
+/** Fill the typed part of \p tlv, checking that the TLV is long enough for
+ *  its fixed part and for all the entries it declares.
+ * @param index position of the TLV in its message.
+ */
+static apr_status_t
+dfp_tlv_view_set(dfp_tlv_view_t *tlv, uint index)
+{
+    const uint8_t *base = tlv->tv_value - sizeof(dfp_tlv_header_t);
+    uint32_t       minlen;
+
+    switch (tlv->tv_type) {
+
+    case DFP_TLV_LOAD: {
+        const dfp_tlv_load_t *load = (const dfp_tlv_load_t *) base;
+        dfp_load_view_t      *lv = &tlv->tv_u.load;
+
+        if (tlv->tv_len < sizeof(dfp_tlv_load_t)) {
+            minlen = sizeof(dfp_tlv_load_t);
+            break;
+        }
+        lv->lv_portn    = ntohs(load->load_portn);
+        lv->lv_protocol = load->load_protocol;
+        lv->lv_flags    = load->load_flags;
+        lv->lv_nhosts   = ntohs(load->load_nhosts);
+        lv->lv_prefs    = (const dfp_tlv_load_preference_t *) (load + 1);
+        minlen = sizeof(dfp_tlv_load_t) +
+            lv->lv_nhosts * sizeof(dfp_tlv_load_preference_t);
+    }
+    break;
+
+    case DFP_TLV_KEEPALIVE: {
+        const dfp_tlv_keepalive_t *ka = (const dfp_tlv_keepalive_t *) base;
+
+        minlen = sizeof(dfp_tlv_keepalive_t);
+        if (tlv->tv_len >= minlen) {
+            tlv->tv_u.keepalive.kv_interval_sec = ntohl(ka->ka_interval_sec);
+        }
+    }
+    break;
+
+    case DFP_TLV_SECURITY: {
+        const dfp_tlv_security_t *sec = (const dfp_tlv_security_t *) base;
+        dfp_security_view_t      *sv = &tlv->tv_u.security;
+
+        /* If present, it MUST be the first TLV in the message. */
+        if (index != 0) {
+            cpe_log(CPE_DEB, "Security TLV at position %u, not first", index);
+            return APR_EGENERAL;
+        }
+        minlen = sizeof(dfp_tlv_security_t);
+        if (tlv->tv_len >= minlen) {
+            sv->sv_algorithm = ntohl(sec->sec_algorithm);
+            sv->sv_data      = (const uint8_t *) (sec + 1);
+            sv->sv_data_len  = tlv->tv_len - minlen;
+        }
+    }
+    break;
+
+    case DFP_TLV_BIND_ID_TABLE: {
+        const dfp_tlv_bind_id_table_t *bt =
+            (const dfp_tlv_bind_id_table_t *) base;
+        dfp_bind_table_view_t         *bv = &tlv->tv_u.bind_table;
+
+        if (tlv->tv_len < sizeof(dfp_tlv_bind_id_table_t)) {
+            minlen = sizeof(dfp_tlv_bind_id_table_t);
+            break;
+        }
+        bv->bv_ipaddr_v4 = bt->btable_ip_addr_v4;
+        bv->bv_portn     = ntohs(bt->btable_port_n);
+        bv->bv_protocol  = bt->btable_protocol;
+        bv->bv_nentries  = ntohs(bt->btable_entry_n);
+        bv->bv_entries   = (const dfp_tlv_bind_id_t *) (bt + 1);
+        minlen = sizeof(dfp_tlv_bind_id_table_t) +
+            bv->bv_nentries * sizeof(dfp_tlv_bind_id_t);
+    }
+    break;
+
+    default:
+        /* Unknown: the generic header checks are all we can do. */
+        minlen = sizeof(dfp_tlv_header_t);
+    }
+
+    if (tlv->tv_len < minlen) {
+        cpe_log(CPE_DEB, "TLV %#x: len %u < minimum len %u", tlv->tv_type,
+            tlv->tv_len, minlen);
+        return APR_EGENERAL;
+    }
+    return APR_SUCCESS;
+}
@@ -84,6 +84,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 /* The smaller message is a DFP_MSG_PREF_INFO with empty payload. */
 #define DFP_MIN_MSG_SIZE sizeof(dfp_msg_header_t)
+/* Bigger messages drop the connection. A PREF_INFO with 16 Load TLVs of 16
+ * hosts each is 2248 bytes.
+ */
+#define DFP_MAX_MSG_SIZE 4096
 
 
 struct dfp_msg_header {
@@ -192,6 +196,87 @@ typedef struct dfp_tlv_bind_id_table dfp_tlv_bind_id_table_t;
 
 
 
+/*
+ * Decoding
+ *
+ * A cursor walks the TLVs of one message, checking every length against
+ * the end of the message before anything is read. The views it yields
+ * point into the iobuf: nothing is copied or allocated, so a view is valid
+ * only as long as the iobuf it came from. Scalars are converted to host
+ * order; IPv4 addresses are left in network order, as in the encoders.
+ */
+
+/* Load TLVs kept by dfp_msg_decode(); further ones are counted, not kept. */
+#define DFP_MSG_MAX_LOADS 16
+
+struct dfp_tlv_cursor {
+    const uint8_t *tc_buf;
+    uint32_t       tc_off;   /**< next TLV */
+    uint32_t       tc_end;   /**< end of the message */
+    uint32_t       tc_ntlvs; /**< TLVs yielded so far */
+};
+typedef struct dfp_tlv_cursor dfp_tlv_cursor_t;
+
+struct dfp_load_view {
+    uint16_t                         lv_portn;
+    uint8_t                          lv_protocol;
+    uint8_t                          lv_flags;
+    uint16_t                         lv_nhosts;
+    const dfp_tlv_load_preference_t *lv_prefs; /**< lv_nhosts, network order */
+};
+typedef struct dfp_load_view dfp_load_view_t;
+
+struct dfp_keepalive_view {
+    uint32_t kv_interval_sec;
+};
+typedef struct dfp_keepalive_view dfp_keepalive_view_t;
+
+struct dfp_security_view {
+    uint32_t       sv_algorithm;
+    const uint8_t *sv_data;     /**< algorithm-specific, e.g. md5 key id */
+    uint16_t       sv_data_len;
+};
+typedef struct dfp_security_view dfp_security_view_t;
+
+struct dfp_bind_table_view {
+    uint32_t                 bv_ipaddr_v4;  /**< network order */
+    uint16_t                 bv_portn;
+    uint8_t                  bv_protocol;
+    uint16_t                 bv_nentries;
+    const dfp_tlv_bind_id_t *bv_entries;    /**< bv_nentries, network order */
+};
+typedef struct dfp_bind_table_view dfp_bind_table_view_t;
+
+struct dfp_tlv_view {
+    uint16_t       tv_type;
+    uint16_t       tv_len;    /**< including the TLV header */
+    const uint8_t *tv_value;  /**< just after the TLV header */
+    union {
+        dfp_load_view_t       load;
+        dfp_keepalive_view_t  keepalive;
+        dfp_security_view_t   security;
+        dfp_bind_table_view_t bind_table;
+    } tv_u;                   /**< set according to tv_type, if known */
+};
+typedef struct dfp_tlv_view dfp_tlv_view_t;
+
+struct dfp_msg_view {
+    uint8_t               mv_version;
+    uint16_t              mv_type;
+    uint32_t              mv_len;
+    int                   mv_has_security;
+    dfp_security_view_t   mv_security;
+    int                   mv_has_keepalive;
+    dfp_keepalive_view_t  mv_keepalive;
+    int                   mv_has_bind_table;
+    dfp_bind_table_view_t mv_bind_table;
+    uint                  mv_nloads;         /**< Load TLVs in mv_loads */
+    uint                  mv_nloads_dropped; /**< beyond DFP_MSG_MAX_LOADS */
+    dfp_load_view_t       mv_loads[DFP_MSG_MAX_LOADS];
+    uint                  mv_nunknown;       /**< unknown TLVs, skipped */
+};
+typedef struct dfp_msg_view dfp_msg_view_t;
+
 apr_status_t
 dfp_msg_server_state_prepare(cpe_io_buf *iobuf, int reqlen, int *start);
 apr_status_t
@@ -205,6 +290,9 @@ apr_status_t
 dfp_msg_pref_info_complete(cpe_io_buf *iobuf, int *start,
     apr_socket_t *sock, uint16_t bind_id, uint16_t weight);
 apr_status_t
+dfp_msg_pref_info_complete2(cpe_io_buf *iobuf, int *start,
+    uint32_t ipaddr_v4, uint16_t bind_id, uint16_t weight);
+apr_status_t
 dfp_msg_bind_change_prepare(cpe_io_buf *iobuf);
 apr_status_t
 dfp_msg_dfp_parameters_complete(cpe_io_buf *iobuf, int *start,
@@ -224,6 +312,20 @@ apr_status_t
 dfp_tlv_load_add_hostpref(cpe_io_buf *iobuf, uint32_t ipaddr_v4,
     uint16_t bind_id, uint16_t weight);
 
+apr_status_t
+dfp_tlv_cursor_init(dfp_tlv_cursor_t *cur, const cpe_io_buf *iobuf,
+    int start);
+apr_status_t
+dfp_tlv_next(dfp_tlv_cursor_t *cur, dfp_tlv_view_t *tlv);
+apr_status_t
+dfp_msg_decode(const cpe_io_buf *iobuf, int start, dfp_msg_view_t *msg);
+void
+dfp_load_view_pref(const dfp_load_view_t *load, uint k,
+    uint32_t *ipaddr_v4, uint16_t *bind_id, uint16_t *weight);
+void
+dfp_bind_table_view_entry(const dfp_bind_table_view_t *table, uint k,
+    uint16_t *bind_id, uint32_t *ipaddr_v4, uint32_t *netmask_v4);
+
 char *
 dfp_msg_type2string(uint16_t type);
 